@@ -4,11 +4,25 @@
 
 #include "graphics.hpp"
 
+#include <cairomm/surface.h>
 #include <gtkmm/drawingarea.h>
 
+#include <glibmm/main.h>  // idle rendering
+
+#include <algorithm>  // min(), max(), stable_sort()
+#include <atomic>
+#include <chrono>
+#include <cmath>    // abs(), floor()
+#include <cstdlib>  // getenv()
+#include <cstring>  // strcmp()
+#include <limits>
+#include <thread>
+
 #include "model/constants.hpp"
 #include "model/tools.hpp"
 #include "model/town.hpp"
+#include "model/trace.hpp"
+#include "raster.hpp"
 
 namespace {
 
@@ -25,6 +39,21 @@ constexpr double ORANGE[3]{1., 133. / 256., 27. / 256.};
 constexpr double GREEN[3]{0., 1., 0.};
 
 constexpr double STROKE_WIDTH(6.);
+/** How far a stroke reaches past its path, mitred corners reach past half its width */
+constexpr double STROKE_REACH(STROKE_WIDTH);
+
+constexpr double HUGE_COORDINATE(std::numeric_limits<double>::max());
+
+/** The back buffer is drawn in bands of rows, for this long per frame at most */
+constexpr int CHUNK_ROWS(32);
+constexpr std::chrono::milliseconds FRAME_BUDGET(8);
+/** Antialiasing reaches a pixel past the bounds of a primitive */
+constexpr double ANTIALIAS_MARGIN(1.);
+constexpr uint32_t WHITE_PIXEL(0xFFFFFFFF);
+
+/** Environment variable that selects the backend, see defaultBackend() */
+constexpr char RENDERER_ENV[]("ARCHIPELAGO_RENDERER");
+constexpr char RASTER_NAME[]("raster");
 
 double calculateScale(double width, double height, double zoom);
 
@@ -35,36 +64,212 @@ namespace graphics {
 /*== Renderer == */
 
 TownView::TownView(const std::shared_ptr<town::Town>& town, double initialZoom)
-    : town(town), zoomFactor(initialZoom) {}
-
+    : town(town),
+      zoomFactor(initialZoom),
+      backend(defaultBackend()),
+      showSelectionBox(false),
+      nextChunk(0),
+      stale(true),
+      renderWidth(0),
+      renderHeight(0),
+      renderScale(ZERO) {}
+
+/** Starts a new render if the view changed, then shows the back buffer */
 bool TownView::on_draw(const Cairo::RefPtr<Cairo::Context>& cr) {
+  TRACE_SCOPE("TownView::on_draw");
   Gtk::Allocation allocation = get_allocation();
-  const double width(allocation.get_width());
-  const double height(allocation.get_height());
+  const int width(allocation.get_width());
+  const int height(allocation.get_height());
   const double scale(calculateScale(width, height, zoomFactor));
+  if (width <= 0 || height <= 0) return true;
 
-  // World to screen space coordinate transformation
-  // World objects are symmetrical, so flipping has no effect on visuals
-  cr->translate(width / TWO, height / TWO);
-  cr->scale(scale, -scale);
+  if (stale || !surface || width != renderWidth || height != renderHeight ||
+      scale != renderScale) {
+    startRender(width, height, scale);
+    drawChunks();
+  }
+  if (nextChunk < chunks.size() && !idleRender.connected()) {
+    idleRender =
+        Glib::signal_idle().connect(sigc::mem_fun(*this, &TownView::continueRender));
+  }
 
-  // Erase and paint the background
-  cr->save();
-  cr->set_source_rgb(WHITE[0], WHITE[1], WHITE[2]);
+  cr->set_source(surface, ZERO, ZERO);
   cr->paint();
-  cr->restore();
-
-  context.setContext(cr);
-  if (town) town->render(context);
 
   return true;
 }
 
 void TownView::setZoom(double newZoom) {
   zoomFactor = newZoom;
+  redraw();
+}
+
+void TownView::setBackend(Backend newBackend) {
+  backend = newBackend;
+  redraw();
+}
+
+void TownView::redraw() {
+  stale = true;
   queue_draw();
 }
 
+void TownView::setSelectionBox(const tools::Vec2& cornerA,
+                               const tools::Vec2& cornerB) {
+  showSelectionBox = true;
+  selectionCornerA = cornerA;
+  selectionCornerB = cornerB;
+  redraw();
+}
+
+void TownView::clearSelectionBox() {
+  showSelectionBox = false;
+  redraw();
+}
+
+/**
+ * Records the town and bins its visible primitives into bands of rows, the band of
+ * the focus first. The back buffer keeps the previous frame until its bands are
+ * drawn again, unless the view was resized.
+ */
+void TownView::startRender(int width, int height, double scale) {
+  TRACE_SCOPE("TownView::startRender");
+  if (!surface || width != renderWidth || height != renderHeight) {
+    const int stride(
+        Cairo::ImageSurface::format_stride_for_width(Cairo::FORMAT_ARGB32, width));
+    pixels.assign(static_cast<size_t>(stride) / sizeof(uint32_t) * height,
+                  WHITE_PIXEL);
+    surface = Cairo::ImageSurface::create(
+        reinterpret_cast<unsigned char*>(pixels.data()), Cairo::FORMAT_ARGB32, width,
+        height, stride);
+  }
+  stale = false;
+  renderWidth = width;
+  renderHeight = height;
+  renderScale = scale;
+
+  recording.clear();
+  if (town) town->render(recording);
+  drawSelectionBox(recording);
+
+  const int nbChunks((height + CHUNK_ROWS - 1) / CHUNK_ROWS);
+  chunks.resize(nbChunks);
+  for (int i(0); i < nbChunks; ++i) {
+    chunks[i].top = i * CHUNK_ROWS;
+    chunks[i].bottom = std::min(height, (i + 1) * CHUNK_ROWS);
+    chunks[i].primitives.clear();
+  }
+
+  // Primitives outside of the view are not drawn
+  for (size_t i(0); i < recording.size(); ++i) {
+    const spatial::Box box(recording.bounds(i));
+    if (width * CENTRE + box.maxX * scale + ANTIALIAS_MARGIN < ZERO ||
+        width * CENTRE + box.minX * scale - ANTIALIAS_MARGIN > width)
+      continue;
+
+    const double top(height * CENTRE - box.maxY * scale - ANTIALIAS_MARGIN);
+    const double bottom(height * CENTRE - box.minY * scale + ANTIALIAS_MARGIN);
+    const int first(std::max(0, static_cast<int>(std::floor(top / CHUNK_ROWS))));
+    const int last(
+        std::min(nbChunks - 1, static_cast<int>(std::floor(bottom / CHUNK_ROWS))));
+    for (int chunk(first); chunk <= last; ++chunk)
+      chunks[chunk].primitives.push_back(i);
+  }
+
+  const double focus(focusRow());
+  std::stable_sort(chunks.begin(), chunks.end(),
+                   [focus](const Chunk& a, const Chunk& b) {
+                     return std::abs((a.top + a.bottom) * CENTRE - focus) <
+                            std::abs((b.top + b.bottom) * CENTRE - focus);
+                   });
+  nextChunk = 0;
+}
+
+/**
+ * Draws the next chunks into the back buffer until the frame budget is spent. The
+ * raster backend draws a chunk per core at a time.
+ */
+void TownView::drawChunks() {
+  TRACE_SCOPE("TownView::drawChunks");
+  const auto deadline(std::chrono::steady_clock::now() + FRAME_BUDGET);
+  const int rowPixels(surface->get_stride() / static_cast<int>(sizeof(uint32_t)));
+  const raster::Target target{pixels.data(), renderWidth, renderHeight, rowPixels};
+  const raster::Transform transform{renderScale, renderWidth * CENTRE,
+                                    renderHeight * CENTRE};
+  const unsigned cores(std::max(1U, std::thread::hardware_concurrency()));
+
+  while (nextChunk < chunks.size() && std::chrono::steady_clock::now() < deadline) {
+    if (backend == CAIRO) {
+      drawChunk(chunks[nextChunk++]);
+      surface->flush();
+      continue;
+    }
+
+    const size_t end(std::min(chunks.size(), nextChunk + cores));
+    std::atomic<size_t> next(nextChunk);
+    auto worker = [&]() {
+      for (size_t i(next++); i < end; i = next++) {
+        raster::Raster raster(target, transform, chunks[i].top, chunks[i].bottom);
+        raster.paintBackground();
+        recording.replay(raster, chunks[i].primitives);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i(nextChunk + 1); i < end; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads) thread.join();
+    surface->mark_dirty();
+    nextChunk = end;
+  }
+}
+
+/** Draws a chunk with Cairo, clipped to its rows */
+void TownView::drawChunk(const Chunk& chunk) {
+  auto cr(Cairo::Context::create(surface));
+  cr->rectangle(ZERO, chunk.top, renderWidth, chunk.bottom - chunk.top);
+  cr->clip();
+
+  // Erase and paint the background
+  cr->set_source_rgb(WHITE[0], WHITE[1], WHITE[2]);
+  cr->paint();
+
+  // World to screen space coordinate transformation
+  // World objects are symmetrical, so flipping has no effect on visuals
+  cr->translate(renderWidth * CENTRE, renderHeight * CENTRE);
+  cr->scale(renderScale, -renderScale);
+
+  context.setContext(cr);
+  recording.replay(context, chunk.primitives);
+}
+
+/** Draws the next chunks while the main loop is idle, returns false once done */
+bool TownView::continueRender() {
+  drawChunks();
+  queue_draw();
+  return nextChunk < chunks.size();
+}
+
+/** The row of the view to draw first, the selected node's or the middle row */
+double TownView::focusRow() const {
+  const node::Node* selected(nullptr);
+  if (town && town->getSelectedNode() != NO_LINK)
+    selected = town->getNode(town->getSelectedNode());
+
+  return renderHeight * CENTRE -
+         (selected ? selected->getPosition().getY() * renderScale : ZERO);
+}
+
+void TownView::drawSelectionBox(tools::RenderContext& context) const {
+  if (!showSelectionBox) return;
+
+  const tools::Vec2& a(selectionCornerA);
+  const tools::Vec2& c(selectionCornerB);
+  context.setColour(tools::ORANGE);
+  context.draw(tools::Polygon4(a, tools::Vec2(c.getX(), a.getY()), c,
+                               tools::Vec2(a.getX(), c.getY())));
+}
+
 /* == Cairo context == */
 
 CairoContext::CairoContext() : colour(tools::Colour::BLACK) {}
@@ -125,6 +330,103 @@ void CairoContext::setSourceFromColour() {
   }
 }
 
+/* == Recording == */
+
+Recording::Recording()
+    : colour(tools::Colour::BLACK),
+      extent{HUGE_COORDINATE, HUGE_COORDINATE, -HUGE_COORDINATE, -HUGE_COORDINATE} {}
+
+void Recording::draw(const tools::Circle& obj) {
+  record(CIRCLE, obj.getRadius(), {obj.getPosition()});
+}
+
+void Recording::draw(const tools::Line& obj) {
+  record(LINE, 0, {obj.getPointA(), obj.getPointB()});
+}
+
+void Recording::draw(const tools::Polygon4& obj) {
+  record(POLYGON, 0, {obj.getA(), obj.getB(), obj.getC(), obj.getD()});
+}
+
+void Recording::setColour(const tools::Colour& newColour) { colour = newColour; }
+
+size_t Recording::size() const { return primitives.size(); }
+
+void Recording::clear() {
+  primitives.clear();
+  points.clear();
+  colour = tools::Colour::BLACK;
+  extent = {HUGE_COORDINATE, HUGE_COORDINATE, -HUGE_COORDINATE, -HUGE_COORDINATE};
+}
+
+spatial::Box Recording::bounds(size_t index) const {
+  const Primitive& primitive(primitives[index]);
+  const unsigned nbPoints(primitive.kind == CIRCLE ? 1
+                          : primitive.kind == LINE ? 2
+                                                   : 4);
+  const double reach(primitive.radius + STROKE_REACH);
+
+  spatial::Box box{HUGE_COORDINATE, HUGE_COORDINATE, -HUGE_COORDINATE,
+                   -HUGE_COORDINATE};
+  for (unsigned i(primitive.first); i < primitive.first + nbPoints; ++i) {
+    box.minX = std::min(box.minX, points[i].getX() - reach);
+    box.minY = std::min(box.minY, points[i].getY() - reach);
+    box.maxX = std::max(box.maxX, points[i].getX() + reach);
+    box.maxY = std::max(box.maxY, points[i].getY() + reach);
+  }
+  return box;
+}
+
+spatial::Box Recording::bounds() const {
+  if (primitives.empty()) return {-DIM_MAX, -DIM_MAX, DIM_MAX, DIM_MAX};
+  return extent;
+}
+
+void Recording::replay(tools::RenderContext& context) const {
+  for (const auto& primitive : primitives) replay(context, primitive);
+}
+
+void Recording::replay(tools::RenderContext& context,
+                       const std::vector<unsigned>& indices) const {
+  for (const auto& index : indices) replay(context, primitives[index]);
+}
+
+void Recording::record(Kind kind, unsigned radius,
+                       std::initializer_list<tools::Vec2> corners) {
+  primitives.push_back({kind, colour, radius, static_cast<unsigned>(points.size())});
+  points.insert(points.end(), corners);
+
+  const spatial::Box box(bounds(primitives.size() - 1));
+  extent.minX = std::min(extent.minX, box.minX);
+  extent.minY = std::min(extent.minY, box.minY);
+  extent.maxX = std::max(extent.maxX, box.maxX);
+  extent.maxY = std::max(extent.maxY, box.maxY);
+}
+
+void Recording::replay(tools::RenderContext& context,
+                       const Primitive& primitive) const {
+  const tools::Vec2* corners(&points[primitive.first]);
+  context.setColour(primitive.colour);
+  switch (primitive.kind) {
+    case CIRCLE:
+      context.draw(tools::Circle(corners[0], primitive.radius));
+      break;
+    case LINE:
+      context.draw(tools::Line(corners[0], corners[1]));
+      break;
+    case POLYGON:
+      context.draw(tools::Polygon4(corners[0], corners[1], corners[2], corners[3]));
+      break;
+  }
+}
+
+/* == Backend == */
+
+Backend defaultBackend() {
+  const char* name(std::getenv(RENDERER_ENV));
+  return name != nullptr && std::strcmp(name, RASTER_NAME) == 0 ? RASTER : CAIRO;
+}
+
 }  // namespace graphics
 
 namespace {
@@ -10,13 +10,20 @@
 #include <sigc++/connection.h>
 #include <sigc++/signal.h>
 
+#include <cstdint>
+#include <initializer_list>
 #include <memory>
+#include <vector>
 
+#include "model/spatial.hpp"
 #include "model/tools.hpp"
 #include "model/town.hpp"
 
 namespace graphics {
 
+/** The ways to draw a town, with Cairo or straight into pixels, see raster.hpp */
+enum Backend { CAIRO, RASTER };
+
 /**
  * An adapter that extends an abstract RenderContext and provides
  * methods to draw to a Cairo context. An instance of CairoContext
@@ -41,11 +48,67 @@ class CairoContext : public tools::RenderContext {
   void setSourceFromColour();
 };
 
+/**
+ * A RenderContext that records the primitives drawn into it, so that they can be
+ * replayed into other contexts, in whole or in part. A town that is recorded once
+ * can be drawn by several threads at the same time, each into its own context.
+ */
+class Recording : public tools::RenderContext {
+ public:
+  Recording();
+
+  /* Inherited methods */
+  void draw(const tools::Circle& obj) override;
+  void draw(const tools::Line& obj) override;
+  void draw(const tools::Polygon4& obj) override;
+  void setColour(const tools::Colour& colour) override;
+
+  size_t size() const;
+  /** Forgets the primitives, their memory is kept for the next recording */
+  void clear();
+
+  /** The area covered by a primitive once stroked, in world units */
+  spatial::Box bounds(size_t index) const;
+  /** The area covered by every primitive, or the world if there are none */
+  spatial::Box bounds() const;
+
+  /** Draws every primitive in the order they were recorded */
+  void replay(tools::RenderContext& context) const;
+  /** Draws the primitives at the given ascending indices */
+  void replay(tools::RenderContext& context,
+              const std::vector<unsigned>& indices) const;
+
+ private:
+  enum Kind : unsigned char { CIRCLE, LINE, POLYGON };
+
+  /** A primitive and its colour, its points are stored consecutively from first */
+  struct Primitive {
+    Kind kind;
+    tools::Colour colour;
+    unsigned radius;
+    unsigned first;
+  };
+
+  std::vector<Primitive> primitives;
+  std::vector<tools::Vec2> points;
+  tools::Colour colour;
+  spatial::Box extent;
+
+  void record(Kind kind, unsigned radius,
+              std::initializer_list<tools::Vec2> corners);
+  void replay(tools::RenderContext& context, const Primitive& primitive) const;
+};
+
 /**
  * A GTKmm Widget that draws a town inside of a drawing area.
  *
  * Creates a Cairo context and provides an abstract interface that a town can
  * draw itself into. Updating the town pointer allows a new town to be drawn.
+ *
+ * The town is drawn progressively into a back buffer, in bands of rows, starting
+ * with the band of the selected node. Each frame draws bands for a limited time,
+ * then shows the buffer, the next bands are drawn when the main loop is idle. A
+ * redraw abandons the bands that are left and starts over.
  */
 class TownView : public Gtk::DrawingArea {
  public:
@@ -53,6 +116,13 @@ class TownView : public Gtk::DrawingArea {
   TownView(const std::shared_ptr<town::Town>& town, double initalZoom);
 
   void setZoom(double zoom);
+  void setBackend(Backend backend);
+  /** Draws the town again, after it changed */
+  void redraw();
+
+  /** Outlines the rectangle between two world positions over the town */
+  void setSelectionBox(const tools::Vec2& cornerA, const tools::Vec2& cornerB);
+  void clearSelectionBox();
 
  protected:
   bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
@@ -61,8 +131,45 @@ class TownView : public Gtk::DrawingArea {
   std::shared_ptr<town::Town> town;
   CairoContext context;
   double zoomFactor;
+  Backend backend;
+
+  bool showSelectionBox;
+  tools::Vec2 selectionCornerA;
+  tools::Vec2 selectionCornerB;
+
+  /** A band of rows of the back buffer and the primitives that reach it */
+  struct Chunk {
+    int top;
+    int bottom;
+    std::vector<unsigned> primitives;
+  };
+
+  /** The back buffer, kept from one frame to the next, and the surface over it */
+  std::vector<uint32_t> pixels;
+  Cairo::RefPtr<Cairo::ImageSurface> surface;
+
+  /** The town being drawn, the bands that are left start from nextChunk */
+  Recording recording;
+  std::vector<Chunk> chunks;
+  size_t nextChunk;
+  /** Whether the town must be drawn again, and the view it was last drawn for */
+  bool stale;
+  int renderWidth;
+  int renderHeight;
+  double renderScale;
+  sigc::connection idleRender;
+
+  void startRender(int width, int height, double scale);
+  void drawChunks();
+  void drawChunk(const Chunk& chunk);
+  bool continueRender();
+  double focusRow() const;
+  void drawSelectionBox(tools::RenderContext& context) const;
 };
 
+/** The backend named by ARCHIPELAGO_RENDERER, "raster" or "cairo" (the default) */
+Backend defaultBackend();
+
 }  // namespace graphics
 
 #endif
@@ -4,6 +4,10 @@
 
 #include "gui.hpp"
 
+#include <gdkmm/cursor.h>       // drag feedback
+#include <gdkmm/frameclock.h>   // drag coalescing
+#include <glibmm/dispatcher.h>  // save completion
+#include <glibmm/main.h>        // metrics reporting
 #include <gtkmm/application.h>
 #include <gtkmm/box.h>  // control housing
 #include <gtkmm/button.h>
@@ -18,14 +22,21 @@
 #include <gtkmm/window.h>
 #include <sigc++/connection.h>        // data store
 #include <sigc++/functors/mem_fun.h>  // data store
+#include <sigc++/functors/ptr_fun.h>  // metrics reporting
 #include <sigc++/signal.h>            // data store
 
-#include <memory>   // shared_ptr
-#include <sstream>  // ostringstream
+#include <algorithm>  // min(), max()
+#include <atomic>     // save completion
+#include <iostream>   // cerr
+#include <memory>     // shared_ptr, unique_ptr
+#include <sstream>    // ostringstream
 #include <string>
 
 #include "graphics.hpp"
 #include "model/constants.hpp"
+#include "model/journal.hpp"
+#include "model/metrics.hpp"
+#include "model/trace.hpp"
 
 namespace {
 
@@ -44,6 +55,9 @@ constexpr double MTA_FIXED_LIMIT(1E4);
 constexpr int SIDEBAR_WIDTH(150);
 constexpr int DEFAULT_SIZE(-1);
 
+/** Interval between two metrics reports on stderr, in seconds */
+constexpr unsigned METRICS_INTERVAL(10);
+
 /** DELTA_ZOOM is not perfectly representable as a binary floating point number */
 constexpr double ZOOM_ERROR(1E-10);
 
@@ -51,14 +65,27 @@ constexpr double ZOOM_ERROR(1E-10);
 constexpr unsigned LEFT_MOUSE(1U);
 constexpr unsigned RIGHT_MOUSE(3U);
 
+/** Shown while a dragged node can not follow the pointer */
+constexpr char BLOCKED_CURSOR[]("not-allowed");
+
 /** Actions that can be triggered by the interface and dispatched to the store */
 enum Action { EXIT, NEW, OPEN, SAVE, ZOOM_IN, ZOOM_OUT, ZOOM_RESET };
 
-/**
- * Initiate a re-render of the gui. If the parameter is true, do a full render
- * with expensive calculations, if false, do an economic render.
- */
-typedef sigc::signal<void, bool> UpdateSignal;
+/** The parts of the store that an update concerns, combined as a bitmask */
+enum Topic : unsigned {
+  GEOMETRY = 1U << 0,   // nodes and links of the town
+  SELECTION = 1U << 1,  // selected node and display options
+  ZOOM = 1U << 2,
+  STATS = 1U << 3,  // expensive town statistics
+  ALL_TOPICS = GEOMETRY | SELECTION | ZOOM | STATS
+};
+typedef unsigned Topics;
+
+/** Modifying the town changes its geometry and its statistics */
+constexpr Topics TOWN_CHANGED(GEOMETRY | STATS);
+
+/** Initiate a re-render of the parts of the gui that depend on the dirty topics */
+typedef sigc::signal<void, Topics> UpdateSignal;
 typedef sigc::signal<void, Action> ActionSignal;
 
 /** Represents a screen location in pixel coordinates */
@@ -70,6 +97,7 @@ struct ScreenLocation {
 /* === FUNCTIONS & CLASSES === */
 
 void showErrorDialog(Gtk::Window* window, std::string title, std::string text);
+bool reportMetrics();
 
 /**
  * The application data store. Contains pointers to data structures as well as
@@ -78,7 +106,8 @@ void showErrorDialog(Gtk::Window* window, std::string title, std::string text);
  *
  * The update change signifies that the GUI should be updated to match the
  * store, and the action stream publishes actions that should be processed by
- * the controller.
+ * the controller. Updates are coalesced, the topics requested during one main loop
+ * iteration are dispatched together once the pending events have been handled.
  */
 class Store {
  public:
@@ -87,7 +116,17 @@ class Store {
   UpdateSignal getUpdateSignal();
   ActionSignal getActionSignal();
 
+  /** Marks topics as dirty and schedules a single update, see UpdateSignal */
+  void update(Topics topics);
+
   std::shared_ptr<town::Town> getTown();
+  /** The journal of the town, which records the edits once the town has a file */
+  journal::Journal* getJournal();
+  /**
+   * Replaces the journal once the previous one has written its records and saves,
+   * nullptr gives the journal of a town without a file
+   */
+  void setJournal(std::unique_ptr<journal::Journal> newJournal);
 
   double getZoomFactor() const;
   node::NodeType getSelectedNode() const;
@@ -102,13 +141,18 @@ class Store {
  private:
   UpdateSignal updateSignal;
   ActionSignal actionSignal;
+  Topics dirtyTopics;
 
   std::shared_ptr<town::Town> town;
+  std::unique_ptr<journal::Journal> journal;
 
   node::NodeType selectedNode;
   double zoomFactor;
   bool showShortestPath;
   bool editLink;
+
+  /** Emits the dirty topics, returns false to run once */
+  bool dispatch();
 };
 
 /** Shorthand to a C++11 shared pointer of a store instance */
@@ -116,12 +160,13 @@ typedef std::shared_ptr<Store> SharedStore;
 
 /**
  * Abstract class that subscribes to a stores update stream, and calls the
- * onUpdate() method with a shared pointer to the store.
+ * onUpdate() method with a shared pointer to the store when one of its topics is
+ * dirty.
  */
 class Subscription {
  public:
   Subscription() = delete;
-  Subscription(SharedStore& store, bool fullRender = true);
+  Subscription(SharedStore& store, Topics topics);
   ~Subscription();
 
  protected:
@@ -129,9 +174,9 @@ class Subscription {
   SharedStore store;
 
  private:
-  bool fullRender;
+  Topics topics;
   sigc::connection connection;
-  void triggerUpdate(bool doFullRender);
+  void triggerUpdate(Topics dirtyTopics);
 };
 
 /** The brain of the GUI, handles actions and updates the central store. */
@@ -151,8 +196,14 @@ class Controller {
   SharedStore store;
   sigc::connection connection;
 
+  /** Wakes up the main loop once the journal has saved the town */
+  Glib::Dispatcher saveDispatcher;
+  sigc::connection saveConnection;
+  std::atomic<unsigned> failedSaves;
+
   void openTown();
   void saveTown();
+  void handleSaved();
 
   void noAction();
   void changeZoom(double newZoom, bool absolute = false);
@@ -225,6 +276,16 @@ class MtaLabel : public Gtk::Label, public Subscription {
   void onUpdate(SharedStore& store) override;
 };
 
+/** Live data element that displays the number of disconnected clusters */
+class ClusterLabel : public Gtk::Label, public Subscription {
+ public:
+  ClusterLabel() = delete;
+  ClusterLabel(SharedStore& store);
+
+ private:
+  void onUpdate(SharedStore& store) override;
+};
+
 class ShortestPath : public Gtk::ToggleButton {
  public:
   ShortestPath() = delete;
@@ -282,6 +343,7 @@ class Sidebar : public Gtk::Box {
   EnjLabel enjLabel;
   CiLabel ciLabel;
   MtaLabel mtaLabel;
+  ClusterLabel clusterLabel;
 };
 
 /** Extended graphics::TownView that subscribes to the data store */
@@ -297,12 +359,37 @@ class Viewport : public Subscription, public graphics::TownView {
 
   ScreenLocation leftDragOrigin;
   bool leftDragEnabled;
+  /** Whether the left drag outlines a box of nodes to select */
+  bool leftDragSelecting;
+
+  /** Whether the selection follows the pointer while the right button is held */
+  bool rightDragActive;
+  /** The drag of a single selected node, a group is moved by offsets instead */
+  std::unique_ptr<town::NodeDrag> rightDrag;
+  ScreenLocation rightDragTarget;
+  /** Where the pointer was when the group was last moved */
+  tools::Vec2 rightDragApplied;
+  /** Whether the pointer has moved since the button was pressed */
+  bool rightDragMoved;
+  /** Whether the node could not follow the pointer to its latest location */
+  bool rightDragBlocked;
+  /** Whether the node has been moved at least once */
+  bool rightDragChanged;
+  /** Whether a frame callback will apply the latest pointer location */
+  bool rightDragPending;
+  guint rightDragFrame;
 
   bool handlePress(const GdkEventButton* event);
   bool handleRelease(const GdkEventButton* event);
+  bool handleMotion(const GdkEventMotion* event);
+  bool handleFrame(const Glib::RefPtr<Gdk::FrameClock>& clock);
 
-  void handleLeftClick(const ScreenLocation& location);
+  void handleLeftClick(const ScreenLocation& location, bool extend);
   void handleRightClick(const ScreenLocation& location);
+  void handleLeftRelease(const ScreenLocation& location);
+
+  void applyRightDrag();
+  void endRightDrag();
 
   /** Convert screenspace coordinates to a worldspace position */
   tools::Vec2 toWorldSpace(const ScreenLocation& location);
@@ -335,7 +422,14 @@ int init(const std::unique_ptr<std::string>& path) {
 
   if (path) window.loadFile(*path);
 
-  return app->run(window);
+#ifdef METRICS
+  Glib::signal_timeout().connect_seconds(sigc::ptr_fun(&reportMetrics),
+                                         METRICS_INTERVAL);
+#endif
+
+  int status(app->run(window));
+  if (metrics::enabled()) reportMetrics();
+  return status;
 }
 
 }  // namespace gui
@@ -348,12 +442,20 @@ void showErrorDialog(Gtk::Window* window, std::string title, std::string text) {
   dialog.run();
 }
 
+/** Periodically dump the metrics, returns true to keep the timeout running */
+bool reportMetrics() {
+  metrics::dump(std::cerr, metrics::snapshot());
+  return true;
+}
+
 /* === DATA === */
 
 /* == Store == */
 
 Store::Store()
-    : town(new town::Town()),
+    : dirtyTopics(0),
+      town(new town::Town()),
+      journal(new journal::Journal()),
       selectedNode(node::HOUSING),
       zoomFactor(INITIAL_ZOOM),
       showShortestPath(false),
@@ -362,7 +464,36 @@ Store::Store()
 ActionSignal Store::getActionSignal() { return actionSignal; }
 UpdateSignal Store::getUpdateSignal() { return updateSignal; }
 
+void Store::update(Topics topics) {
+  if (topics == 0) return;
+  if (dirtyTopics != 0) {
+    METRICS_COUNT(UPDATES_COALESCED, 1);
+  } else {
+    // Runs before the redraw, which has a lower priority
+    Glib::signal_idle().connect(sigc::mem_fun(*this, &Store::dispatch),
+                                Glib::PRIORITY_HIGH_IDLE);
+  }
+  dirtyTopics |= topics;
+}
+
+bool Store::dispatch() {
+  TRACE_SCOPE("Store::dispatch");
+  METRICS_TIMER(UPDATE_DISPATCH);
+  METRICS_COUNT(UPDATES_DISPATCHED, 1);
+  const Topics topics(dirtyTopics);
+  dirtyTopics = 0;  // subscriptions may request another update
+  if (topics & GEOMETRY) journal->compact(*town);
+  updateSignal.emit(topics);
+  return false;
+}
+
 std::shared_ptr<town::Town> Store::getTown() { return town; }
+journal::Journal* Store::getJournal() { return journal.get(); }
+void Store::setJournal(std::unique_ptr<journal::Journal> newJournal) {
+  journal.reset();
+  journal = newJournal ? std::move(newJournal)
+                       : std::unique_ptr<journal::Journal>(new journal::Journal());
+}
 double Store::getZoomFactor() const { return zoomFactor; }
 node::NodeType Store::getSelectedNode() const { return selectedNode; }
 bool Store::getShowShortestPath() const { return showShortestPath; }
@@ -376,15 +507,15 @@ void Store::setEditLink(bool newValue) { editLink = newValue; }
 
 /* == Subscription == */
 
-Subscription::Subscription(SharedStore& store, bool fullRender)
+Subscription::Subscription(SharedStore& store, Topics topics)
     : store(store),
-      fullRender(fullRender),
+      topics(topics),
       connection(store->getUpdateSignal().connect(
           sigc::mem_fun(*this, &Subscription::triggerUpdate))) {}
 Subscription::~Subscription() { connection.disconnect(); }
 
-void Subscription::triggerUpdate(bool doFullRender) {
-  if (doFullRender || fullRender) onUpdate(store);
+void Subscription::triggerUpdate(Topics dirtyTopics) {
+  if (dirtyTopics & topics) onUpdate(store);
 }
 
 /* == Controller == */
@@ -393,20 +524,31 @@ Controller::Controller(Gtk::Window& window)
     : window(&window),
       store(new Store()),
       connection(store->getActionSignal().connect(
-          sigc::mem_fun(*this, &Controller::handleAction))) {}
-Controller::~Controller() { connection.disconnect(); }
+          sigc::mem_fun(*this, &Controller::handleAction))),
+      saveConnection(saveDispatcher.connect(
+          sigc::mem_fun(*this, &Controller::handleSaved))),
+      failedSaves(0) {}
+
+/** The store may outlive the controller, the pending saves finish here */
+Controller::~Controller() {
+  store->setJournal(nullptr);
+  saveConnection.disconnect();
+  connection.disconnect();
+}
 
 SharedStore& Controller::getStore() { return store; }
 
 void Controller::handleAction(const Action& action) {
+  TRACE_SCOPE("Controller::handleAction");
   switch (action) {
     case Action::EXIT:
       window->close();  // let the program terminate gracefully
       break;
 
     case Action::NEW:
+      store->setJournal(nullptr);  // the edits stay in the journal of the file
       *store->getTown() = town::Town();
-      store->getUpdateSignal().emit(true);
+      store->update(TOWN_CHANGED | SELECTION);
       break;
 
     case Action::OPEN:
@@ -436,7 +578,7 @@ void Controller::changeZoom(double zoomFactor, bool absolute) {
   double newZoom(absolute ? zoomFactor : currentZoom += zoomFactor);
   if (newZoom + ZOOM_ERROR >= MIN_ZOOM && newZoom - ZOOM_ERROR <= MAX_ZOOM) {
     store->setZoomFactor(newZoom);
-    store->getUpdateSignal().emit(false);
+    store->update(ZOOM);
   }
 }
 
@@ -457,15 +599,28 @@ void Controller::saveTown() {
   const auto result = dialog.run();
   dialog.close();  // helps avoid conflict with a subsequent error dialog
 
+  // Only the nodes and links are copied here, editing continues during the save
   if (result == Gtk::RESPONSE_OK) {
-    town::saveToFile(dialog.get_filename(), *store->getTown());
+    store->getJournal()->save(*store->getTown(), dialog.get_filename(),
+                              [this](bool saved) {
+                                if (!saved) ++failedSaves;
+                                saveDispatcher.emit();
+                              });
   }
 }
 
+void Controller::handleSaved() {
+  if (failedSaves.exchange(0) > 0) {
+    showErrorDialog(window, "Could not save town", "The file could not be written.");
+  }
+}
+
+/** Unsaved edits of the file that were recorded in its journal are restored */
 void Controller::loadTown(const std::string& path) {
   try {
-    *store->getTown() = town::loadFromFile(path);
-    store->getUpdateSignal().emit(true);
+    store->setJournal(nullptr);  // finishes the saves of the previous town
+    store->setJournal(journal::recover(path, *store->getTown()));
+    store->update(TOWN_CHANGED | SELECTION);
   } catch (std::string err) {
     showErrorDialog(window, "Could not open file", err);
     store->getActionSignal().emit(NEW);  // fresh new town
@@ -503,9 +658,10 @@ void Group::add(Widget& widget) { buttonBox.add(widget); }
 
 /* == ZoomLabel == */
 
-ZoomLabel::ZoomLabel(SharedStore& store) : Subscription(store) {}
+ZoomLabel::ZoomLabel(SharedStore& store) : Subscription(store, ZOOM) {}
 
 void ZoomLabel::onUpdate(SharedStore& store) {
+  TRACE_SCOPE("ZoomLabel::onUpdate");
   std::ostringstream formatter;
   formatter.setf(std::ios::fixed);
   formatter.precision(ZOOM_PRECISION);
@@ -516,9 +672,10 @@ void ZoomLabel::onUpdate(SharedStore& store) {
 
 /* == EnjLabel == */
 
-EnjLabel::EnjLabel(SharedStore& store) : Subscription(store, false) {}
+EnjLabel::EnjLabel(SharedStore& store) : Subscription(store, STATS) {}
 
 void EnjLabel::onUpdate(SharedStore& store) {
+  TRACE_SCOPE("EnjLabel::onUpdate");
   std::ostringstream formatter;
   formatter.setf(std::ios::fixed);
   formatter.precision(ENJ_PRECISION);
@@ -529,9 +686,10 @@ void EnjLabel::onUpdate(SharedStore& store) {
 
 /* == CiLabel == */
 
-CiLabel::CiLabel(SharedStore& store) : Subscription(store, false) {}
+CiLabel::CiLabel(SharedStore& store) : Subscription(store, STATS) {}
 
 void CiLabel::onUpdate(SharedStore& store) {
+  TRACE_SCOPE("CiLabel::onUpdate");
   std::ostringstream formatter;
   formatter << store->getTown()->ci();
   set_label("CI: " + formatter.str());
@@ -540,9 +698,10 @@ void CiLabel::onUpdate(SharedStore& store) {
 
 /* == MtaLabel == */
 
-MtaLabel::MtaLabel(SharedStore& store) : Subscription(store, false) {}
+MtaLabel::MtaLabel(SharedStore& store) : Subscription(store, STATS) {}
 
 void MtaLabel::onUpdate(SharedStore& store) {
+  TRACE_SCOPE("MtaLabel::onUpdate");
   std::stringstream formatter;
   auto mta(store->getTown()->mta());
   formatter << mta;
@@ -550,6 +709,16 @@ void MtaLabel::onUpdate(SharedStore& store) {
   set_margin_bottom(SPACING);
 }
 
+/* == ClusterLabel == */
+
+ClusterLabel::ClusterLabel(SharedStore& store) : Subscription(store, STATS) {}
+
+void ClusterLabel::onUpdate(SharedStore& store) {
+  TRACE_SCOPE("ClusterLabel::onUpdate");
+  set_label("Clusters: " + std::to_string(store->getTown()->getClusterCount()));
+  set_margin_bottom(SPACING);
+}
+
 /* == EditLink == */
 
 EditLink::EditLink(SharedStore& store) : ToggleButton("Edit link"), store(store) {
@@ -557,10 +726,7 @@ EditLink::EditLink(SharedStore& store) : ToggleButton("Edit link"), store(store)
   set_margin_bottom(SPACING);
 }
 
-void EditLink::handleToggle() {
-  store->setEditLink(get_active());
-  store->getUpdateSignal().emit(false);
-}
+void EditLink::handleToggle() { store->setEditLink(get_active()); }
 
 /* == ShortestPath == */
 
@@ -572,7 +738,7 @@ ShortestPath::ShortestPath(SharedStore& store)
 
 void ShortestPath::handleToggle() {
   store->setShowShortestPath(get_active());
-  store->getUpdateSignal().emit(false);
+  store->update(SELECTION);
 }
 
 /* == Selectors == */
@@ -627,7 +793,8 @@ Sidebar::Sidebar(SharedStore& store)
       zoomLabel(store),
       enjLabel(store),
       ciLabel(store),
-      mtaLabel(store) {
+      mtaLabel(store),
+      clusterLabel(store) {
   generalGroup.add(exitButton);
   generalGroup.add(newButton);
   generalGroup.add(openButton);
@@ -642,6 +809,7 @@ Sidebar::Sidebar(SharedStore& store)
   infoGroup.add(enjLabel);
   infoGroup.add(ciLabel);
   infoGroup.add(mtaLabel);
+  infoGroup.add(clusterLabel);
 
   add(generalGroup);
   add(displayGroup);
@@ -653,28 +821,40 @@ Sidebar::Sidebar(SharedStore& store)
 /* == Viewport == */
 
 Viewport::Viewport(SharedStore& store, Gtk::Window& window)
-    : Subscription(store),
+    : Subscription(store, GEOMETRY | SELECTION | ZOOM),
       TownView(store->getTown(), INITIAL_ZOOM),
       window(&window),
-      leftDragEnabled(false) {
-  add_events(Gdk::BUTTON_PRESS_MASK | Gdk::BUTTON_RELEASE_MASK);
+      leftDragEnabled(false),
+      leftDragSelecting(false),
+      rightDragActive(false),
+      rightDragMoved(false),
+      rightDragBlocked(false),
+      rightDragChanged(false),
+      rightDragPending(false),
+      rightDragFrame(0) {
+  add_events(Gdk::BUTTON_PRESS_MASK | Gdk::BUTTON_RELEASE_MASK |
+             Gdk::BUTTON1_MOTION_MASK | Gdk::BUTTON3_MOTION_MASK);
   signal_button_press_event().connect(sigc::mem_fun(*this, &Viewport::handlePress));
   signal_button_release_event().connect(
       sigc::mem_fun(*this, &Viewport::handleRelease));
+  signal_motion_notify_event().connect(sigc::mem_fun(*this, &Viewport::handleMotion));
 }
 
+/** The only redraw of an update, setZoom() queues it */
 void Viewport::onUpdate(SharedStore& store) {
-  setZoom(store->getZoomFactor());
+  TRACE_SCOPE("Viewport::onUpdate");
   store->getTown()->setHighlightShortestPath(store->getShowShortestPath());
+  setZoom(store->getZoomFactor());
 }
 
 bool Viewport::handlePress(const GdkEventButton* event) {
+  TRACE_SCOPE("Viewport::handlePress");
   if (event->type != GDK_BUTTON_PRESS) return true;  // ignore double clicks
   ScreenLocation pressLocation({(double)event->x, (double)event->y});
 
   switch (event->button) {
     case LEFT_MOUSE:
-      handleLeftClick(pressLocation);
+      handleLeftClick(pressLocation, event->state & GDK_SHIFT_MASK);
       break;
 
     case RIGHT_MOUSE:
@@ -682,79 +862,119 @@ bool Viewport::handlePress(const GdkEventButton* event) {
       break;
   }
 
-  queue_draw();
   return true;
 }
 
 bool Viewport::handleRelease(const GdkEventButton* event) {
-  if (event->button != LEFT_MOUSE || !leftDragEnabled) return true;
+  TRACE_SCOPE("Viewport::handleRelease");
+  if (event->button == RIGHT_MOUSE && rightDragActive) {
+    endRightDrag();
+    return true;
+  }
+  if (event->button == LEFT_MOUSE && (leftDragEnabled || leftDragSelecting))
+    handleLeftRelease({(double)event->x, (double)event->y});
+  return true;
+}
 
-  ScreenLocation releaseLocation({(double)event->x, (double)event->y});
+/** Ends a box selection, or resizes the selection by the length of the drag */
+void Viewport::handleLeftRelease(const ScreenLocation& releaseLocation) {
+  TRACE_SCOPE("Viewport::handleLeftRelease");
   auto town(store->getTown());
+  const bool moved(releaseLocation.x != leftDragOrigin.x ||
+                   releaseLocation.y != leftDragOrigin.y);
+
+  if (leftDragSelecting) {
+    leftDragSelecting = false;
+    clearSelectionBox();
+    if (!moved) return;
+
+    // The box adds to the selection, like a click with shift
+    const tools::Vec2 cornerA(toWorldSpace(leftDragOrigin));
+    const tools::Vec2 cornerB(toWorldSpace(releaseLocation));
+    auto selection(town->getNodesIn({std::min(cornerA.getX(), cornerB.getX()),
+                                     std::min(cornerA.getY(), cornerB.getY()),
+                                     std::max(cornerA.getX(), cornerB.getX()),
+                                     std::max(cornerA.getY(), cornerB.getY())}));
+    for (const auto& uid : town->getSelection()) selection.push_back(uid);
+    town->selectNodes(selection);
+    store->update(SELECTION);
+    return;
+  }
 
-  if (releaseLocation.x == leftDragOrigin.x && releaseLocation.y == leftDragOrigin.y) {
-    // Deselect the node
+  leftDragEnabled = false;
+  const auto selection(town->getSelection());
+  if (!moved) {
     town->selectNode(NO_LINK);
-    store->getUpdateSignal().emit(false);
-  } else {
-    // Resize the node
-    auto selectedNode(town->getModifiableNode(town->getSelectedNode()));
-
-    if (selectedNode != nullptr) {
-      unsigned oldCapacity(selectedNode->getCapacity());
-
-      tools::Vec2 nodePosition(selectedNode->getPosition());
-      tools::Vec2 dragStart(toWorldSpace(leftDragOrigin));
-      tools::Vec2 dragEnd(toWorldSpace(releaseLocation));
-
-      auto radiusDifference((dragEnd - nodePosition).norm() -
-                            (dragStart - nodePosition).norm());
-      try {
-        town->resizeNode(selectedNode->getUid(),
-                         selectedNode->radius() + radiusDifference);
-        store->getUpdateSignal().emit(true);
-      } catch (std::string& err) {
-        selectedNode->setCapacity(oldCapacity);
-        showErrorDialog(window, "Could not resize node",
-                        "The requested size intersected with another node or link.");
-      }
+    store->update(SELECTION);
+  } else if (!selection.empty()) {
+    // The radius grows by how much further from the selection the pointer went
+    tools::Vec2 centre;
+    for (const auto& uid : selection)
+      centre = centre + town->getNode(uid)->getPosition();
+    centre = centre * (1. / selection.size());
+
+    const tools::Vec2 dragStart(toWorldSpace(leftDragOrigin));
+    const tools::Vec2 dragEnd(toWorldSpace(releaseLocation));
+    try {
+      town->resizeNodes(selection,
+                        (dragEnd - centre).norm() - (dragStart - centre).norm());
+      store->getJournal()->setNodes(*town, selection);
+      store->update(TOWN_CHANGED);
+    } catch (std::string& err) {
+      showErrorDialog(window, selection.size() == 1 ? "Could not resize node"
+                                                    : "Could not resize nodes",
+                      "The requested size intersected with another node or link.");
     }
   }
-
-  queue_draw();
-  leftDragEnabled = false;
-  return true;
 }
 
-void Viewport::handleLeftClick(const ScreenLocation& location) {
+void Viewport::handleLeftClick(const ScreenLocation& location, bool extend) {
+  TRACE_SCOPE("Viewport::handleLeftClick");
   auto town(store->getTown());
-  bool doFullRender(true);
+  Topics topics(0);  // a failed edit changes nothing
 
   auto clickedNode(town->getNodeAt(toWorldSpace(location)));
-  if (clickedNode != NO_LINK) {
+  if (extend) {
+    // Shift adds or removes a node, or outlines a box of nodes to select
+    if (clickedNode != NO_LINK) {
+      town->toggleSelected(clickedNode);
+      topics = SELECTION;
+    } else {
+      leftDragOrigin = location;
+      leftDragSelecting = true;
+    }
+  } else if (clickedNode != NO_LINK) {
     const unsigned selectedNode(town->getSelectedNode());
-    if (clickedNode == selectedNode) {
-      town->removeNode(clickedNode);
+    if (town->getNode(clickedNode)->getSelected()) {
+      const auto selection(town->getSelection());
+      town->removeNodes(selection);
+      store->getJournal()->removeNodes(selection);
+      topics = TOWN_CHANGED | SELECTION;
     } else if (store->getEditLink() && selectedNode != NO_LINK) {
       node::Link newLink({selectedNode, clickedNode});
       try {
         if (town->hasLink(newLink)) {
           town->removeLink(newLink);
+          store->getJournal()->removeLink(newLink);
         } else {
           town->addLink(newLink, DIST_MIN);
+          store->getJournal()->addLink(newLink);
         }
+        topics = TOWN_CHANGED;
       } catch (std::string err) {
         showErrorDialog(window, "Could not modify link", err);
       }
     } else {
       town->selectNode(clickedNode);
-      doFullRender = false;
+      topics = SELECTION;
     }
-  } else if (town->getSelectedNode() == NO_LINK) {
+  } else if (town->getSelection().empty()) {
     try {
-      town->addNode(node::Node(store->getSelectedNode(), town->availableUid(),
-                               toWorldSpace(location), MIN_CAPACITY),
-                    DIST_MIN);
+      const node::Node newNode(store->getSelectedNode(), town->availableUid(),
+                               toWorldSpace(location), MIN_CAPACITY);
+      town->addNode(newNode, DIST_MIN);
+      store->getJournal()->addNode(newNode);
+      topics = TOWN_CHANGED;
     } catch (std::string& err) {
       showErrorDialog(window, "Could not create a node here",
                       "The position you chose intersected with another node or link.");
@@ -764,24 +984,111 @@ void Viewport::handleLeftClick(const ScreenLocation& location) {
     leftDragEnabled = true;
   }
 
-  store->getUpdateSignal().emit(doFullRender);
+  store->update(topics);
+}
+
+/** Coalesces the motion events of a drag, only the latest location is applied */
+bool Viewport::handleMotion(const GdkEventMotion* event) {
+  if (leftDragSelecting) {
+    setSelectionBox(toWorldSpace(leftDragOrigin), toWorldSpace({event->x, event->y}));
+    return true;
+  }
+  if (!rightDragActive) return true;
+  rightDragTarget = {event->x, event->y};
+  rightDragMoved = true;
+
+  if (!rightDragPending) {
+    rightDragPending = true;
+    rightDragFrame = add_tick_callback(sigc::mem_fun(*this, &Viewport::handleFrame));
+  }
+  return true;
+}
+
+/** Applies the latest drag location once per frame, returns false to run once */
+bool Viewport::handleFrame(const Glib::RefPtr<Gdk::FrameClock>&) {
+  rightDragPending = false;
+  if (rightDragActive) applyRightDrag();
+  return false;
 }
 
 void Viewport::handleRightClick(const ScreenLocation& location) {
+  TRACE_SCOPE("Viewport::handleRightClick");
   auto town(store->getTown());
 
+  if (town->getSelection().empty()) return;
+
+  rightDragActive = true;
+  rightDragTarget = location;
+  rightDragMoved = false;
+  rightDragChanged = false;
+  town->setHighlightShortestPath(false);  // restored on release
+
   auto selectedNode(town->getSelectedNode());
   if (selectedNode != NO_LINK) {
-    try {
-      town->moveNode(selectedNode, toWorldSpace(location));
+    // The node jumps to the pointer, then follows it until the button is released
+    rightDrag.reset(new town::NodeDrag(*town, selectedNode));
+    applyRightDrag();
+  } else {
+    // A group keeps its shape, it follows the movements of the pointer
+    rightDragApplied = toWorldSpace(location);
+  }
+}
 
-    } catch (std::string& err) {
-      showErrorDialog(window, "Could not move node",
-                      "The new position intersected with another node or link.");
+/** Moves the dragged nodes, or leaves them at their last free location */
+void Viewport::applyRightDrag() {
+  TRACE_SCOPE("Viewport::applyRightDrag");
+  try {
+    const tools::Vec2 target(toWorldSpace(rightDragTarget));
+    if (rightDrag) {
+      rightDrag->moveTo(target);
+    } else {
+      auto town(store->getTown());
+      town->moveNodes(town->getSelection(), target - rightDragApplied);
+      rightDragApplied = target;
     }
+    rightDragBlocked = false;
+    rightDragChanged = true;
+  } catch (std::string& err) {
+    rightDragBlocked = true;
   }
 
-  store->getUpdateSignal().emit(true);
+  auto gdkWindow(get_window());
+  if (gdkWindow) {
+    gdkWindow->set_cursor(rightDragBlocked
+                              ? Gdk::Cursor::create(get_display(), BLOCKED_CURSOR)
+                              : Glib::RefPtr<Gdk::Cursor>());
+  }
+  redraw();
+}
+
+/** Statistics and path highlighting only follow the node once it is released */
+void Viewport::endRightDrag() {
+  TRACE_SCOPE("Viewport::endRightDrag");
+  if (rightDragPending) {
+    remove_tick_callback(rightDragFrame);
+    rightDragPending = false;
+    applyRightDrag();
+  }
+
+  const bool failedClick(rightDragBlocked && !rightDragMoved);
+  rightDragActive = false;
+  rightDrag.reset();
+  rightDragBlocked = false;
+  if (get_window()) get_window()->set_cursor();
+
+  if (failedClick) {
+    showErrorDialog(window, "Could not move node",
+                    "The new position intersected with another node or link.");
+  }
+
+  auto town(store->getTown());
+  town->setHighlightShortestPath(store->getShowShortestPath());
+  redraw();
+  if (!rightDragChanged) return;
+
+  // The drag is recorded once, where the nodes were left
+  store->getJournal()->setNodes(*town, town->getSelection());
+  store->update(TOWN_CHANGED);
 }
 
 tools::Vec2 Viewport::toWorldSpace(const ScreenLocation& location) {
@@ -819,7 +1126,7 @@ Window::Window()
   add(view);
   show_all();
 
-  controller.getStore()->getUpdateSignal().emit(true);
+  controller.getStore()->update(ALL_TOPICS);
 }
 
 void Window::loadFile(const std::string& path) { controller.loadTown(path); }
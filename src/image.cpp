@@ -0,0 +1,246 @@
+// archipelago v3.0.0 - architecture b2
+// image.cpp - headless rendering of towns to image files
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "image.hpp"
+
+#include <cairomm/context.h>
+#include <cairomm/surface.h>
+
+#include <algorithm>  // max(), min()
+#include <atomic>
+#include <cmath>      // ceil(), floor()
+#include <exception>  // cairomm errors
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "graphics.hpp"
+#include "model/constants.hpp"
+#include "model/error.hpp"
+#include "model/spatial.hpp"
+#include "model/trace.hpp"
+#include "raster.hpp"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+constexpr char PNG_EXTENSION[](".png");
+constexpr char SVG_EXTENSION[](".svg");
+constexpr char PDF_EXTENSION[](".pdf");
+
+/** The side of the tiles of a raster image, each tile is drawn by one thread */
+constexpr int TILE_SIZE(1024);
+/** Antialiasing reaches a pixel past the bounds of a primitive */
+constexpr double ANTIALIAS_MARGIN(1.);
+constexpr int BYTES_PER_PIXEL(4);
+
+constexpr double WHITE[3]{1., 1., 1.};
+
+/** Places the town in the image, world coordinates to image coordinates */
+struct Frame {
+  double scale;
+  double minX;
+  double maxY;
+  int width;
+  int height;
+};
+
+bool hasExtension(const string& path, const string& extension);
+Frame frameOf(const spatial::Box& box, unsigned size);
+void transform(const Cairo::RefPtr<Cairo::Context>& cr, const Frame& frame, int x,
+               int y);
+void paintBackground(const Cairo::RefPtr<Cairo::Context>& cr);
+vector<vector<unsigned>> binTiles(const graphics::Recording& recording,
+                                  const Frame& frame, int nbColumns, int nbRows);
+void drawTiles(unsigned char* data, int stride, const graphics::Recording& recording,
+               const Frame& frame);
+void exportRaster(const string& path, const graphics::Recording& recording,
+                  const Frame& frame);
+void exportVector(const Cairo::RefPtr<Cairo::Surface>& surface,
+                  const graphics::Recording& recording, const Frame& frame);
+
+}  // namespace
+
+namespace image {
+
+void exportTown(const string& path, town::Town& town, unsigned size) {
+  TRACE_SCOPE("image::exportTown");
+  if (size == 0 || size > MAX_IMAGE_SIZE)
+    throw error::invalid_image_size(std::to_string(size));
+
+  const bool png(hasExtension(path, PNG_EXTENSION));
+  const bool svg(hasExtension(path, SVG_EXTENSION));
+  const bool pdf(hasExtension(path, PDF_EXTENSION));
+  if (!png && !svg && !pdf)
+    throw string("Unknown image format, use .png, .svg or .pdf\n");
+
+  // Rendering a town updates its highlighted paths, it is only drawn once
+  graphics::Recording recording;
+  town.render(recording);
+  const Frame frame(frameOf(recording.bounds(), size));
+
+  try {
+    if (png) {
+      exportRaster(path, recording, frame);
+    } else if (svg) {
+      exportVector(Cairo::SvgSurface::create(path, frame.width, frame.height),
+                   recording, frame);
+    } else {
+      exportVector(Cairo::PdfSurface::create(path, frame.width, frame.height),
+                   recording, frame);
+    }
+  } catch (std::exception&) {
+    throw string("Could not write image\n");
+  }
+}
+
+}  // namespace image
+
+namespace {
+
+bool hasExtension(const string& path, const string& extension) {
+  return path.size() > extension.size() &&
+         path.compare(path.size() - extension.size(), extension.size(), extension) ==
+             0;
+}
+
+/** Fits the box in an image whose longest side is the given size */
+Frame frameOf(const spatial::Box& box, unsigned size) {
+  const double width(box.maxX - box.minX);
+  const double height(box.maxY - box.minY);
+  const double scale(size / std::max(width, height));
+
+  return {scale, box.minX, box.maxY,
+          std::max(1, static_cast<int>(std::ceil(width * scale))),
+          std::max(1, static_cast<int>(std::ceil(height * scale)))};
+}
+
+/** World to image coordinates, for the part of the image that starts at (x, y) */
+void transform(const Cairo::RefPtr<Cairo::Context>& cr, const Frame& frame, int x,
+               int y) {
+  cr->translate(-x, -y);
+  cr->scale(frame.scale, -frame.scale);
+  cr->translate(-frame.minX, -frame.maxY);
+}
+
+void paintBackground(const Cairo::RefPtr<Cairo::Context>& cr) {
+  cr->save();
+  cr->set_source_rgb(WHITE[0], WHITE[1], WHITE[2]);
+  cr->paint();
+  cr->restore();
+}
+
+/** The primitives that reach each tile, in drawing order, tiles are row-major */
+vector<vector<unsigned>> binTiles(const graphics::Recording& recording,
+                                  const Frame& frame, int nbColumns, int nbRows) {
+  vector<vector<unsigned>> bins(nbColumns * nbRows);
+
+  for (size_t i(0); i < recording.size(); ++i) {
+    const spatial::Box box(recording.bounds(i));
+    const double left((box.minX - frame.minX) * frame.scale - ANTIALIAS_MARGIN);
+    const double right((box.maxX - frame.minX) * frame.scale + ANTIALIAS_MARGIN);
+    const double top((frame.maxY - box.maxY) * frame.scale - ANTIALIAS_MARGIN);
+    const double bottom((frame.maxY - box.minY) * frame.scale + ANTIALIAS_MARGIN);
+
+    const int firstColumn(std::max(0, static_cast<int>(std::floor(left / TILE_SIZE))));
+    const int lastColumn(
+        std::min(nbColumns - 1, static_cast<int>(std::floor(right / TILE_SIZE))));
+    const int firstRow(std::max(0, static_cast<int>(std::floor(top / TILE_SIZE))));
+    const int lastRow(
+        std::min(nbRows - 1, static_cast<int>(std::floor(bottom / TILE_SIZE))));
+
+    for (int row(firstRow); row <= lastRow; ++row) {
+      for (int column(firstColumn); column <= lastColumn; ++column)
+        bins[row * nbColumns + column].push_back(i);
+    }
+  }
+  return bins;
+}
+
+/** Draws the image with Cairo in tiles on every core, see exportRaster() */
+void drawTiles(unsigned char* data, int stride, const graphics::Recording& recording,
+               const Frame& frame) {
+  const int nbColumns((frame.width + TILE_SIZE - 1) / TILE_SIZE);
+  const int nbRows((frame.height + TILE_SIZE - 1) / TILE_SIZE);
+  const vector<vector<unsigned>> bins(binTiles(recording, frame, nbColumns, nbRows));
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  const unsigned nbThreads(std::max(
+      1U, std::min<unsigned>(std::thread::hardware_concurrency(), bins.size())));
+
+  auto worker = [&]() {
+    for (size_t i(next++); i < bins.size(); i = next++) {
+      const int x(i % nbColumns * TILE_SIZE), y(i / nbColumns * TILE_SIZE);
+      try {
+        auto surface(Cairo::ImageSurface::create(
+            data + static_cast<size_t>(y) * stride + x * BYTES_PER_PIXEL,
+            Cairo::FORMAT_ARGB32, std::min(TILE_SIZE, frame.width - x),
+            std::min(TILE_SIZE, frame.height - y), stride));
+        auto cr(Cairo::Context::create(surface));
+        paintBackground(cr);
+        transform(cr, frame, x, y);
+
+        graphics::CairoContext context;
+        context.setContext(cr);
+        recording.replay(context, bins[i]);
+        surface->flush();
+      } catch (std::exception&) {
+        failed = true;
+      }
+    }
+  };
+
+  vector<std::thread> threads;
+  for (unsigned i(1); i < nbThreads; ++i) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+  if (failed) throw string("Could not render image\n");
+}
+
+/**
+ * Draws the image into a buffer that is written once complete, with the backend
+ * selected for the GUI. Cairo draws tiles, each tile is a surface over its part of
+ * the buffer, the raster backend draws bands of rows.
+ */
+void exportRaster(const string& path, const graphics::Recording& recording,
+                  const Frame& frame) {
+  const int stride(
+      Cairo::ImageSurface::format_stride_for_width(Cairo::FORMAT_ARGB32, frame.width));
+  std::unique_ptr<unsigned char[]> data(
+      new unsigned char[static_cast<size_t>(stride) * frame.height]);
+
+  if (graphics::defaultBackend() == graphics::RASTER) {
+    const raster::Target target{reinterpret_cast<uint32_t*>(data.get()), frame.width,
+                                frame.height, stride / BYTES_PER_PIXEL};
+    const raster::Transform toPixels{frame.scale, -frame.minX * frame.scale,
+                                     frame.maxY * frame.scale};
+    raster::drawBands(target, toPixels, [&recording](raster::Raster& raster) {
+      raster.paintBackground();
+      recording.replay(raster);
+    });
+  } else {
+    drawTiles(data.get(), stride, recording, frame);
+  }
+
+  Cairo::ImageSurface::create(data.get(), Cairo::FORMAT_ARGB32, frame.width,
+                              frame.height, stride)
+      ->write_to_png(path);
+}
+
+void exportVector(const Cairo::RefPtr<Cairo::Surface>& surface,
+                  const graphics::Recording& recording, const Frame& frame) {
+  auto cr(Cairo::Context::create(surface));
+  paintBackground(cr);
+  transform(cr, frame, 0, 0);
+
+  graphics::CairoContext context;
+  context.setContext(cr);
+  recording.replay(context);
+  surface->finish();
+}
+
+}  // namespace
@@ -0,0 +1,35 @@
+// archipelago v3.0.0 - architecture b2
+// image.hpp - headless rendering of towns to image files
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <string>
+
+#include "model/town.hpp"
+
+/**
+ * Module: image
+ * Renders a town to a file without a window or a display server, as the GUI draws
+ * it. The town is recorded once (see graphics::Recording), which lets a raster image
+ * be drawn in tiles on every core, each tile with its own Cairo context on its own
+ * part of the image. Vector formats are drawn in one pass.
+ *
+ * The image frames every node and link of the town, its longest side has the given
+ * size in pixels, or in points for vector formats.
+ */
+
+namespace image {
+
+/* === FUNCTIONS === */
+
+/**
+ * Renders the town to a PNG, SVG or PDF file, following the file's extension
+ * @throws If the format or the size is not supported, or the file can not be written
+ */
+void exportTown(const std::string& path, town::Town& town, unsigned size);
+
+}  // namespace image
+
+#endif
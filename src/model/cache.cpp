@@ -0,0 +1,216 @@
+// archipelago v3.0.0 - architecture b2
+// cache.cpp - persistent cache of derived data, shared between runs
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "cache.hpp"
+
+#include <dirent.h>    // opendir(), readdir()
+#include <sys/stat.h>  // mkdir(), stat()
+#include <unistd.h>    // getpid(), unlink()
+#include <utime.h>     // utime()
+
+#include <algorithm>  // sort()
+#include <atomic>
+#include <cerrno>   // errno
+#include <cstdio>   // rename(), snprintf()
+#include <cstdlib>  // getenv(), strtoull()
+#include <ctime>    // time()
+#include <fstream>
+#include <iterator>  // istreambuf_iterator
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+constexpr char APPLICATION_DIRECTORY[]("archipelago");
+constexpr char FALLBACK_DIRECTORY[]("/.cache");  // relative to $HOME
+constexpr char ENTRY_EXTENSION[](".entry");
+constexpr char TEMPORARY_EXTENSION[](".tmp");
+constexpr char SIZE_ENV[]("ARCHIPELAGO_CACHE_SIZE");
+
+constexpr unsigned long long DEFAULT_SIZE(256ULL << 20);  // bytes of entries
+constexpr time_t STALE_TEMPORARY(3600);  // seconds, left behind by a crashed writer
+constexpr mode_t DIRECTORY_MODE(0700);
+constexpr unsigned MAX_KEY_LENGTH(64);
+constexpr int DECIMAL_BASE(10);
+
+constexpr unsigned long long FNV_OFFSET(14695981039346656037ULL);
+constexpr unsigned long long FNV_PRIME(1099511628211ULL);
+
+/** An entry of the directory, by the time it was last used */
+struct Entry {
+  time_t used;
+  unsigned long long size;
+  string name;
+};
+
+/** Distinguishes the temporary files of the threads of a process */
+std::atomic<unsigned> temporaryCounter(0);
+
+/** Creates a directory and its missing parents, like mkdir -p */
+bool makeDirectories(const string& path);
+void hashBytes(unsigned long long& hash, const string& bytes);
+bool endsWith(const string& text, const char* suffix);
+unsigned long long sizeLimit();
+void evict(const string& directory);
+
+}  // namespace
+
+namespace cache {
+
+/* === FUNCTIONS === */
+
+string directory() {
+  string base;
+  const char* xdgCache(std::getenv("XDG_CACHE_HOME"));
+  const char* home(std::getenv("HOME"));
+
+  // Relative paths are invalid according to the specification, and ignored
+  if (xdgCache != nullptr && xdgCache[0] == '/') {
+    base = xdgCache;
+  } else if (home != nullptr && home[0] == '/') {
+    base = string(home) + FALLBACK_DIRECTORY;
+  } else {
+    return "";
+  }
+
+  const string path(base + "/" + APPLICATION_DIRECTORY);
+  if (!makeDirectories(path)) return "";
+  return path;
+}
+
+/** A 64-bit FNV-1a hash, followed by the length of the content */
+string key(const string& content, const string& salt) {
+  unsigned long long hash(FNV_OFFSET);
+  hashBytes(hash, salt);
+  hashBytes(hash, content);
+
+  char formatted[MAX_KEY_LENGTH];
+  std::snprintf(formatted, sizeof(formatted), "%016llx-%llx", hash,
+                static_cast<unsigned long long>(content.size()));
+  return formatted;
+}
+
+bool load(const string& key, string& data) {
+  const string root(directory());
+  if (root.empty()) return false;
+
+  const string path(root + "/" + key + ENTRY_EXTENSION);
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  if (!file.is_open()) return false;
+
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  if (file.bad()) return false;
+
+  utime(path.c_str(), nullptr);  // the last use, for the eviction
+  return true;
+}
+
+void store(const string& key, const string& data) {
+  const string root(directory());
+  if (root.empty()) return;
+
+  const string path(root + "/" + key + ENTRY_EXTENSION);
+  const string temporary(root + "/" + key + "." + std::to_string(getpid()) + "." +
+                         std::to_string(temporaryCounter++) + TEMPORARY_EXTENSION);
+  {
+    std::ofstream file(temporary, std::ios::out | std::ios::binary);
+    if (!file.is_open()) return;
+    file.write(data.data(), data.size());
+    file.close();
+    if (file.fail()) {
+      unlink(temporary.c_str());
+      return;
+    }
+  }
+
+  // Readers see either the previous entry or the complete new one
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return;
+  }
+  evict(root);
+}
+
+}  // namespace cache
+
+namespace {
+
+bool makeDirectories(const string& path) {
+  for (size_t separator(path.find('/', 1)); separator != string::npos;
+       separator = path.find('/', separator + 1)) {
+    const string parent(path, 0, separator);
+    if (mkdir(parent.c_str(), DIRECTORY_MODE) != 0 && errno != EEXIST) return false;
+  }
+  if (mkdir(path.c_str(), DIRECTORY_MODE) != 0 && errno != EEXIST) return false;
+
+  // An existing file of the same name is not a directory
+  struct stat status;
+  return stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+void hashBytes(unsigned long long& hash, const string& bytes) {
+  for (const char& byte : bytes) {
+    hash ^= static_cast<unsigned char>(byte);
+    hash *= FNV_PRIME;
+  }
+}
+
+bool endsWith(const string& text, const char* suffix) {
+  const string ending(suffix);
+  return text.size() >= ending.size() &&
+         text.compare(text.size() - ending.size(), ending.size(), ending) == 0;
+}
+
+unsigned long long sizeLimit() {
+  const char* limit(std::getenv(SIZE_ENV));
+  if (limit == nullptr || limit[0] == '\0') return DEFAULT_SIZE;
+  return std::strtoull(limit, nullptr, DECIMAL_BASE);
+}
+
+/**
+ * Removes the least recently used entries until the others fit in the limit.
+ * Concurrent processes may remove the same entry, a missing file is skipped.
+ */
+void evict(const string& directory) {
+  DIR* listing(opendir(directory.c_str()));
+  if (listing == nullptr) return;
+
+  vector<Entry> entries;
+  unsigned long long total(0);
+  const time_t now(std::time(nullptr));
+
+  for (dirent* item(readdir(listing)); item != nullptr; item = readdir(listing)) {
+    const string name(item->d_name);
+    const string path(directory + "/" + name);
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) continue;
+
+    if (endsWith(name, ENTRY_EXTENSION)) {
+      entries.push_back(
+          {status.st_mtime, static_cast<unsigned long long>(status.st_size), path});
+      total += status.st_size;
+    } else if (endsWith(name, TEMPORARY_EXTENSION) &&
+               now - status.st_mtime > STALE_TEMPORARY) {
+      unlink(path.c_str());
+    }
+  }
+  closedir(listing);
+
+  const unsigned long long limit(sizeLimit());
+  if (total <= limit) return;
+
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.used < b.used || (a.used == b.used && a.name < b.name);
+  });
+  for (const auto& entry : entries) {
+    if (total <= limit) break;
+    unlink(entry.name.c_str());
+    total -= entry.size;
+  }
+}
+
+}  // namespace
@@ -0,0 +1,51 @@
+// archipelago v3.0.0 - architecture b2
+// cache.hpp - persistent cache of derived data, shared between runs
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_CACHE_H
+#define MODEL_CACHE_H
+
+#include <string>
+
+/**
+ * Module: cache
+ * A directory of entries keyed by a hash of the content they were derived from,
+ * such as a validated town and its statistics. Entries survive across runs and are
+ * shared by every process of the user.
+ *
+ * An entry is written to a temporary file that is then renamed, a process reads
+ * either a complete entry or none. Each read refreshes the modification time of the
+ * entry, the least recently used entries are removed once the entries exceed the
+ * size limit. The caller still validates the content of an entry that it reads.
+ */
+
+namespace cache {
+
+/* === FUNCTIONS === */
+
+/**
+ * The directory of the cache, $XDG_CACHE_HOME/archipelago or ~/.cache/archipelago,
+ * created with its missing parents if needed. Empty if it can not be determined or
+ * created, the cache is then disabled.
+ */
+std::string directory();
+
+/**
+ * The key of an entry, a hash of the content combined with a salt that tells apart
+ * entries derived differently from the same content
+ */
+std::string key(const std::string& content, const std::string& salt);
+
+/** Reads an entry into data and marks it as used. Returns false if it is missing */
+bool load(const std::string& key, std::string& data);
+
+/**
+ * Writes an entry, replacing an entry with the same key, and removes the least
+ * recently used entries beyond the size limit. Failures are ignored.
+ * The limit is 256 MiB, or ARCHIPELAGO_CACHE_SIZE bytes if set.
+ */
+void store(const std::string& key, const std::string& data);
+
+}  // namespace cache
+
+#endif
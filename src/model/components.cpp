@@ -0,0 +1,216 @@
+// archipelago v3.0.0 - architecture b2
+// components.cpp - incremental connectivity of town nodes
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "components.hpp"
+
+#include <algorithm>  // find()
+#include <utility>    // swap()
+
+using node::NodeType;
+using std::vector;
+
+namespace {
+
+bool isTransit(const NodeType& type) { return type != node::PRODUCTION; }
+
+void removeNeighbour(vector<unsigned>& neighbours, unsigned uid);
+
+}  // namespace
+
+namespace components {
+
+/* === CLASSES === */
+
+Components::Components() : nbClusters(0), stamp(0) {}
+
+void Components::addNode(unsigned uid, const NodeType& type) {
+  Entry& entry(entries[uid]);
+  entry = {uid, type, {}, stamp, 1, 0, 0, 0};
+  if (type == node::HOUSING) entry.nbHousing = 1;
+  if (type == node::TRANSPORT) entry.nbTransport = 1;
+  ++nbClusters;
+}
+
+void Components::removeNode(unsigned uid) {
+  auto it(entries.find(uid));
+  if (it == entries.end()) return;
+
+  const Entry removed(std::move(it->second));
+  entries.erase(it);
+
+  if (!isTransit(removed.type)) {
+    // Detach the production node from the clusters it was linked to
+    if (removed.neighbours.empty()) --nbClusters;
+    for (const auto& neighbour : removed.neighbours) {
+      removeNeighbour(entries[neighbour].neighbours, uid);
+      --entries[root(neighbour)].nbProductionLinks;
+    }
+    return;
+  }
+
+  for (const auto& neighbour : removed.neighbours) {
+    Entry& entry(entries[neighbour]);
+    removeNeighbour(entry.neighbours, uid);
+    if (!isTransit(entry.type) && entry.neighbours.empty()) ++nbClusters;
+  }
+
+  // The remaining nodes of the cluster are each linked to one of its neighbours
+  --nbClusters;
+  ++stamp;
+  for (const auto& neighbour : removed.neighbours) {
+    const Entry& entry(entries[neighbour]);
+    if (isTransit(entry.type) && entry.mark != stamp) {
+      relabel(neighbour);
+      ++nbClusters;
+    }
+  }
+}
+
+void Components::addLink(unsigned uid0, unsigned uid1) {
+  Entry& entry0(entries[uid0]);
+  Entry& entry1(entries[uid1]);
+  const bool transit0(isTransit(entry0.type)), transit1(isTransit(entry1.type));
+  if (!transit0 && !transit1) return;  // can never be part of a path
+
+  entry0.neighbours.push_back(uid1);
+  entry1.neighbours.push_back(uid0);
+
+  if (transit0 && transit1) {
+    merge(uid0, uid1);
+  } else {
+    const Entry& production(transit0 ? entry1 : entry0);
+    if (production.neighbours.size() == 1) --nbClusters;  // no longer on its own
+    ++entries[root(transit0 ? uid0 : uid1)].nbProductionLinks;
+  }
+}
+
+void Components::removeLink(unsigned uid0, unsigned uid1) {
+  auto it0(entries.find(uid0)), it1(entries.find(uid1));
+  if (it0 == entries.end() || it1 == entries.end()) return;
+
+  Entry& entry0(it0->second);
+  Entry& entry1(it1->second);
+  const bool transit0(isTransit(entry0.type)), transit1(isTransit(entry1.type));
+  if (!transit0 && !transit1) return;
+
+  removeNeighbour(entry0.neighbours, uid1);
+  removeNeighbour(entry1.neighbours, uid0);
+
+  if (transit0 && transit1) {
+    // The cluster may have been split in two
+    ++stamp;
+    relabel(uid0);
+    if (entry1.mark != stamp) {
+      relabel(uid1);
+      ++nbClusters;
+    }
+  } else {
+    if ((transit0 ? entry1 : entry0).neighbours.empty()) ++nbClusters;
+    --entries[root(transit0 ? uid0 : uid1)].nbProductionLinks;
+  }
+}
+
+bool Components::reachable(unsigned origin, const NodeType& type) const {
+  const Entry& entry(entries.at(origin));
+  if (!isTransit(entry.type)) return type == node::PRODUCTION;  // can not be left
+
+  const Entry& cluster(entries.at(root(origin)));
+  switch (type) {
+    case node::HOUSING:
+      return cluster.nbHousing > 0;
+    case node::TRANSPORT:
+      return cluster.nbTransport > 0;
+    default:
+      return cluster.nbProductionLinks > 0;
+  }
+}
+
+bool Components::connected(unsigned origin, unsigned destination) const {
+  if (origin == destination) return true;
+
+  const Entry& entry(entries.at(origin));
+  if (!isTransit(entry.type)) return false;
+
+  const unsigned cluster(root(origin));
+  const Entry& target(entries.at(destination));
+  if (isTransit(target.type)) return root(destination) == cluster;
+
+  for (const auto& neighbour : target.neighbours)
+    if (root(neighbour) == cluster) return true;
+  return false;
+}
+
+unsigned Components::count() const { return nbClusters; }
+
+/** Union by size keeps the trees shallow without compressing paths */
+unsigned Components::root(unsigned uid) const {
+  unsigned current(uid);
+  for (unsigned parent(entries.at(current).parent); parent != current;
+       parent = entries.at(current).parent)
+    current = parent;
+  return current;
+}
+
+void Components::merge(unsigned uid0, unsigned uid1) {
+  unsigned root0(root(uid0)), root1(root(uid1));
+  if (root0 == root1) return;
+
+  if (entries[root0].size < entries[root1].size) std::swap(root0, root1);
+  Entry& parent(entries[root0]);
+  const Entry& child(entries[root1]);
+
+  entries[root1].parent = root0;
+  parent.size += child.size;
+  parent.nbHousing += child.nbHousing;
+  parent.nbTransport += child.nbTransport;
+  parent.nbProductionLinks += child.nbProductionLinks;
+  --nbClusters;
+}
+
+/**
+ * Rebuilds the cluster containing the seed from its links, marking each member
+ * with the current stamp and making the seed its root.
+ */
+void Components::relabel(unsigned seed) {
+  Entry& cluster(entries[seed]);
+  cluster.size = cluster.nbHousing = cluster.nbTransport = cluster.nbProductionLinks = 0;
+
+  vector<unsigned> pending{seed};
+  cluster.mark = stamp;
+
+  while (!pending.empty()) {
+    const unsigned uid(pending.back());
+    pending.pop_back();
+
+    Entry& entry(entries[uid]);
+    entry.parent = seed;
+    ++cluster.size;
+    if (entry.type == node::HOUSING) ++cluster.nbHousing;
+    if (entry.type == node::TRANSPORT) ++cluster.nbTransport;
+
+    for (const auto& neighbour : entry.neighbours) {
+      Entry& next(entries[neighbour]);
+      if (!isTransit(next.type)) {
+        ++cluster.nbProductionLinks;
+      } else if (next.mark != stamp) {
+        next.mark = stamp;
+        pending.push_back(neighbour);
+      }
+    }
+  }
+}
+
+}  // namespace components
+
+namespace {
+
+void removeNeighbour(vector<unsigned>& neighbours, unsigned uid) {
+  auto it(std::find(neighbours.begin(), neighbours.end(), uid));
+  if (it != neighbours.end()) {
+    *it = neighbours.back();
+    neighbours.pop_back();
+  }
+}
+
+}  // namespace
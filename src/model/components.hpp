@@ -0,0 +1,74 @@
+// archipelago v3.0.0 - architecture b2
+// components.hpp - incremental connectivity of town nodes
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_COMPONENTS_H
+#define MODEL_COMPONENTS_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "node.hpp"
+
+namespace components {
+
+/* === CLASSES === */
+
+/**
+ * Tracks the connected clusters of a town with a union-find structure, following the
+ * path finding rules: housing and transport nodes are merged by their links, while a
+ * production node can not be traversed and is only attached to the clusters that it
+ * is linked to. Each cluster counts its node types, which answers whether a node
+ * type is reachable without any search.
+ *
+ * Adding a link is a union, removing a link or a node recomputes the affected
+ * cluster only.
+ */
+class Components {
+ public:
+  Components();
+
+  /* Modifiers, the caller is responsible for the validity of the nodes and links */
+
+  void addNode(unsigned uid, const node::NodeType& type);
+  void removeNode(unsigned uid);
+  void addLink(unsigned uid0, unsigned uid1);
+  void removeLink(unsigned uid0, unsigned uid1);
+
+  /* Queries */
+
+  /** Whether a path exists from the origin to a node of the given type */
+  bool reachable(unsigned origin, const node::NodeType& type) const;
+  /** Whether a path exists from the origin to the destination */
+  bool connected(unsigned origin, unsigned destination) const;
+
+  /** Number of disconnected clusters, including unlinked production nodes */
+  unsigned count() const;
+
+ private:
+  struct Entry {
+    unsigned parent;
+    node::NodeType type;
+    /** Linked nodes, except for links between two production nodes */
+    std::vector<unsigned> neighbours;
+    unsigned mark;
+
+    /* Cluster totals, only valid for a root */
+    unsigned size;
+    unsigned nbHousing;
+    unsigned nbTransport;
+    unsigned nbProductionLinks;
+  };
+
+  std::unordered_map<unsigned, Entry> entries;
+  unsigned nbClusters;
+  unsigned stamp;
+
+  unsigned root(unsigned uid) const;
+  void merge(unsigned uid0, unsigned uid1);
+  void relabel(unsigned seed);
+};
+
+}  // namespace components
+
+#endif
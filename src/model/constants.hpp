@@ -37,6 +37,8 @@ constexpr double INFINITE_TIME(1e100);
 
 /** Initial canvas size (window size) */
 constexpr unsigned DEFAULT_DRAWING_SIZE(800);
+/** Largest side of an exported image, that of a Cairo image surface */
+constexpr unsigned MAX_IMAGE_SIZE(32767);
 
 /* Zoom step (incrementation) */
 constexpr double DELTA_ZOOM(0.2);
@@ -25,6 +25,15 @@ string error::link_vacuum(unsigned int uid) {
          to_string(uid) + string("\n");
 }
 
+string error::link_link_superposition(unsigned int uid1, unsigned int uid2,
+                                     unsigned int uid3, unsigned int uid4) {
+  sort_uid(uid1, uid2);
+  sort_uid(uid3, uid4);
+  return string("Impossible to have superposition between two links: ") +
+         to_string(uid1) + string(" <-> ") + to_string(uid2) + string(" with ") +
+         to_string(uid3) + string(" <-> ") + to_string(uid4) + string("\n");
+}
+
 string error::max_link(unsigned int uid) {
   return string("Too many connections for node: ") + to_string(uid) + string("\n");
 }
@@ -69,6 +78,11 @@ string error::too_much_capacity(unsigned int capacity) {
          string(" > ") + to_string(MAX_CAPACITY) + string("\n");
 }
 
+string error::invalid_image_size(const string& size) {
+  return string("Impossible to export an image of size: ") + size +
+         string(", expected 1 to ") + to_string(MAX_IMAGE_SIZE) + string("\n");
+}
+
 /* === Internal functions === */
 namespace {
 void sort_uid(unsigned int &uid1, unsigned int &uid2) {
@@ -20,6 +20,10 @@ std::string identical_uid(unsigned int uid);
 // One of the nodes indicated for a link does not exist.
 std::string link_vacuum(unsigned int uid);
 
+// A link crosses another link, given by the last two uids
+std::string link_link_superposition(unsigned int uid1, unsigned int uid2,
+                                    unsigned int uid3, unsigned int uid4);
+
 // A housing node number of links exceeds the allowed maximum number
 std::string max_link(unsigned int uid);
 
@@ -46,6 +50,9 @@ std::string too_little_capacity(unsigned int capacity);
 
 // A node that has too much capacity
 std::string too_much_capacity(unsigned int capacity);
+
+// An image size that is not a whole number of pixels up to the largest image
+std::string invalid_image_size(const std::string& size);
 }  // namespace error
 
 #endif
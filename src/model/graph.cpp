@@ -0,0 +1,341 @@
+// archipelago v3.0.0 - architecture b2
+// graph.cpp - compact town graph and path finding
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "graph.hpp"
+
+#include <algorithm>  // lower_bound(), push_heap(), pop_heap(), reverse()
+#include <functional>  // greater
+
+#include "constants.hpp"
+#include "metrics.hpp"
+
+using node::NodeType;
+using std::vector;
+
+namespace {
+
+constexpr double ZERO_TIME(0.);  // an absence of time
+
+constexpr unsigned long long FNV_OFFSET(14695981039346656037ULL);
+constexpr unsigned long long FNV_PRIME(1099511628211ULL);
+
+typedef std::pair<double, unsigned> HeapEntry;
+
+template <typename T>
+void hashValue(unsigned long long& hash, const T& value);
+
+}  // namespace
+
+namespace graph {
+
+/* === CLASSES === */
+
+/* == Graph == */
+
+Graph::Graph(const std::map<unsigned, node::Node>& nodes,
+             const vector<node::Link>& links, unsigned long generation)
+    : generation(generation), offsets(nodes.size() + 1, 0), links(links) {
+  uids.reserve(nodes.size());
+  types.reserve(nodes.size());
+  positions.reserve(nodes.size());
+  capacities.reserve(nodes.size());
+
+  for (const auto& node : nodes) {
+    uids.push_back(node.first);
+    types.push_back(node.second.getType());
+    positions.push_back(node.second.getPosition());
+    capacities.push_back(node.second.getCapacity());
+  }
+  columns = {static_cast<unsigned>(uids.size()), uids.data(), types.data(),
+             positions.data(), capacities.data(), offsets.data(), nullptr, nullptr};
+
+  // Count the degree of each node, then turn the counts into offsets
+  for (const auto& link : links) {
+    ++offsets[index(link.getUid0()) + 1];
+    ++offsets[index(link.getUid1()) + 1];
+  }
+  for (unsigned i(1); i < offsets.size(); ++i) offsets[i] += offsets[i - 1];
+
+  // Fill the edges in link order, which preserves the town's neighbour order
+  vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+  targets.resize(offsets.back());
+  weights.resize(offsets.back());
+  columns.targets = targets.data();
+  columns.weights = weights.data();
+
+  for (const auto& link : links) {
+    const unsigned index0(index(link.getUid0())), index1(index(link.getUid1()));
+    const double distance((positions[index1] - positions[index0]).norm());
+    const double time(accessTime(types[index0], types[index1], distance));
+
+    targets[fill[index0]] = index1;
+    weights[fill[index0]++] = time;
+    targets[fill[index1]] = index0;
+    weights[fill[index1]++] = time;
+  }
+}
+
+Graph::Graph(const Columns& columns, unsigned long generation)
+    : generation(generation), columns(columns) {}
+
+unsigned long Graph::getGeneration() const { return generation; }
+
+unsigned Graph::size() const { return columns.nbNodes; }
+
+unsigned Graph::index(unsigned uid) const {
+  const unsigned* const end(columns.uids + columns.nbNodes);
+  const unsigned* it(std::lower_bound(columns.uids, end, uid));
+  if (it == end || *it != uid) return NO_LINK;
+  return it - columns.uids;
+}
+
+unsigned Graph::uid(unsigned index) const { return columns.uids[index]; }
+NodeType Graph::type(unsigned index) const { return columns.types[index]; }
+const tools::Vec2& Graph::position(unsigned index) const {
+  return columns.positions[index];
+}
+unsigned Graph::capacity(unsigned index) const { return columns.capacities[index]; }
+
+unsigned Graph::edgesBegin(unsigned index) const { return columns.offsets[index]; }
+unsigned Graph::edgesEnd(unsigned index) const { return columns.offsets[index + 1]; }
+unsigned Graph::target(unsigned edge) const { return columns.targets[edge]; }
+double Graph::weight(unsigned edge) const { return columns.weights[edge]; }
+
+const vector<node::Link>& Graph::getLinks() const { return links; }
+const Columns& Graph::getColumns() const { return columns; }
+
+/* == Workspace == */
+
+Workspace::Workspace() : stamp(0) {}
+
+void Workspace::reset(unsigned size) {
+  if (reached.size() < size) {
+    reached.resize(size, 0);
+    settled.resize(size, 0);
+    distances.resize(size);
+    parents.resize(size);
+    priorities.resize(size);
+  }
+
+  heap.clear();
+  if (++stamp == 0) {
+    // The stamp wrapped around, old entries could be mistaken as valid
+    std::fill(reached.begin(), reached.end(), 0);
+    std::fill(settled.begin(), settled.end(), 0);
+    stamp = 1;
+  }
+}
+
+bool Workspace::isReached(unsigned index) const { return reached[index] == stamp; }
+bool Workspace::isSettled(unsigned index) const { return settled[index] == stamp; }
+
+double Workspace::getDistance(unsigned index) const {
+  return isReached(index) ? distances[index] : INFINITE_TIME;
+}
+
+unsigned Workspace::getParent(unsigned index) const {
+  return isReached(index) ? parents[index] : NO_LINK;
+}
+
+bool Workspace::relax(unsigned index, double distance, unsigned parent) {
+  return relax(index, distance, parent, distance);
+}
+
+bool Workspace::relax(unsigned index, double distance, unsigned parent,
+                      double priority) {
+  if (!(distance < getDistance(index))) return false;
+
+  reached[index] = stamp;
+  distances[index] = distance;
+  parents[index] = parent;
+  priorities[index] = priority;
+
+  heap.push_back({priority, index});
+  std::push_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+  return true;
+}
+
+bool Workspace::settleNext(unsigned& index) {
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+    const HeapEntry entry(heap.back());
+    heap.pop_back();
+
+    // Skip entries that were superseded by a shorter distance
+    if (isSettled(entry.second) || entry.first != priorities[entry.second]) continue;
+
+    settled[entry.second] = stamp;
+    index = entry.second;
+    return true;
+  }
+  return false;
+}
+
+/* === FUNCTIONS === */
+
+double accessTime(const NodeType& type0, const NodeType& type1, double distance) {
+  if (type0 == node::TRANSPORT && type1 == node::TRANSPORT)
+    return distance / FAST_SPEED;
+  return distance / DEFAULT_SPEED;
+}
+
+unsigned long long fingerprint(const Graph& graph) {
+  unsigned long long hash(FNV_OFFSET);
+  hashValue(hash, graph.size());
+
+  for (unsigned i(0); i < graph.size(); ++i) {
+    hashValue(hash, graph.uid(i));
+    hashValue(hash, graph.type(i));
+    hashValue(hash, graph.position(i).getX());
+    hashValue(hash, graph.position(i).getY());
+    hashValue(hash, graph.edgesEnd(i) - graph.edgesBegin(i));
+    for (unsigned edge(graph.edgesBegin(i)); edge < graph.edgesEnd(i); ++edge)
+      hashValue(hash, graph.target(edge));
+  }
+  return hash;
+}
+
+Search nearest(const Graph& graph, Workspace& workspace, unsigned origin,
+               const NodeType& type) {
+  workspace.reset(graph.size());
+  workspace.relax(origin, ZERO_TIME, NO_LINK);
+
+  unsigned current;
+  while (workspace.settleNext(current)) {
+    METRICS_COUNT(NODES_SETTLED, 1);
+    const NodeType currentType(graph.type(current));
+    const double currentDistance(workspace.getDistance(current));
+
+    if (currentType == type) return {current, currentDistance};
+    if (currentType == node::PRODUCTION) continue;  // can not be traversed
+
+    for (unsigned edge(graph.edgesBegin(current)); edge < graph.edgesEnd(current);
+         ++edge) {
+      const unsigned neighbour(graph.target(edge));
+      if (workspace.isSettled(neighbour)) continue;
+
+      METRICS_COUNT(EDGES_RELAXED, 1);
+      workspace.relax(neighbour, currentDistance + graph.weight(edge), current);
+    }
+  }
+
+  return {NO_LINK, INFINITE_TIME};
+}
+
+DualSearch nearest(const Graph& graph, Workspace& workspace, unsigned origin,
+                   const NodeType& first, const NodeType& second) {
+  DualSearch result{{NO_LINK, INFINITE_TIME}, {NO_LINK, INFINITE_TIME}};
+  workspace.reset(graph.size());
+  workspace.relax(origin, ZERO_TIME, NO_LINK);
+
+  // The settle order does not depend on the target types, so each target is found
+  // exactly when a single search would have stopped
+  unsigned current;
+  while (workspace.settleNext(current)) {
+    METRICS_COUNT(NODES_SETTLED, 1);
+    const NodeType currentType(graph.type(current));
+    const double currentDistance(workspace.getDistance(current));
+
+    if (currentType == first && result.first.destination == NO_LINK)
+      result.first = {current, currentDistance};
+    if (currentType == second && result.second.destination == NO_LINK)
+      result.second = {current, currentDistance};
+
+    if (result.first.destination != NO_LINK && result.second.destination != NO_LINK)
+      break;
+    if (currentType == node::PRODUCTION) continue;  // can not be traversed
+
+    for (unsigned edge(graph.edgesBegin(current)); edge < graph.edgesEnd(current);
+         ++edge) {
+      const unsigned neighbour(graph.target(edge));
+      if (workspace.isSettled(neighbour)) continue;
+
+      METRICS_COUNT(EDGES_RELAXED, 1);
+      workspace.relax(neighbour, currentDistance + graph.weight(edge), current);
+    }
+  }
+
+  return result;
+}
+
+Search route(const Graph& graph, Workspace& workspace, unsigned origin,
+             unsigned destination) {
+  const tools::Vec2& goal(graph.position(destination));
+  workspace.reset(graph.size());
+  workspace.relax(origin, ZERO_TIME, NO_LINK,
+                  (goal - graph.position(origin)).norm() / FAST_SPEED);
+
+  unsigned current;
+  while (workspace.settleNext(current)) {
+    METRICS_COUNT(NODES_SETTLED, 1);
+    const double currentDistance(workspace.getDistance(current));
+
+    if (current == destination) return {current, currentDistance};
+    if (graph.type(current) == node::PRODUCTION) continue;  // can not be traversed
+
+    for (unsigned edge(graph.edgesBegin(current)); edge < graph.edgesEnd(current);
+         ++edge) {
+      const unsigned neighbour(graph.target(edge));
+      if (workspace.isSettled(neighbour)) continue;
+
+      METRICS_COUNT(EDGES_RELAXED, 1);
+      const double distance(currentDistance + graph.weight(edge));
+      const double remaining((goal - graph.position(neighbour)).norm() / FAST_SPEED);
+      workspace.relax(neighbour, distance, current, distance + remaining);
+    }
+  }
+
+  return {NO_LINK, INFINITE_TIME};
+}
+
+void towards(const Graph& graph, Workspace& workspace, unsigned target,
+             double maxTime) {
+  workspace.reset(graph.size());
+  workspace.relax(target, ZERO_TIME, NO_LINK);
+
+  unsigned current;
+  while (workspace.settleNext(current)) {
+    METRICS_COUNT(NODES_SETTLED, 1);
+    const double currentDistance(workspace.getDistance(current));
+
+    if (currentDistance > maxTime) break;  // truncated search
+    if (current != target && graph.type(current) == node::PRODUCTION) continue;
+
+    for (unsigned edge(graph.edgesBegin(current)); edge < graph.edgesEnd(current);
+         ++edge) {
+      const unsigned neighbour(graph.target(edge));
+      if (workspace.isSettled(neighbour)) continue;
+
+      METRICS_COUNT(EDGES_RELAXED, 1);
+      workspace.relax(neighbour, currentDistance + graph.weight(edge), current);
+    }
+  }
+}
+
+void tracePath(const Graph& graph, const Workspace& workspace, unsigned destination,
+               vector<unsigned>& path) {
+  const size_t start(path.size());
+
+  for (unsigned index(destination); index != NO_LINK;
+       index = workspace.getParent(index)) {
+    path.push_back(graph.uid(index));
+  }
+  std::reverse(path.begin() + start, path.end());
+}
+
+}  // namespace graph
+
+namespace {
+
+/** Feeds the bytes of a value into an FNV-1a hash */
+template <typename T>
+void hashValue(unsigned long long& hash, const T& value) {
+  const unsigned char* bytes(reinterpret_cast<const unsigned char*>(&value));
+  for (size_t i(0); i < sizeof(value); ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+}
+
+}  // namespace
@@ -0,0 +1,212 @@
+// archipelago v3.0.0 - architecture b2
+// graph.hpp - compact town graph and path finding
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_GRAPH_H
+#define MODEL_GRAPH_H
+
+#include <map>
+#include <utility>  // pair
+#include <vector>
+
+#include "node.hpp"
+#include "tools.hpp"
+
+namespace graph {
+
+/* === DEFINITIONS === */
+
+/**
+ * The columns of a graph, indexed by node, and its edges in CSR form. They point
+ * into the graph's own storage, or into memory that outlives the graph such as a
+ * mapped town snapshot (see view::TownView).
+ */
+struct Columns {
+  unsigned nbNodes;
+  const unsigned* uids;
+  const node::NodeType* types;
+  const tools::Vec2* positions;
+  const unsigned* capacities;
+  /** The edges of node i are in the range [offsets[i], offsets[i + 1]) */
+  const unsigned* offsets;
+  const unsigned* targets;
+  const double* weights;
+};
+
+/* === CLASSES === */
+
+/**
+ * An immutable snapshot of a town's nodes and links, stored as contiguous columns
+ * and a compressed adjacency list (CSR). Nodes are addressed by an index that
+ * follows the uid order, edges carry their precomputed access time.
+ *
+ * A graph remembers the town generation it was built from, which allows the town
+ * to cache it until it is modified.
+ */
+class Graph {
+ public:
+  Graph() = delete;
+  Graph(const std::map<unsigned, node::Node>& nodes,
+        const std::vector<node::Link>& links, unsigned long generation);
+  /** A graph over columns owned by the caller, it has no links */
+  Graph(const Columns& columns, unsigned long generation);
+
+  /* The columns may point into the graph itself */
+  Graph(const Graph&) = delete;
+  Graph& operator=(const Graph&) = delete;
+
+  /* Accessors */
+
+  unsigned long getGeneration() const;
+
+  /** Number of nodes in the graph */
+  unsigned size() const;
+
+  /** Returns the index of the node with the given uid, or NO_LINK */
+  unsigned index(unsigned uid) const;
+
+  unsigned uid(unsigned index) const;
+  node::NodeType type(unsigned index) const;
+  const tools::Vec2& position(unsigned index) const;
+  unsigned capacity(unsigned index) const;
+
+  /** The edges of a node are in the range [edgesBegin, edgesEnd) */
+  unsigned edgesBegin(unsigned index) const;
+  unsigned edgesEnd(unsigned index) const;
+
+  /** Index of the node that an edge leads to */
+  unsigned target(unsigned edge) const;
+  /** Access time of an edge */
+  double weight(unsigned edge) const;
+
+  /** The town links, in the order of the town */
+  const std::vector<node::Link>& getLinks() const;
+
+  /** The columns of the graph, for a serialised copy */
+  const Columns& getColumns() const;
+
+ private:
+  unsigned long generation;
+  Columns columns;
+
+  /* The storage of the columns, unless they are owned by the caller */
+
+  std::vector<unsigned> uids;
+  std::vector<node::NodeType> types;
+  std::vector<tools::Vec2> positions;
+  std::vector<unsigned> capacities;
+
+  std::vector<unsigned> offsets;
+  std::vector<unsigned> targets;
+  std::vector<double> weights;
+
+  std::vector<node::Link> links;
+};
+
+/**
+ * Reusable scratch memory of a path search. Resetting the workspace between two
+ * searches is O(1), entries are invalidated by bumping a search stamp instead of
+ * clearing the arrays.
+ */
+class Workspace {
+ public:
+  Workspace();
+
+  /** Prepare the workspace for a new search on a graph of the given size */
+  void reset(unsigned size);
+
+  /** Whether the node has a tentative distance in the current search */
+  bool isReached(unsigned index) const;
+  /** Whether the node's distance is final in the current search */
+  bool isSettled(unsigned index) const;
+
+  double getDistance(unsigned index) const;
+  unsigned getParent(unsigned index) const;
+
+  /** Lower the tentative distance of a node, returns false if it is not lower */
+  bool relax(unsigned index, double distance, unsigned parent);
+  /** Same as above, but the node is settled in the order of the given priority */
+  bool relax(unsigned index, double distance, unsigned parent, double priority);
+
+  /** Pops the closest unsettled node and settles it, returns false if none remain */
+  bool settleNext(unsigned& index);
+
+ private:
+  unsigned stamp;
+  std::vector<unsigned> reached;
+  std::vector<unsigned> settled;
+  std::vector<double> distances;
+  std::vector<unsigned> parents;
+  std::vector<double> priorities;
+
+  /** Min-heap of (priority, index), stale entries are skipped when popped */
+  std::vector<std::pair<double, unsigned>> heap;
+};
+
+/** The outcome of a search, destination is an index or NO_LINK */
+struct Search {
+  unsigned destination;
+  double distance;
+};
+
+/** The outcome of a search for the nearest nodes of two types */
+struct DualSearch {
+  Search first;
+  Search second;
+};
+
+/* === FUNCTIONS === */
+
+/** Computes the access time between two nodes */
+double accessTime(const node::NodeType& type0, const node::NodeType& type1,
+                  double distance);
+
+/**
+ * A hash (FNV-1a) of the nodes, positions and edges of a graph, identifying the
+ * graph content independently of the town generation.
+ */
+unsigned long long fingerprint(const Graph& graph);
+
+/**
+ * Dijkstra search from an origin index to the closest node of a certain type.
+ * Production nodes are not traversed to gain access to other nodes. Equidistant
+ * nodes are settled in index (uid) order.
+ */
+Search nearest(const Graph& graph, Workspace& workspace, unsigned origin,
+               const node::NodeType& type);
+
+/**
+ * Same as above, but the search only stops once the nearest node of each type has
+ * been settled. Both results, and the paths traced from the workspace, are the same
+ * as those of two separate searches.
+ */
+DualSearch nearest(const Graph& graph, Workspace& workspace, unsigned origin,
+                   const node::NodeType& first, const node::NodeType& second);
+
+/**
+ * A* search from an origin index to a destination index, following the same
+ * traversal rules as nearest(). The heuristic is the straight-line distance at the
+ * fastest speed, which never overestimates the remaining access time.
+ */
+Search route(const Graph& graph, Workspace& workspace, unsigned origin,
+             unsigned destination);
+
+/**
+ * Dijkstra search towards a target, settling every node whose access time to the
+ * target is at most maxTime. Edges are symmetric, so the search runs outwards from
+ * the target. Production nodes are only expanded when they are the target, as they
+ * can not be traversed on the way there.
+ */
+void towards(const Graph& graph, Workspace& workspace, unsigned target,
+             double maxTime);
+
+/**
+ * Appends the uids of the path leading to destination, starting with the origin of
+ * the last search of the workspace.
+ */
+void tracePath(const Graph& graph, const Workspace& workspace, unsigned destination,
+               std::vector<unsigned>& path);
+
+}  // namespace graph
+
+#endif
@@ -0,0 +1,451 @@
+// archipelago v3.0.0 - architecture b2
+// hierarchy.cpp - contraction hierarchy for repeated travel time queries
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "hierarchy.hpp"
+
+#include <unistd.h>  // getpid(), unlink()
+
+#include <algorithm>  // reverse()
+#include <atomic>     // temporary file names
+#include <cstdint>    // fixed-width binary format
+#include <cstdio>     // rename()
+#include <fstream>
+#include <functional>  // greater
+#include <iostream>    // cerr
+#include <queue>
+
+#include "constants.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+using std::vector;
+
+namespace {
+
+constexpr double ZERO_TIME(0.);
+
+constexpr char BINARY_MAGIC[]("ARCHCH01");
+constexpr unsigned MAGIC_LENGTH(8);
+constexpr char TEMPORARY_EXTENSION[](".tmp");  // a sidecar being saved
+/** The bytes of an edge in a sidecar: its target, weight and middle node */
+constexpr unsigned EDGE_BYTES(sizeof(uint32_t) + sizeof(double) + sizeof(uint32_t));
+
+/** Settled nodes after which a witness search gives up and keeps the shortcut */
+constexpr unsigned WITNESS_LIMIT(64);
+
+/** An edge of the graph that remains to be contracted */
+struct Arc {
+  unsigned target;
+  double weight;
+  unsigned middle;
+};
+
+typedef vector<vector<Arc>> Adjacency;
+typedef std::pair<int, unsigned> Candidate;  // (priority, index)
+
+/** Distinguishes the temporary files of concurrent saves of a sidecar */
+std::atomic<unsigned> temporaryCounter(0);
+
+int contract(Adjacency& adjacency, graph::Workspace& workspace, unsigned node,
+             bool simulate);
+void addArc(vector<Arc>& arcs, unsigned target, double weight, unsigned middle);
+void removeArc(vector<Arc>& arcs, unsigned target);
+
+void writeUnsigned(std::ostream& stream, uint32_t value);
+template <typename T>
+void writeVector(std::ostream& stream, const vector<T>& values);
+bool readUnsigned(std::istream& stream, uint32_t& value);
+template <typename T>
+bool readVector(std::istream& stream, vector<T>& values, size_t size);
+
+}  // namespace
+
+namespace hierarchy {
+
+/* === CLASSES === */
+
+Hierarchy::Hierarchy(unsigned long generation)
+    : generation(generation), fingerprint(0) {}
+
+Hierarchy::Hierarchy(const graph::Graph& graph)
+    : generation(graph.getGeneration()),
+      fingerprint(graph::fingerprint(graph)),
+      production(graph.size()),
+      ranks(graph.size(), 0) {
+  TRACE_SCOPE("hierarchy::Hierarchy");
+  const unsigned size(graph.size());
+  Adjacency adjacency(size);
+  uids.reserve(size);
+
+  for (unsigned i(0); i < size; ++i) {
+    uids.push_back(graph.uid(i));
+    production[i] = graph.type(i) == node::PRODUCTION;
+  }
+
+  // A link between two production nodes can never be part of a path
+  for (unsigned i(0); i < size; ++i) {
+    for (unsigned edge(graph.edgesBegin(i)); edge < graph.edgesEnd(i); ++edge) {
+      const unsigned target(graph.target(edge));
+      if (!(production[i] && production[target]))
+        addArc(adjacency[i], target, graph.weight(edge), NO_LINK);
+    }
+  }
+
+  vector<vector<Arc>> upward(size);
+  vector<int> contractedNeighbours(size, 0);
+  graph::Workspace workspace;
+  unsigned rank(0);
+
+  auto finish = [&](unsigned node) {
+    ranks[node] = rank++;
+    for (const auto& arc : adjacency[node]) {
+      removeArc(adjacency[arc.target], node);
+      ++contractedNeighbours[arc.target];
+    }
+    upward[node].swap(adjacency[node]);
+  };
+
+  // Production nodes are never traversed, so they need no shortcuts
+  for (unsigned i(0); i < size; ++i) {
+    if (production[i]) finish(i);
+  }
+
+  // The remaining nodes are contracted by increasing edge difference, priorities
+  // are updated lazily when a node reaches the top of the queue
+  std::priority_queue<Candidate, vector<Candidate>, std::greater<Candidate>> queue;
+  for (unsigned i(0); i < size; ++i) {
+    if (!production[i])
+      queue.push(
+          {contract(adjacency, workspace, i, true) + contractedNeighbours[i], i});
+  }
+
+  while (!queue.empty()) {
+    const unsigned node(queue.top().second);
+    queue.pop();
+
+    const int priority(contract(adjacency, workspace, node, true) +
+                       contractedNeighbours[node]);
+    if (!queue.empty() && priority > queue.top().first) {
+      queue.push({priority, node});
+      continue;
+    }
+
+    contract(adjacency, workspace, node, false);
+    finish(node);
+  }
+
+  // Flatten the upward edges into CSR form
+  offsets.assign(size + 1, 0);
+  for (unsigned i(0); i < size; ++i) offsets[i + 1] = offsets[i] + upward[i].size();
+
+  targets.reserve(offsets.back());
+  weights.reserve(offsets.back());
+  middles.reserve(offsets.back());
+  for (const auto& arcs : upward) {
+    for (const auto& arc : arcs) {
+      targets.push_back(arc.target);
+      weights.push_back(arc.weight);
+      middles.push_back(arc.middle);
+    }
+  }
+}
+
+unsigned long Hierarchy::getGeneration() const { return generation; }
+unsigned long long Hierarchy::getFingerprint() const { return fingerprint; }
+
+double Hierarchy::query(unsigned originUid, unsigned destinationUid, Scratch& scratch,
+                        vector<unsigned>* path) const {
+  const unsigned origin(index(originUid)), destination(index(destinationUid));
+  if (origin == NO_LINK || destination == NO_LINK)
+    throw std::string("Node does not exist");
+
+  if (path != nullptr) path->clear();
+  if (origin == destination) {
+    if (path != nullptr) path->push_back(originUid);
+    return ZERO_TIME;
+  }
+  if (production[origin]) return INFINITE_TIME;  // can not be left
+
+  // The forward search is exhaustive, upward search spaces are small. The backward
+  // search stops as soon as it can no longer improve on the best meeting node.
+  double best(INFINITE_TIME);
+  unsigned meeting(NO_LINK);
+  search(scratch.forward, origin, nullptr, best, meeting);
+  search(scratch.backward, destination, &scratch.forward, best, meeting);
+
+  if (meeting == NO_LINK) return INFINITE_TIME;
+
+  if (path != nullptr) {
+    vector<unsigned> chain;
+    for (unsigned i(meeting); i != NO_LINK; i = scratch.forward.getParent(i))
+      chain.push_back(i);
+    std::reverse(chain.begin(), chain.end());
+    for (unsigned i(scratch.backward.getParent(meeting)); i != NO_LINK;
+         i = scratch.backward.getParent(i))
+      chain.push_back(i);
+
+    path->push_back(uids[chain.front()]);
+    for (size_t i(1); i < chain.size(); ++i) unpack(chain[i - 1], chain[i], *path);
+  }
+
+  return best;
+}
+
+unsigned Hierarchy::index(unsigned uid) const {
+  auto it(std::lower_bound(uids.begin(), uids.end(), uid));
+  if (it == uids.end() || *it != uid) return NO_LINK;
+  return it - uids.begin();
+}
+
+/**
+ * Dijkstra search following upward edges only. When given the workspace of the
+ * opposite search, every settled node is a candidate meeting node.
+ */
+void Hierarchy::search(graph::Workspace& workspace, unsigned origin,
+                       const graph::Workspace* other, double& best,
+                       unsigned& meeting) const {
+  workspace.reset(uids.size());
+  workspace.relax(origin, ZERO_TIME, NO_LINK);
+
+  unsigned current;
+  while (workspace.settleNext(current)) {
+    METRICS_COUNT(NODES_SETTLED, 1);
+    const double currentDistance(workspace.getDistance(current));
+    if (other != nullptr && currentDistance >= best) break;
+
+    if (other != nullptr && other->isSettled(current)) {
+      const double total(other->getDistance(current) + currentDistance);
+      if (total < best) {
+        best = total;
+        meeting = current;
+      }
+    }
+
+    for (unsigned edge(offsets[current]); edge < offsets[current + 1]; ++edge) {
+      METRICS_COUNT(EDGES_RELAXED, 1);
+      workspace.relax(targets[edge], currentDistance + weights[edge], current);
+    }
+  }
+}
+
+/**
+ * Checks the invariants that queries rely on, for a hierarchy read from a file: uids
+ * are sorted, edges point to higher ranked nodes and a shortcut bypasses a node
+ * ranked below both of its ends, so that unpacking a path terminates.
+ */
+bool Hierarchy::isValid() const {
+  const unsigned size(uids.size());
+  if (offsets.front() != 0 || offsets.back() != targets.size()) return false;
+
+  for (unsigned i(0); i < size; ++i) {
+    if ((i > 0 && uids[i - 1] >= uids[i]) || ranks[i] >= size ||
+        offsets[i] > offsets[i + 1])
+      return false;
+
+    for (unsigned edge(offsets[i]); edge < offsets[i + 1]; ++edge) {
+      const unsigned target(targets[edge]), middle(middles[edge]);
+      if (target >= size || ranks[target] <= ranks[i]) return false;
+      if (middle != NO_LINK && (middle >= size || ranks[middle] >= ranks[i]))
+        return false;
+    }
+  }
+  return true;
+}
+
+/** Appends the original path behind an edge, excluding its first node */
+void Hierarchy::unpack(unsigned from, unsigned to, vector<unsigned>& path) const {
+  // Edges are stored on their lower ranked end
+  const unsigned low(ranks[from] < ranks[to] ? from : to);
+  const unsigned high(low == from ? to : from);
+
+  unsigned middle(NO_LINK);
+  for (unsigned edge(offsets[low]); edge < offsets[low + 1]; ++edge) {
+    if (targets[edge] == high) {
+      middle = middles[edge];
+      break;
+    }
+  }
+
+  if (middle == NO_LINK) {
+    path.push_back(uids[to]);
+  } else {
+    unpack(from, middle, path);
+    unpack(middle, to, path);
+  }
+}
+
+/* === FUNCTIONS === */
+
+bool saveToFile(const std::string& path, const Hierarchy& hierarchy) {
+  const std::string temporary(path + "." + std::to_string(getpid()) + "." +
+                              std::to_string(temporaryCounter++) +
+                              TEMPORARY_EXTENSION);
+  std::ofstream file(temporary, std::ios::out | std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Error: Could not open file" << std::endl;
+    return false;
+  }
+
+  vector<unsigned char> production(hierarchy.production.begin(),
+                                   hierarchy.production.end());
+
+  file.write(BINARY_MAGIC, MAGIC_LENGTH);
+  file.write(reinterpret_cast<const char*>(&hierarchy.fingerprint),
+             sizeof(hierarchy.fingerprint));
+  writeUnsigned(file, hierarchy.uids.size());
+  writeUnsigned(file, hierarchy.targets.size());
+  writeVector(file, hierarchy.uids);
+  writeVector(file, production);
+  writeVector(file, hierarchy.ranks);
+  writeVector(file, hierarchy.offsets);
+  writeVector(file, hierarchy.targets);
+  writeVector(file, hierarchy.weights);
+  writeVector(file, hierarchy.middles);
+  file.close();
+
+  // Readers, or a concurrent writer, see either the previous sidecar or a whole one
+  if (file.fail() || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    std::cerr << "Error: Could not write file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const Hierarchy> loadFromFile(const std::string& path,
+                                              const graph::Graph& graph) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  if (!file.is_open()) return nullptr;
+
+  // The edge count is bounded by the file size before anything is allocated
+  file.seekg(0, std::ios::end);
+  const std::streamoff fileSize(file.tellg());
+  file.seekg(0, std::ios::beg);
+
+  char magic[MAGIC_LENGTH];
+  std::shared_ptr<Hierarchy> hierarchy(new Hierarchy(graph.getGeneration()));
+  uint32_t nbNodes, nbEdges;
+  vector<unsigned char> production;
+
+  if (!file.read(magic, MAGIC_LENGTH) ||
+      !std::equal(magic, magic + MAGIC_LENGTH, BINARY_MAGIC) ||
+      !file.read(reinterpret_cast<char*>(&hierarchy->fingerprint),
+                 sizeof(hierarchy->fingerprint)) ||
+      hierarchy->fingerprint != graph::fingerprint(graph) ||
+      !readUnsigned(file, nbNodes) || nbNodes != graph.size() ||
+      !readUnsigned(file, nbEdges) ||
+      static_cast<unsigned long long>(nbEdges) * EDGE_BYTES >
+          static_cast<unsigned long long>(fileSize) ||
+      !readVector(file, hierarchy->uids, nbNodes) ||
+      !readVector(file, production, nbNodes) ||
+      !readVector(file, hierarchy->ranks, nbNodes) ||
+      !readVector(file, hierarchy->offsets, nbNodes + 1) ||
+      !readVector(file, hierarchy->targets, nbEdges) ||
+      !readVector(file, hierarchy->weights, nbEdges) ||
+      !readVector(file, hierarchy->middles, nbEdges) ||
+      !hierarchy->isValid()) {
+    return nullptr;
+  }
+
+  hierarchy->production.assign(production.begin(), production.end());
+  return hierarchy;
+}
+
+}  // namespace hierarchy
+
+namespace {
+
+/**
+ * Contracts a node, connecting each pair of its remaining neighbours with a
+ * shortcut unless a witness path of at most the same access time avoids the node.
+ * Returns the edge difference, the number of shortcuts minus the removed edges.
+ * When simulating, the graph is left untouched.
+ */
+int contract(Adjacency& adjacency, graph::Workspace& workspace, unsigned node,
+             bool simulate) {
+  const vector<Arc> arcs(adjacency[node]);
+  int shortcuts(0);
+
+  for (size_t i(0); i < arcs.size(); ++i) {
+    const Arc& in(arcs[i]);
+    double maxTime(ZERO_TIME);
+    for (size_t j(i + 1); j < arcs.size(); ++j)
+      maxTime = std::max(maxTime, in.weight + arcs[j].weight);
+
+    // Local search that avoids the contracted node, edges are symmetric
+    workspace.reset(adjacency.size());
+    workspace.relax(in.target, ZERO_TIME, NO_LINK);
+    unsigned current, settledCount(0);
+    while (settledCount++ < WITNESS_LIMIT && workspace.settleNext(current)) {
+      const double currentDistance(workspace.getDistance(current));
+      if (currentDistance > maxTime) break;
+
+      for (const auto& arc : adjacency[current]) {
+        if (arc.target != node)
+          workspace.relax(arc.target, currentDistance + arc.weight, current);
+      }
+    }
+
+    for (size_t j(i + 1); j < arcs.size(); ++j) {
+      const Arc& out(arcs[j]);
+      const double time(in.weight + out.weight);
+      if (workspace.getDistance(out.target) <= time) continue;  // witness found
+
+      ++shortcuts;
+      if (!simulate) {
+        addArc(adjacency[in.target], out.target, time, node);
+        addArc(adjacency[out.target], in.target, time, node);
+      }
+    }
+  }
+
+  return shortcuts - static_cast<int>(arcs.size());
+}
+
+/** Adds an arc, or lowers the weight of an existing arc to the same target */
+void addArc(vector<Arc>& arcs, unsigned target, double weight, unsigned middle) {
+  for (auto& arc : arcs) {
+    if (arc.target == target) {
+      if (weight < arc.weight) arc = {target, weight, middle};
+      return;
+    }
+  }
+  arcs.push_back({target, weight, middle});
+}
+
+void removeArc(vector<Arc>& arcs, unsigned target) {
+  for (size_t i(0); i < arcs.size(); ++i) {
+    if (arcs[i].target == target) {
+      arcs[i] = arcs.back();
+      arcs.pop_back();
+      return;
+    }
+  }
+}
+
+void writeUnsigned(std::ostream& stream, uint32_t value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+void writeVector(std::ostream& stream, const vector<T>& values) {
+  if (!values.empty())
+    stream.write(reinterpret_cast<const char*>(values.data()),
+                 sizeof(T) * values.size());
+}
+
+bool readUnsigned(std::istream& stream, uint32_t& value) {
+  return static_cast<bool>(
+      stream.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+template <typename T>
+bool readVector(std::istream& stream, vector<T>& values, size_t size) {
+  values.resize(size);
+  if (size == 0) return true;
+  return static_cast<bool>(
+      stream.read(reinterpret_cast<char*>(values.data()), sizeof(T) * size));
+}
+
+}  // namespace
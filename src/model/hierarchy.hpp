@@ -0,0 +1,98 @@
+// archipelago v3.0.0 - architecture b2
+// hierarchy.hpp - contraction hierarchy for repeated travel time queries
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_HIERARCHY_H
+#define MODEL_HIERARCHY_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "graph.hpp"
+
+namespace hierarchy {
+
+/* === CLASSES === */
+
+/** Reusable scratch memory of a hierarchy query, one per querying thread */
+struct Scratch {
+  graph::Workspace forward;
+  graph::Workspace backward;
+};
+
+/**
+ * A contraction hierarchy built from a town graph, answering point-to-point travel
+ * time queries by searching only "upwards" in a node ranking from both ends.
+ *
+ * Production nodes can not be traversed, so they are contracted first without any
+ * shortcut and the links between two production nodes are dropped. A production
+ * node can then only appear at the end of a path, like in Town::pathFind().
+ */
+class Hierarchy {
+ public:
+  Hierarchy() = delete;
+  /** Preprocess the graph, this is a lot more expensive than a single query */
+  Hierarchy(const graph::Graph& graph);
+
+  /** The generation of the town graph that the hierarchy was built from */
+  unsigned long getGeneration() const;
+  /** A hash of the graph content, used to validate a serialised hierarchy */
+  unsigned long long getFingerprint() const;
+
+  /**
+   * Returns the access time between two nodes, or INFINITE_TIME if there is no
+   * path. If a path vector is given, the path's uids are written into it.
+   * @throws If either node is not a part of the hierarchy
+   */
+  double query(unsigned originUid, unsigned destinationUid, Scratch& scratch,
+               std::vector<unsigned>* path = nullptr) const;
+
+  friend bool saveToFile(const std::string& path, const Hierarchy& hierarchy);
+  friend std::shared_ptr<const Hierarchy> loadFromFile(const std::string& path,
+                                                       const graph::Graph& graph);
+
+ private:
+  explicit Hierarchy(unsigned long generation);
+
+  unsigned long generation;
+  unsigned long long fingerprint;
+
+  std::vector<unsigned> uids;
+  std::vector<bool> production;
+  std::vector<unsigned> ranks;
+
+  /** Edges towards higher ranked nodes, in CSR form */
+  std::vector<unsigned> offsets;
+  std::vector<unsigned> targets;
+  std::vector<double> weights;
+  /** The contracted node that a shortcut bypasses, or NO_LINK for a town link */
+  std::vector<unsigned> middles;
+
+  unsigned index(unsigned uid) const;
+  bool isValid() const;
+  void search(graph::Workspace& workspace, unsigned origin,
+              const graph::Workspace* other, double& best, unsigned& meeting) const;
+  void unpack(unsigned from, unsigned to, std::vector<unsigned>& path) const;
+};
+
+/* === FUNCTIONS === */
+
+/**
+ * Write a hierarchy to a binary file, next to its town file. The file is written
+ * under a temporary name then renamed, it is replaced whole or not at all.
+ * Returns false if it could not be written.
+ */
+bool saveToFile(const std::string& path, const Hierarchy& hierarchy);
+
+/**
+ * Read a hierarchy from a binary file. Returns a null pointer if the file can not be
+ * read, if it was built from a graph with a different fingerprint or if it is not
+ * a valid hierarchy.
+ */
+std::shared_ptr<const Hierarchy> loadFromFile(const std::string& path,
+                                              const graph::Graph& graph);
+
+}  // namespace hierarchy
+
+#endif
@@ -0,0 +1,547 @@
+// archipelago v3.0.0 - architecture b2
+// journal.cpp - append-only log of the edits of a town file
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "journal.hpp"
+
+#include <fcntl.h>     // open()
+#include <sys/stat.h>  // stat()
+#include <unistd.h>    // write(), fsync(), ftruncate(), unlink()
+
+#include <algorithm>  // max()
+#include <cerrno>     // errno
+#include <chrono>
+#include <cstdio>  // rename()
+#include <fstream>
+#include <iostream>  // cerr
+#include <string>
+#include <vector>
+
+#include "cache.hpp"
+#include "trace.hpp"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+/* === CONSTANTS, DECLARATIONS & PROTOTYPES === */
+
+constexpr char JOURNAL_MAGIC[]("ARCHJL01");
+constexpr size_t MAGIC_LENGTH(sizeof(JOURNAL_MAGIC) - 1);
+constexpr char JOURNAL_EXTENSION[](".journal");    // appended to the town file name
+constexpr char AUTOSAVE_EXTENSION[](".autosave");  // a town file, see compact()
+constexpr char TEMPORARY_EXTENSION[](".tmp");
+constexpr mode_t FILE_MODE(0666);  // restricted by the umask
+
+/** Edits arriving within this delay of a sync are synced together */
+constexpr std::chrono::milliseconds SYNC_INTERVAL(100);
+/** The records are compacted once they outgrow both this and their base, in bytes */
+constexpr unsigned long long MIN_COMPACTION(1ULL << 20);
+
+constexpr unsigned long long FNV_OFFSET(14695981039346656037ULL);
+constexpr unsigned long long FNV_PRIME(1099511628211ULL);
+
+/** The edit of a record, written as a single byte */
+enum Kind : unsigned char {
+  ADD_NODE = 1,
+  REMOVE_NODES,
+  SET_NODES,
+  ADD_LINK,
+  REMOVE_LINK
+};
+
+bool readFile(const string& path, string& contents);
+string baseKey(const string& contents);
+bool isNewer(const string& path, const string& otherPath);
+
+string encodeHeader(const string& key);
+bool readHeader(const string& data, size_t& position, string& key);
+string encodeRecord(const string& body);
+size_t replay(const string& data, size_t position, town::Town& town);
+void applyRecord(const string& body, town::Town& town);
+
+int createJournal(const string& townPath, const string& key);
+bool writeAll(int file, const char* data, size_t length);
+void syncDirectory(const string& path);
+void discard(const string& townPath);
+
+template <typename T>
+void append(string& data, const T& value);
+template <typename T>
+bool take(const string& data, size_t& position, T& value);
+unsigned long long checksum(const string& data, size_t begin, size_t end);
+
+}  // namespace
+
+namespace journal {
+
+/* === CLASSES === */
+
+Journal::Journal() : Journal("", -1, 0, 0) {}
+
+Journal::Journal(const string& townPath, int file, unsigned long long size,
+                 unsigned long long baseSize)
+    : hasFile(!townPath.empty()),
+      size(size),
+      townPath(townPath),
+      file(file),
+      baseSize(baseSize),
+      stopping(false),
+      writer(&Journal::write, this) {}
+
+Journal::~Journal() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    ready.notify_one();
+  }
+  writer.join();
+  if (file >= 0) close(file);
+}
+
+void Journal::addNode(const node::Node& node) {
+  string body;
+  append(body, ADD_NODE);
+  append(body, node.getUid());
+  append(body, static_cast<unsigned>(node.getType()));
+  append(body, node.getPosition().getX());
+  append(body, node.getPosition().getY());
+  append(body, node.getCapacity());
+  appendRecord(encodeRecord(body));
+}
+
+void Journal::removeNodes(const vector<unsigned>& uids) {
+  string body;
+  append(body, REMOVE_NODES);
+  append(body, static_cast<unsigned>(uids.size()));
+  for (const auto& uid : uids) append(body, uid);
+  appendRecord(encodeRecord(body));
+}
+
+void Journal::setNodes(const town::Town& town, const vector<unsigned>& uids) {
+  string body;
+  append(body, SET_NODES);
+  append(body, static_cast<unsigned>(uids.size()));
+  for (const auto& uid : uids) {
+    const node::Node* node(town.getNode(uid));
+    if (node == nullptr) throw string("Node does not exist");
+    append(body, uid);
+    append(body, node->getPosition().getX());
+    append(body, node->getPosition().getY());
+    append(body, node->getCapacity());
+  }
+  appendRecord(encodeRecord(body));
+}
+
+void Journal::addLink(const node::Link& link) {
+  string body;
+  append(body, ADD_LINK);
+  append(body, link.getUid0());
+  append(body, link.getUid1());
+  appendRecord(encodeRecord(body));
+}
+
+void Journal::removeLink(const node::Link& link) {
+  string body;
+  append(body, REMOVE_LINK);
+  append(body, link.getUid0());
+  append(body, link.getUid1());
+  appendRecord(encodeRecord(body));
+}
+
+/** Amortised over the records, compacting costs a constant per recorded byte */
+void Journal::compact(const town::Town& town) {
+  if (!hasFile || size <= std::max(MIN_COMPACTION, baseSize.load())) return;
+  {
+    // A pending save or compaction already starts the journal over
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!checkpoints.empty()) return;
+  }
+
+  TRACE_SCOPE("journal::compact");
+  const auto records(town::copyRecords(town));
+  std::lock_guard<std::mutex> lock(mutex);
+  checkpoints.push_back({records, "", pending.size(), nullptr});
+  size = 0;
+  ready.notify_one();
+}
+
+void Journal::save(const town::Town& town, const string& path,
+                   std::function<void(bool)> done) {
+  TRACE_SCOPE("journal::save");
+  const auto records(town::copyRecords(town));
+  std::lock_guard<std::mutex> lock(mutex);
+  checkpoints.push_back({records, path, pending.size(), done});
+  hasFile = true;
+  size = 0;
+  ready.notify_one();
+}
+
+void Journal::appendRecord(const string& record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  pending += record;
+  size += record.size();
+  ready.notify_one();
+}
+
+/** The background thread, writes and syncs the pending records in batches */
+void Journal::write() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    ready.wait(lock, [this] {
+      return stopping || !pending.empty() || !checkpoints.empty();
+    });
+    if (pending.empty() && checkpoints.empty()) return;
+
+    string batch;
+    batch.swap(pending);
+    std::deque<Checkpoint> batchCheckpoints;
+    batchCheckpoints.swap(checkpoints);
+    lock.unlock();
+
+    // The records before a checkpoint stay in the old journal if it fails
+    size_t written(0);
+    for (const auto& checkpoint : batchCheckpoints) {
+      writeRecords(batch.data() + written, checkpoint.offset - written);
+      written = checkpoint.offset;
+      const bool saved(writeCheckpoint(checkpoint));
+      if (checkpoint.done) checkpoint.done(saved);
+    }
+    writeRecords(batch.data() + written, batch.size() - written);
+    if (file >= 0 && fdatasync(file) != 0)
+      std::cerr << "Error: Could not sync the journal" << std::endl;
+
+    lock.lock();
+    ready.wait_for(lock, SYNC_INTERVAL, [this] { return stopping; });
+  }
+}
+
+void Journal::writeRecords(const char* data, size_t length) {
+  if (file >= 0 && length > 0 && !writeAll(file, data, length))
+    std::cerr << "Error: Could not write the journal" << std::endl;
+}
+
+/**
+ * Writes the copy of the town to the autosave or to the saved file, then replaces
+ * the journal with one based on it. Each file is renamed into place once synced,
+ * a crash leaves either journal intact. Returns whether the town was written.
+ */
+bool Journal::writeCheckpoint(const Checkpoint& checkpoint) {
+  TRACE_SCOPE("journal::writeCheckpoint");
+  const bool autosave(checkpoint.path.empty());
+  if (autosave && townPath.empty()) return false;
+
+  const string base(autosave ? autosavePath(townPath) : checkpoint.path);
+  string contents;
+  if (!town::saveToFile(base, *checkpoint.records) || !readFile(base, contents)) {
+    if (autosave) std::cerr << "Error: Could not compact the journal" << std::endl;
+    return false;
+  }
+  syncDirectory(base);
+
+  const string savedPath(autosave ? townPath : checkpoint.path);
+  const int next(createJournal(savedPath, baseKey(contents)));
+  if (next < 0) {
+    std::cerr << "Error: Could not create the journal" << std::endl;
+    if (autosave) return false;  // the previous journal still applies
+  }
+  if (file >= 0) close(file);
+  file = next;
+  baseSize = contents.size();
+
+  // The previous sidecars are outdated by the saved file
+  if (!autosave) {
+    if (!townPath.empty() && townPath != savedPath) discard(townPath);
+    unlink(autosavePath(savedPath).c_str());
+    townPath = savedPath;
+  }
+  return true;
+}
+
+/* === FUNCTIONS === */
+
+unique_ptr<Journal> recover(const string& townPath, town::Town& town) {
+  TRACE_SCOPE("journal::recover");
+  string contents, data, key;
+  size_t position(0), end(0);
+  const bool readable(readFile(townPath, contents));
+  if (readFile(journalPath(townPath), data) && readHeader(data, position, key)) {
+    // The edits apply to the file, or to the autosave unless the file was saved since
+    string base(townPath), autosave;
+    if (!readable || key != baseKey(contents)) {
+      base = autosavePath(townPath);
+      if (!isNewer(base, townPath) || !readFile(base, autosave) ||
+          key != baseKey(autosave))
+        base.clear();
+    }
+
+    if (!base.empty()) {
+      town = town::parseCached(base == townPath ? contents : autosave);
+      end = replay(data, position, town);
+      if (end == 0) {
+        std::cerr << "Error: Could not replay the journal" << std::endl;
+      } else if (base != townPath) {
+        contents.swap(autosave);  // the size of the base
+      }
+    }
+  }
+
+  int file(-1);
+  if (end > 0) {
+    // A record that was cut short by a crash is overwritten by the next one
+    file = open(journalPath(townPath).c_str(), O_WRONLY);
+    if (file >= 0 && (ftruncate(file, end) != 0 || lseek(file, 0, SEEK_END) < 0)) {
+      close(file);
+      file = -1;
+    }
+  } else {
+    // Without edits to replay, the journal starts over from the file
+    town = readable ? town::parseCached(contents) : town::loadCached(townPath);
+    if (readable) file = createJournal(townPath, baseKey(contents));
+  }
+  if (file < 0 && readable)
+    std::cerr << "Error: Could not open the journal" << std::endl;
+
+  return unique_ptr<Journal>(new Journal(readable ? townPath : "", file,
+                                         end > 0 ? end - position : 0,
+                                         contents.size()));
+}
+
+string journalPath(const string& townPath) { return townPath + JOURNAL_EXTENSION; }
+string autosavePath(const string& townPath) { return townPath + AUTOSAVE_EXTENSION; }
+
+}  // namespace journal
+
+/* === INTERNAL FUNCTIONS === */
+
+namespace {
+
+/* == Files == */
+
+/** Reads a whole file at once, returns false if it could not be opened */
+bool readFile(const string& path, string& contents) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  if (!file.is_open()) return false;
+
+  file.seekg(0, std::ios::end);
+  const std::streamoff size(file.tellg());
+  file.seekg(0, std::ios::beg);
+  contents.clear();
+  if (size > 0) {
+    contents.resize(size);
+    file.read(&contents[0], size);
+    contents.resize(file.gcount());
+  }
+  return true;
+}
+
+/** Identifies the content of the base of a journal */
+string baseKey(const string& contents) { return cache::key(contents, JOURNAL_MAGIC); }
+
+/** Whether the first file was modified after the second, or the second is missing */
+bool isNewer(const string& path, const string& otherPath) {
+  struct stat status, otherStatus;
+  if (stat(path.c_str(), &status) != 0) return false;
+  if (stat(otherPath.c_str(), &otherStatus) != 0) return true;
+  return status.st_mtim.tv_sec != otherStatus.st_mtim.tv_sec
+             ? status.st_mtim.tv_sec > otherStatus.st_mtim.tv_sec
+             : status.st_mtim.tv_nsec > otherStatus.st_mtim.tv_nsec;
+}
+
+/** Writes a journal with only its header, then renames it into place */
+int createJournal(const string& townPath, const string& key) {
+  const string path(journal::journalPath(townPath));
+  const string temporary(path + TEMPORARY_EXTENSION);
+  const string header(encodeHeader(key));
+
+  const int file(open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, FILE_MODE));
+  if (file < 0) return -1;
+  if (!writeAll(file, header.data(), header.size()) || fsync(file) != 0 ||
+      std::rename(temporary.c_str(), path.c_str()) != 0) {
+    close(file);
+    unlink(temporary.c_str());
+    return -1;
+  }
+  syncDirectory(path);
+  return file;
+}
+
+bool writeAll(int file, const char* data, size_t length) {
+  while (length > 0) {
+    const ssize_t written(::write(file, data, length));
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+/** Makes a rename within the directory of the path durable */
+void syncDirectory(const string& path) {
+  const size_t separator(path.rfind('/'));
+  const string directory(separator == string::npos ? "." : path.substr(0, separator));
+  const int file(open((directory.empty() ? "/" : directory).c_str(), O_RDONLY));
+  if (file < 0) return;
+  fsync(file);
+  close(file);
+}
+
+/** Removes the journal and the autosave of a town file */
+void discard(const string& townPath) {
+  unlink(journal::journalPath(townPath).c_str());
+  unlink(journal::autosavePath(townPath).c_str());
+}
+
+/* == Records == */
+
+/** The magic, the key of the base and a checksum of both */
+string encodeHeader(const string& key) {
+  string data(JOURNAL_MAGIC, MAGIC_LENGTH);
+  append(data, static_cast<unsigned>(key.size()));
+  data += key;
+  append(data, checksum(data, 0, data.size()));
+  return data;
+}
+
+bool readHeader(const string& data, size_t& position, string& key) {
+  unsigned keyLength(0);
+  unsigned long long sum(0);
+  position = MAGIC_LENGTH;
+  if (data.compare(0, MAGIC_LENGTH, JOURNAL_MAGIC) != 0 ||
+      !take(data, position, keyLength) || data.size() - position < keyLength)
+    return false;
+
+  key = data.substr(position, keyLength);
+  position += keyLength;
+  const size_t end(position);
+  return take(data, position, sum) && sum == checksum(data, 0, end);
+}
+
+/** The length of the body, the body and its checksum */
+string encodeRecord(const string& body) {
+  string record;
+  append(record, static_cast<unsigned>(body.size()));
+  record += body;
+  append(record, checksum(body, 0, body.size()));
+  return record;
+}
+
+/**
+ * Applies the records after the header at once, up to the first incomplete or
+ * damaged one. Returns the end of the last applied record, 0 if the edits failed.
+ */
+size_t replay(const string& data, size_t position, town::Town& town) {
+  TRACE_SCOPE("journal::replay");
+  town.beginBatch();
+  try {
+    for (;;) {
+      size_t next(position);
+      unsigned length(0);
+      unsigned long long sum(0);
+      if (!take(data, next, length) || data.size() - next < length) break;
+      size_t end(next + length);
+      if (!take(data, end, sum) || sum != checksum(data, next, next + length)) break;
+
+      applyRecord(data.substr(next, length), town);
+      position = end;
+    }
+  } catch (string& err) {
+    town.rollback();
+    return 0;
+  }
+
+  try {
+    town.commit();
+  } catch (string& err) {
+    return 0;
+  }
+  return position;
+}
+
+/** @throws If the record is malformed or the edit fails */
+void applyRecord(const string& body, town::Town& town) {
+  size_t position(0);
+  Kind kind;
+  unsigned uid(0), uid1(0), type(0), capacity(0), count(0);
+  double x(0.), y(0.);
+  if (!take(body, position, kind)) throw string("Empty record");
+
+  switch (kind) {
+    case ADD_NODE:
+      if (!take(body, position, uid) || !take(body, position, type) ||
+          !take(body, position, x) || !take(body, position, y) ||
+          !take(body, position, capacity) || type > node::PRODUCTION)
+        throw string("Malformed record");
+      town.addNode(node::Node(static_cast<node::NodeType>(type), uid,
+                              tools::Vec2(x, y), capacity));
+      break;
+
+    case REMOVE_NODES: {
+      if (!take(body, position, count)) throw string("Malformed record");
+      vector<unsigned> uids(count);
+      for (auto& removed : uids)
+        if (!take(body, position, removed)) throw string("Malformed record");
+      town.removeNodes(uids);
+      break;
+    }
+
+    case SET_NODES:
+      if (!take(body, position, count)) throw string("Malformed record");
+      for (unsigned i(0); i < count; ++i) {
+        if (!take(body, position, uid) || !take(body, position, x) ||
+            !take(body, position, y) || !take(body, position, capacity))
+          throw string("Malformed record");
+        node::Node* node(town.getModifiableNode(uid));
+        if (node == nullptr) throw string("Node does not exist");
+        node->setPosition(tools::Vec2(x, y));
+        node->setCapacity(capacity);
+        town.nodeChanged(uid);
+      }
+      break;
+
+    case ADD_LINK:
+    case REMOVE_LINK:
+      if (!take(body, position, uid) || !take(body, position, uid1))
+        throw string("Malformed record");
+      if (kind == ADD_LINK) {
+        town.addLink(node::Link(uid, uid1));
+      } else {
+        town.removeLink(node::Link(uid, uid1));
+      }
+      break;
+
+    default:
+      throw string("Unknown record");
+  }
+  if (position != body.size()) throw string("Malformed record");
+}
+
+template <typename T>
+void append(string& data, const T& value) {
+  data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool take(const string& data, size_t& position, T& value) {
+  if (data.size() - position < sizeof(value)) return false;
+  data.copy(reinterpret_cast<char*>(&value), sizeof(value), position);
+  position += sizeof(value);
+  return true;
+}
+
+/** A 64-bit FNV-1a hash of a range of the data */
+unsigned long long checksum(const string& data, size_t begin, size_t end) {
+  unsigned long long hash(FNV_OFFSET);
+  for (size_t i(begin); i < end; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+}  // namespace
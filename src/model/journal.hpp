@@ -0,0 +1,128 @@
+// archipelago v3.0.0 - architecture b2
+// journal.hpp - append-only log of the edits of a town file
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_JOURNAL_H
+#define MODEL_JOURNAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "node.hpp"
+#include "town.hpp"
+
+/**
+ * Module: journal
+ * Keeps the unsaved edits of a town file in a sidecar file next to it, so that
+ * saving an edit only costs the size of the edit and survives a crash.
+ *
+ * The journal starts with the key of its base, the town file or the autosave that
+ * the edits apply to, followed by one checksummed record per edit. Records are
+ * written and synced in batches by a background thread. Once the records outgrow
+ * their base, the town is compacted into the autosave and the journal starts over
+ * from it. Recovering a town replays the records onto their base, up to the first
+ * incomplete or damaged record.
+ *
+ * Saving the town is a checkpoint of the same thread: a copy of the nodes and links
+ * is written to the file in the background, then the journal starts over from it.
+ */
+
+namespace journal {
+
+/* === CLASSES === */
+
+/** The journal of an open town, records are appended from a single thread */
+class Journal {
+ public:
+  /** The journal of a town without a file, nothing is recorded until it is saved */
+  Journal();
+  /** Writes the pending records and checkpoints, then stops the background thread */
+  ~Journal();
+
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  void addNode(const node::Node& node);
+  void removeNodes(const std::vector<unsigned>& uids);
+  /** Records the position and capacity of moved or resized nodes */
+  void setNodes(const town::Town& town, const std::vector<unsigned>& uids);
+  void addLink(const node::Link& link);
+  void removeLink(const node::Link& link);
+
+  /**
+   * Compacts the journal into an autosave of the town once the records outgrow
+   * their base, does nothing otherwise. The town is copied, see town::copyRecords(),
+   * the autosave is written by the background thread.
+   */
+  void compact(const town::Town& town);
+
+  /**
+   * Saves the town to a file without waiting, the journal then continues from the
+   * file with the records appended in the meantime. The callback is called on the
+   * background thread, with whether the file was written.
+   */
+  void save(const town::Town& town, const std::string& path,
+            std::function<void(bool)> done);
+
+ private:
+  Journal(const std::string& townPath, int file, unsigned long long size,
+          unsigned long long baseSize);
+  friend std::unique_ptr<Journal> recover(const std::string& townPath,
+                                          town::Town& town);
+
+  /** A copy of the town to write once the records before it are written */
+  struct Checkpoint {
+    std::shared_ptr<const town::Records> records;
+    /** The file to save to, empty for an autosave */
+    std::string path;
+    /** Bytes of the pending records before the copy */
+    size_t offset;
+    std::function<void(bool)> done;
+  };
+
+  /** Whether the town has a file to compact for, and its records since the base */
+  bool hasFile;
+  unsigned long long size;
+
+  /** The town file and the journal, owned by the background thread once it runs */
+  std::string townPath;
+  int file;
+  std::atomic<unsigned long long> baseSize;
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::string pending;
+  std::deque<Checkpoint> checkpoints;
+  bool stopping;
+  std::thread writer;
+
+  void appendRecord(const std::string& record);
+  void write();
+  void writeRecords(const char* data, size_t length);
+  bool writeCheckpoint(const Checkpoint& checkpoint);
+};
+
+/* === FUNCTIONS === */
+
+/**
+ * Loads a town file with the edits of its journal, then continues its journal.
+ * A journal of another version of the file is ignored and replaced. If the journal
+ * can not be written, the town is loaded and edits are not recorded.
+ * @throws If the town file is invalid, see town::loadCached()
+ */
+std::unique_ptr<Journal> recover(const std::string& townPath, town::Town& town);
+
+/** The sidecar files of a town file */
+std::string journalPath(const std::string& townPath);
+std::string autosavePath(const std::string& townPath);
+
+}  // namespace journal
+
+#endif
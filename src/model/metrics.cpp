@@ -0,0 +1,286 @@
+// archipelago v3.0.0 - architecture b2
+// metrics.cpp - hot-path instrumentation
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "metrics.hpp"
+
+#include <atomic>  // thread-local blocks
+#include <iomanip>
+#include <mutex>  // block registry
+#include <vector>
+
+using std::chrono::steady_clock;
+
+namespace {
+
+constexpr double NS_PER_MS(1e6);
+constexpr double MEDIAN(.5);
+constexpr double TAIL(.99);
+constexpr int REPORT_WIDTH(20);
+
+const char* const COUNTER_NAMES[metrics::NB_COUNTERS]{
+    "nodes_settled",      "edges_relaxed",      "pairs_tested",
+    "lines_parsed",       "bytes_parsed",       "primitives_emitted",
+    "updates_dispatched", "updates_coalesced",  "cache_hits",
+    "cache_misses"};
+
+const char* const TIMER_NAMES[metrics::NB_TIMERS]{
+    "path_find", "superposition", "parse", "render", "update_dispatch"};
+
+void clear(metrics::Snapshot& snapshot);
+
+#ifdef METRICS
+
+typedef std::atomic<unsigned long long> Cell;
+
+/**
+ * The accumulation block of a single thread. Only the owning thread writes to
+ * it, the atomics allow other threads to read a consistent value. The maximum is
+ * the exception, reset() clears it, a race only loses a maximum recorded meanwhile.
+ */
+struct Block {
+  Cell counters[metrics::NB_COUNTERS];
+  Cell count[metrics::NB_TIMERS];
+  Cell total[metrics::NB_TIMERS];
+  Cell max[metrics::NB_TIMERS];
+  Cell buckets[metrics::NB_TIMERS][metrics::NB_BUCKETS];
+};
+
+/** All live thread blocks, as well as the totals of exited threads */
+struct Registry {
+  Registry();
+  std::mutex mutex;
+  std::vector<Block*> blocks;
+  metrics::Snapshot retired;
+  metrics::Snapshot baseline;
+};
+
+/** Registers a block on the first use by a thread and retires it on exit */
+class LocalBlock {
+ public:
+  LocalBlock();
+  ~LocalBlock();
+  Block block;
+};
+
+Registry& registry();
+LocalBlock& local();
+unsigned bucketOf(unsigned long long nanoseconds);
+void accumulate(metrics::Snapshot& snapshot, const Block& block);
+void subtract(metrics::Snapshot& snapshot, const metrics::Snapshot& baseline);
+
+/** Single-writer increment, avoids a locked read-modify-write instruction */
+inline void add(Cell& cell, unsigned long long amount) {
+  cell.store(cell.load(std::memory_order_relaxed) + amount,
+             std::memory_order_relaxed);
+}
+
+#endif
+
+}  // namespace
+
+namespace metrics {
+
+/* === FUNCTIONS === */
+
+#ifdef METRICS
+
+bool enabled() { return true; }
+
+void count(Counter counter, unsigned long long amount) {
+  add(local().block.counters[counter], amount);
+}
+
+void record(Timer timer, unsigned long long nanoseconds) {
+  Block& block(local().block);
+  add(block.count[timer], 1);
+  add(block.total[timer], nanoseconds);
+  add(block.buckets[timer][bucketOf(nanoseconds)], 1);
+  if (nanoseconds > block.max[timer].load(std::memory_order_relaxed))
+    block.max[timer].store(nanoseconds, std::memory_order_relaxed);
+}
+
+Snapshot snapshot() {
+  Registry& reg(registry());
+  std::lock_guard<std::mutex> lock(reg.mutex);
+
+  Snapshot result(reg.retired);
+  for (const auto& block : reg.blocks) accumulate(result, *block);
+  subtract(result, reg.baseline);
+  return result;
+}
+
+void reset() {
+  Snapshot current(snapshot());
+  Registry& reg(registry());
+  std::lock_guard<std::mutex> lock(reg.mutex);
+
+  // The baseline is cumulative, accumulate the difference since the last reset
+  for (unsigned i(0); i < NB_COUNTERS; ++i)
+    reg.baseline.counters[i] += current.counters[i];
+  for (unsigned i(0); i < NB_TIMERS; ++i) {
+    reg.baseline.timers[i].count += current.timers[i].count;
+    reg.baseline.timers[i].total += current.timers[i].total;
+    for (unsigned j(0); j < NB_BUCKETS; ++j)
+      reg.baseline.timers[i].buckets[j] += current.timers[i].buckets[j];
+
+    // A maximum can not be rebased, it starts over instead
+    reg.retired.timers[i].max = 0;
+    for (auto& block : reg.blocks) block->max[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+#else
+
+bool enabled() { return false; }
+void count(Counter, unsigned long long) {}
+void record(Timer, unsigned long long) {}
+
+Snapshot snapshot() {
+  Snapshot result;
+  clear(result);
+  return result;
+}
+
+void reset() {}
+
+#endif
+
+unsigned long long percentile(const Histogram& histogram, double fraction) {
+  if (histogram.count == 0) return 0;
+
+  unsigned long long target(fraction * histogram.count), seen(0);
+  for (unsigned i(0); i < NB_BUCKETS; ++i) {
+    seen += histogram.buckets[i];
+    if (seen > target) return 2ULL << i;  // upper bound of the bucket
+  }
+  return histogram.max;
+}
+
+void dump(std::ostream& stream, const Snapshot& snapshot) {
+  stream << "# Archipelago metrics" << std::endl;
+  for (unsigned i(0); i < NB_COUNTERS; ++i) {
+    stream << std::left << std::setw(REPORT_WIDTH) << COUNTER_NAMES[i]
+           << snapshot.counters[i] << std::endl;
+  }
+
+  for (unsigned i(0); i < NB_TIMERS; ++i) {
+    const Histogram& timer(snapshot.timers[i]);
+    stream << std::left << std::setw(REPORT_WIDTH) << TIMER_NAMES[i]
+           << "n=" << timer.count << " total=" << timer.total / NS_PER_MS
+           << "ms p50<" << percentile(timer, MEDIAN) / NS_PER_MS
+           << "ms p99<" << percentile(timer, TAIL) / NS_PER_MS
+           << "ms max=" << timer.max / NS_PER_MS << "ms" << std::endl;
+  }
+}
+
+const char* name(Counter counter) { return COUNTER_NAMES[counter]; }
+const char* name(Timer timer) { return TIMER_NAMES[timer]; }
+
+/* === CLASSES === */
+
+ScopedTimer::ScopedTimer(Timer timer) : timer(timer), start(steady_clock::now()) {}
+
+ScopedTimer::~ScopedTimer() {
+  auto elapsed(steady_clock::now() - start);
+  record(timer,
+         std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+}  // namespace metrics
+
+namespace {
+
+void clear(metrics::Snapshot& snapshot) {
+  for (auto& counter : snapshot.counters) counter = 0;
+  for (auto& timer : snapshot.timers) {
+    timer.count = timer.total = timer.max = 0;
+    for (auto& bucket : timer.buckets) bucket = 0;
+  }
+}
+
+#ifdef METRICS
+
+Registry::Registry() {
+  clear(retired);
+  clear(baseline);
+}
+
+Registry& registry() {
+  static Registry instance;  // constructed on first use, outlives thread blocks
+  return instance;
+}
+
+LocalBlock& local() {
+  thread_local LocalBlock instance;
+  return instance;
+}
+
+LocalBlock::LocalBlock() {
+  for (auto& cell : block.counters) cell.store(0, std::memory_order_relaxed);
+  for (unsigned i(0); i < metrics::NB_TIMERS; ++i) {
+    block.count[i].store(0, std::memory_order_relaxed);
+    block.total[i].store(0, std::memory_order_relaxed);
+    block.max[i].store(0, std::memory_order_relaxed);
+    for (auto& cell : block.buckets[i]) cell.store(0, std::memory_order_relaxed);
+  }
+
+  Registry& reg(registry());
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  reg.blocks.push_back(&block);
+}
+
+LocalBlock::~LocalBlock() {
+  Registry& reg(registry());
+  std::lock_guard<std::mutex> lock(reg.mutex);
+
+  accumulate(reg.retired, block);
+  for (auto it(reg.blocks.begin()); it != reg.blocks.end(); ++it) {
+    if (*it == &block) {
+      reg.blocks.erase(it);
+      break;
+    }
+  }
+}
+
+unsigned bucketOf(unsigned long long nanoseconds) {
+  unsigned bucket(0);
+  while (nanoseconds > 1 && bucket < metrics::NB_BUCKETS - 1) {
+    nanoseconds >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+void accumulate(metrics::Snapshot& snapshot, const Block& block) {
+  for (unsigned i(0); i < metrics::NB_COUNTERS; ++i)
+    snapshot.counters[i] += block.counters[i].load(std::memory_order_relaxed);
+
+  for (unsigned i(0); i < metrics::NB_TIMERS; ++i) {
+    metrics::Histogram& timer(snapshot.timers[i]);
+    timer.count += block.count[i].load(std::memory_order_relaxed);
+    timer.total += block.total[i].load(std::memory_order_relaxed);
+
+    unsigned long long max(block.max[i].load(std::memory_order_relaxed));
+    if (max > timer.max) timer.max = max;
+
+    for (unsigned j(0); j < metrics::NB_BUCKETS; ++j)
+      timer.buckets[j] += block.buckets[i][j].load(std::memory_order_relaxed);
+  }
+}
+
+void subtract(metrics::Snapshot& snapshot, const metrics::Snapshot& baseline) {
+  for (unsigned i(0); i < metrics::NB_COUNTERS; ++i)
+    snapshot.counters[i] -= baseline.counters[i];
+
+  for (unsigned i(0); i < metrics::NB_TIMERS; ++i) {
+    snapshot.timers[i].count -= baseline.timers[i].count;
+    snapshot.timers[i].total -= baseline.timers[i].total;
+    for (unsigned j(0); j < metrics::NB_BUCKETS; ++j)
+      snapshot.timers[i].buckets[j] -= baseline.timers[i].buckets[j];
+  }
+}
+
+#endif
+
+}  // namespace
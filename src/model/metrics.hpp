@@ -0,0 +1,113 @@
+// archipelago v3.0.0 - architecture b2
+// metrics.hpp - hot-path instrumentation
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_METRICS_H
+#define MODEL_METRICS_H
+
+#include <chrono>
+#include <iostream>
+
+/**
+ * Module: metrics
+ * Lightweight counters and timers that are placed around the hot paths of the
+ * model and the GUI. Each thread accumulates into its own block, the blocks are
+ * only summed when a snapshot is requested.
+ *
+ * The instrumentation is only compiled when the METRICS flag is defined (see the
+ * Makefile), otherwise the METRICS_* macros expand to nothing and the query API
+ * returns empty snapshots.
+ */
+
+namespace metrics {
+
+/* === DEFINITIONS === */
+
+/** Monotonic event counters */
+enum Counter {
+  NODES_SETTLED,
+  EDGES_RELAXED,
+  PAIRS_TESTED,
+  LINES_PARSED,
+  BYTES_PARSED,
+  PRIMITIVES_EMITTED,
+  UPDATES_DISPATCHED,
+  UPDATES_COALESCED,
+  CACHE_HITS,
+  CACHE_MISSES,
+  NB_COUNTERS
+};
+
+/** Scoped timers, each backed by a duration histogram */
+enum Timer { PATH_FIND, SUPERPOSITION, PARSE, RENDER, UPDATE_DISPATCH, NB_TIMERS };
+
+/** Number of power-of-two nanosecond buckets in a histogram */
+constexpr unsigned NB_BUCKETS(40);
+
+/** Durations in nanoseconds, bucket i counts samples in [2^i, 2^(i+1)) */
+struct Histogram {
+  unsigned long long count;
+  unsigned long long total;
+  unsigned long long max;
+  unsigned long long buckets[NB_BUCKETS];
+};
+
+/** The accumulated value of every counter and timer, summed over all threads */
+struct Snapshot {
+  unsigned long long counters[NB_COUNTERS];
+  Histogram timers[NB_TIMERS];
+};
+
+/* === FUNCTIONS === */
+
+/** Whether the instrumentation was compiled in */
+bool enabled();
+
+/** Increment a counter of the calling thread */
+void count(Counter counter, unsigned long long amount);
+
+/** Record a duration sample of the calling thread */
+void record(Timer timer, unsigned long long nanoseconds);
+
+/** Sum the counters and timers of all threads since the last reset */
+Snapshot snapshot();
+
+/** Set the baseline of future snapshots to the current values */
+void reset();
+
+/** Returns an upper bound of the given percentile (0-1) of a histogram, in ns */
+unsigned long long percentile(const Histogram& histogram, double fraction);
+
+/** Print a human-readable report of a snapshot */
+void dump(std::ostream& stream, const Snapshot& snapshot);
+
+const char* name(Counter counter);
+const char* name(Timer timer);
+
+/* === CLASSES === */
+
+/** RAII timer that records the lifetime of the instance */
+class ScopedTimer {
+ public:
+  ScopedTimer() = delete;
+  ScopedTimer(Timer timer);
+  ~ScopedTimer();
+
+ private:
+  Timer timer;
+  std::chrono::steady_clock::time_point start;
+};
+
+}  // namespace metrics
+
+/* === MACROS === */
+
+#ifdef METRICS
+#define METRICS_COUNT(counter, amount) metrics::count(metrics::counter, amount)
+#define METRICS_TIMER(timer) metrics::ScopedTimer metricsScopedTimer(metrics::timer)
+#else
+#define METRICS_COUNT(counter, amount) ((void)0)
+#define METRICS_TIMER(timer) ((void)0)
+#endif
+
+#endif
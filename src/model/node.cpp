@@ -9,6 +9,7 @@
 
 #include "constants.hpp"
 #include "error.hpp"
+#include "metrics.hpp"
 
 namespace {
 
@@ -45,6 +46,7 @@ void Node::render(tools::RenderContext& ctx) {
 
   ctx.setColour(selected ? tools::ORANGE : highlighted ? tools::GREEN : tools::BLACK);
   ctx.draw(tools::Circle(position, nodeRadius));
+  METRICS_COUNT(PRIMITIVES_EMITTED, 1);
 
   switch (type) {
     case PRODUCTION:
@@ -141,6 +143,7 @@ void drawProduction(tools::RenderContext& ctx, const tools::Vec2& position,
   tools::Vec2 d(position.getX() - radius * PRODUCTION_SIGN_WIDTH,
                 position.getY() + radius * PRODUCTION_SIGN_HEIGHT);
   ctx.draw(tools::Polygon4(a, b, c, d));
+  METRICS_COUNT(PRIMITIVES_EMITTED, 1);
 }
 
 void drawTransport(tools::RenderContext& ctx, const tools::Vec2& position,
@@ -161,6 +164,7 @@ void drawTransport(tools::RenderContext& ctx, const tools::Vec2& position,
   ctx.draw(tools::Line(point3, point7));
   ctx.draw(tools::Line(point2, point6));
   ctx.draw(tools::Line(point4, point8));
+  METRICS_COUNT(PRIMITIVES_EMITTED, 4);
 }
 
 }  // namespace
@@ -0,0 +1,400 @@
+// archipelago v3.0.0 - architecture b2
+// parser.cpp - parallel parsing of the town file format
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "parser.hpp"
+
+#include <algorithm>  // min(), max(), upper_bound()
+#include <atomic>     // work distribution
+#include <cctype>     // isspace()
+#include <cstring>    // memchr()
+#include <limits>     // numeric_limits
+#include <sstream>    // stringstream
+#include <string>
+#include <thread>
+
+#include "metrics.hpp"
+#include "trace.hpp"
+
+using node::NodeType;
+using std::istream;
+using std::string;
+using std::vector;
+using validation::LinkRecord;
+using validation::NodeRecord;
+
+namespace {
+
+constexpr char COMMENT_DELIMITER('#');
+constexpr char LINE_FEED('\n');
+constexpr int LINE_START(0);           // beginning of a line
+constexpr size_t CHUNK_BYTES(1 << 20);  // text handed to a thread at once
+constexpr unsigned NB_SECTIONS(4);      // housing, transport, production and links
+constexpr unsigned LINK_SECTION(3);
+
+typedef vector<NodeRecord> NodeRecords;
+typedef vector<LinkRecord> LinkRecords;
+
+/** A line-aligned part of the text, with the lines that precede it */
+struct Chunk {
+  const char* begin;
+  const char* end;
+  /** Line feeds in the chunk */
+  size_t lines;
+  /** Lines with content that start in the chunk */
+  size_t contents;
+  size_t linesBefore;
+  size_t contentsBefore;
+};
+
+/**
+ * The place of each section as indices among the lines with content, where the
+ * header is followed by the records
+ */
+struct Layout {
+  size_t headers[NB_SECTIONS];
+  size_t counts[NB_SECTIONS];
+  /** The index of the first node record of each node section */
+  size_t nodeOffsets[LINK_SECTION];
+};
+
+vector<Chunk> split(const char* text, size_t size);
+template <typename Task>
+void forEachChunk(vector<Chunk>& chunks, Task task);
+void countLines(Chunk& chunk);
+const char* contentEnd(const char* line, const char* end);
+bool hasContent(const char* line, const char* end);
+bool locate(const vector<Chunk>& chunks, size_t total, Layout& layout);
+unsigned long long readHeader(const vector<Chunk>& chunks, size_t index);
+void parseChunk(const Chunk& chunk, const Layout& layout, NodeRecord* nodes,
+                LinkRecord* links);
+
+void parseNodes(istream& stream, unsigned& line, NodeRecords& nodes, NodeType type);
+void parseLinks(istream& stream, unsigned& line, LinkRecords& links);
+
+std::stringstream getNextLine(istream& stream, unsigned& line);
+unsigned readUnsigned(istream& stream);
+unsigned long long readLongUnsigned(istream& stream);
+double readDouble(istream& stream);
+
+}  // namespace
+
+namespace parser {
+
+/* === FUNCTIONS === */
+
+void parseTown(const char* text, size_t size, NodeRecords& nodes, LinkRecords& links) {
+  TRACE_SCOPE("parser::parseTown");
+  METRICS_TIMER(PARSE);
+  METRICS_COUNT(BYTES_PARSED, size);
+
+  vector<Chunk> chunks(split(text, size));
+  forEachChunk(chunks, [](Chunk& chunk) { countLines(chunk); });
+
+  size_t lines(0), total(0);
+  for (auto& chunk : chunks) {
+    chunk.linesBefore = lines;
+    chunk.contentsBefore = total;
+    lines += chunk.lines;
+    total += chunk.contents;
+  }
+  METRICS_COUNT(LINES_PARSED, lines);
+
+  // A count that runs past the last line is left to the sequential parser, which
+  // reads one zero record for the missing ones (see parseSequential). Its records
+  // are bounded by the lines of the file, one more for each section at most.
+  Layout layout;
+  if (!locate(chunks, total, layout)) {
+    std::istringstream stream(string(text, size));
+    parseSequential(stream, nodes, links);
+    return;
+  }
+
+  const size_t nodeStart(nodes.size()), linkStart(links.size());
+  nodes.resize(nodeStart + layout.nodeOffsets[LINK_SECTION - 1] +
+               layout.counts[LINK_SECTION - 1]);
+  links.resize(linkStart + layout.counts[LINK_SECTION]);
+
+  NodeRecord* nodeSlots(nodes.data() + nodeStart);
+  LinkRecord* linkSlots(links.data() + linkStart);
+  forEachChunk(chunks, [&](Chunk& chunk) {
+    parseChunk(chunk, layout, nodeSlots, linkSlots);
+  });
+}
+
+void parseSequential(istream& stream, NodeRecords& nodes, LinkRecords& links) {
+  unsigned line(0);
+
+  // Parse each node
+  parseNodes(stream, line, nodes, node::HOUSING);
+  parseNodes(stream, line, nodes, node::TRANSPORT);
+  parseNodes(stream, line, nodes, node::PRODUCTION);
+
+  // Parse each link
+  parseLinks(stream, line, links);
+}
+
+}  // namespace parser
+
+/* === INTERNAL FUNCTIONS === */
+
+namespace {
+
+/* == Parallel parsing == */
+
+/** Splits the text into chunks of about CHUNK_BYTES that end after a line feed */
+vector<Chunk> split(const char* text, size_t size) {
+  vector<Chunk> chunks;
+  const char* const end(text + size);
+
+  for (const char* begin(text); begin < end;) {
+    const char* boundary(begin + std::min<size_t>(CHUNK_BYTES, end - begin) - 1);
+    const void* feed(std::memchr(boundary, LINE_FEED, end - boundary));
+    boundary = feed ? static_cast<const char*>(feed) + 1 : end;
+
+    chunks.push_back({begin, boundary, 0, 0, 0, 0});
+    begin = boundary;
+  }
+  return chunks;
+}
+
+/** Runs a task for each chunk on every core, chunks are handed out one at a time */
+template <typename Task>
+void forEachChunk(vector<Chunk>& chunks, Task task) {
+  std::atomic<size_t> next(0);
+  const unsigned nbThreads(std::max(
+      1U, std::min<unsigned>(std::thread::hardware_concurrency(), chunks.size())));
+
+  auto worker = [&]() {
+    for (size_t i(next++); i < chunks.size(); i = next++) task(chunks[i]);
+  };
+
+  vector<std::thread> threads;
+  for (unsigned i(1); i < nbThreads; ++i) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+}
+
+void countLines(Chunk& chunk) {
+  for (const char* line(chunk.begin); line < chunk.end;) {
+    const void* feed(std::memchr(line, LINE_FEED, chunk.end - line));
+    const char* lineEnd(feed ? static_cast<const char*>(feed) : chunk.end);
+
+    if (feed) ++chunk.lines;
+    if (hasContent(line, contentEnd(line, lineEnd))) ++chunk.contents;
+    line = lineEnd + 1;
+  }
+}
+
+/** The end of a line without its comment */
+const char* contentEnd(const char* line, const char* end) {
+  const void* comment(std::memchr(line, COMMENT_DELIMITER, end - line));
+  return comment ? static_cast<const char*>(comment) : end;
+}
+
+/** Whether the line has a character other than whitespace */
+bool hasContent(const char* line, const char* end) {
+  for (; line < end; ++line) {
+    if (!isspace(static_cast<unsigned char>(*line))) return true;
+  }
+  return false;
+}
+
+/**
+ * Reads the four count headers, returns false if the records that they announce
+ * do not all fit in the remaining lines
+ */
+bool locate(const vector<Chunk>& chunks, size_t total, Layout& layout) {
+  size_t header(0), nodeOffset(0);
+
+  for (unsigned section(0); section < NB_SECTIONS; ++section) {
+    if (header >= total) return false;
+
+    const unsigned long long count(readHeader(chunks, header));
+    if (count > total - header - 1) return false;
+
+    layout.headers[section] = header;
+    layout.counts[section] = count;
+    if (section < LINK_SECTION) {
+      layout.nodeOffsets[section] = nodeOffset;
+      nodeOffset += count;
+    }
+    header += 1 + count;
+  }
+  return true;
+}
+
+/** Reads the count of the line with content at the given index */
+unsigned long long readHeader(const vector<Chunk>& chunks, size_t index) {
+  const auto chunk(std::upper_bound(chunks.begin(), chunks.end(), index,
+                                    [](size_t value, const Chunk& chunk) {
+                                      return value < chunk.contentsBefore;
+                                    }) -
+                   1);
+  size_t current(chunk->contentsBefore);
+
+  for (const char* line(chunk->begin); line < chunk->end;) {
+    const void* feed(std::memchr(line, LINE_FEED, chunk->end - line));
+    const char* lineEnd(feed ? static_cast<const char*>(feed) : chunk->end);
+    const char* end(contentEnd(line, lineEnd));
+
+    if (hasContent(line, end) && current++ == index) {
+      std::istringstream stream(string(line, end));
+      return readLongUnsigned(stream);
+    }
+    line = lineEnd + 1;
+  }
+  return 0;
+}
+
+/**
+ * Parses the records of a chunk into their slots. Fields are read with a stream
+ * like the sequential parser, which keeps its handling of malformed numbers.
+ */
+void parseChunk(const Chunk& chunk, const Layout& layout, NodeRecord* nodes,
+                LinkRecord* links) {
+  const size_t last(layout.headers[LINK_SECTION] + layout.counts[LINK_SECTION]);
+  size_t index(chunk.contentsBefore);
+  size_t lineNumber(chunk.linesBefore);
+  unsigned section(0);
+  std::istringstream stream;
+
+  for (const char* line(chunk.begin); line < chunk.end && index <= last;) {
+    const void* feed(std::memchr(line, LINE_FEED, chunk.end - line));
+    const char* lineEnd(feed ? static_cast<const char*>(feed) : chunk.end);
+    const char* end(contentEnd(line, lineEnd));
+    ++lineNumber;
+
+    if (hasContent(line, end)) {
+      while (section < LINK_SECTION && index >= layout.headers[section + 1]) ++section;
+
+      if (index != layout.headers[section]) {
+        const size_t record(index - layout.headers[section] - 1);
+        stream.clear();
+        stream.str(string(line, end));
+
+        if (section == LINK_SECTION) {
+          LinkRecord& link(links[record]);
+          link.uid0 = readUnsigned(stream);
+          link.uid1 = readUnsigned(stream);
+          link.line = lineNumber;
+        } else {
+          NodeRecord& node(nodes[layout.nodeOffsets[section] + record]);
+          node.type = static_cast<NodeType>(section);
+          node.uid = readUnsigned(stream);
+          const double x(readDouble(stream));
+          node.position = {x, readDouble(stream)};
+          node.capacity = readUnsigned(stream);
+          node.line = lineNumber;
+        }
+      }
+      ++index;
+    }
+    line = lineEnd + 1;
+  }
+}
+
+/* == Sequential parsing == */
+
+/**
+ * Read and parse a single node type from an input stream and append the node
+ * records to the given vector. This function initially reads the node count.
+ */
+void parseNodes(istream& rawStream, unsigned& line, NodeRecords& nodes,
+                NodeType type) {
+  std::stringstream lineStream(getNextLine(rawStream, line));
+
+  size_t count(readLongUnsigned(lineStream));
+
+  unsigned int uid, capacity;
+  double x, y;
+
+  // Read as many nodes as were specified by the count
+  for (size_t i(0); i < count; ++i) {
+    lineStream = getNextLine(rawStream, line);
+    const bool exhausted(lineStream.eof());
+    uid = readUnsigned(lineStream);
+    x = readDouble(lineStream);
+    y = readDouble(lineStream);
+    capacity = readUnsigned(lineStream);
+
+    nodes.push_back({type, uid, {x, y}, capacity, line});
+    if (exhausted) break;  // see parseSequential()
+  }
+}
+
+/**
+ * Read and parse links from an input stream, appending the link records to a
+ * vector.
+ */
+void parseLinks(istream& rawStream, unsigned& line, LinkRecords& links) {
+  std::stringstream lineStream(getNextLine(rawStream, line));
+
+  size_t count(readLongUnsigned(lineStream));
+  unsigned int uid0, uid1;
+
+  // Read as many links as were specified by the count
+  for (size_t i(0); i < count; ++i) {
+    lineStream = getNextLine(rawStream, line);
+    const bool exhausted(lineStream.eof());
+    uid0 = readUnsigned(lineStream);
+    uid1 = readUnsigned(lineStream);
+
+    links.push_back({uid0, uid1, line});
+    if (exhausted) break;  // see parseSequential()
+  }
+}
+
+/**
+ * Read a single line of real content (containing readable characters) from an
+ * input stream. Each line is stripped of comments before being returned, and the
+ * line counter is advanced past it.
+ */
+std::stringstream getNextLine(istream& stream, unsigned& lineNumber) {
+  // Signal the end by return a stringstream with an EOF bit. The line feed that
+  // ends the last line is not followed by another line, which is not counted
+  string line;
+  if (stream.eof() || !std::getline(stream, line)) {
+    std::stringstream emptyStream("");
+    emptyStream.ignore(std::numeric_limits<std::streamsize>::max());
+    return emptyStream;
+  }
+  ++lineNumber;
+
+  // Trim off comments
+  size_t commentPos(line.find(COMMENT_DELIMITER));
+  if (commentPos != string::npos) {
+    line = line.substr(LINE_START, commentPos);
+  }
+
+  // skip empty lines
+  if (!hasContent(line.data(), line.data() + line.size())) {
+    return getNextLine(stream, lineNumber);  // recursively fetch the next line
+  }
+
+  std::stringstream lineStream(line);
+  return lineStream;
+}
+
+/** Read and return an int from an input stream */
+unsigned readUnsigned(istream& stream) {
+  unsigned buffer(0);
+  stream >> buffer;
+  return buffer;
+}
+
+/** Read and return an int from an input stream */
+unsigned long long readLongUnsigned(istream& stream) {
+  unsigned long long buffer(0);
+  stream >> buffer;
+  return buffer;
+}
+
+/** Read and return a double from an input stream */
+double readDouble(istream& stream) {
+  double buffer(0.);
+  stream >> buffer;
+  return buffer;
+}
+
+}  // namespace
@@ -0,0 +1,49 @@
+// archipelago v3.0.0 - architecture b2
+// parser.hpp - parallel parsing of the town file format
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_PARSER_H
+#define MODEL_PARSER_H
+
+#include <cstddef>
+#include <istream>
+#include <vector>
+
+#include "validation.hpp"
+
+/**
+ * Module: parser
+ * Reads the text of a town file into node and link records, before validation.
+ *
+ * The text is split into line-aligned chunks that are parsed on every core. A first
+ * pass counts the lines of each chunk, which locates the four count headers and
+ * the place of every record in the file. A second pass parses each chunk directly
+ * into its slots of the preallocated records. The records are identical to those
+ * of a sequential parse, in file order and with their line, so that validation
+ * reports the same first error.
+ */
+
+namespace parser {
+
+/* === FUNCTIONS === */
+
+/**
+ * Parses the text of a town file, appending the records to the given vectors.
+ * Missing fields are read as zero, lines past the last link are ignored.
+ */
+void parseTown(const char* text, size_t size,
+               std::vector<validation::NodeRecord>& nodes,
+               std::vector<validation::LinkRecord>& links);
+
+/**
+ * Reads a town file line by line, the reference for parseTown() and its reader of
+ * files whose counts run past their end. Such a count reads a single zero record at
+ * the last line, in place of all the missing records: it is the first of them to
+ * fail validation, and a count of billions neither allocates nor loops for each.
+ */
+void parseSequential(std::istream& stream, std::vector<validation::NodeRecord>& nodes,
+                     std::vector<validation::LinkRecord>& links);
+
+}  // namespace parser
+
+#endif
@@ -0,0 +1,574 @@
+// archipelago v3.0.0 - architecture b2
+// spatial.cpp - spatial indexing of town members
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "spatial.hpp"
+
+#include <algorithm>  // sort(), unique(), min(), max(), nth_element()
+#include <cmath>      // floor(), fabs(), sqrt()
+#include <queue>      // priority_queue
+
+using std::vector;
+using tools::Vec2;
+
+namespace {
+
+/** Boxes are padded so that rounding never loses an item on a cell border */
+constexpr double PADDING(1e-6);
+
+/** Cell coordinates are clamped, this keeps them representable in a key */
+constexpr long long CELL_LIMIT(1LL << 30);
+constexpr long long KEY_OFFSET(1LL << 31);
+constexpr unsigned KEY_SHIFT(32);
+constexpr unsigned long long KEY_MASK((1ULL << KEY_SHIFT) - 1);
+
+/** Larger items are kept out of the cells, such as a link across a huge town */
+constexpr double MAX_ITEM_CELLS(1 << 12);
+
+/** Marks a missing parent or child in a hierarchy */
+constexpr unsigned NO_ENTRY(static_cast<unsigned>(-1));
+constexpr double HALF(.5);
+constexpr double TWO(2.);
+
+/** An entry of a hierarchy, or an item once its exact distance is known */
+struct Candidate {
+  double distance;
+  unsigned index;
+  bool exact;
+};
+
+/** Orders the priority queue nearest first, boxes before the items they may hold */
+struct Farther {
+  bool operator()(const Candidate& a, const Candidate& b) const;
+};
+
+unsigned long long key(long long column, long long row);
+long long column(unsigned long long key);
+long long row(unsigned long long key);
+unsigned long long linkKey(unsigned uid0, unsigned uid1);
+
+bool overlaps(const spatial::Box& boxA, const spatial::Box& boxB);
+bool equal(const spatial::Box& boxA, const spatial::Box& boxB);
+/** Half the perimeter, unlike the area it still grows for flat boxes */
+double cost(const spatial::Box& box);
+double centre(const spatial::Box& box, bool alongX);
+
+}  // namespace
+
+namespace spatial {
+
+/* === CLASSES === */
+
+Grid::Grid(double cellSize) : cellSize(cellSize) {}
+
+double Grid::getCellSize() const { return cellSize; }
+
+void Grid::insert(unsigned item, const Box& box) {
+  if (cellsOverlapped(box) > MAX_ITEM_CELLS) {
+    oversized.push_back(item);
+    return;
+  }
+  for (long long x(cell(box.minX - PADDING)); x <= cell(box.maxX + PADDING); ++x)
+    for (long long y(cell(box.minY - PADDING)); y <= cell(box.maxY + PADDING); ++y)
+      cells[key(x, y)].push_back(item);
+}
+
+void Grid::remove(unsigned item, const Box& box) {
+  if (cellsOverlapped(box) > MAX_ITEM_CELLS) {
+    eraseOversized(item);
+    return;
+  }
+  for (long long x(cell(box.minX - PADDING)); x <= cell(box.maxX + PADDING); ++x)
+    for (long long y(cell(box.minY - PADDING)); y <= cell(box.maxY + PADDING); ++y)
+      erase(key(x, y), item);
+}
+
+void Grid::insert(unsigned item, const Vec2& pointA, const Vec2& pointB) {
+  if (cellsCrossed(pointA, pointB) > MAX_ITEM_CELLS) {
+    oversized.push_back(item);
+    return;
+  }
+  const long long firstX(cell(std::min(pointA.getX(), pointB.getX()) - PADDING));
+  const long long lastX(cell(std::max(pointA.getX(), pointB.getX()) + PADDING));
+  for (long long x(firstX); x <= lastX; ++x) {
+    long long first, last;
+    columnRange(pointA, pointB, x, first, last);
+    for (long long y(first); y <= last; ++y) cells[key(x, y)].push_back(item);
+  }
+}
+
+void Grid::remove(unsigned item, const Vec2& pointA, const Vec2& pointB) {
+  if (cellsCrossed(pointA, pointB) > MAX_ITEM_CELLS) {
+    eraseOversized(item);
+    return;
+  }
+  const long long firstX(cell(std::min(pointA.getX(), pointB.getX()) - PADDING));
+  const long long lastX(cell(std::max(pointA.getX(), pointB.getX()) + PADDING));
+  for (long long x(firstX); x <= lastX; ++x) {
+    long long first, last;
+    columnRange(pointA, pointB, x, first, last);
+    for (long long y(first); y <= last; ++y) erase(key(x, y), item);
+  }
+}
+
+void Grid::query(const Box& box, vector<unsigned>& items) const {
+  const long long firstX(cell(box.minX - PADDING)), lastX(cell(box.maxX + PADDING));
+  const long long firstY(cell(box.minY - PADDING)), lastY(cell(box.maxY + PADDING));
+  const double area(static_cast<double>(lastX - firstX + 1) * (lastY - firstY + 1));
+
+  items = oversized;
+  if (area <= cells.size()) {
+    for (long long x(firstX); x <= lastX; ++x)
+      for (long long y(firstY); y <= lastY; ++y) collect(key(x, y), items);
+  } else {
+    // A large box, visiting the occupied cells is cheaper
+    for (const auto& entry : cells) {
+      const long long x(column(entry.first)), y(row(entry.first));
+      if (x >= firstX && x <= lastX && y >= firstY && y <= lastY)
+        items.insert(items.end(), entry.second.begin(), entry.second.end());
+    }
+  }
+
+  std::sort(items.begin(), items.end());
+  items.erase(std::unique(items.begin(), items.end()), items.end());
+}
+
+void Grid::query(const Vec2& pointA, const Vec2& pointB,
+                 vector<unsigned>& items) const {
+  const long long firstX(cell(std::min(pointA.getX(), pointB.getX()) - PADDING));
+  const long long lastX(cell(std::max(pointA.getX(), pointB.getX()) + PADDING));
+  const long long firstY(cell(std::min(pointA.getY(), pointB.getY()) - PADDING));
+  const long long lastY(cell(std::max(pointA.getY(), pointB.getY()) + PADDING));
+  const double length(static_cast<double>(lastX - firstX) + (lastY - firstY) + 1);
+
+  items = oversized;
+  if (length <= cells.size()) {
+    // Walk the cells crossed by the segment, one column at a time
+    for (long long x(firstX); x <= lastX; ++x) {
+      long long first, last;
+      columnRange(pointA, pointB, x, first, last);
+      for (long long y(first); y <= last; ++y) collect(key(x, y), items);
+    }
+  } else {
+    for (const auto& entry : cells) {
+      const long long x(column(entry.first)), y(row(entry.first));
+      if (x < firstX || x > lastX) continue;
+
+      long long first, last;
+      columnRange(pointA, pointB, x, first, last);
+      if (y >= first && y <= last)
+        items.insert(items.end(), entry.second.begin(), entry.second.end());
+    }
+  }
+
+  std::sort(items.begin(), items.end());
+  items.erase(std::unique(items.begin(), items.end()), items.end());
+}
+
+double Grid::cellsOverlapped(const Box& box) const {
+  const double columns(static_cast<double>(cell(box.maxX + PADDING)) -
+                       cell(box.minX - PADDING) + 1);
+  const double rows(static_cast<double>(cell(box.maxY + PADDING)) -
+                    cell(box.minY - PADDING) + 1);
+  return columns * rows;
+}
+
+/** A segment crosses at most one cell per column and row that it spans */
+double Grid::cellsCrossed(const Vec2& pointA, const Vec2& pointB) const {
+  const double columns(
+      static_cast<double>(cell(std::max(pointA.getX(), pointB.getX()) + PADDING)) -
+      cell(std::min(pointA.getX(), pointB.getX()) - PADDING) + 1);
+  const double rows(
+      static_cast<double>(cell(std::max(pointA.getY(), pointB.getY()) + PADDING)) -
+      cell(std::min(pointA.getY(), pointB.getY()) - PADDING) + 1);
+  return columns + rows;
+}
+
+long long Grid::cell(double coordinate) const {
+  const double index(std::floor(coordinate / cellSize));
+  if (!(index > -CELL_LIMIT)) return -CELL_LIMIT;  // also catches NaN
+  if (index > CELL_LIMIT) return CELL_LIMIT;
+  return static_cast<long long>(index);
+}
+
+/** The rows of the cells crossed by a segment within a column */
+void Grid::columnRange(const Vec2& pointA, const Vec2& pointB, long long column,
+                       long long& first, long long& last) const {
+  const double minX(std::min(pointA.getX(), pointB.getX()));
+  const double maxX(std::max(pointA.getX(), pointB.getX()));
+  double lowY(std::min(pointA.getY(), pointB.getY()));
+  double highY(std::max(pointA.getY(), pointB.getY()));
+
+  if (pointA.getX() != pointB.getX()) {
+    // Clip the segment to the column, the column may only touch the padding
+    const double x0(std::min(std::max(column * cellSize, minX), maxX));
+    const double x1(std::min(std::max((column + 1) * cellSize, minX), maxX));
+    const double slope((pointB.getY() - pointA.getY()) /
+                       (pointB.getX() - pointA.getX()));
+    const double y0(pointA.getY() + (x0 - pointA.getX()) * slope);
+    const double y1(pointA.getY() + (x1 - pointA.getX()) * slope);
+    // Rounding in the clipped coordinates is amplified by the slope
+    const double margin(PADDING * std::fabs(slope));
+    lowY = std::max(lowY, std::min(y0, y1) - margin);
+    highY = std::min(highY, std::max(y0, y1) + margin);
+  }
+
+  first = cell(lowY - PADDING);
+  last = cell(highY + PADDING);
+}
+
+void Grid::collect(unsigned long long cellKey, vector<unsigned>& items) const {
+  auto it(cells.find(cellKey));
+  if (it != cells.end())
+    items.insert(items.end(), it->second.begin(), it->second.end());
+}
+
+void Grid::erase(unsigned long long cellKey, unsigned item) {
+  auto it(cells.find(cellKey));
+  if (it == cells.end()) return;
+
+  auto& list(it->second);
+  auto position(std::find(list.begin(), list.end(), item));
+  if (position != list.end()) {
+    *position = list.back();
+    list.pop_back();
+  }
+  if (list.empty()) cells.erase(it);
+}
+
+void Grid::eraseOversized(unsigned item) {
+  auto position(std::find(oversized.begin(), oversized.end(), item));
+  if (position != oversized.end()) {
+    *position = oversized.back();
+    oversized.pop_back();
+  }
+}
+
+LinkGrid::LinkGrid(double cellSize) : grid(cellSize) {}
+
+void LinkGrid::insert(unsigned uid0, unsigned uid1, const Vec2& pointA,
+                      const Vec2& pointB) {
+  unsigned slot(slots.size());
+  if (freeSlots.empty()) {
+    slots.push_back({std::min(uid0, uid1), std::max(uid0, uid1)});
+  } else {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+    slots[slot] = {std::min(uid0, uid1), std::max(uid0, uid1)};
+  }
+  slotOfLink[linkKey(uid0, uid1)] = slot;
+  grid.insert(slot, pointA, pointB);
+}
+
+void LinkGrid::remove(unsigned uid0, unsigned uid1, const Vec2& pointA,
+                      const Vec2& pointB) {
+  auto it(slotOfLink.find(linkKey(uid0, uid1)));
+  if (it == slotOfLink.end()) return;
+
+  grid.remove(it->second, pointA, pointB);
+  freeSlots.push_back(it->second);
+  slotOfLink.erase(it);
+}
+
+void LinkGrid::clear() {
+  grid = Grid(grid.getCellSize());
+  slots.clear();
+  freeSlots.clear();
+  slotOfLink.clear();
+}
+
+void LinkGrid::query(const Vec2& pointA, const Vec2& pointB,
+                     vector<std::pair<unsigned, unsigned>>& links) const {
+  vector<unsigned> candidates;
+  grid.query(pointA, pointB, candidates);
+  toLinks(candidates, links);
+}
+
+void LinkGrid::query(const Box& box,
+                     vector<std::pair<unsigned, unsigned>>& links) const {
+  vector<unsigned> candidates;
+  grid.query(box, candidates);
+  toLinks(candidates, links);
+}
+
+void LinkGrid::toLinks(const vector<unsigned>& candidates,
+                       vector<std::pair<unsigned, unsigned>>& links) const {
+  links.clear();
+  for (const auto& slot : candidates) links.push_back(slots[slot]);
+  std::sort(links.begin(), links.end());
+}
+
+Bvh::Bvh() : root(NO_ENTRY) {}
+
+void Bvh::build(const vector<std::pair<unsigned, Box>>& items) {
+  clear();
+  if (items.empty()) return;
+
+  vector<std::pair<unsigned, Box>> pending(items);
+  entries.reserve(TWO * items.size());
+  root = buildRange(pending, 0, pending.size(), NO_ENTRY);
+}
+
+void Bvh::insert(unsigned item, const Box& box) {
+  const unsigned leaf(allocate());
+  entries[leaf] = {box, NO_ENTRY, NO_ENTRY, NO_ENTRY, item};
+  leafOfItem[item] = leaf;
+  if (root == NO_ENTRY) {
+    root = leaf;
+    return;
+  }
+
+  // Descend while a child can hold the item more cheaply than a new branch here
+  unsigned sibling(root);
+  while (!isLeaf(sibling)) {
+    const Entry& entry(entries[sibling]);
+    const double combined(cost(merge(entry.box, box)));
+    const double here(TWO * combined);
+    const double inherited(TWO * (combined - cost(entry.box)));
+
+    double childCosts[2];
+    const unsigned children[2]{entry.left, entry.right};
+    for (unsigned i(0); i < 2; ++i) {
+      const Box& childBox(entries[children[i]].box);
+      childCosts[i] = cost(merge(childBox, box)) + inherited;
+      if (!isLeaf(children[i])) childCosts[i] -= cost(childBox);
+    }
+
+    if (here < childCosts[0] && here < childCosts[1]) break;
+    sibling = childCosts[0] <= childCosts[1] ? children[0] : children[1];
+  }
+
+  const unsigned parent(entries[sibling].parent);
+  const unsigned branch(allocate());
+  entries[branch] = {merge(entries[sibling].box, box), parent, sibling, leaf,
+                     NO_ENTRY};
+  entries[sibling].parent = branch;
+  entries[leaf].parent = branch;
+
+  if (parent == NO_ENTRY) {
+    root = branch;
+  } else {
+    (entries[parent].left == sibling ? entries[parent].left : entries[parent].right) =
+        branch;
+    refitAncestors(parent);
+  }
+}
+
+void Bvh::remove(unsigned item) {
+  auto it(leafOfItem.find(item));
+  if (it == leafOfItem.end()) return;
+
+  const unsigned leaf(it->second);
+  const unsigned parent(entries[leaf].parent);
+  leafOfItem.erase(it);
+  release(leaf);
+  if (parent == NO_ENTRY) {
+    root = NO_ENTRY;
+    return;
+  }
+
+  // The sibling takes the place of the parent
+  const unsigned sibling(entries[parent].left == leaf ? entries[parent].right
+                                                      : entries[parent].left);
+  const unsigned grandParent(entries[parent].parent);
+  entries[sibling].parent = grandParent;
+  release(parent);
+
+  if (grandParent == NO_ENTRY) {
+    root = sibling;
+  } else {
+    (entries[grandParent].left == parent ? entries[grandParent].left
+                                         : entries[grandParent].right) = sibling;
+    refitAncestors(grandParent);
+  }
+}
+
+void Bvh::refit(unsigned item, const Box& box) {
+  const unsigned leaf(leafOfItem.at(item));
+  entries[leaf].box = box;
+  refitAncestors(entries[leaf].parent);
+}
+
+void Bvh::clear() {
+  entries.clear();
+  freeEntries.clear();
+  leafOfItem.clear();
+  root = NO_ENTRY;
+}
+
+size_t Bvh::size() const { return leafOfItem.size(); }
+
+void Bvh::query(const Box& box, vector<unsigned>& items) const {
+  items.clear();
+  if (root == NO_ENTRY) return;
+
+  vector<unsigned> pending{root};
+  while (!pending.empty()) {
+    const Entry& entry(entries[pending.back()]);
+    const bool leaf(isLeaf(pending.back()));
+    pending.pop_back();
+    if (!overlaps(entry.box, box)) continue;
+
+    if (leaf) {
+      items.push_back(entry.item);
+    } else {
+      pending.push_back(entry.left);
+      pending.push_back(entry.right);
+    }
+  }
+  std::sort(items.begin(), items.end());
+}
+
+void Bvh::query(const Vec2& point, vector<unsigned>& items) const {
+  query(Box{point.getX(), point.getY(), point.getX(), point.getY()}, items);
+}
+
+/** A best-first search, an item is only reported once no box can hold a nearer one */
+void Bvh::nearest(const Vec2& point, unsigned count, const Distance& itemDistance,
+                  vector<unsigned>& items) const {
+  items.clear();
+  if (root == NO_ENTRY || count == 0) return;
+
+  std::priority_queue<Candidate, vector<Candidate>, Farther> queue;
+  queue.push({distance(point, entries[root].box), root, false});
+  while (!queue.empty() && items.size() < count) {
+    const Candidate candidate(queue.top());
+    queue.pop();
+    if (candidate.exact) {
+      items.push_back(candidate.index);
+      continue;
+    }
+
+    const Entry& entry(entries[candidate.index]);
+    if (isLeaf(candidate.index)) {
+      queue.push({itemDistance(entry.item), entry.item, true});
+    } else {
+      queue.push({distance(point, entries[entry.left].box), entry.left, false});
+      queue.push({distance(point, entries[entry.right].box), entry.right, false});
+    }
+  }
+}
+
+unsigned Bvh::allocate() {
+  if (freeEntries.empty()) {
+    entries.push_back(Entry());
+    return entries.size() - 1;
+  }
+  const unsigned entry(freeEntries.back());
+  freeEntries.pop_back();
+  return entry;
+}
+
+void Bvh::release(unsigned entry) { freeEntries.push_back(entry); }
+
+/** Splits the items at the median of the widest axis of their centres */
+unsigned Bvh::buildRange(vector<std::pair<unsigned, Box>>& items, size_t begin,
+                         size_t end, unsigned parent) {
+  const unsigned entry(allocate());
+  if (end - begin == 1) {
+    entries[entry] = {items[begin].second, parent, NO_ENTRY, NO_ENTRY,
+                      items[begin].first};
+    leafOfItem[items[begin].first] = entry;
+    return entry;
+  }
+
+  Box centres{centre(items[begin].second, true), centre(items[begin].second, false),
+              centre(items[begin].second, true), centre(items[begin].second, false)};
+  for (size_t i(begin + 1); i < end; ++i) {
+    const double x(centre(items[i].second, true)), y(centre(items[i].second, false));
+    centres = merge(centres, Box{x, y, x, y});
+  }
+  const bool alongX(centres.maxX - centres.minX >= centres.maxY - centres.minY);
+
+  const size_t middle(begin + (end - begin) / 2);
+  std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+                   [alongX](const std::pair<unsigned, Box>& a,
+                            const std::pair<unsigned, Box>& b) {
+                     return centre(a.second, alongX) < centre(b.second, alongX);
+                   });
+
+  const unsigned left(buildRange(items, begin, middle, entry));
+  const unsigned right(buildRange(items, middle, end, entry));
+  entries[entry] = {merge(entries[left].box, entries[right].box), parent, left, right,
+                    NO_ENTRY};
+  return entry;
+}
+
+void Bvh::refitAncestors(unsigned entry) {
+  while (entry != NO_ENTRY) {
+    const Entry& branch(entries[entry]);
+    const Box box(merge(entries[branch.left].box, entries[branch.right].box));
+    if (equal(box, branch.box)) return;  // the ancestors are unchanged too
+    entries[entry].box = box;
+    entry = entries[entry].parent;
+  }
+}
+
+bool Bvh::isLeaf(unsigned entry) const { return entries[entry].left == NO_ENTRY; }
+
+/* === FUNCTIONS === */
+
+Box merge(const Box& boxA, const Box& boxB) {
+  return {std::min(boxA.minX, boxB.minX), std::min(boxA.minY, boxB.minY),
+          std::max(boxA.maxX, boxB.maxX), std::max(boxA.maxY, boxB.maxY)};
+}
+
+double distance(const Vec2& point, const Box& box) {
+  const double dx(std::max({box.minX - point.getX(), 0., point.getX() - box.maxX}));
+  const double dy(std::max({box.minY - point.getY(), 0., point.getY() - box.maxY}));
+  return std::sqrt(dx * dx + dy * dy);
+}
+
+Box around(const Vec2& centre, double radius) {
+  return {centre.getX() - radius, centre.getY() - radius, centre.getX() + radius,
+          centre.getY() + radius};
+}
+
+}  // namespace spatial
+
+namespace {
+
+unsigned long long key(long long column, long long row) {
+  return (static_cast<unsigned long long>(column + KEY_OFFSET) << KEY_SHIFT) |
+         static_cast<unsigned long long>(row + KEY_OFFSET);
+}
+
+long long column(unsigned long long cellKey) {
+  return static_cast<long long>(cellKey >> KEY_SHIFT) - KEY_OFFSET;
+}
+
+long long row(unsigned long long cellKey) {
+  return static_cast<long long>(cellKey & KEY_MASK) - KEY_OFFSET;
+}
+
+bool Farther::operator()(const Candidate& a, const Candidate& b) const {
+  if (a.distance != b.distance) return a.distance > b.distance;
+  if (a.exact != b.exact) return a.exact;
+  return a.index > b.index;
+}
+
+bool overlaps(const spatial::Box& boxA, const spatial::Box& boxB) {
+  return boxA.minX <= boxB.maxX && boxB.minX <= boxA.maxX && boxA.minY <= boxB.maxY &&
+         boxB.minY <= boxA.maxY;
+}
+
+bool equal(const spatial::Box& boxA, const spatial::Box& boxB) {
+  return boxA.minX == boxB.minX && boxA.minY == boxB.minY && boxA.maxX == boxB.maxX &&
+         boxA.maxY == boxB.maxY;
+}
+
+double cost(const spatial::Box& box) {
+  return (box.maxX - box.minX) + (box.maxY - box.minY);
+}
+
+double centre(const spatial::Box& box, bool alongX) {
+  return alongX ? (box.minX + box.maxX) * HALF : (box.minY + box.maxY) * HALF;
+}
+
+/** Identifies a link regardless of the order of its uids */
+unsigned long long linkKey(unsigned uid0, unsigned uid1) {
+  return (static_cast<unsigned long long>(std::min(uid0, uid1)) << KEY_SHIFT) |
+         std::max(uid0, uid1);
+}
+
+}  // namespace
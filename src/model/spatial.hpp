@@ -0,0 +1,192 @@
+// archipelago v3.0.0 - architecture b2
+// spatial.hpp - spatial indexing of town members
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_SPATIAL_H
+#define MODEL_SPATIAL_H
+
+#include <functional>  // function
+#include <unordered_map>
+#include <utility>  // pair
+#include <vector>
+
+#include "tools.hpp"
+
+namespace spatial {
+
+/* === DEFINITIONS === */
+
+/** An axis-aligned bounding box */
+struct Box {
+  double minX;
+  double minY;
+  double maxX;
+  double maxY;
+};
+
+/* === CLASSES === */
+
+/**
+ * A uniform grid of square cells, each cell lists the items whose bounding box
+ * overlaps it. Items are identified by an index chosen by the caller, and are only
+ * candidates: the caller still needs to test the exact geometry.
+ *
+ * Only the occupied cells are stored, a query never visits more cells than there
+ * are occupied cells. Items that would span too many cells are kept aside and are
+ * candidates of every query.
+ */
+class Grid {
+ public:
+  Grid() = delete;
+  explicit Grid(double cellSize);
+
+  double getCellSize() const;
+
+  /** Adds an item to every cell that its box overlaps */
+  void insert(unsigned item, const Box& box);
+  /** Removes an item, the box must be the one it was inserted with */
+  void remove(unsigned item, const Box& box);
+  /** Adds an item to every cell that a segment crosses */
+  void insert(unsigned item, const tools::Vec2& pointA, const tools::Vec2& pointB);
+  /** Removes an item, the segment must be the one it was inserted with */
+  void remove(unsigned item, const tools::Vec2& pointA, const tools::Vec2& pointB);
+
+  /** Replaces items with the sorted items whose box may overlap the given box */
+  void query(const Box& box, std::vector<unsigned>& items) const;
+  /** Replaces items with the sorted items whose box may be crossed by a segment */
+  void query(const tools::Vec2& pointA, const tools::Vec2& pointB,
+             std::vector<unsigned>& items) const;
+
+ private:
+  double cellSize;
+  std::unordered_map<unsigned long long, std::vector<unsigned>> cells;
+  std::vector<unsigned> oversized;
+
+  long long cell(double coordinate) const;
+  /** The number of cells that a box overlaps */
+  double cellsOverlapped(const Box& box) const;
+  /** An upper bound of the number of cells that a segment crosses */
+  double cellsCrossed(const tools::Vec2& pointA, const tools::Vec2& pointB) const;
+  void columnRange(const tools::Vec2& pointA, const tools::Vec2& pointB,
+                   long long column, long long& first, long long& last) const;
+  void collect(unsigned long long key, std::vector<unsigned>& items) const;
+  void erase(unsigned long long key, unsigned item);
+  void eraseOversized(unsigned item);
+};
+
+/**
+ * A grid of the links of a town, identified by the uids of their ends rather than
+ * by their position in the town, which changes when a link is removed.
+ */
+class LinkGrid {
+ public:
+  LinkGrid() = delete;
+  explicit LinkGrid(double cellSize);
+
+  /** Adds the segment of a link between two uids */
+  void insert(unsigned uid0, unsigned uid1, const tools::Vec2& pointA,
+              const tools::Vec2& pointB);
+  /** Removes a link, the segment must be the one it was inserted with */
+  void remove(unsigned uid0, unsigned uid1, const tools::Vec2& pointA,
+              const tools::Vec2& pointB);
+  /** Removes every link */
+  void clear();
+
+  /**
+   * Replaces links with the (smallest, largest) uids of the links that may cross a
+   * segment, sorted
+   */
+  void query(const tools::Vec2& pointA, const tools::Vec2& pointB,
+             std::vector<std::pair<unsigned, unsigned>>& links) const;
+  /** Same as above, for the links that may overlap a box */
+  void query(const Box& box, std::vector<std::pair<unsigned, unsigned>>& links) const;
+
+ private:
+  Grid grid;
+  /** The uids of the link in each slot, free slots are reused */
+  std::vector<std::pair<unsigned, unsigned>> slots;
+  std::vector<unsigned> freeSlots;
+  std::unordered_map<unsigned long long, unsigned> slotOfLink;
+
+  void toLinks(const std::vector<unsigned>& candidates,
+               std::vector<std::pair<unsigned, unsigned>>& links) const;
+};
+
+/**
+ * A bounding volume hierarchy, a binary tree of boxes in which each branch bounds
+ * its two children and each leaf holds one item. Unlike a grid, it adapts to items
+ * of any size and density, a query only descends into the branches it overlaps.
+ *
+ * Bulk loading splits the items at the median of their widest axis. A single
+ * insertion picks the sibling whose box grows the least, and a changed item only
+ * refits the boxes of its ancestors, the shape of the tree is kept.
+ */
+class Bvh {
+ public:
+  Bvh();
+
+  /** The distance from the point of a query to an item, at least that to its box */
+  typedef std::function<double(unsigned item)> Distance;
+
+  /** Replaces every item with the given ones, building a balanced tree */
+  void build(const std::vector<std::pair<unsigned, Box>>& items);
+  /** Adds an item, which must not be in the tree already */
+  void insert(unsigned item, const Box& box);
+  /** Removes an item, if it is in the tree */
+  void remove(unsigned item);
+  /** Changes the box of an item that is in the tree */
+  void refit(unsigned item, const Box& box);
+  /** Removes every item */
+  void clear();
+
+  size_t size() const;
+
+  /** Replaces items with the sorted items whose box overlaps the given box */
+  void query(const Box& box, std::vector<unsigned>& items) const;
+  /** Replaces items with the sorted items whose box contains a point */
+  void query(const tools::Vec2& point, std::vector<unsigned>& items) const;
+  /**
+   * Replaces items with the count items nearest to a point, nearest first. Items at
+   * the same distance are ordered by item.
+   */
+  void nearest(const tools::Vec2& point, unsigned count, const Distance& itemDistance,
+               std::vector<unsigned>& items) const;
+
+ private:
+  /** A branch bounds its children, a leaf (without children) holds an item */
+  struct Entry {
+    Box box;
+    unsigned parent;
+    unsigned left;
+    unsigned right;
+    unsigned item;
+  };
+
+  std::vector<Entry> entries;
+  std::vector<unsigned> freeEntries;
+  unsigned root;
+  std::unordered_map<unsigned, unsigned> leafOfItem;
+
+  unsigned allocate();
+  void release(unsigned entry);
+  unsigned buildRange(std::vector<std::pair<unsigned, Box>>& items, size_t begin,
+                      size_t end, unsigned parent);
+  /** Recomputes the boxes from an entry up to the root */
+  void refitAncestors(unsigned entry);
+  bool isLeaf(unsigned entry) const;
+};
+
+/* === FUNCTIONS === */
+
+/** The smallest box that contains both boxes */
+Box merge(const Box& boxA, const Box& boxB);
+
+/** The distance from a point to a box, zero inside */
+double distance(const tools::Vec2& point, const Box& box);
+
+/** The bounding box of a circle */
+Box around(const tools::Vec2& centre, double radius);
+
+}  // namespace spatial
+
+#endif
@@ -4,11 +4,116 @@
 
 #include "tools.hpp"
 
-#include <algorithm>  // min()
-#include <cmath>      // pow(), sqrt()
+#include <algorithm>  // min(), max(), minmax()
+#include <cmath>      // pow(), sqrt(), fabs(), fma()
+#include <iterator>   // next(), prev()
+#include <limits>     // infinity()
+#include <queue>      // priority_queue
+#include <set>        // set, multiset
 #include <sstream>    // double formatting
 #include <string>     // toString()
 
+using std::pair;
+using std::vector;
+
+namespace {
+
+constexpr unsigned NB_ENDS(2);  // ends of a segment
+
+/**
+ * Relative bound of the rounding error of a predicate evaluated in double precision,
+ * compared to the sum of the magnitudes of its terms. A few times the error of the
+ * longest chain of roundings of any predicate, the exact sign is computed below it.
+ */
+constexpr double FILTER_BOUND(8 * std::numeric_limits<double>::epsilon());
+
+/** A number as the exact sum of its terms, see sign() */
+typedef vector<double> Terms;
+
+/** Adjacent segments of the status that may cross, once the sweep passes x */
+struct Check {
+  double x;
+  unsigned lower;
+  unsigned upper;
+};
+
+/** Makes the priority queue return the leftmost check first */
+struct LaterCheck {
+  bool operator()(const Check& check0, const Check& check1) const;
+};
+
+/**
+ * A Bentley-Ottmann sweep from left to right, which stops at each abscissa of an
+ * endpoint. The status holds slots sorted by the height of their segment just right
+ * of the sweep line, two crossing segments exchange their slots rather than being
+ * reinserted. The order is only ever decided by exact predicates, so that the slots
+ * stay sorted and every insertion agrees with the order of the set.
+ *
+ * Before the sweep line moves to the next abscissa, the adjacent segments that
+ * cross before it exchange their slots, each exchange reporting a pair. The checks
+ * of adjacent segments are queued by a lower bound of their crossing, an estimate
+ * that is verified exactly. Vertical segments and single points never enter the
+ * status, they are compared to the segments around them on the sweep line.
+ */
+class Sweep {
+ public:
+  Sweep() = delete;
+  explicit Sweep(const vector<tools::Segment>& segments);
+
+  vector<pair<unsigned, unsigned>> run();
+
+ private:
+  struct Below {
+    const Sweep* sweep;
+    bool operator()(unsigned slot0, unsigned slot1) const;
+  };
+  typedef std::multiset<unsigned, Below> Status;
+
+  const vector<tools::Segment>& segments;
+  vector<tools::Vec2> lefts;
+  vector<tools::Vec2> rights;
+  vector<unsigned> slotSegments;
+  vector<unsigned> segmentSlots;
+  vector<Status::iterator> positions;
+  vector<bool> active;
+  Status status;
+  std::priority_queue<Check, vector<Check>, LaterCheck> checks;
+  std::set<pair<unsigned, unsigned>> scheduled;
+  std::set<pair<unsigned, unsigned>> crossings;
+  double sweepX;
+  /** The slot looked up by a height, see probeY */
+  unsigned probe;
+  double probeY;
+
+  bool isVertical(unsigned segment) const;
+  int compare(unsigned segment0, unsigned segment1, double x) const;
+  double crossingBound(unsigned lower, unsigned upper, double end) const;
+  void advance();
+  void start(unsigned segment);
+  void finish(unsigned segment);
+  void crossVerticals(vector<unsigned>& verticals);
+  void neighbours(Status::iterator lower);
+  void touching(Status::iterator position);
+  void report(unsigned segment0, unsigned segment1);
+};
+
+double cross(const tools::Vec2& vector0, const tools::Vec2& vector1);
+int orientation(const tools::Vec2& pointA, const tools::Vec2& pointB,
+                const tools::Vec2& pointC);
+int slopeOrder(const tools::Vec2& left0, const tools::Vec2& right0,
+               const tools::Vec2& left1, const tools::Vec2& right1);
+int heightOrder(const tools::Vec2& left0, const tools::Vec2& right0,
+                const tools::Vec2& left1, const tools::Vec2& right1, double x);
+Terms difference(double minuend, double subtrahend);
+Terms product(const Terms& terms0, const Terms& terms1);
+Terms negated(Terms terms);
+Terms operator+(Terms terms0, const Terms& terms1);
+int sign(const Terms& terms);
+bool withinBounds(const tools::Vec2& point, const tools::Segment& segment);
+pair<unsigned, unsigned> orderedPair(unsigned index0, unsigned index1);
+
+}  // namespace
+
 namespace tools {
 
 constexpr int INVERSE_FACTOR(-2);
@@ -128,4 +233,438 @@ double minPointSegmentDistance(const Vec2& point, const Vec2& segmentA,
   return std::min(vecAP.norm(), vecBP.norm());
 }
 
+bool segmentsIntersect(const Segment& segment0, const Segment& segment1) {
+  const int side0(orientation(segment0.pointA, segment0.pointB, segment1.pointA));
+  const int side1(orientation(segment0.pointA, segment0.pointB, segment1.pointB));
+  const int side2(orientation(segment1.pointA, segment1.pointB, segment0.pointA));
+  const int side3(orientation(segment1.pointA, segment1.pointB, segment0.pointB));
+
+  // Each segment has the ends of the other strictly on either side
+  if (side0 * side1 < 0 && side2 * side3 < 0) return true;
+
+  // Otherwise they can only meet at an end that lies on the other segment
+  return (side0 == 0 && withinBounds(segment1.pointA, segment0)) ||
+         (side1 == 0 && withinBounds(segment1.pointB, segment0)) ||
+         (side2 == 0 && withinBounds(segment0.pointA, segment1)) ||
+         (side3 == 0 && withinBounds(segment0.pointB, segment1));
+}
+
+bool segmentsCross(const Segment& segment0, const Segment& segment1) {
+  if (!segmentsIntersect(segment0, segment1)) return false;
+
+  // Segments that share an endpoint only cross if they overlap beyond it
+  const Vec2 ends0[] = {segment0.pointA, segment0.pointB};
+  const Vec2 ends1[] = {segment1.pointA, segment1.pointB};
+  for (unsigned i(0); i < NB_ENDS; ++i) {
+    for (unsigned j(0); j < NB_ENDS; ++j) {
+      if (ends0[i].getX() != ends1[j].getX() || ends0[i].getY() != ends1[j].getY())
+        continue;
+      const Vec2 direction0(ends0[1 - i] - ends0[i]);
+      const Vec2 direction1(ends1[1 - j] - ends1[j]);
+      return orientation(ends0[i], ends0[1 - i], ends1[1 - j]) == 0 &&
+             direction0 * direction1 > 0;
+    }
+  }
+  return true;
+}
+
+vector<pair<unsigned, unsigned>> findCrossings(const vector<Segment>& segments) {
+  return Sweep(segments).run();
+}
+
 }  // namespace tools
+
+namespace {
+
+bool LaterCheck::operator()(const Check& check0, const Check& check1) const {
+  return check0.x > check1.x;
+}
+
+Sweep::Sweep(const vector<tools::Segment>& segments)
+    : segments(segments),
+      status(Below{this}),
+      sweepX(0.),
+      probe(segments.size()),
+      probeY(0.) {
+  for (unsigned i(0); i < segments.size(); ++i) {
+    tools::Vec2 left(segments[i].pointA), right(segments[i].pointB);
+    if (right.getX() < left.getX() ||
+        (right.getX() == left.getX() && right.getY() < left.getY()))
+      std::swap(left, right);
+
+    lefts.push_back(left);
+    rights.push_back(right);
+    slotSegments.push_back(i);
+    segmentSlots.push_back(i);
+  }
+  positions.resize(segments.size(), status.end());
+  active.resize(segments.size(), false);
+}
+
+vector<pair<unsigned, unsigned>> Sweep::run() {
+  // Segments by their left then their right abscissa, a vertical one only once
+  vector<pair<double, unsigned>> starts, ends;
+  for (unsigned i(0); i < segments.size(); ++i) {
+    starts.push_back({lefts[i].getX(), i});
+    if (!isVertical(i)) ends.push_back({rights[i].getX(), i});
+  }
+  std::sort(starts.begin(), starts.end());
+  std::sort(ends.begin(), ends.end());
+
+  vector<unsigned> verticals;
+  size_t nextStart(0), nextEnd(0);
+  while (nextEnd < ends.size() || nextStart < starts.size()) {
+    sweepX = nextStart == starts.size() ? ends[nextEnd].first
+             : nextEnd == ends.size()   ? starts[nextStart].first
+                 : std::min(starts[nextStart].first, ends[nextEnd].first);
+    advance();
+
+    // Segments that end here are still on the sweep line for those that start here
+    verticals.clear();
+    for (; nextStart < starts.size(); ++nextStart) {
+      if (starts[nextStart].first != sweepX) break;
+      const unsigned segment(starts[nextStart].second);
+      if (isVertical(segment)) {
+        verticals.push_back(segment);
+      } else {
+        start(segment);
+      }
+    }
+    crossVerticals(verticals);
+    for (; nextEnd < ends.size() && ends[nextEnd].first == sweepX; ++nextEnd)
+      finish(ends[nextEnd].second);
+  }
+  return vector<pair<unsigned, unsigned>>(crossings.begin(), crossings.end());
+}
+
+bool Sweep::Below::operator()(unsigned slot0, unsigned slot1) const {
+  const tools::Vec2 probe(sweep->sweepX, sweep->probeY);
+  if (slot0 == sweep->probe) {
+    const unsigned segment(sweep->slotSegments[slot1]);
+    return orientation(sweep->lefts[segment], sweep->rights[segment], probe) < 0;
+  }
+  if (slot1 == sweep->probe) {
+    const unsigned segment(sweep->slotSegments[slot0]);
+    return orientation(sweep->lefts[segment], sweep->rights[segment], probe) > 0;
+  }
+  return sweep->compare(sweep->slotSegments[slot0], sweep->slotSegments[slot1],
+                        sweep->sweepX) < 0;
+}
+
+bool Sweep::isVertical(unsigned segment) const {
+  return lefts[segment].getX() == rights[segment].getX();
+}
+
+/**
+ * The order of two segments just right of a vertical line, -1 if the first one is
+ * below. Segments that meet on the line are ordered as they leave it, and segments
+ * that overlap by their index.
+ */
+int Sweep::compare(unsigned segment0, unsigned segment1, double x) const {
+  if (segment0 == segment1) return 0;
+  int order(heightOrder(lefts[segment0], rights[segment0], lefts[segment1],
+                        rights[segment1], x));
+  if (order == 0)
+    order = slopeOrder(lefts[segment0], rights[segment0], lefts[segment1],
+                       rights[segment1]);
+  if (order == 0) order = segment0 < segment1 ? -1 : 1;
+  return order;
+}
+
+/**
+ * An abscissa before which the lower segment stays below the upper one, which is
+ * above it at the given end. The rounded crossing is moved left until it is
+ * verified, it is never left of the sweep line.
+ */
+double Sweep::crossingBound(unsigned lower, unsigned upper, double end) const {
+  const tools::Vec2 direction0(rights[lower] - lefts[lower]);
+  const tools::Vec2 direction1(rights[upper] - lefts[upper]);
+  const double factor(cross(lefts[upper] - lefts[lower], direction1) /
+                      cross(direction0, direction1));
+  const double estimate(lefts[lower].getX() + factor * direction0.getX());
+  if (!(estimate > sweepX)) return sweepX;  // also catches NaN
+
+  double x(std::min(estimate, end));
+  double step(std::max(std::fabs(x), std::fabs(sweepX)) *
+              std::numeric_limits<double>::epsilon());
+  while (x > sweepX && compare(lower, upper, x) > 0) {
+    x -= step;
+    step *= 2;
+  }
+  return std::max(x, sweepX);
+}
+
+/** Exchanges the slots of the adjacent segments that cross before the sweep line */
+void Sweep::advance() {
+  vector<Check> deferred;
+  while (!checks.empty() && checks.top().x < sweepX) {
+    const Check check(checks.top());
+    checks.pop();
+
+    const pair<unsigned, unsigned> key(orderedPair(check.lower, check.upper));
+    if (!active[check.lower] || !active[check.upper]) {
+      scheduled.erase(key);
+      continue;
+    }
+    Status::iterator lower(positions[segmentSlots[check.lower]]);
+    Status::iterator upper(positions[segmentSlots[check.upper]]);
+    if (std::next(upper) == lower) std::swap(lower, upper);
+    if (std::next(lower) != upper) {
+      scheduled.erase(key);
+      continue;
+    }
+
+    // The rounded bound was too low, the crossing is right of the sweep line
+    const unsigned segment0(slotSegments[*lower]), segment1(slotSegments[*upper]);
+    if (compare(segment0, segment1, sweepX) < 0) {
+      deferred.push_back({sweepX, segment0, segment1});
+      continue;
+    }
+
+    scheduled.erase(key);
+    report(segment0, segment1);
+    slotSegments[*lower] = segment1;
+    slotSegments[*upper] = segment0;
+    segmentSlots[segment1] = *lower;
+    segmentSlots[segment0] = *upper;
+
+    if (lower != status.begin()) neighbours(std::prev(lower));
+    neighbours(upper);
+  }
+  for (const auto& check : deferred) checks.push(check);
+}
+
+void Sweep::start(unsigned segment) {
+  const unsigned slot(segmentSlots[segment]);
+  const Status::iterator position(status.insert(slot));
+  positions[slot] = position;
+  active[segment] = true;
+
+  touching(position);
+  if (position != status.begin()) neighbours(std::prev(position));
+  neighbours(position);
+}
+
+void Sweep::finish(unsigned segment) {
+  const Status::iterator position(positions[segmentSlots[segment]]);
+  const bool hasLower(position != status.begin());
+  const Status::iterator lower(hasLower ? std::prev(position) : status.end());
+
+  status.erase(position);
+  active[segment] = false;
+  if (hasLower) neighbours(lower);
+}
+
+/**
+ * Reports the segments on the sweep line within the extent of each vertical segment
+ * or single point on it, then the vertical segments that overlap each other.
+ */
+void Sweep::crossVerticals(vector<unsigned>& verticals) {
+  for (const auto& vertical : verticals) {
+    probeY = lefts[vertical].getY();
+    const tools::Vec2 top(rights[vertical]);
+    for (auto it(status.lower_bound(probe)); it != status.end(); ++it) {
+      const unsigned segment(slotSegments[*it]);
+      if (orientation(lefts[segment], rights[segment], top) < 0) break;
+      report(vertical, segment);
+    }
+  }
+
+  std::sort(verticals.begin(), verticals.end(),
+            [this](unsigned lower, unsigned upper) {
+              return lefts[lower].getY() < lefts[upper].getY();
+            });
+  for (auto it(verticals.begin()); it != verticals.end(); ++it) {
+    for (auto other(std::next(it)); other != verticals.end(); ++other) {
+      if (lefts[*other].getY() > rights[*it].getY()) break;
+      report(*it, *other);
+    }
+  }
+}
+
+/** Queues a check of a segment and the next one, if they cross later on */
+void Sweep::neighbours(Status::iterator lower) {
+  const Status::iterator upper(std::next(lower));
+  if (upper == status.end()) return;
+
+  const unsigned segment0(slotSegments[*lower]), segment1(slotSegments[*upper]);
+  const double end(std::min(rights[segment0].getX(), rights[segment1].getX()));
+  double x(-std::numeric_limits<double>::infinity());  // crossed already, if inverted
+  if (compare(segment0, segment1, sweepX) < 0) {
+    if (compare(segment0, segment1, end) < 0) return;
+    x = crossingBound(segment0, segment1, end);
+  }
+  if (scheduled.insert(orderedPair(segment0, segment1)).second)
+    checks.push({x, segment0, segment1});
+}
+
+/**
+ * Reports the segments around a position that pass through the left end of its
+ * segment, they are next to each other on the sweep line.
+ */
+void Sweep::touching(Status::iterator position) {
+  const unsigned segment(slotSegments[*position]);
+  const tools::Vec2& point(lefts[segment]);
+
+  for (auto it(position); it != status.begin();) {
+    const unsigned other(slotSegments[*--it]);
+    if (orientation(lefts[other], rights[other], point) != 0) break;
+    report(segment, other);
+  }
+  for (auto it(std::next(position)); it != status.end(); ++it) {
+    const unsigned other(slotSegments[*it]);
+    if (orientation(lefts[other], rights[other], point) != 0) break;
+    report(segment, other);
+  }
+}
+
+void Sweep::report(unsigned segment0, unsigned segment1) {
+  const pair<unsigned, unsigned> key(orderedPair(segment0, segment1));
+  if (crossings.count(key) == 0 &&
+      tools::segmentsCross(segments[segment0], segments[segment1]))
+    crossings.insert(key);
+}
+
+double cross(const tools::Vec2& vector0, const tools::Vec2& vector1) {
+  return vector0.getX() * vector1.getY() - vector0.getY() * vector1.getX();
+}
+
+/* == Exact predicates == */
+
+/** The side of the line AB on which C lies, 0 if on the line */
+int orientation(const tools::Vec2& pointA, const tools::Vec2& pointB,
+                const tools::Vec2& pointC) {
+  const double left((pointB.getX() - pointA.getX()) *
+                    (pointC.getY() - pointA.getY()));
+  const double right((pointB.getY() - pointA.getY()) *
+                     (pointC.getX() - pointA.getX()));
+  const double bound(FILTER_BOUND * (std::fabs(left) + std::fabs(right)));
+  if (left - right > bound) return 1;
+  if (right - left > bound) return -1;
+
+  return sign(product(difference(pointB.getX(), pointA.getX()),
+                      difference(pointC.getY(), pointA.getY())) +
+              negated(product(difference(pointB.getY(), pointA.getY()),
+                              difference(pointC.getX(), pointA.getX()))));
+}
+
+/** Compares the slopes of two segments that are not vertical, given left to right */
+int slopeOrder(const tools::Vec2& left0, const tools::Vec2& right0,
+               const tools::Vec2& left1, const tools::Vec2& right1) {
+  const double steep((right0.getY() - left0.getY()) * (right1.getX() - left1.getX()));
+  const double flat((right1.getY() - left1.getY()) * (right0.getX() - left0.getX()));
+  const double bound(FILTER_BOUND * (std::fabs(steep) + std::fabs(flat)));
+  if (steep - flat > bound) return 1;
+  if (flat - steep > bound) return -1;
+
+  return sign(product(difference(right0.getY(), left0.getY()),
+                      difference(right1.getX(), left1.getX())) +
+              negated(product(difference(right1.getY(), left1.getY()),
+                              difference(right0.getX(), left0.getX()))));
+}
+
+/**
+ * Compares the heights of two segments that are not vertical at an abscissa within
+ * both. A height scaled by the width of its segment is the weighted mean of the
+ * heights of its ends, each weighted by the distance of the abscissa to the other.
+ */
+int heightOrder(const tools::Vec2& left0, const tools::Vec2& right0,
+                const tools::Vec2& left1, const tools::Vec2& right1, double x) {
+  const double width0(right0.getX() - left0.getX());
+  const double width1(right1.getX() - left1.getX());
+  const double weights0[] = {right0.getX() - x, x - left0.getX()};
+  const double weights1[] = {right1.getX() - x, x - left1.getX()};
+  const double high(
+      (left0.getY() * weights0[0] + right0.getY() * weights0[1]) * width1);
+  const double low(
+      (left1.getY() * weights1[0] + right1.getY() * weights1[1]) * width0);
+  const double magnitude0(std::fabs(left0.getY() * weights0[0]) +
+                          std::fabs(right0.getY() * weights0[1]));
+  const double magnitude1(std::fabs(left1.getY() * weights1[0]) +
+                          std::fabs(right1.getY() * weights1[1]));
+  const double magnitude(magnitude0 * std::fabs(width1) +
+                         magnitude1 * std::fabs(width0));
+  const double bound(FILTER_BOUND * magnitude);
+  if (high - low > bound) return 1;
+  if (low - high > bound) return -1;
+
+  const Terms height0(product({left0.getY()}, difference(right0.getX(), x)) +
+                      product({right0.getY()}, difference(x, left0.getX())));
+  const Terms height1(product({left1.getY()}, difference(right1.getX(), x)) +
+                      product({right1.getY()}, difference(x, left1.getX())));
+  return sign(product(height0, difference(right1.getX(), left1.getX())) +
+              negated(product(height1, difference(right0.getX(), left0.getX()))));
+}
+
+/** The exact difference of two numbers, its rounding and the rounding error */
+Terms difference(double minuend, double subtrahend) {
+  const double rounded(minuend - subtrahend);
+  const double subtrahendPart(minuend - rounded);
+  const double minuendPart(rounded + subtrahendPart);
+  return {rounded,
+          (minuend - minuendPart) + (subtrahendPart - subtrahend)};
+}
+
+/** The exact product, each product of terms is split into its rounding and error */
+Terms product(const Terms& terms0, const Terms& terms1) {
+  Terms result;
+  result.reserve(NB_ENDS * terms0.size() * terms1.size());
+  for (const auto& term0 : terms0) {
+    for (const auto& term1 : terms1) {
+      const double rounded(term0 * term1);
+      result.push_back(rounded);
+      result.push_back(std::fma(term0, term1, -rounded));
+    }
+  }
+  return result;
+}
+
+Terms negated(Terms terms) {
+  for (auto& term : terms) term = -term;
+  return terms;
+}
+
+Terms operator+(Terms terms0, const Terms& terms1) {
+  terms0.insert(terms0.end(), terms1.begin(), terms1.end());
+  return terms0;
+}
+
+/**
+ * The sign of the exact sum of the terms. They are added one by one into an
+ * expansion, the exact sum of components that do not overlap by increasing
+ * magnitude, whose sign is that of its largest component (see Shewchuk, "Adaptive
+ * Precision Floating-Point Arithmetic and Fast Robust Geometric Predicates").
+ */
+int sign(const Terms& terms) {
+  Terms expansion, grown;
+  for (const auto& term : terms) {
+    grown.clear();
+    double sum(term);
+    for (const auto& component : expansion) {
+      const double rounded(sum + component);
+      const double componentPart(rounded - sum);
+      const double sumPart(rounded - componentPart);
+      const double error((sum - sumPart) + (component - componentPart));
+      if (error != 0.) grown.push_back(error);
+      sum = rounded;
+    }
+    if (sum != 0.) grown.push_back(sum);
+    expansion.swap(grown);
+  }
+  if (expansion.empty()) return 0;
+  return expansion.back() > 0. ? 1 : -1;
+}
+
+/** Whether a point collinear with a segment lies within its extent */
+bool withinBounds(const tools::Vec2& point, const tools::Segment& segment) {
+  return point.getX() >= std::min(segment.pointA.getX(), segment.pointB.getX()) &&
+         point.getX() <= std::max(segment.pointA.getX(), segment.pointB.getX()) &&
+         point.getY() >= std::min(segment.pointA.getY(), segment.pointB.getY()) &&
+         point.getY() <= std::max(segment.pointA.getY(), segment.pointB.getY());
+}
+
+pair<unsigned, unsigned> orderedPair(unsigned index0, unsigned index1) {
+  return std::minmax(index0, index1);
+}
+
+}  // namespace
@@ -6,6 +6,8 @@
 #define MODEL_TOOLS_H
 
 #include <iostream>  // operator<< overloading
+#include <utility>   // pair
+#include <vector>
 
 namespace tools {
 
@@ -57,6 +59,12 @@ Vec2 operator*(const Vec2 vector, const double& factor);
 double operator*(const Vec2 vector1, const Vec2& vector2);
 std::ostream& operator<<(std::ostream& stream, const Vec2& vector);
 
+/** A straight segment between two points */
+struct Segment {
+  Vec2 pointA;
+  Vec2 pointB;
+};
+
 /* === RENDER HELPERS === */
 
 /** An immutable circle primitive */
@@ -129,6 +137,28 @@ double minPointLineDistance(const Vec2& point, const Vec2& lineA, const Vec2& li
 double minPointSegmentDistance(const Vec2& point, const Vec2& segmentA,
                                const Vec2& segmentB);
 
+/**
+ * Whether two segments have at least one point in common, touching included. The
+ * sides of the points are decided exactly, without rounding.
+ */
+bool segmentsIntersect(const Segment& segment0, const Segment& segment1);
+
+/**
+ * Whether two segments intersect anywhere else than at an endpoint that they share,
+ * such as two links of the same node.
+ */
+bool segmentsCross(const Segment& segment0, const Segment& segment1);
+
+/**
+ * Finds every pair of crossing segments (see segmentsCross) with a Bentley-Ottmann
+ * sweep, in O((n + k) log n) for n segments and k reported pairs. The sweep orders
+ * its segments with the same exact predicates, so it reports the same pairs as
+ * segmentsCross() on every pair. Pairs are sorted and hold the segment indices,
+ * the smaller index first.
+ */
+std::vector<std::pair<unsigned, unsigned>> findCrossings(
+    const std::vector<Segment>& segments);
+
 }  // namespace tools
 
 #endif
@@ -4,29 +4,38 @@
 
 #include "town.hpp"
 
-#include <algorithm>  // reverse()
+#include <fcntl.h>     // open()
+#include <sys/stat.h>  // stat(), fchmod()
+#include <unistd.h>    // fsync(), unlink()
+
+#include <algorithm>  // find(), max()
 #include <array>      // inline for loop
-#include <cctype>     // isspace()
-#include <fstream>    // istream
+#include <clocale>    // localeconv()
+#include <cstdint>    // cache entry fields
+#include <cstdio>     // snprintf(), rename()
+#include <cstdlib>    // mkstemp()
+#include <fstream>
 #include <iostream>   // cerr
-#include <limits>     // numeric_limits
 #include <map>        // validation
-#include <memory>     // unique_ptr
+#include <memory>     // unique_ptr, shared_ptr
+#include <mutex>      // hierarchy construction
 #include <set>        // validation
-#include <sstream>    // stringstream
 #include <string>
 #include <vector>
 
+#include "cache.hpp"
 #include "constants.hpp"
 #include "error.hpp"
+#include "metrics.hpp"
 #include "node.hpp"
+#include "parser.hpp"
 #include "tools.hpp"
+#include "trace.hpp"
 
 /* Select a few reused imports to help alleviate the syntax */
 using node::Link;
 using node::Node;
 using node::NodeType;
-using std::istream;
 using std::map;
 using std::ostream;
 using std::set;
@@ -42,71 +51,143 @@ namespace {
 
 constexpr char COMMENT_DELIMITER('#');
 constexpr int NB_LINK_UIDS(2);   // number of UIDs in a Link
-constexpr double ZERO_TIME(0.);  // an absence of time
-constexpr int LINE_START(0);     // beginning of a line
+
+constexpr size_t WRITE_BUFFER_SIZE(1 << 20);  // bytes handed to the stream at once
+constexpr unsigned MAX_NUMBER_LENGTH(32);     // formatted number, %g or 64-bit int
+constexpr unsigned DECIMAL_BASE(10);
+
+constexpr char HIERARCHY_EXTENSION[](".ch");  // appended to the town file name
+constexpr char TEMPORARY_SUFFIX[](".tmp.XXXXXX");  // a town file being saved
+constexpr mode_t FILE_MODE(0644);  // a new town file, mkstemp() creates 0600
+constexpr char CACHE_MAGIC[]("ARCHTC01");      // a cached town and its statistics
+constexpr unsigned MAGIC_LENGTH(8);
+constexpr unsigned long long FNV_OFFSET(14695981039346656037ULL);
+constexpr unsigned long long FNV_PRIME(1099511628211ULL);
+
+constexpr double LINK_CELL_SIZE(50.);  // a town spans a few dozen cells of links
+constexpr double NODE_CELL_SIZE(50.);  // a few nodes of the minimum capacity
 
 typedef vector<Node> Nodes;
 typedef vector<Link> Links;
+typedef vector<validation::NodeRecord> NodeRecords;
+typedef vector<validation::LinkRecord> LinkRecords;
 
-/** Represents a node in the Dijkstra algorithm graph */
-struct DijkstraNode {
-  bool visited;
-  double distance;
-  unsigned parent;
-};
+/** Held while any town builds its contraction hierarchy, so each is built once */
+std::mutex hierarchyMutex;
 
-/** A graph of UIDs and nodes */
-typedef map<unsigned, DijkstraNode> DijkstraGraph;
+spatial::Box boundsOf(const Node& node);
 
-Town parseTown(istream& stream);
-void parseNodes(istream& stream, Nodes& nodes, NodeType type);
-void parseLinks(istream& stream, Links& links);
+NodeRecords toRecords(const Nodes& nodes);
+LinkRecords toRecords(const Links& links);
 
-std::stringstream getNextLine(istream& stream);
-unsigned readUnsigned(istream& stream);
-unsigned long long readLongUnsigned(istream& stream);
-double readDouble(istream& stream);
+bool readFile(const string& path, string& contents);
+bool syncFile(const string& path);
+/**
+ * Creates a file of a unique name next to the path, with the mode of the file that
+ * it replaces. Returns its name, empty if it could not be created.
+ */
+string createTemporary(const string& path);
 
-void writeTown(ostream& stream, const Town& town);
+/**
+ * A reusable output buffer that formats numbers in place and hands large blocks
+ * to the underlying stream, instead of flushing and allocating for every line.
+ */
+class Writer {
+ public:
+  Writer() = delete;
+  Writer(ostream& stream);
+  ~Writer();
+
+  void write(char character);
+  void write(const char* text);
+  void write(unsigned long long value);
+  void write(double value);
+
+  /** Hand the buffered bytes over to the stream */
+  void flush();
+
+ private:
+  ostream& stream;
+  vector<char> buffer;
+  size_t size;
+  char decimalPoint;
+
+  /** Flush the buffer if there is not enough room for the given length */
+  void reserve(size_t length);
+};
 
-void printNodeType(ostream& stream, const Town& town, const NodeType& type);
-void printLinks(ostream& stream, const Town& town);
+void writeTown(ostream& stream, const town::Records& records);
+
+string encodeTown(const NodeRecords& nodes, const LinkRecords& links,
+                  const town::Statistics& statistics);
+bool decodeTown(const string& data, NodeRecords& nodes, LinkRecords& links,
+                town::Statistics& statistics);
+template <typename T>
+void append(string& data, const T& value);
+template <typename T>
+bool take(const string& data, size_t& position, T& value);
+unsigned long long checksum(const string& data, size_t size);
+
+void printNodeType(Writer& writer, const NodeRecords& nodes, const NodeType& type);
+void printLinks(Writer& writer, const LinkRecords& links);
 
-DijkstraGraph createDijkstraGraph(const vector<unsigned>& uids, unsigned originUid);
-double computeAccessTime(const NodeType& type0, const NodeType& type2,
-                         double distance);
-town::PathFindingResult generatePathResult(DijkstraGraph graph,
-                                           unsigned destinationUid, double distance);
-bool nextGraphNode(DijkstraGraph graph, unsigned& nextUid);
 }  // namespace
 
 namespace town {
 
 /* === CLASSES === */
 
-Town::Town(Nodes nodes, Links links) : selectedNode(NO_LINK) {
-  for (const auto& node : nodes) {
-    addNode(node);
-  }
-  for (const auto& link : links) {
-    addLink(link);
-  }
+Town::Town(Nodes nodes, Links links) : Town(toRecords(nodes), toRecords(links)) {}
+
+Town::Town(const NodeRecords& nodeRecords, const LinkRecords& linkRecords,
+           bool crossingsAllowed)
+    : crossingsAllowed(crossingsAllowed),
+      linkGrid(LINK_CELL_SIZE),
+      indicesStale(false),
+      generation(0),
+      batching(false),
+      batchSafety(DEFAULT_SAFETY) {
+  const auto violations(
+      validation::validate(nodeRecords, linkRecords, crossingsAllowed));
+  if (!violations.empty()) throw validation::message(violations.front());
+
+  insertValid(nodeRecords, linkRecords);
+}
+
+Town::Town(const NodeRecords& nodeRecords, const LinkRecords& linkRecords,
+           bool crossingsAllowed, const Statistics& cachedStatistics)
+    : crossingsAllowed(crossingsAllowed),
+      linkGrid(LINK_CELL_SIZE),
+      indicesStale(false),
+      generation(0),
+      batching(false),
+      batchSafety(DEFAULT_SAFETY) {
+  insertValid(nodeRecords, linkRecords);
+
+  Statistics current(cachedStatistics);
+  current.generation = generation;
+  statistics = std::make_shared<const Statistics>(std::move(current));
 }
 
 void Town::render(tools::RenderContext& ctx) {
+  METRICS_TIMER(RENDER);
+  TRACE_SCOPE("Town::render");
   set<unsigned> tPathNodes, pPathNodes;
 
   // Path finding calculations
   clearHighlightedNodes();
+  const unsigned selectedNode(getSelectedNode());
   if (highlightShortestPath && selectedNode != NO_LINK &&
       getNode(selectedNode)->getType() == node::HOUSING) {
-    const auto tPath(pathFind(selectedNode, node::TRANSPORT));
+    const auto paths(pathFind(selectedNode, node::TRANSPORT, node::PRODUCTION));
+    const auto& tPath(paths.first);
+    const auto& pPath(paths.second);
+
     if (tPath.success) {
       highlightNodes(*tPath.path, false);
       for (const auto& uid : *tPath.path) tPathNodes.insert(uid);
     }
 
-    const auto pPath(pathFind(selectedNode, node::PRODUCTION));
     if (pPath.success) {
       highlightNodes(*pPath.path, false);
       for (const auto& uid : *pPath.path) pPathNodes.insert(uid);
@@ -127,6 +208,7 @@ void Town::render(tools::RenderContext& ctx) {
 
     ctx.setColour(highlighted ? tools::GREEN : tools::BLACK);
     ctx.draw(tools::Line(getNode(uid0)->getPosition(), getNode(uid1)->getPosition()));
+    METRICS_COUNT(PRIMITIVES_EMITTED, 1);
   }
 
   // Render nodes, they know if they are highlighted
@@ -141,11 +223,19 @@ void Town::addNode(const Node& node, const double safetyDistance) {
   // Check if the node already is part of the town
   if (nodes.count(uid) == 1) throw error::identical_uid(node.getUid());
 
-  // Check if the new node would cause a superposition
-  checkNodeSuperposition(node, safetyDistance);
-  checkLinkSuperposition(node, safetyDistance);
+  // Check if the new node would cause a superposition, a batch checks it later
+  if (batching) {
+    logChange(ADD_NODE, node);
+    batchSafety = std::max(batchSafety, safetyDistance);
+  } else {
+    checkNodeSuperposition(node, safetyDistance);
+    checkLinkSuperposition(node, safetyDistance);
+  }
 
   nodes.emplace(uid, node);  // avoid unnecessary copies
+  nodeTree.insert(uid, boundsOf(node));
+  components.addNode(uid, node.getType());
+  ++generation;
 }
 
 const Node* Town::getNode(const unsigned uid) const {
@@ -159,9 +249,21 @@ Node* Town::getModifiableNode(const unsigned uid) {
   auto node(nodes.find(uid));
 
   if (node == nodes.end()) return nullptr;
+  if (batching) {
+    logChange(MODIFY_NODE, node->second);
+    batchSafety = std::max(batchSafety, DIST_MIN);
+  }
   return &(node->second);
 }
 
+void Town::nodeChanged(const unsigned uid) {
+  if (nodes.find(uid) == nodes.end()) return;
+  // Counted once the node holds its new value, so that nothing derived from the
+  // town in between is stamped with the new generation
+  ++generation;
+  indicesStale = true;
+}
+
 vector<unsigned> Town::getNodes() const {
   vector<unsigned> nodeUids;
   nodeUids.reserve(nodes.size());
@@ -171,41 +273,102 @@ vector<unsigned> Town::getNodes() const {
   return nodeUids;
 }
 
+const map<unsigned, Node>* Town::getNodeMap() const { return &nodes; }
+
 void Town::removeNode(unsigned uid) {
   // Efficiently delete links containing this node's uid
-  for (auto it(links.begin()); it != links.end(); ++it)
-    if (it->getUid0() == uid || it->getUid1() == uid) {
-      *it = std::move(links.back());
-      links.pop_back();
-      --it;
-    }
+  if (degree(uid) > 0) {
+    for (auto it(links.begin()); it != links.end(); ++it)
+      if (it->getUid0() == uid || it->getUid1() == uid) {
+        unindexLink(*it, nodes.at(it->getUid0()).getPosition(),
+                    nodes.at(it->getUid1()).getPosition());
+        removeNeighbours(*it);
+        if (batching) logChange(REMOVE_LINK, *it, it - links.begin(), true);
+        *it = std::move(links.back());
+        links.pop_back();
+        --it;
+      }
+  }
+
+  auto node(nodes.find(uid));
+  if (node != nodes.end()) {
+    if (batching) logChange(REMOVE_NODE, node->second);
+    nodes.erase(node);
+  }
+  selection.erase(uid);
+  nodeTree.remove(uid);
+  components.removeNode(uid);
+  ++generation;
+}
 
-  if (selectedNode == uid) selectedNode = NO_LINK;
-  nodes.erase(uid);
+void Town::removeNodes(const vector<unsigned>& uids) {
+  const set<unsigned> removed(uids.begin(), uids.end());
+
+  // A single pass over the links, which keep their order, also within a batch
+  size_t kept(0);
+  for (const auto& link : links) {
+    if (removed.count(link.getUid0()) == 0 && removed.count(link.getUid1()) == 0) {
+      links[kept++] = link;
+    } else {
+      unindexLink(link, nodes.at(link.getUid0()).getPosition(),
+                  nodes.at(link.getUid1()).getPosition());
+      removeNeighbours(link);
+      if (batching) logChange(REMOVE_LINK, link, kept);  // as if erased in turn
+    }
+  }
+  links.erase(links.begin() + kept, links.end());
+
+  for (const auto& uid : removed) {
+    auto node(nodes.find(uid));
+    if (node == nodes.end()) continue;
+    if (batching) logChange(REMOVE_NODE, node->second);
+    nodes.erase(node);
+    selection.erase(uid);
+    nodeTree.remove(uid);
+    components.removeNode(uid);
+  }
+  ++generation;
 }
 
 void Town::moveNode(unsigned uid, const tools::Vec2& newPosition) {
   auto node(nodes.find(uid));
   if (node == nodes.end()) return;
+  // The indices must hold the old position, which nodeMoved() unindexes
+  refreshIndices();
+  if (batching) {
+    const vector<Node> before{node->second};
+    node->second.setPosition(newPosition);
+    stageNodes(before);
+    return;
+  }
+
   tools::Vec2 oldPosition(node->second.getPosition());
+  vector<Link> nodeLinks;
+  for (const auto& link : links)
+    if (link.getUid0() == uid || link.getUid1() == uid) nodeLinks.push_back(link);
 
   try {
     node->second.setPosition(newPosition);
     checkNodeSuperposition(node->second, DIST_MIN);
     checkLinkSuperposition(node->second, DIST_MIN);
-    for (const auto& link : links)
-      if (link.getUid0() == uid || link.getUid1() == uid)
-        checkLinkSuperposition(link, DIST_MIN);
+    for (const auto& link : nodeLinks) checkLinkSuperposition(link, DIST_MIN);
+    for (const auto& link : nodeLinks) checkLinkCrossing(link);
 
   } catch (std::string err) {
     node->second.setPosition(oldPosition);
     throw err;
   }
+  nodeMoved(uid, oldPosition, nodeLinks);
 }
 
 void Town::resizeNode(unsigned uid, unsigned newRadius) {
+  refreshIndices();  // before the node changes, see moveNode()
   auto node(nodes.find(uid));
-  if (node != nodes.end()) {
+  if (node != nodes.end() && batching) {
+    const vector<Node> before{node->second};
+    node->second.setRadius(newRadius);
+    stageNodes(before);
+  } else if (node != nodes.end()) {
     const unsigned oldCapacity(node->second.getCapacity());
     try {
       node->second.setRadius(newRadius);
@@ -215,15 +378,46 @@ void Town::resizeNode(unsigned uid, unsigned newRadius) {
       node->second.setCapacity(oldCapacity);
       throw err;
     }
+    nodeTree.refit(uid, boundsOf(node->second));
+    ++generation;
+  }
+}
+
+void Town::moveNodes(const vector<unsigned>& uids, const Vec2& offset) {
+  refreshIndices();
+  vector<Node> before;
+  for (const auto& uid : set<unsigned>(uids.begin(), uids.end())) {
+    auto node(nodes.find(uid));
+    if (node == nodes.end()) continue;
+    before.push_back(node->second);
+    node->second.setPosition(node->second.getPosition() + offset);
+  }
+  if (batching) {
+    stageNodes(before);
+  } else {
+    commitNodes(before);
+  }
+}
+
+void Town::resizeNodes(const vector<unsigned>& uids, double radiusDifference) {
+  refreshIndices();
+  vector<Node> before;
+  for (const auto& uid : set<unsigned>(uids.begin(), uids.end())) {
+    auto node(nodes.find(uid));
+    if (node == nodes.end()) continue;
+    before.push_back(node->second);
+    node->second.setRadius(std::max(node->second.radius() + radiusDifference, 0.));
+  }
+  if (batching) {
+    stageNodes(before);
+  } else {
+    commitNodes(before);
   }
 }
 
 void Town::addLink(const Link& link, double safetyDistance) {
   // Check that the link doesn't already exist
-  for (const auto& townLink : links) {
-    if (townLink == link)
-      throw error::multiple_same_link(link.getUid0(), link.getUid1());
-  }
+  if (hasLink(link)) throw error::multiple_same_link(link.getUid0(), link.getUid1());
 
   // Check that the nodes exist
   if (nodes.count(link.getUid0()) == 0) {
@@ -236,20 +430,30 @@ void Town::addLink(const Link& link, double safetyDistance) {
   std::array<unsigned, NB_LINK_UIDS> uids{link.getUid0(), link.getUid1()};
   for (const unsigned& uid : uids) {
     if (getNode(uid)->getType() == node::HOUSING) {
-      if (getLinkedNodes(uid).size() >= MAX_LINK) throw error::max_link(uid);
+      if (degree(uid) >= MAX_LINK) throw error::max_link(uid);
     }
   }
 
-  checkLinkSuperposition(link, safetyDistance);
+  if (batching) {
+    logChange(ADD_LINK, link);
+    batchSafety = std::max(batchSafety, safetyDistance);
+  } else {
+    checkLinkSuperposition(link, safetyDistance);
+    checkLinkCrossing(link);
+  }
 
   links.push_back(link);
+  indexLink(link);
+  addNeighbours(link);
+  components.addLink(link.getUid0(), link.getUid1());
+  ++generation;
 }
 
 bool Town::hasLink(const Link& link) const {
-  for (const auto& townLink : links) {
-    if (link == townLink) return true;
-  }
-  return false;
+  auto neighbours(adjacency.find(link.getUid0()));
+  if (neighbours == adjacency.end()) return false;
+  return std::find(neighbours->second.begin(), neighbours->second.end(),
+                   link.getUid1()) != neighbours->second.end();
 }
 
 const vector<Link>* Town::getLinks() const { return &links; }
@@ -269,16 +473,114 @@ vector<unsigned> Town::getLinkedNodes(const unsigned uid) const {
 }
 
 void Town::removeLink(const Link& link) {
+  if (!hasLink(link)) return;
   auto end(links.end());
   for (auto it(links.begin()); it < end; ++it) {
     if (link == *it) {
+      const Link removed(*it);  // the given link may be an element of links
+      unindexLink(removed, getNode(removed.getUid0())->getPosition(),
+                  getNode(removed.getUid1())->getPosition());
+      removeNeighbours(removed);
+      if (batching) logChange(REMOVE_LINK, removed, it - links.begin());
       links.erase(it);
+      components.removeLink(removed.getUid0(), removed.getUid1());
+      ++generation;
       return;
     }
   }
 }
 
-double Town::enj() {
+void Town::setCrossingsAllowed(bool allowed) {
+  if (allowed == crossingsAllowed) return;
+  if (allowed) {
+    crossingsAllowed = true;
+    return;
+  }
+
+  vector<tools::Segment> segments;
+  segments.reserve(links.size());
+  for (const auto& link : links)
+    segments.push_back({getNode(link.getUid0())->getPosition(),
+                        getNode(link.getUid1())->getPosition()});
+
+  // Report the crossing that adding the links one by one would run into first
+  const auto crossings(tools::findCrossings(segments));
+  if (!crossings.empty()) {
+    auto first(crossings.front());
+    for (const auto& crossing : crossings)
+      if (crossing.second < first.second ||
+          (crossing.second == first.second && crossing.first < first.first))
+        first = crossing;
+
+    const Link& link(links[first.second]);
+    const Link& crossed(links[first.first]);
+    throw error::link_link_superposition(link.getUid0(), link.getUid1(),
+                                         crossed.getUid0(), crossed.getUid1());
+  }
+
+  crossingsAllowed = false;
+}
+
+bool Town::getCrossingsAllowed() const { return crossingsAllowed; }
+
+void Town::beginBatch() {
+  if (batching) return;
+  batching = true;
+  batchSafety = DEFAULT_SAFETY;
+}
+
+void Town::commit() {
+  if (!batching) return;
+  TRACE_SCOPE("Town::commit");
+
+  // The nodes that are still part of the town, and the links that were added
+  set<unsigned> uids;
+  set<std::pair<unsigned, unsigned>> addedLinks;
+  size_t nodeCopy(0), linkCopy(0);
+  for (const auto& change : changes) {
+    if (change.kind == ADD_LINK || change.kind == REMOVE_LINK) {
+      const Link& link(batchLinks[linkCopy++]);
+      if (change.kind == ADD_LINK && hasLink(link))
+        addedLinks.insert({link.getUid0(), link.getUid1()});
+    } else {
+      const unsigned uid(batchNodes[nodeCopy++].getUid());
+      if (change.kind != REMOVE_NODE && nodes.count(uid) == 1) uids.insert(uid);
+    }
+  }
+
+  vector<Link> touchedLinks(linksOf(uids));
+  for (const auto& link : addedLinks)
+    if (uids.count(link.first) == 0 && uids.count(link.second) == 0)
+      touchedLinks.push_back(Link(link.first, link.second));
+
+  try {
+    refreshIndices();
+    checkNeighbourhood(uids, touchedLinks, batchSafety);
+
+  } catch (std::string&) {
+    rollback();
+    throw;
+  }
+  batching = false;
+  changes.clear();
+  batchNodes.clear();
+  batchLinks.clear();
+}
+
+void Town::rollback() {
+  if (!batching) return;
+  batching = false;
+  undoChanges();
+  ++generation;
+}
+
+bool Town::isBatching() const { return batching; }
+
+double Town::enj() const {
+  TRACE_SCOPE("Town::enj");
+  const auto cached(std::atomic_load(&statistics));
+  if (cached && cached->generation == generation) return cached->enj;
+
   double enjSum(0);
   unsigned population(0);
 
@@ -302,7 +604,11 @@ double Town::enj() {
   return enjSum / population;
 }
 
-double Town::ci() {
+double Town::ci() const {
+  TRACE_SCOPE("Town::ci");
+  const auto cached(std::atomic_load(&statistics));
+  if (cached && cached->generation == generation) return cached->ci;
+
   double ci(0);
 
   for (const auto& link : links) {
@@ -332,113 +638,300 @@ double Town::ci() {
   return ci;
 }
 
-double Town::mta() {
+double Town::mta() const { return getStatistics()->mta; }
+
+std::shared_ptr<const town::Statistics> Town::getStatistics() const {
+  auto cached(std::atomic_load(&statistics));
+  if (cached && cached->generation == generation) return cached;
+
+  TRACE_SCOPE("Town::mta");
+  std::shared_ptr<Statistics> computed(new Statistics{generation, enj(), ci(), 0, {}});
   double sum(0);
-  double nbNodes(0);
+  graph::Workspace workspace;
+  vector<unsigned> tPath, pPath;
 
   for (const auto& node : nodes) {
     if (node.second.getType() == node::HOUSING) {
-      sum += pathFind(node.first, node::TRANSPORT).distance;
-      sum += pathFind(node.first, node::PRODUCTION).distance;
-      ++nbNodes;
+      const DualPathQuery query(pathFind(node.first, node::TRANSPORT, node::PRODUCTION,
+                                         workspace, tPath, pPath));
+      sum += query.first.distance;
+      sum += query.second.distance;
+      computed->access.push_back(
+          {node.first, query.first.distance, query.second.distance});
     }
   }
 
-  if (nbNodes == 0) return 0;  // special case
-  return sum / nbNodes;
+  // Special case, without any housing node
+  if (!computed->access.empty()) computed->mta = sum / computed->access.size();
+
+  cached = computed;
+  std::atomic_store(&statistics, cached);
+  return cached;
 }
 
-/**
- * Our only function that exceeds 40 lines, favourable for optimisation and spacing
- */
 town::PathFindingResult Town::pathFind(unsigned originUid,
                                        const NodeType& searchType) const {
-  if (getNode(originUid) == nullptr) throw string("Node does not exist");
-
-  // Prepare algorithm variables
-  DijkstraGraph graph(createDijkstraGraph(getNodes(), originUid));
-
-  unsigned currentUid(originUid);
-  const Node* currentNode(nullptr);
-  const Node* neighbourNode(nullptr);
-
-  DijkstraGraph::iterator currentGraphNode;  // TN(n)
-  DijkstraGraph::iterator graphNeighbour;    // TN(lv)
-
-  double currentDistance(0);    // "TN(n).access"
-  double neighbourDistance(0);  // "alt" variable
-
-  NodeType currentType;
-  NodeType neighbourType;
-
-  // Execute the algorithm
-  while (nextGraphNode(graph, currentUid)) {
-    currentNode = &nodes.find(currentUid)->second;
-    currentGraphNode = graph.find(currentUid);
-    currentDistance = currentGraphNode->second.distance;
-    currentType = currentNode->getType();
-    auto neighbourNodes(getLinkedNodes(currentGraphNode->first));
-
-    if (currentType == searchType)
-      return generatePathResult(graph, currentUid, currentDistance);
-
-    // Evaluate all graph neighbours
-    if (currentType != node::PRODUCTION) {
-      for (const auto& neighbourUid : neighbourNodes) {
-        graphNeighbour = graph.find(neighbourUid);
-        if (graphNeighbour->second.visited) continue;
-
-        neighbourNode = getNode(neighbourUid);
-        neighbourNode = getNode(neighbourUid);
-        neighbourType = neighbourNode->getType();
-        neighbourDistance =
-            (neighbourNode->getPosition() - currentNode->getPosition()).norm();
-
-        neighbourDistance =
-            currentDistance +
-            computeAccessTime(currentType, neighbourType, neighbourDistance);
-
-        if (neighbourDistance < graphNeighbour->second.distance) {
-          graphNeighbour->second.distance = neighbourDistance;
-          graphNeighbour->second.parent = currentUid;
-        }
-      }
-    }
+  graph::Workspace workspace;
+  Path path(new vector<unsigned>());
+
+  const PathQuery query(pathFind(originUid, searchType, workspace, *path));
+  if (!query.success) path.reset();
 
-    // Mark the node as visited to progress the algorithm
-    currentGraphNode->second.visited = true;
+  return {query.success, std::move(path), query.distance};
+}
+
+town::PathQuery Town::pathFind(unsigned originUid, const NodeType& searchType,
+                               graph::Workspace& workspace,
+                               vector<unsigned>& path) const {
+  METRICS_TIMER(PATH_FIND);
+  path.clear();
+
+  const auto townGraph(getGraph());
+  const unsigned origin(townGraph->index(originUid));
+  if (origin == NO_LINK) throw string("Node does not exist");
+  if (!components.reachable(originUid, searchType)) return {false, INFINITE_TIME};
+
+  const graph::Search search(
+      graph::nearest(*townGraph, workspace, origin, searchType));
+  if (search.destination == NO_LINK) return {false, INFINITE_TIME};
+
+  graph::tracePath(*townGraph, workspace, search.destination, path);
+  return {true, search.distance};
+}
+
+town::DualPathFindingResult Town::pathFind(unsigned originUid, const NodeType& first,
+                                           const NodeType& second) const {
+  graph::Workspace workspace;
+  Path firstPath(new vector<unsigned>()), secondPath(new vector<unsigned>());
+
+  const DualPathQuery query(
+      pathFind(originUid, first, second, workspace, *firstPath, *secondPath));
+  if (!query.first.success) firstPath.reset();
+  if (!query.second.success) secondPath.reset();
+
+  return {{query.first.success, std::move(firstPath), query.first.distance},
+          {query.second.success, std::move(secondPath), query.second.distance}};
+}
+
+town::DualPathQuery Town::pathFind(unsigned originUid, const NodeType& first,
+                                   const NodeType& second, graph::Workspace& workspace,
+                                   vector<unsigned>& firstPath,
+                                   vector<unsigned>& secondPath) const {
+  METRICS_TIMER(PATH_FIND);
+  firstPath.clear();
+  secondPath.clear();
+
+  const auto townGraph(getGraph());
+  const unsigned origin(townGraph->index(originUid));
+  if (origin == NO_LINK) throw string("Node does not exist");
+
+  // A single search would look for an unreachable type until it runs out of nodes
+  const bool firstReachable(components.reachable(originUid, first));
+  const bool secondReachable(components.reachable(originUid, second));
+  graph::DualSearch search{{NO_LINK, INFINITE_TIME}, {NO_LINK, INFINITE_TIME}};
+
+  if (firstReachable && secondReachable) {
+    search = graph::nearest(*townGraph, workspace, origin, first, second);
+  } else if (firstReachable) {
+    search.first = graph::nearest(*townGraph, workspace, origin, first);
+  } else if (secondReachable) {
+    search.second = graph::nearest(*townGraph, workspace, origin, second);
   }
 
-  return generatePathResult(graph, NO_LINK, INFINITE_TIME);
+  DualPathQuery query{{false, INFINITE_TIME}, {false, INFINITE_TIME}};
+
+  if (search.first.destination != NO_LINK) {
+    graph::tracePath(*townGraph, workspace, search.first.destination, firstPath);
+    query.first = {true, search.first.distance};
+  }
+  if (search.second.destination != NO_LINK) {
+    graph::tracePath(*townGraph, workspace, search.second.destination, secondPath);
+    query.second = {true, search.second.distance};
+  }
+  return query;
 }
 
-unsigned Town::getNodeAt(tools::Vec2 position) {
-  for (const auto& node : nodes)
-    if ((node.second.getPosition() - position).norm() <= node.second.radius())
-      return node.second.getUid();
+town::PathFindingResult Town::pathFindTo(unsigned originUid,
+                                         unsigned destinationUid) const {
+  graph::Workspace workspace;
+  Path path(new vector<unsigned>());
+
+  const PathQuery query(pathFindTo(originUid, destinationUid, workspace, *path));
+  if (!query.success) path.reset();
+
+  return {query.success, std::move(path), query.distance};
+}
+
+town::PathQuery Town::pathFindTo(unsigned originUid, unsigned destinationUid,
+                                 graph::Workspace& workspace,
+                                 vector<unsigned>& path) const {
+  METRICS_TIMER(PATH_FIND);
+  path.clear();
+
+  const auto townGraph(getGraph());
+  const unsigned origin(townGraph->index(originUid));
+  const unsigned destination(townGraph->index(destinationUid));
+  if (origin == NO_LINK || destination == NO_LINK)
+    throw string("Node does not exist");
+  if (!components.connected(originUid, destinationUid)) return {false, INFINITE_TIME};
 
+  const graph::Search search(graph::route(*townGraph, workspace, origin, destination));
+  if (search.destination == NO_LINK) return {false, INFINITE_TIME};
+
+  graph::tracePath(*townGraph, workspace, search.destination, path);
+  return {true, search.distance};
+}
+
+void Town::pathFind(const vector<unsigned>& origins, const NodeType& searchType,
+                    PathBatch& batch) const {
+  METRICS_TIMER(PATH_FIND);
+  batch.uids.clear();
+  batch.offsets.assign(1, 0);
+  batch.distances.clear();
+
+  const auto townGraph(getGraph());
+  for (const auto& originUid : origins) {
+    const unsigned origin(townGraph->index(originUid));
+    if (origin == NO_LINK) throw string("Node does not exist");
+
+    graph::Search search{NO_LINK, INFINITE_TIME};
+    if (components.reachable(originUid, searchType))
+      search = graph::nearest(*townGraph, batch.workspace, origin, searchType);
+    if (search.destination != NO_LINK)
+      graph::tracePath(*townGraph, batch.workspace, search.destination, batch.uids);
+
+    batch.offsets.push_back(batch.uids.size());
+    batch.distances.push_back(search.distance);
+  }
+}
+
+std::shared_ptr<const graph::Graph> Town::getGraph() const {
+  // Atomic accesses allow concurrent const queries to share the cache
+  auto cached(std::atomic_load(&graph));
+  if (!cached || cached->getGeneration() != generation) {
+    cached = std::make_shared<const graph::Graph>(nodes, links, generation);
+    std::atomic_store(&graph, cached);
+  }
+  return cached;
+}
+
+std::shared_ptr<const travel::Matrix> Town::getTravelMatrix() const {
+  auto cached(std::atomic_load(&travelMatrix));
+  if (!cached || cached->getGeneration() != generation) {
+    cached = std::make_shared<const travel::Matrix>(*getGraph());
+    std::atomic_store(&travelMatrix, cached);
+  }
+  return cached;
+}
+
+std::shared_ptr<const hierarchy::Hierarchy> Town::getHierarchy(
+    const string& sidecarPath) const {
+  auto cached(std::atomic_load(&hierarchy));
+  if (cached && cached->getGeneration() == generation) return cached;
+
+  // Concurrent first queries wait for a single build instead of each building one
+  std::lock_guard<std::mutex> lock(hierarchyMutex);
+  cached = std::atomic_load(&hierarchy);
+  if (!cached || cached->getGeneration() != generation) {
+    const auto townGraph(getGraph());
+    cached = sidecarPath.empty() ? nullptr
+                                 : hierarchy::loadFromFile(sidecarPath, *townGraph);
+
+    if (!cached) {
+      cached = std::make_shared<const hierarchy::Hierarchy>(*townGraph);
+      if (!sidecarPath.empty()) hierarchy::saveToFile(sidecarPath, *cached);
+    }
+    std::atomic_store(&hierarchy, cached);
+  }
+  return cached;
+}
+
+unsigned Town::getClusterCount() const { return components.count(); }
+
+unsigned long Town::getGeneration() const { return generation; }
+
+unsigned Town::getNodeAt(tools::Vec2 position) const {
+  vector<unsigned> candidates;
+  refreshIndices();
+  nodeTree.query(position, candidates);
+
+  // Nodes are drawn in uid order, the last one is on top
+  for (auto it(candidates.rbegin()); it != candidates.rend(); ++it) {
+    const Node& node(nodes.at(*it));
+    if ((node.getPosition() - position).norm() <= node.radius()) return *it;
+  }
   return NO_LINK;
 }
 
-unsigned Town::getSelectedNode() const { return selectedNode; }
+vector<unsigned> Town::getNodesIn(const spatial::Box& box) const {
+  vector<unsigned> candidates, uids;
+  refreshIndices();
+  nodeTree.query(box, candidates);
+
+  for (const auto& uid : candidates) {
+    // The point of the box nearest to the centre
+    const Vec2 centre(nodes.at(uid).getPosition());
+    const Vec2 nearest(std::min(std::max(centre.getX(), box.minX), box.maxX),
+                       std::min(std::max(centre.getY(), box.minY), box.maxY));
+    if ((nearest - centre).norm() <= nodes.at(uid).radius()) uids.push_back(uid);
+  }
+  return uids;
+}
+
+vector<unsigned> Town::getNearestNodes(const Vec2& position, unsigned count) const {
+  vector<unsigned> uids;
+  const auto distance([this, &position](unsigned uid) {
+    const Node& node(nodes.at(uid));
+    return std::max((node.getPosition() - position).norm() - node.radius(), 0.);
+  });
+  refreshIndices();
+  nodeTree.nearest(position, count, distance, uids);
+  return uids;
+}
+
+unsigned Town::getSelectedNode() const {
+  return selection.size() == 1 ? *selection.begin() : NO_LINK;
+}
+
+vector<unsigned> Town::getSelection() const {
+  return vector<unsigned>(selection.begin(), selection.end());
+}
 
 void Town::selectNode(unsigned nodeToSelect) {
-  // Deselect the currently selected node
-  if (selectedNode != NO_LINK) {
-    auto node(getModifiableNode(selectedNode));
-    if (node != nullptr) node->setSelected(false);
-  }
-
-  // Select the new active node
-  selectedNode = nodeToSelect;
-  if (nodeToSelect != NO_LINK) {
-    auto node(getModifiableNode(nodeToSelect));
-    if (node != nullptr) {
-      node->setSelected(true);
+  selectNodes(nodeToSelect == NO_LINK ? vector<unsigned>()
+                                      : vector<unsigned>{nodeToSelect});
+}
+
+void Town::selectNodes(const vector<unsigned>& nodesToSelect) {
+  // Deselect the currently selected nodes
+  for (const auto& uid : selection) {
+    auto node(nodes.find(uid));
+    if (node != nodes.end()) node->second.setSelected(false);
+  }
+  selection.clear();
+
+  for (const auto& uid : nodesToSelect) {
+    auto node(nodes.find(uid));
+    if (node != nodes.end()) {
+      node->second.setSelected(true);
+      selection.insert(uid);
     }
   }
 }
 
+void Town::toggleSelected(unsigned nodeToToggle) {
+  auto node(nodes.find(nodeToToggle));
+  if (node == nodes.end()) return;
+
+  const bool selected(selection.count(nodeToToggle) == 0);
+  if (selected) {
+    selection.insert(nodeToToggle);
+  } else {
+    selection.erase(nodeToToggle);
+  }
+  node->second.setSelected(selected);
+}
+
 void Town::setHighlightShortestPath(bool highlight) {
   highlightShortestPath = highlight;
 }
@@ -447,8 +940,8 @@ void Town::highlightNodes(const std::vector<unsigned>& highlighted, bool deselec
   if (deselect) clearHighlightedNodes();
 
   for (const auto& uid : highlighted) {
-    auto node(getModifiableNode(uid));
-    if (node != nullptr) node->setHighlighted(true);
+    auto node(nodes.find(uid));
+    if (node != nodes.end()) node->second.setHighlighted(true);
   }
 }
 
@@ -465,11 +958,31 @@ unsigned Town::availableUid() const {
 
 /* == Private members == */
 
+void Town::insertValid(const NodeRecords& nodeRecords,
+                       const LinkRecords& linkRecords) {
+  for (const auto& record : nodeRecords) {
+    nodes.emplace(record.uid,
+                  Node(record.type, record.uid, record.position, record.capacity));
+    components.addNode(record.uid, record.type);
+  }
+
+  links.reserve(linkRecords.size());
+  for (const auto& record : linkRecords) {
+    links.push_back(Link(record.uid0, record.uid1));
+    addNeighbours(links.back());
+    components.addLink(record.uid0, record.uid1);
+  }
+  buildIndices();
+  ++generation;
+}
+
 /** Checks whether the given node intersects any town links */
 void Town::checkLinkSuperposition(const Node& testNode, const double safetyDistance) {
+  METRICS_TIMER(SUPERPOSITION);
   unsigned uid(testNode.getUid()), link0, link1;
   double radius;
   for (const auto& townLink : links) {
+    METRICS_COUNT(PAIRS_TESTED, 1);
     link0 = townLink.getUid0();
     link1 = townLink.getUid1();
 
@@ -487,6 +1000,7 @@ void Town::checkLinkSuperposition(const Node& testNode, const double safetyDista
 
 /** Checks whether the given link would intersect any town nodes */
 void Town::checkLinkSuperposition(const Link& testLink, const double safetyDistance) {
+  METRICS_TIMER(SUPERPOSITION);
   double radius;
   unsigned link0(testLink.getUid0()), link1(testLink.getUid1());
 
@@ -495,6 +1009,7 @@ void Town::checkLinkSuperposition(const Link& testLink, const double safetyDista
   Vec2 link1Pos(getNode(link1)->getPosition());
 
   for (const auto& townNode : nodes) {
+    METRICS_COUNT(PAIRS_TESTED, 1);
     unsigned uid(townNode.second.getUid());
 
     // Ignore node connections to self, these can violate safety distances
@@ -508,10 +1023,293 @@ void Town::checkLinkSuperposition(const Link& testLink, const double safetyDista
   }
 }
 
+void Town::refreshIndices() const {
+  if (indicesStale) buildIndices();
+}
+
+void Town::buildIndices() const {
+  vector<std::pair<unsigned, spatial::Box>> boxes;
+  boxes.reserve(nodes.size());
+  for (const auto& entry : nodes)
+    boxes.push_back({entry.first, boundsOf(entry.second)});
+  nodeTree.build(boxes);
+
+  linkGrid.clear();
+  for (const auto& link : links)
+    linkGrid.insert(link.getUid0(), link.getUid1(),
+                    nodes.at(link.getUid0()).getPosition(),
+                    nodes.at(link.getUid1()).getPosition());
+  indicesStale = false;
+}
+
+void Town::commitNodes(const vector<Node>& before) {
+  set<unsigned> uids;
+  for (const auto& node : before) uids.insert(node.getUid());
+  const vector<Link> nodeLinks(linksOf(uids));
+
+  reindex(before, nodeLinks);
+  try {
+    checkNeighbourhood(uids, nodeLinks, DIST_MIN);
+
+  } catch (std::string&) {
+    vector<Node> after;
+    for (const auto& node : before) {
+      after.push_back(nodes.at(node.getUid()));
+      nodes.at(node.getUid()) = node;
+    }
+    reindex(after, nodeLinks);
+    throw;
+  }
+  ++generation;
+}
+
+/** The nodes must still be indexed with the boxes of the given copies */
+void Town::reindex(const vector<Node>& before, const vector<Link>& nodeLinks) {
+  map<unsigned, Vec2> oldPositions;
+  for (const auto& node : before) {
+    oldPositions[node.getUid()] = node.getPosition();
+    nodeTree.refit(node.getUid(), boundsOf(nodes.at(node.getUid())));
+  }
+
+  for (const auto& link : nodeLinks) {
+    auto old0(oldPositions.find(link.getUid0()));
+    auto old1(oldPositions.find(link.getUid1()));
+    unindexLink(link,
+                old0 != oldPositions.end() ? old0->second
+                                           : nodes.at(link.getUid0()).getPosition(),
+                old1 != oldPositions.end() ? old1->second
+                                           : nodes.at(link.getUid1()).getPosition());
+    indexLink(link);
+  }
+}
+
+/** Each candidate comes from the indices, only pairs that are close are tested */
+void Town::checkNeighbourhood(const set<unsigned>& uids, const vector<Link>& nodeLinks,
+                              double safetyDistance) const {
+  METRICS_TIMER(SUPERPOSITION);
+  vector<unsigned> candidates;
+  vector<std::pair<unsigned, unsigned>> linkCandidates;
+
+  for (const auto& uid : uids) {
+    const Node& node(nodes.at(uid));
+    const double reach(node.radius() + safetyDistance);
+
+    nodeTree.query(spatial::around(node.getPosition(), reach), candidates);
+    for (const auto& candidate : candidates) {
+      if (candidate == uid) continue;
+      METRICS_COUNT(PAIRS_TESTED, 1);
+      const Node& other(nodes.at(candidate));
+      if ((node.getPosition() - other.getPosition()).norm() <= reach + other.radius())
+        throw error::node_node_superposition(uid, candidate);
+    }
+
+    linkGrid.query(spatial::around(node.getPosition(), reach), linkCandidates);
+    for (const auto& candidate : linkCandidates) {
+      if (candidate.first == uid || candidate.second == uid) continue;
+      METRICS_COUNT(PAIRS_TESTED, 1);
+      if (minPointSegmentDistance(node.getPosition(),
+                                  nodes.at(candidate.first).getPosition(),
+                                  nodes.at(candidate.second).getPosition()) <= reach)
+        throw error::node_link_superposition(uid);
+    }
+  }
+
+  for (const auto& link : nodeLinks) {
+    const Vec2 position0(nodes.at(link.getUid0()).getPosition());
+    const Vec2 position1(nodes.at(link.getUid1()).getPosition());
+    const spatial::Box box{
+        std::min(position0.getX(), position1.getX()) - safetyDistance,
+        std::min(position0.getY(), position1.getY()) - safetyDistance,
+        std::max(position0.getX(), position1.getX()) + safetyDistance,
+        std::max(position0.getY(), position1.getY()) + safetyDistance};
+
+    nodeTree.query(box, candidates);
+    for (const auto& candidate : candidates) {
+      if (candidate == link.getUid0() || candidate == link.getUid1()) continue;
+      METRICS_COUNT(PAIRS_TESTED, 1);
+      const Node& other(nodes.at(candidate));
+      if (minPointSegmentDistance(other.getPosition(), position0, position1) <=
+          other.radius() + safetyDistance)
+        throw error::node_link_superposition(candidate);
+    }
+    checkLinkCrossing(link);
+  }
+}
+
+void Town::stageNodes(const vector<Node>& before) {
+  set<unsigned> uids;
+  for (const auto& node : before) {
+    logChange(MODIFY_NODE, node);
+    uids.insert(node.getUid());
+  }
+  reindex(before, linksOf(uids));
+  batchSafety = std::max(batchSafety, DIST_MIN);
+  ++generation;
+}
+
+void Town::logChange(ChangeKind kind, const Node& node) {
+  changes.push_back({kind, 0, false});
+  batchNodes.push_back(node);
+}
+
+void Town::logChange(ChangeKind kind, const Link& link, size_t position,
+                     bool swapped) {
+  changes.push_back({kind, position, swapped});
+  batchLinks.push_back(link);
+}
+
+/** Each change is undone in the state that directly followed it */
+void Town::undoChanges() {
+  for (auto change(changes.rbegin()); change != changes.rend(); ++change) {
+    if (change->kind == ADD_LINK || change->kind == REMOVE_LINK) {
+      const Link link(batchLinks.back());
+      batchLinks.pop_back();
+
+      if (change->kind == ADD_LINK) {
+        // The link was added last, and every later change has been undone
+        links.pop_back();
+        unindexLink(link, nodes.at(link.getUid0()).getPosition(),
+                    nodes.at(link.getUid1()).getPosition());
+        removeNeighbours(link);
+        components.removeLink(link.getUid0(), link.getUid1());
+        continue;
+      }
+
+      if (change->position == links.size()) {
+        links.push_back(link);
+      } else if (change->swapped) {
+        links.push_back(links[change->position]);
+        links[change->position] = link;
+      } else {
+        links.insert(links.begin() + change->position, link);
+      }
+      indexLink(link);
+      addNeighbours(link);
+      components.addLink(link.getUid0(), link.getUid1());
+      continue;
+    }
+
+    const Node copy(batchNodes.back());
+    const unsigned uid(copy.getUid());
+    batchNodes.pop_back();
+
+    if (change->kind == ADD_NODE) {
+      selection.erase(uid);
+      nodes.erase(uid);
+      nodeTree.remove(uid);
+      components.removeNode(uid);
+    } else if (change->kind == REMOVE_NODE) {
+      nodes.emplace(uid, copy);
+      nodeTree.insert(uid, boundsOf(copy));
+      components.addNode(uid, copy.getType());
+      if (copy.getSelected()) selection.insert(uid);
+    } else {
+      Node& node(nodes.at(uid));
+      const vector<Node> modified{node};
+      node = copy;
+      node.setSelected(selection.count(uid) == 1);
+      reindex(modified, linksOf({uid}));
+    }
+  }
+  changes.clear();
+}
+
+/** Links between two of the nodes are listed with the smaller uid */
+vector<Link> Town::linksOf(const set<unsigned>& uids) const {
+  vector<Link> nodeLinks;
+  for (const auto& uid : uids) {
+    auto neighbours(adjacency.find(uid));
+    if (neighbours == adjacency.end()) continue;
+    for (const auto& neighbour : neighbours->second)
+      if (uid < neighbour || uids.count(neighbour) == 0)
+        nodeLinks.push_back(Link(uid, neighbour));
+  }
+  return nodeLinks;
+}
+
+size_t Town::degree(unsigned uid) const {
+  auto neighbours(adjacency.find(uid));
+  return neighbours == adjacency.end() ? 0 : neighbours->second.size();
+}
+
+void Town::addNeighbours(const Link& link) {
+  adjacency[link.getUid0()].push_back(link.getUid1());
+  adjacency[link.getUid1()].push_back(link.getUid0());
+}
+
+void Town::removeNeighbours(const Link& link) {
+  const std::array<unsigned, NB_LINK_UIDS> uids{link.getUid0(), link.getUid1()};
+  for (int i(0); i < NB_LINK_UIDS; ++i) {
+    auto neighbours(adjacency.find(uids[i]));
+    if (neighbours == adjacency.end()) continue;
+    auto& others(neighbours->second);
+    auto other(std::find(others.begin(), others.end(), uids[NB_LINK_UIDS - 1 - i]));
+    if (other != others.end()) {
+      *other = others.back();
+      others.pop_back();
+    }
+    if (others.empty()) adjacency.erase(neighbours);
+  }
+}
+
+void Town::nodeMoved(unsigned uid, const Vec2& oldPosition,
+                     const vector<Link>& nodeLinks) {
+  nodeTree.refit(uid, boundsOf(nodes.at(uid)));
+  // The links of the node were indexed at its former position
+  for (const auto& link : nodeLinks) {
+    const bool first(link.getUid0() == uid);
+    unindexLink(link, first ? oldPosition : getNode(link.getUid0())->getPosition(),
+                first ? getNode(link.getUid1())->getPosition() : oldPosition);
+    indexLink(link);
+  }
+  ++generation;
+}
+
+/** Checks the links around the given link, as the bulk validation would */
+void Town::checkLinkCrossing(const Link& testLink) const {
+  if (crossingsAllowed) return;
+  refreshIndices();
+  METRICS_TIMER(SUPERPOSITION);
+  const unsigned link0(testLink.getUid0()), link1(testLink.getUid1());
+  const tools::Segment segment{getNode(link0)->getPosition(),
+                               getNode(link1)->getPosition()};
+
+  vector<std::pair<unsigned, unsigned>> candidates;
+  linkGrid.query(segment.pointA, segment.pointB, candidates);
+
+  for (const auto& candidate : candidates) {
+    METRICS_COUNT(PAIRS_TESTED, 1);
+    // Links of the same node are left to segmentsCross(), like findCrossings()
+    if ((candidate.first == link0 && candidate.second == link1) ||
+        (candidate.first == link1 && candidate.second == link0))
+      continue;
+
+    const tools::Segment other{getNode(candidate.first)->getPosition(),
+                               getNode(candidate.second)->getPosition()};
+    if (tools::segmentsCross(segment, other))
+      throw error::link_link_superposition(link0, link1, candidate.first,
+                                           candidate.second);
+  }
+}
+
+void Town::indexLink(const Link& link) {
+  linkGrid.insert(link.getUid0(), link.getUid1(),
+                  getNode(link.getUid0())->getPosition(),
+                  getNode(link.getUid1())->getPosition());
+}
+
+/** The positions must be those of the link's nodes when it was indexed */
+void Town::unindexLink(const Link& link, const Vec2& position0,
+                       const Vec2& position1) {
+  linkGrid.remove(link.getUid0(), link.getUid1(), position0, position1);
+}
+
 /** Checks whether the given node would intersect any town nodes */
 void Town::checkNodeSuperposition(const Node& testNode, const double safetyDistance) {
+  METRICS_TIMER(SUPERPOSITION);
   double distance;
   for (const auto& townNodePair : nodes) {
+    METRICS_COUNT(PAIRS_TESTED, 1);
     const Node* townNode(&townNodePair.second);
     if (testNode.getUid() == townNode->getUid()) continue;
 
@@ -522,275 +1320,494 @@ void Town::checkNodeSuperposition(const Node& testNode, const double safetyDista
   }
 }
 
-/* === FUNCTIONS === */
+NodeDrag::NodeDrag(Town& town, unsigned uid)
+    : town(&town), uid(uid), nodeGrid(NODE_CELL_SIZE), linkGrid(LINK_CELL_SIZE) {
+  TRACE_SCOPE("NodeDrag::NodeDrag");
+  for (const auto& entry : town.nodes) {
+    if (entry.first == uid) continue;
+    const Node& other(entry.second);
+    nodeGrid.insert(entry.first,
+                    spatial::around(other.getPosition(), other.radius() + DIST_MIN));
+  }
 
-Town loadFromFile(const string& path) {
-  std::ifstream file(path);
-  if (file.is_open()) {
-    return Town(parseTown(file));
-  } else {
-    std::cerr << "Error: Could not open file" << std::endl;
-    return Town();
+  for (const auto& link : town.links) {
+    if (link.getUid0() == uid || link.getUid1() == uid) {
+      ownLinks.push_back(link);
+    } else {
+      linkGrid.insert(link.getUid0(), link.getUid1(),
+                      town.getNode(link.getUid0())->getPosition(),
+                      town.getNode(link.getUid1())->getPosition());
+    }
   }
 }
 
-void saveToFile(const std::string& path, const Town& town) {
-  std::ofstream file(path);
-  if (file.is_open()) {
-    writeTown(file, town);
-    file.close();
-  } else {
-    std::cerr << "Error: Could not open file" << std::endl;
+void NodeDrag::moveTo(const Vec2& position) {
+  METRICS_TIMER(SUPERPOSITION);
+  auto entry(town->nodes.find(uid));
+  if (entry == town->nodes.end()) return;
+  Node& node(entry->second);
+  const Vec2 oldPosition(node.getPosition());
+  town->refreshIndices();  // see Town::moveNode()
+
+  // Same checks and order as Town::moveNode
+  try {
+    node.setPosition(position);
+    checkNodes(node);
+    checkLinks(node);
+    checkOwnLinks(node);
+    for (const auto& link : ownLinks) town->checkLinkCrossing(link);
+
+  } catch (std::string&) {
+    node.setPosition(oldPosition);
+    throw;
   }
+  town->nodeMoved(uid, oldPosition, ownLinks);
 }
 
-}  // namespace town
+/** Candidates are sorted by uid, the first collision is the one of moveNode */
+void NodeDrag::checkNodes(const Node& node) const {
+  vector<unsigned> candidates;
+  nodeGrid.query(spatial::around(node.getPosition(), node.radius()), candidates);
+
+  for (const auto& candidate : candidates) {
+    METRICS_COUNT(PAIRS_TESTED, 1);
+    const Node* other(town->getNode(candidate));
+    const double distance((node.getPosition() - other->getPosition()).norm());
+    if (distance <= node.radius() + other->radius() + DIST_MIN)
+      throw error::node_node_superposition(uid, candidate);
+  }
+}
 
-/* === INTERNAL FUNCTIONS === */
+void NodeDrag::checkLinks(const Node& node) const {
+  vector<std::pair<unsigned, unsigned>> candidates;
+  linkGrid.query(spatial::around(node.getPosition(), node.radius() + DIST_MIN),
+                 candidates);
+
+  for (const auto& candidate : candidates) {
+    METRICS_COUNT(PAIRS_TESTED, 1);
+    if (minPointSegmentDistance(node.getPosition(),
+                                town->getNode(candidate.first)->getPosition(),
+                                town->getNode(candidate.second)->getPosition()) <=
+        node.radius() + DIST_MIN)
+      throw error::node_link_superposition(uid);
+  }
+}
 
-namespace {
+void NodeDrag::checkOwnLinks(const Node& node) const {
+  vector<unsigned> candidates;
+  for (const auto& link : ownLinks) {
+    const unsigned other(link.getUid0() == uid ? link.getUid1() : link.getUid0());
+    const Vec2 end(town->getNode(other)->getPosition());
+    nodeGrid.query(node.getPosition(), end, candidates);
+
+    for (const auto& candidate : candidates) {
+      METRICS_COUNT(PAIRS_TESTED, 1);
+      if (candidate == other) continue;
+      const Node* crossed(town->getNode(candidate));
+      if (minPointSegmentDistance(crossed->getPosition(), node.getPosition(), end) <=
+          crossed->radius() + DIST_MIN)
+        throw error::node_link_superposition(candidate);
+    }
+  }
+}
 
-/* == Town parsing == */
+/* === FUNCTIONS === */
 
-/**
- * Reads an entire input stream and generates a town using the archipelago file
- * format.
- *
- * If quitOnError is true, the program will output the results to the terminal,
- * and additionally exit immediately if a parsing error is encountered.
- */
-Town parseTown(istream& stream) {
-  Nodes nodes;
-  Links links;
+Town loadFromFile(const string& path, bool crossingsAllowed) {
+  TRACE_SCOPE("town::loadFromFile");
+  string contents;
+  if (readFile(path, contents)) {
+    NodeRecords nodes;
+    LinkRecords links;
+    parser::parseTown(contents.data(), contents.size(), nodes, links);
+    return Town(nodes, links, crossingsAllowed);
+  } else {
+    std::cerr << "Error: Could not open file" << std::endl;
+    return Town();
+  }
+}
 
-  // Parse each node
-  parseNodes(stream, nodes, node::HOUSING);
-  parseNodes(stream, nodes, node::TRANSPORT);
-  parseNodes(stream, nodes, node::PRODUCTION);
+Town loadCached(const string& path, bool crossingsAllowed) {
+  string contents;
+  if (!readFile(path, contents)) {
+    std::cerr << "Error: Could not open file" << std::endl;
+    return Town();
+  }
+  return parseCached(contents, crossingsAllowed);
+}
+
+Town openCached(const string& path, bool crossingsAllowed, bool storeEntry) {
+  string contents;
+  if (!readFile(path, contents)) throw string("Could not open file\n");
+  return parseCached(contents, crossingsAllowed, storeEntry);
+}
 
-  // Parse each link
-  parseLinks(stream, links);
+Town parseCached(const string& contents, bool crossingsAllowed, bool storeEntry) {
+  TRACE_SCOPE("town::parseCached");
+  // The validation of the same content differs if crossings are not allowed
+  const string key(
+      cache::key(contents, string(CACHE_MAGIC) + (crossingsAllowed ? "+" : "-")));
+  string entry;
+  NodeRecords nodes;
+  LinkRecords links;
+  Statistics statistics;
+  if (cache::load(key, entry) && decodeTown(entry, nodes, links, statistics)) {
+    METRICS_COUNT(CACHE_HITS, 1);
+    return Town(nodes, links, crossingsAllowed, statistics);
+  }
 
-  // Construct the town and return
-  Town town(nodes, links);
+  METRICS_COUNT(CACHE_MISSES, 1);
+  nodes.clear();
+  links.clear();
+  parser::parseTown(contents.data(), contents.size(), nodes, links);
 
+  Town town(nodes, links, crossingsAllowed);
+  if (storeEntry) cache::store(key, encodeTown(nodes, links, *town.getStatistics()));
   return town;
 }
 
-/**
- * Read and parse a single node type from an input stream, create the Node
- * instances and append them to the given vector. This function initially reads
- * the node count.
- */
-void parseNodes(istream& rawStream, Nodes& nodes, NodeType type) {
-  std::stringstream lineStream(getNextLine(rawStream));
+vector<validation::Violation> validateFile(const string& path,
+                                          bool crossingsAllowed) {
+  TRACE_SCOPE("town::validateFile");
+  string contents;
+  if (!readFile(path, contents)) throw string("Could not open file\n");
 
-  size_t count(readLongUnsigned(lineStream));
+  NodeRecords nodes;
+  LinkRecords links;
+  parser::parseTown(contents.data(), contents.size(), nodes, links);
+  return validation::validate(nodes, links, crossingsAllowed);
+}
 
-  unsigned int uid, capacity;
-  double x, y;
+bool saveToFile(const std::string& path, const Town& town) {
+  return saveToFile(path, *copyRecords(town));
+}
 
-  // Read as many nodes as were specified by the count
-  for (size_t i(0); i < count; ++i) {
-    lineStream = getNextLine(rawStream);
-    uid = readUnsigned(lineStream);
-    x = readDouble(lineStream);
-    y = readDouble(lineStream);
-    capacity = readUnsigned(lineStream);
+bool saveToFile(const std::string& path, const Records& records) {
+  TRACE_SCOPE("town::saveToFile");
+  const string temporary(createTemporary(path));
+  std::ofstream file;
+  if (!temporary.empty()) file.open(temporary);
+  if (!file.is_open()) {
+    if (!temporary.empty()) unlink(temporary.c_str());
+    std::cerr << "Error: Could not open file" << std::endl;
+    return false;
+  }
 
-    nodes.push_back(Node(type, uid, {x, y}, capacity));
+  writeTown(file, records);
+  file.close();
+  if (file.fail() || !syncFile(temporary) ||
+      std::rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    std::cerr << "Error: Could not write file" << std::endl;
+    return false;
   }
+  return true;
 }
 
-/**
- * Read and parse links from an input stream, creating Link objects and
- * appending them to a vector.
- */
-void parseLinks(istream& rawStream, Links& links) {
-  std::stringstream lineStream(getNextLine(rawStream));
+std::shared_ptr<const Records> copyRecords(const Town& town) {
+  TRACE_SCOPE("town::copyRecords");
+  std::shared_ptr<Records> records(new Records());
+  const auto nodes(town.getNodeMap());
+  records->nodes.reserve(nodes->size());
+  for (const auto& node : *nodes) {
+    records->nodes.push_back({node.second.getType(), node.first,
+                              node.second.getPosition(), node.second.getCapacity(),
+                              0});
+  }
+  records->links = toRecords(*town.getLinks());
+  return records;
+}
 
-  size_t count(readLongUnsigned(lineStream));
-  unsigned int uid0, uid1;
+string hierarchyPath(const string& townPath) { return townPath + HIERARCHY_EXTENSION; }
 
-  // Read as many links as were specified by the count
-  for (size_t i(0); i < count; ++i) {
-    lineStream = getNextLine(rawStream);
-    uid0 = readUnsigned(lineStream);
-    uid1 = readUnsigned(lineStream);
+}  // namespace town
 
-    links.push_back({uid0, uid1});
-  }
-}
+/* === INTERNAL FUNCTIONS === */
+
+namespace {
+
+/* == Town cache == */
 
 /**
- * Read a single line of real content (containing readable characters) from an
- * input stream. Each line is stripped of comments before being returned.
+ * The records are written without their lines, followed by the statistics and a
+ * checksum of everything before it. Values are in the byte order of the machine,
+ * the cache is not shared between machines.
  */
-std::stringstream getNextLine(istream& stream) {
-  // Signal the end by return a stringstream with an EOF bit
-  if (stream.eof()) {
-    std::stringstream emptyStream("");
-    emptyStream.ignore(std::numeric_limits<std::streamsize>::max());
-    return emptyStream;
+string encodeTown(const NodeRecords& nodes, const LinkRecords& links,
+                  const town::Statistics& statistics) {
+  string data(CACHE_MAGIC, MAGIC_LENGTH);
+  append<uint64_t>(data, nodes.size());
+  for (const auto& node : nodes) {
+    append<uint8_t>(data, node.type);
+    append<uint32_t>(data, node.uid);
+    append(data, node.position.getX());
+    append(data, node.position.getY());
+    append<uint32_t>(data, node.capacity);
   }
 
-  string line;
-  std::getline(stream, line);
+  append<uint64_t>(data, links.size());
+  for (const auto& link : links) {
+    append<uint32_t>(data, link.uid0);
+    append<uint32_t>(data, link.uid1);
+  }
 
-  // Trim off comments
-  size_t commentPos(line.find(COMMENT_DELIMITER));
-  if (commentPos != string::npos) {
-    line = line.substr(LINE_START, commentPos);
+  append(data, statistics.enj);
+  append(data, statistics.ci);
+  append(data, statistics.mta);
+  append<uint64_t>(data, statistics.access.size());
+  for (const auto& access : statistics.access) {
+    append<uint32_t>(data, access.uid);
+    append(data, access.transport);
+    append(data, access.production);
   }
 
-  // search for non-whitespace character
-  bool hasContent(false);
-  for (const char& stringChar : line) {
-    if (!isspace(stringChar)) {
-      hasContent = true;
-      break;
-    }
+  append(data, checksum(data, data.size()));
+  return data;
+}
+
+/** Returns false if the data is not a complete entry */
+bool decodeTown(const string& data, NodeRecords& nodes, LinkRecords& links,
+                town::Statistics& statistics) {
+  unsigned long long expected;
+  if (data.size() < MAGIC_LENGTH + sizeof(expected) ||
+      data.compare(0, MAGIC_LENGTH, CACHE_MAGIC) != 0)
+    return false;
+
+  const size_t payload(data.size() - sizeof(expected));
+  size_t end(payload);
+  if (!take(data, end, expected) || expected != checksum(data, payload)) return false;
+
+  size_t position(MAGIC_LENGTH);
+  uint64_t nbNodes, nbLinks, nbAccess;
+  if (!take(data, position, nbNodes)) return false;
+  for (uint64_t i(0); i < nbNodes; ++i) {
+    uint8_t type;
+    uint32_t uid, capacity;
+    double x, y;
+    if (!take(data, position, type) || type > node::PRODUCTION ||
+        !take(data, position, uid) || !take(data, position, x) ||
+        !take(data, position, y) || !take(data, position, capacity))
+      return false;
+    nodes.push_back({static_cast<NodeType>(type), uid, Vec2(x, y), capacity, 0});
   }
 
-  // skip empty lines
-  if (!hasContent) {
-    return getNextLine(stream);  // recursively fetch the next line
+  if (!take(data, position, nbLinks)) return false;
+  for (uint64_t i(0); i < nbLinks; ++i) {
+    uint32_t uid0, uid1;
+    if (!take(data, position, uid0) || !take(data, position, uid1)) return false;
+    links.push_back({uid0, uid1, 0});
   }
 
-  std::stringstream lineStream(line);
-  return lineStream;
+  if (!take(data, position, statistics.enj) || !take(data, position, statistics.ci) ||
+      !take(data, position, statistics.mta) || !take(data, position, nbAccess))
+    return false;
+  for (uint64_t i(0); i < nbAccess; ++i) {
+    town::Access access;
+    if (!take(data, position, access.uid) || !take(data, position, access.transport) ||
+        !take(data, position, access.production))
+      return false;
+    statistics.access.push_back(access);
+  }
+  return position == payload;
 }
 
-/** Read and return an int from an input stream */
-unsigned readUnsigned(istream& stream) {
-  unsigned buffer(0);
-  stream >> buffer;
-  return buffer;
+template <typename T>
+void append(string& data, const T& value) {
+  data.append(reinterpret_cast<const char*>(&value), sizeof(value));
 }
 
-/** Read and return an int from an input stream */
-unsigned long long readLongUnsigned(istream& stream) {
-  unsigned long long buffer(0);
-  stream >> buffer;
-  return buffer;
+template <typename T>
+bool take(const string& data, size_t& position, T& value) {
+  if (data.size() - position < sizeof(value)) return false;
+  data.copy(reinterpret_cast<char*>(&value), sizeof(value), position);
+  position += sizeof(value);
+  return true;
 }
 
-/** Read and return a double from an input stream */
-double readDouble(istream& stream) {
-  double buffer(0.);
-  stream >> buffer;
-  return buffer;
+/** A 64-bit FNV-1a hash of the first bytes of the data */
+unsigned long long checksum(const string& data, size_t size) {
+  unsigned long long hash(FNV_OFFSET);
+  for (size_t i(0); i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= FNV_PRIME;
+  }
+  return hash;
 }
 
-/* == Saving == */
+/* == Town parsing == */
 
-/** Serialises the town into a streamable format */
-void writeTown(ostream& stream, const Town& town) {
-  stream << COMMENT_DELIMITER << " Archipelago Town" << std::endl;
-  stream << COMMENT_DELIMITER << " AUTOMATICALLY GENERATED FILE" << std::endl;
+/** Describes already constructed nodes as records, for validation */
+spatial::Box boundsOf(const Node& node) {
+  return spatial::around(node.getPosition(), node.radius());
+}
 
-  printNodeType(stream, town, node::HOUSING);
-  printNodeType(stream, town, node::TRANSPORT);
-  printNodeType(stream, town, node::PRODUCTION);
+NodeRecords toRecords(const Nodes& nodes) {
+  NodeRecords records;
+  records.reserve(nodes.size());
+  for (const auto& node : nodes) {
+    records.push_back(
+        {node.getType(), node.getUid(), node.getPosition(), node.getCapacity(), 0});
+  }
+  return records;
+}
 
-  printLinks(stream, town);
+LinkRecords toRecords(const Links& links) {
+  LinkRecords records;
+  records.reserve(links.size());
+  for (const auto& link : links)
+    records.push_back({link.getUid0(), link.getUid1(), 0});
+  return records;
 }
 
-void printNodeType(ostream& stream, const Town& town, const NodeType& type) {
-  unsigned count(0);
-  vector<unsigned> uids;
-  Vec2 position;
+/** Reads a whole file at once, returns false if it could not be opened */
+bool readFile(const string& path, string& contents) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  if (!file.is_open()) return false;
+
+  file.seekg(0, std::ios::end);
+  const std::streamoff size(file.tellg());
+  file.seekg(0, std::ios::beg);
+  if (size > 0) {
+    contents.resize(size);
+    file.read(&contents[0], size);
+    contents.resize(file.gcount());
+  }
+  return true;
+}
 
-  stream << std::endl;
+/** Flushes a written file to the disk, before it replaces another */
+bool syncFile(const string& path) {
+  const int file(open(path.c_str(), O_RDONLY));
+  if (file < 0) return false;
+  const bool synced(fsync(file) == 0);
+  close(file);
+  return synced;
+}
 
-  // Find all nodes of a certain type
-  for (const auto& uid : town.getNodes()) {
-    if (town.getNode(uid)->getType() == type) {
-      ++count;
-      uids.push_back(uid);
-    }
+string createTemporary(const string& path) {
+  string temporary(path + TEMPORARY_SUFFIX);
+  const int file(mkstemp(&temporary[0]));
+  if (file < 0) return "";
+
+  struct stat replaced;
+  const mode_t mode(stat(path.c_str(), &replaced) == 0 ? replaced.st_mode & 07777
+                                                        : FILE_MODE);
+  const bool created(fchmod(file, mode) == 0);
+  close(file);
+  if (!created) {
+    unlink(temporary.c_str());
+    return "";
   }
+  return temporary;
+}
 
-  stream << count << std::endl;
+/* == Saving == */
 
-  for (const auto& uid : uids) {
-    stream << town.getNode(uid)->toString() << std::endl;
-  }
+/** Serialises the town into a streamable format */
+void writeTown(ostream& stream, const town::Records& records) {
+  Writer writer(stream);
+  writer.write(COMMENT_DELIMITER);
+  writer.write(" Archipelago Town\n");
+  writer.write(COMMENT_DELIMITER);
+  writer.write(" AUTOMATICALLY GENERATED FILE\n");
+
+  printNodeType(writer, records.nodes, node::HOUSING);
+  printNodeType(writer, records.nodes, node::TRANSPORT);
+  printNodeType(writer, records.nodes, node::PRODUCTION);
+
+  printLinks(writer, records.links);
 }
 
-void printLinks(ostream& stream, const Town& town) {
-  auto links(town.getLinks());
+void printNodeType(Writer& writer, const NodeRecords& nodes, const NodeType& type) {
+  unsigned long long count(0);
+
+  // Count the nodes of a certain type, they are written in a second pass
+  for (const auto& node : nodes)
+    if (node.type == type) ++count;
+
+  writer.write('\n');
+  writer.write(count);
+  writer.write('\n');
 
-  stream << std::endl << links->size() << std::endl;
-  for (const auto& link : *links) {
-    stream << link.getUid0() << " " << link.getUid1() << std::endl;
+  for (const auto& node : nodes) {
+    if (node.type != type) continue;
+
+    writer.write(static_cast<unsigned long long>(node.uid));
+    writer.write(' ');
+    writer.write(node.position.getX());
+    writer.write(' ');
+    writer.write(node.position.getY());
+    writer.write(' ');
+    writer.write(static_cast<unsigned long long>(node.capacity));
+    writer.write('\n');
   }
 }
 
-/* == Dijkstra == */
-
-/**
- * Creates a graph that is suitable for path finding calculations using the
- * Dijkstra algorithm. All nodes will univisited and set to INFINITE_TIME, apart
- * from the origin node which will have a distance of 0.
- */
-DijkstraGraph createDijkstraGraph(const vector<unsigned>& uids, unsigned originUid) {
-  DijkstraGraph graph;
-  for (const auto& uid : uids) {
-    if (uid == originUid) {
-      graph.insert({uid, {false, ZERO_TIME, NO_LINK}});
-    } else {
-      graph.insert({uid, {false, INFINITE_TIME, NO_LINK}});
-    }
+void printLinks(Writer& writer, const LinkRecords& links) {
+  writer.write('\n');
+  writer.write(static_cast<unsigned long long>(links.size()));
+  writer.write('\n');
+  for (const auto& link : links) {
+    writer.write(static_cast<unsigned long long>(link.uid0));
+    writer.write(' ');
+    writer.write(static_cast<unsigned long long>(link.uid1));
+    writer.write('\n');
   }
+}
+
+/* == Writer == */
 
-  return graph;
+Writer::Writer(ostream& stream)
+    : stream(stream), buffer(WRITE_BUFFER_SIZE), size(0), decimalPoint('.') {
+  // printf() follows the C locale which the GUI toolkit may change, while the
+  // C++ streams that the file format was defined with always use a dot
+  const char* point(localeconv()->decimal_point);
+  if (point != nullptr && *point != '\0') decimalPoint = *point;
 }
 
-/** Computes the access time between two nodes */
-double computeAccessTime(const NodeType& type0, const NodeType& type1,
-                         double distance) {
-  if (type0 == node::TRANSPORT && type1 == node::TRANSPORT)
-    return distance / FAST_SPEED;
-  return distance / DEFAULT_SPEED;
+Writer::~Writer() { flush(); }
+
+void Writer::write(char character) {
+  reserve(1);
+  buffer[size++] = character;
 }
 
-/** Generates a result of a path finding operation, returning whether a
- * destination was found, a list of UIDs in the path and the total distance */
-town::PathFindingResult generatePathResult(DijkstraGraph graph,
-                                           unsigned destinationUid, double distance) {
-  bool success(destinationUid != NO_LINK);
-  town::Path path;
+void Writer::write(const char* text) {
+  for (; *text != '\0'; ++text) write(*text);
+}
 
-  if (success) {
-    path.reset(new vector<unsigned>());
-    path->push_back(destinationUid);
-    auto graphNode(graph.find(destinationUid));
+void Writer::write(unsigned long long value) {
+  char digits[MAX_NUMBER_LENGTH];
+  unsigned length(0);
 
-    while (graphNode->second.parent != NO_LINK) {
-      graphNode = graph.find(graphNode->second.parent);
-      path->push_back(graphNode->first);
-    }
-    std::reverse(path->begin(), path->end());
-  }
+  do {
+    digits[length++] = '0' + value % DECIMAL_BASE;
+    value /= DECIMAL_BASE;
+  } while (value != 0);
 
-  return {success, std::move(path), distance};
+  reserve(length);
+  while (length > 0) buffer[size++] = digits[--length];
 }
 
-/** Fins the next node, and sets nextUid. Returns a bool whether a node was found */
-bool nextGraphNode(DijkstraGraph graph, unsigned& nextUid) {
-  unsigned closestUid(NO_LINK);
-  double closestDistance(INFINITE_TIME);
+/** Same representation as the default formatting of std::ostream */
+void Writer::write(double value) {
+  reserve(MAX_NUMBER_LENGTH);
+  int length(std::snprintf(&buffer[size], MAX_NUMBER_LENGTH, "%g", value));
 
-  for (const auto& node : graph) {
-    if (!node.second.visited && node.second.distance < closestDistance) {
-      closestUid = node.first;
-      closestDistance = node.second.distance;
-    }
+  if (decimalPoint != '.') {
+    for (int i(0); i < length; ++i)
+      if (buffer[size + i] == decimalPoint) buffer[size + i] = '.';
   }
+  size += length;
+}
+
+void Writer::flush() {
+  if (size > 0) stream.write(buffer.data(), size);
+  size = 0;
+}
 
-  nextUid = closestUid;
-  return closestUid != NO_LINK;
+void Writer::reserve(size_t length) {
+  if (size + length > buffer.size()) flush();
 }
 
 }  // namespace
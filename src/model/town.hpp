@@ -7,10 +7,18 @@
 
 #include <map>
 #include <memory>
+#include <set>
+#include <unordered_map>
 #include <vector>
 
+#include "components.hpp"
+#include "graph.hpp"
+#include "hierarchy.hpp"
 #include "node.hpp"
+#include "spatial.hpp"
 #include "tools.hpp"
+#include "travel.hpp"
+#include "validation.hpp"
 
 namespace {
 
@@ -32,6 +40,62 @@ struct PathFindingResult {
   double distance;
 };
 
+/** Represents a result from a path finding operation with a caller-provided path */
+struct PathQuery {
+  bool success;
+  double distance;
+};
+
+/** The results of a dual-target path finding operation, in the order of the types */
+struct DualPathFindingResult {
+  PathFindingResult first;
+  PathFindingResult second;
+};
+
+/** Same as above, with caller-provided paths */
+struct DualPathQuery {
+  PathQuery first;
+  PathQuery second;
+};
+
+/**
+ * The results of a batch of path finding operations, paths are stored back to
+ * back. The memory of a batch is reused when it is passed to another query.
+ */
+struct PathBatch {
+  /** The path of origin i is the range [offsets[i], offsets[i + 1]) of uids */
+  std::vector<unsigned> uids;
+  std::vector<size_t> offsets;
+  /** The distance of each path, or INFINITE_TIME if a path was not found */
+  std::vector<double> distances;
+  /** Scratch memory shared by the queries of the batch */
+  graph::Workspace workspace;
+};
+
+/** The travel times from a housing node to its nearest transport and production */
+struct Access {
+  unsigned uid;
+  double transport;
+  double production;
+};
+
+/** The statistics of a town, which are computed together */
+struct Statistics {
+  /** The generation of the town that they describe */
+  unsigned long generation;
+  double enj;
+  double ci;
+  double mta;
+  /** The access times of every housing node, in uid order */
+  std::vector<Access> access;
+};
+
+/** A copy of the nodes and links of a town, nodes in uid order and links in order */
+struct Records {
+  std::vector<validation::NodeRecord> nodes;
+  std::vector<validation::LinkRecord> links;
+};
+
 /* === CLASSES === */
 
 /**
@@ -47,6 +111,14 @@ class Town : public tools::Renderable {
   Town(std::vector<node::Node> nodes = std::vector<node::Node>(),
        std::vector<node::Link> links = std::vector<node::Link>());
 
+  /**
+   * Construct a town from records read from a file. Every record is validated in a
+   * single pass (see validation::validate) before the town is built.
+   * @throws The message of the first violation, if any
+   */
+  Town(const std::vector<validation::NodeRecord>& nodes,
+       const std::vector<validation::LinkRecord>& links, bool crossingsAllowed = true);
+
   void render(tools::RenderContext& context) override;
 
   /* Accessors/Manipulators */
@@ -60,21 +132,47 @@ class Town : public tools::Renderable {
   /** Returns a constant pointer to the node instance, or nullptr */
   const node::Node* getNode(const unsigned uid) const;
 
-  /** Returns a non-constant pointer to the node instance, or nullptr */
+  /**
+   * Returns a non-constant pointer to the node instance, or nullptr. The caller
+   * must call nodeChanged() once it has modified the node
+   */
   node::Node* getModifiableNode(const unsigned uid);
 
+  /** Counts a direct modification of a node as a modification of the town */
+  void nodeChanged(const unsigned uid);
+
   /** Returns a list of node uids that are a part of the town */
   std::vector<unsigned> getNodes() const;
 
+  /** Returns an immutably referenced uid-sorted map of the town's nodes */
+  const std::map<unsigned, node::Node>* getNodeMap() const;
+
   /** Removes a node by uid from the town. Does not check if the node exists */
   void removeNode(unsigned uid);
 
+  /** Removes every given node and their links at once, missing nodes are ignored */
+  void removeNodes(const std::vector<unsigned>& uids);
+
   /** Moves a node to a new position, or throws a string error on collision */
   void moveNode(unsigned uid, const tools::Vec2& newPosition);
 
   /** Resizes the given node. Careful! The new size is the radius, not the capacity */
   void resizeNode(unsigned uid, unsigned newRadius);
 
+  /**
+   * Moves every given node by the same offset. The new positions are checked once,
+   * against the neighbourhood of the moved nodes and links only.
+   * @throws On the first collision, every node is left in place
+   */
+  void moveNodes(const std::vector<unsigned>& uids, const tools::Vec2& offset);
+
+  /**
+   * Grows (or shrinks) the radius of every given node by the same amount, checked
+   * like moveNodes()
+   * @throws On the first collision, every node keeps its size
+   */
+  void resizeNodes(const std::vector<unsigned>& uids, double radiusDifference);
+
   /**
    * Adds a link to the town
    * @throws If the link's nodes are not a part of the town, or a superposition occurs
@@ -96,12 +194,50 @@ class Town : public tools::Renderable {
   /** Removes a link from the town. Does not check if the link exists */
   void removeLink(const node::Link& link);
 
+  /**
+   * Whether links may cross each other, which is allowed by default. Otherwise,
+   * addLink and moveNode only check the links around the new link's position.
+   * @throws If crossings are no longer allowed but two links already cross
+   */
+  void setCrossingsAllowed(bool allowed);
+  bool getCrossingsAllowed() const;
+
+  /* Batches */
+
+  /**
+   * Starts a batch of modifications, unless one is in progress. Until the batch is
+   * committed, the mutators only check the uids and links themselves (identical uid,
+   * duplicate link, vacuum, max link). Superpositions and crossings are checked once
+   * by commit(), around the modified nodes and links only.
+   */
+  void beginBatch();
+
+  /**
+   * Checks the nodes and links added or modified by the batch against those around
+   * them and ends the batch. The safety distance is the largest one given to the
+   * batched operations, DIST_MIN if a node was moved, resized or modified.
+   * @throws The first collision, the batch is then rolled back
+   */
+  void commit();
+
+  /** Undoes every modification of the batch, last first, and ends the batch */
+  void rollback();
+
+  /** Whether a batch is in progress */
+  bool isBatching() const;
+
   /** Calculate the town ENJ index */
-  double enj();
+  double enj() const;
   /** Calculate the town CI index */
-  double ci();
-  /** Calculate the town MTA index */
-  double mta();
+  double ci() const;
+  /** Calculate the town MTA index, see getStatistics() */
+  double mta() const;
+
+  /**
+   * Returns the indices of the town and the access times of every housing node,
+   * computed together and cached until the town is modified
+   */
+  std::shared_ptr<const Statistics> getStatistics() const;
 
   /**
    * Execute a pathfinding algorithm from an origin node to the closest node of a
@@ -113,13 +249,95 @@ class Town : public tools::Renderable {
    */
   PathFindingResult pathFind(unsigned origin, const node::NodeType& destination) const;
 
-  /** Returns the node that intersects with the given piece of space, or NO_LINK */
-  unsigned getNodeAt(tools::Vec2 position);
+  /**
+   * Same as above, but the path is written into a caller-provided vector (cleared
+   * first) and the search reuses the given workspace, avoiding any allocation once
+   * both have grown to the size of the town.
+   */
+  PathQuery pathFind(unsigned origin, const node::NodeType& destination,
+                     graph::Workspace& workspace, std::vector<unsigned>& path) const;
+
+  /**
+   * Find the closest node of each of two types with a single search from the origin,
+   * which stops once both have been found. The results are the same as those of two
+   * separate path finding operations.
+   */
+  DualPathFindingResult pathFind(unsigned origin, const node::NodeType& first,
+                                 const node::NodeType& second) const;
+
+  /** Same as above, with caller-provided paths and workspace */
+  DualPathQuery pathFind(unsigned origin, const node::NodeType& first,
+                         const node::NodeType& second, graph::Workspace& workspace,
+                         std::vector<unsigned>& firstPath,
+                         std::vector<unsigned>& secondPath) const;
+
+  /**
+   * Execute a pathfinding algorithm from an origin node to a specific destination
+   * node, with the same traversal rules as above. The search is an A* algorithm
+   * guided towards the destination, settling far fewer nodes than a Dijkstra.
+   * @throws If either node is not a part of the town
+   */
+  PathFindingResult pathFindTo(unsigned origin, unsigned destination) const;
+
+  /** Same as above, with a caller-provided path and workspace */
+  PathQuery pathFindTo(unsigned origin, unsigned destination,
+                       graph::Workspace& workspace, std::vector<unsigned>& path) const;
+
+  /** Execute a path finding operation for each origin, reusing the batch's memory */
+  void pathFind(const std::vector<unsigned>& origins,
+                const node::NodeType& destination, PathBatch& batch) const;
+
+  /** Returns a compact graph of the town, cached until the town is modified */
+  std::shared_ptr<const graph::Graph> getGraph() const;
+
+  /**
+   * Returns the travel time from every housing node to every transport and
+   * production node, computed in parallel and cached until the town is modified
+   */
+  std::shared_ptr<const travel::Matrix> getTravelMatrix() const;
+
+  /**
+   * Returns a contraction hierarchy for repeated point-to-point travel time queries,
+   * built once on first use, even by concurrent callers, and cached until the town
+   * is modified. If a sidecar path is given, a hierarchy saved there for the same
+   * graph is loaded instead of being built, and a newly built hierarchy is saved
+   * there.
+   */
+  std::shared_ptr<const hierarchy::Hierarchy> getHierarchy(
+      const std::string& sidecarPath = "") const;
+
+  /** Number of disconnected clusters of nodes, see components::Components */
+  unsigned getClusterCount() const;
+
+  /** A counter that changes whenever the nodes or links of the town are modified */
+  unsigned long getGeneration() const;
+
+  /**
+   * Returns the topmost node that contains the given position, the one drawn last,
+   * or NO_LINK
+   */
+  unsigned getNodeAt(tools::Vec2 position) const;
+
+  /** Returns the sorted uids of the nodes that overlap a box, such as a selection */
+  std::vector<unsigned> getNodesIn(const spatial::Box& box) const;
+
+  /**
+   * Returns up to count nodes nearest to a position, nearest first, measured to the
+   * edge of each node
+   */
+  std::vector<unsigned> getNearestNodes(const tools::Vec2& position,
+                                        unsigned count) const;
 
-  /** Returns the uid of the selected node, or NO_LINK */
+  /** Returns the uid of the selected node if it is the only one, or NO_LINK */
   unsigned getSelectedNode() const;
-  /** Marks the node as selected, or NO_LINK to deselect the currently selected node */
+  /** Returns the sorted uids of every selected node */
+  std::vector<unsigned> getSelection() const;
+  /** Marks the node as the only selected one, or NO_LINK to deselect every node */
   void selectNode(unsigned node);
+  /** Replaces the selection with the given nodes, missing nodes are ignored */
+  void selectNodes(const std::vector<unsigned>& nodes);
+  /** Adds a node to the selection, or removes it if it is already selected */
+  void toggleSelected(unsigned node);
 
   /** Whether to highlight the selected node's shortest paths when rendering */
   void setHighlightShortestPath(bool highlight);
@@ -132,6 +350,10 @@ class Town : public tools::Renderable {
   /** Returns an available uid value */
   unsigned availableUid() const;
 
+  friend class NodeDrag;
+  friend Town parseCached(const std::string& contents, bool crossingsAllowed,
+                          bool storeEntry);
+
  private:
   /* Attributes */
 
@@ -141,8 +363,40 @@ class Town : public tools::Renderable {
   /** A list of Link instances that are part of the town */
   std::vector<node::Link> links;
 
-  /** The selected node, or NO_LINK if no node is selected */
-  unsigned selectedNode;
+  /** The uids linked to each node, nodes without links have no entry */
+  std::unordered_map<unsigned, std::vector<unsigned>> adjacency;
+
+  /** The uids of the selected nodes */
+  std::set<unsigned> selection;
+
+  /** Connectivity of the nodes, kept up to date by every modification */
+  components::Components components;
+
+  /** Whether links may cross each other */
+  bool crossingsAllowed;
+
+  /** The links of the town, by the cells that they cross */
+  mutable spatial::LinkGrid linkGrid;
+
+  /** The boxes of the nodes by uid, refitted when a node moves or is resized */
+  mutable spatial::Bvh nodeTree;
+  /** Whether a node has been modified directly, see nodeChanged() */
+  mutable bool indicesStale;
+
+  /** Incremented by every modification of nodes or links */
+  unsigned long generation;
+
+  /** The last built graph, may be outdated. Use getGraph() */
+  mutable std::shared_ptr<const graph::Graph> graph;
+
+  /** The last computed travel matrix, may be outdated. Use getTravelMatrix() */
+  mutable std::shared_ptr<const travel::Matrix> travelMatrix;
+
+  /** The last built contraction hierarchy, may be outdated. Use getHierarchy() */
+  mutable std::shared_ptr<const hierarchy::Hierarchy> hierarchy;
+
+  /** The last computed statistics, may be outdated. Use getStatistics() */
+  mutable std::shared_ptr<const Statistics> statistics;
 
   /**
    * Whether to highlight the shortest path from the selected node to a transport
@@ -150,8 +404,44 @@ class Town : public tools::Renderable {
    */
   bool highlightShortestPath;
 
+  /** The kinds of modification recorded by a batch */
+  enum ChangeKind { ADD_NODE, REMOVE_NODE, MODIFY_NODE, ADD_LINK, REMOVE_LINK };
+
+  /**
+   * A modification recorded by a batch. Each node change has a copy of its node in
+   * batchNodes (as added, or as it was before), each link change a copy of its link
+   * in batchLinks, in the order of the changes.
+   */
+  struct Change {
+    ChangeKind kind;
+    /** Where a link was in the list of links */
+    size_t position;
+    /** Whether the last link was moved into the place of the removed link */
+    bool swapped;
+  };
+
+  /** Whether a batch is in progress, see beginBatch() */
+  bool batching;
+  /** The safety distance of the checks of the batch */
+  double batchSafety;
+  std::vector<Change> changes;
+  std::vector<node::Node> batchNodes;
+  std::vector<node::Link> batchLinks;
+
   /* Methods */
 
+  /**
+   * Construct a town from records that already passed validation, with their
+   * statistics, see loadCached()
+   */
+  Town(const std::vector<validation::NodeRecord>& nodes,
+       const std::vector<validation::LinkRecord>& links, bool crossingsAllowed,
+       const Statistics& statistics);
+
+  /** Inserts records that passed validation, without checking them again */
+  void insertValid(const std::vector<validation::NodeRecord>& nodeRecords,
+                   const std::vector<validation::LinkRecord>& linkRecords);
+
   /** Checks whether the given node intersects any town links */
   void checkNodeSuperposition(const node::Node& node,
                               const double safetyDistance = DEFAULT_SAFETY);
@@ -165,15 +455,144 @@ class Town : public tools::Renderable {
   /** Checks whether the given link intersects any town nodes. */
   void checkLinkSuperposition(const node::Link& link,
                               const double safetyDistance = DEFAULT_SAFETY);
+
+  /** Checks whether the given link crosses any town link, if it is not allowed */
+  void checkLinkCrossing(const node::Link& link) const;
+
+  /** Rebuilds the node tree and the link grid if they are stale */
+  void refreshIndices() const;
+  /** Builds a balanced node tree from every node, and the link grid */
+  void buildIndices() const;
+
+  /**
+   * Checks the given nodes, modified since the copies were made, and their links.
+   * Keeps the modifications if they are valid, otherwise restores the copies.
+   * @throws The first collision
+   */
+  void commitNodes(const std::vector<node::Node>& before);
+  /** Moves the indexed boxes of the given nodes and links to their current place */
+  void reindex(const std::vector<node::Node>& before,
+               const std::vector<node::Link>& nodeLinks);
+  /** Checks the given nodes and links against the nodes and links around them */
+  void checkNeighbourhood(const std::set<unsigned>& uids,
+                          const std::vector<node::Link>& nodeLinks,
+                          double safetyDistance) const;
+
+  /** Records the copies of nodes modified by a batch, which are checked by commit() */
+  void stageNodes(const std::vector<node::Node>& before);
+  /** Records a change of a batch */
+  void logChange(ChangeKind kind, const node::Node& node);
+  void logChange(ChangeKind kind, const node::Link& link, size_t position = 0,
+                 bool swapped = false);
+  /** Undoes and forgets the changes of the batch, last first */
+  void undoChanges();
+
+  /** The links of the given nodes, each once */
+  std::vector<node::Link> linksOf(const std::set<unsigned>& uids) const;
+  /** The number of links of a node */
+  size_t degree(unsigned uid) const;
+  /** Adds the ends of a link to, or removes them from each other's neighbours */
+  void addNeighbours(const node::Link& link);
+  void removeNeighbours(const node::Link& link);
+
+  /**
+   * Indexes the given links of a node that moved again, the town has been modified.
+   * The indices must not have been rebuilt since the node moved.
+   */
+  void nodeMoved(unsigned uid, const tools::Vec2& oldPosition,
+                 const std::vector<node::Link>& nodeLinks);
+
+  /** Adds a link to, or removes it from the link grid */
+  void indexLink(const node::Link& link);
+  void unindexLink(const node::Link& link, const tools::Vec2& position0,
+                   const tools::Vec2& position1);
+};
+
+/**
+ * Moves a node of a town repeatedly, such as while it is dragged. The other nodes
+ * and links are indexed once when the drag starts, each move then only checks the
+ * neighbourhood of the node, with the rules and errors of Town::moveNode.
+ *
+ * The town must not be modified in any other way while the drag exists.
+ */
+class NodeDrag {
+ public:
+  NodeDrag() = delete;
+  NodeDrag(Town& town, unsigned uid);
+
+  /**
+   * Moves the node, if it exists
+   * @throws If the node would collide at the new position, it is left in place
+   */
+  void moveTo(const tools::Vec2& position);
+
+ private:
+  Town* town;
+  unsigned uid;
+  /** The other nodes by uid, their boxes include the safety distance */
+  spatial::Grid nodeGrid;
+  /** The links that are not connected to the node */
+  spatial::LinkGrid linkGrid;
+  /** The links of the node, in the order of the town */
+  std::vector<node::Link> ownLinks;
+
+  void checkNodes(const node::Node& node) const;
+  void checkLinks(const node::Node& node) const;
+  void checkOwnLinks(const node::Node& node) const;
 };
 
 /* === FUNCTIONS === */
 
 /** Read the given file and parse the town */
-Town loadFromFile(const std::string& path);
+Town loadFromFile(const std::string& path, bool crossingsAllowed = true);
+
+/**
+ * Same as above, through a persistent cache (see cache.hpp) of validated towns and
+ * their statistics, found by a hash of the file's content. The town of an unchanged
+ * file is neither validated nor are its statistics computed again. Invalid files
+ * are not cached.
+ */
+Town loadCached(const std::string& path, bool crossingsAllowed = true);
+
+/**
+ * Same as loadCached(), for callers that report a missing file instead of falling
+ * back to an empty town. Without storeEntry, a town that is not in the cache is
+ * not added to it.
+ * @throws If the file can not be read or is invalid
+ */
+Town openCached(const std::string& path, bool crossingsAllowed = true,
+                bool storeEntry = true);
+
+/**
+ * Same as openCached(), from the contents of a file that the caller already read.
+ * The cache key and the town come from the same contents, even if the file changes.
+ * @throws If the town is invalid
+ */
+Town parseCached(const std::string& contents, bool crossingsAllowed = true,
+                 bool storeEntry = true);
+
+/**
+ * Read the given file and collect every rule violation of its town, instead of
+ * stopping at the first one
+ */
+std::vector<validation::Violation> validateFile(const std::string& path,
+                                                bool crossingsAllowed = true);
+
+/**
+ * Save the given town to a file, returns false if it could not be written. The town
+ * is written and synced to a temporary file of a unique name, which then replaces
+ * the file, so the file always holds a complete town.
+ */
+bool saveToFile(const std::string& path, const Town& town);
+
+/** Same as above, from a copy of a town that can be saved on another thread */
+bool saveToFile(const std::string& path, const Records& records);
+
+/** Copies the nodes and links of the town, far cheaper than copying the town */
+std::shared_ptr<const Records> copyRecords(const Town& town);
 
-/** Save the given town to a file */
-void saveToFile(const std::string& path, const Town& town);
+/** The path of the contraction hierarchy sidecar of a town file */
+std::string hierarchyPath(const std::string& townPath);
 
 }  // namespace town
 
@@ -0,0 +1,184 @@
+// archipelago v3.0.0 - architecture b2
+// trace.cpp - timeline recording in the Chrome trace-event format
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "trace.hpp"
+
+#include <atomic>  // lock-free ring buffers
+#include <chrono>
+#include <fstream>
+#include <iostream>  // cerr
+#include <memory>    // unique_ptr
+#include <mutex>     // buffer registry
+#include <vector>
+
+using std::chrono::steady_clock;
+
+namespace {
+
+/** Number of events kept per thread, older events are overwritten */
+constexpr unsigned RING_SIZE(1U << 16);
+constexpr double NS_PER_US(1e3);
+constexpr int TS_PRECISION(3);  // nanosecond resolution in microseconds
+
+constexpr char BEGIN('B');
+constexpr char END('E');
+constexpr char INSTANT('i');
+
+struct Event {
+  const char* name;
+  char phase;
+  long long timestamp;  // ns since start()
+};
+
+/**
+ * A single-producer ring buffer. The owning thread writes the event before
+ * publishing the new head, the flushing thread only reads published events.
+ */
+struct Ring {
+  unsigned tid;
+  std::atomic<unsigned long long> head;
+  std::vector<Event> events;
+};
+
+/** Owns the ring buffers, they outlive their threads until the final flush */
+struct Registry {
+  Registry();
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Ring>> rings;
+  std::string path;
+  steady_clock::time_point origin;
+  std::atomic<bool> recording;
+};
+
+Registry& registry();
+Ring& local();
+void push(char phase, const char* name);
+void writeEvent(std::ostream& stream, const Event& event, unsigned tid);
+void writeString(std::ostream& stream, const char* text);
+
+}  // namespace
+
+namespace trace {
+
+/* === FUNCTIONS === */
+
+void start(const std::string& path) {
+  Registry& reg(registry());
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  reg.path = path;
+  reg.origin = steady_clock::now();
+  for (auto& ring : reg.rings) ring->head.store(0, std::memory_order_relaxed);
+  reg.recording.store(true, std::memory_order_release);
+}
+
+bool active() { return registry().recording.load(std::memory_order_relaxed); }
+
+void stop() {
+  Registry& reg(registry());
+  if (!reg.recording.exchange(false)) return;
+
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  std::ofstream file(reg.path);
+  if (!file.is_open()) {
+    std::cerr << "Error: Could not write the trace file" << std::endl;
+    return;
+  }
+
+  bool first(true);
+  file.setf(std::ios::fixed);
+  file.precision(TS_PRECISION);
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for (const auto& ring : reg.rings) {
+    unsigned long long head(ring->head.load(std::memory_order_acquire));
+    unsigned long long tail(head > RING_SIZE ? head - RING_SIZE : 0);
+
+    for (unsigned long long i(tail); i < head; ++i) {
+      if (!first) file << ",";
+      writeEvent(file, ring->events[i % RING_SIZE], ring->tid);
+      first = false;
+    }
+  }
+  file << "]}\n";
+}
+
+void begin(const char* name) {
+  if (active()) push(BEGIN, name);
+}
+
+void end(const char* name) {
+  if (active()) push(END, name);
+}
+
+void instant(const char* name) {
+  if (active()) push(INSTANT, name);
+}
+
+/* === CLASSES === */
+
+Scope::Scope(const char* name) : name(name), recorded(active()) {
+  if (recorded) push(BEGIN, name);
+}
+
+Scope::~Scope() {
+  if (recorded) end(name);
+}
+
+}  // namespace trace
+
+namespace {
+
+Registry::Registry() : recording(false) {}
+
+Registry& registry() {
+  static Registry instance;
+  return instance;
+}
+
+/** Returns the ring of the calling thread, registering it on first use */
+Ring& local() {
+  thread_local Ring* ring(nullptr);
+  if (ring == nullptr) {
+    Registry& reg(registry());
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    reg.rings.emplace_back(new Ring());
+    ring = reg.rings.back().get();
+    ring->tid = reg.rings.size();
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->events.resize(RING_SIZE);
+  }
+  return *ring;
+}
+
+void push(char phase, const char* name) {
+  Ring& ring(local());
+  long long timestamp(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          steady_clock::now() - registry().origin)
+                          .count());
+
+  unsigned long long head(ring.head.load(std::memory_order_relaxed));
+  ring.events[head % RING_SIZE] = {name, phase, timestamp};
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+void writeEvent(std::ostream& stream, const Event& event, unsigned tid) {
+  stream << "\n{\"name\":";
+  writeString(stream, event.name);
+  stream << ",\"ph\":\"" << event.phase << "\",\"ts\":" << event.timestamp / NS_PER_US
+         << ",\"pid\":1,\"tid\":" << tid;
+  if (event.phase == INSTANT) stream << ",\"s\":\"t\"";
+  stream << "}";
+}
+
+/** Writes a JSON string literal, escaping quotes and backslashes */
+void writeString(std::ostream& stream, const char* text) {
+  stream << '"';
+  for (const char* c(text); *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') stream << '\\';
+    stream << *c;
+  }
+  stream << '"';
+}
+
+}  // namespace
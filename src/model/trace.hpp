@@ -0,0 +1,62 @@
+// archipelago v3.0.0 - architecture b2
+// trace.hpp - timeline recording in the Chrome trace-event format
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_TRACE_H
+#define MODEL_TRACE_H
+
+#include <string>
+
+/**
+ * Module: trace
+ * An opt-in timeline recorder. Spans are recorded into a fixed-size ring buffer
+ * per thread without taking any lock, and flushed as trace_event JSON that can be
+ * opened in chrome://tracing or Perfetto.
+ *
+ * Recording is disabled until start() is called, in which case each span costs a
+ * single atomic load. Span names must be string literals, only the pointer is
+ * stored.
+ */
+
+namespace trace {
+
+/* === FUNCTIONS === */
+
+/** Start recording events, they will be written to the given path by stop() */
+void start(const std::string& path);
+
+/** Whether events are currently being recorded */
+bool active();
+
+/** Stop recording and write all buffered events to the file given to start() */
+void stop();
+
+/** Open a span on the calling thread */
+void begin(const char* name);
+/** Close the last span opened on the calling thread */
+void end(const char* name);
+/** Record an event without duration */
+void instant(const char* name);
+
+/* === CLASSES === */
+
+/** RAII span that covers the lifetime of the instance */
+class Scope {
+ public:
+  Scope() = delete;
+  Scope(const char* name);
+  ~Scope();
+
+ private:
+  const char* name;
+  bool recorded;
+};
+
+}  // namespace trace
+
+/* === MACROS === */
+
+#define TRACE_SCOPE(name) trace::Scope traceScope(name)
+#define TRACE_INSTANT(name) trace::instant(name)
+
+#endif
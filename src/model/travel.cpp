@@ -0,0 +1,176 @@
+// archipelago v3.0.0 - architecture b2
+// travel.cpp - housing to service travel times
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "travel.hpp"
+
+#include <algorithm>  // min()
+#include <atomic>     // work distribution
+#include <cstdint>    // fixed-width binary format
+#include <fstream>
+#include <limits>  // infinity()
+#include <thread>
+
+#include "trace.hpp"
+
+using std::vector;
+
+namespace {
+
+constexpr char BINARY_MAGIC[]("ARCHACCM");
+constexpr unsigned MAGIC_LENGTH(8);
+constexpr char CSV_EXTENSION[](".csv");
+constexpr char CSV_HOUSING_HEADER[]("housing");
+constexpr int CSV_PRECISION(9);  // enough to round-trip a float
+
+const float UNREACHABLE(std::numeric_limits<float>::infinity());
+
+void computeColumns(const graph::Graph& graph, const vector<unsigned>& rowIndices,
+                    const vector<unsigned>& columnIndices, double maxTime,
+                    std::atomic<unsigned>& nextColumn, vector<float>& times);
+void writeUnsigned(std::ostream& stream, uint32_t value);
+bool endsWith(const std::string& text, const std::string& suffix);
+
+}  // namespace
+
+namespace travel {
+
+/* === CLASSES === */
+
+Matrix::Matrix(const graph::Graph& graph, double maxTime)
+    : generation(graph.getGeneration()) {
+  TRACE_SCOPE("travel::Matrix");
+  vector<unsigned> rowIndices, columnIndices;
+
+  for (unsigned i(0); i < graph.size(); ++i) {
+    if (graph.type(i) == node::HOUSING) {
+      housing.push_back(graph.uid(i));
+      rowIndices.push_back(i);
+    } else {
+      services.push_back(graph.uid(i));
+      columnIndices.push_back(i);
+    }
+  }
+
+  times.assign(housing.size() * services.size(), UNREACHABLE);
+  if (times.empty()) return;
+
+  // Columns are handed out one at a time, searches vary a lot in cost
+  std::atomic<unsigned> nextColumn(0);
+  const unsigned nbThreads(std::max(
+      1U, std::min<unsigned>(std::thread::hardware_concurrency(), services.size())));
+
+  vector<std::thread> workers;
+  for (unsigned i(1); i < nbThreads; ++i) {
+    workers.emplace_back(computeColumns, std::cref(graph), std::cref(rowIndices),
+                         std::cref(columnIndices), maxTime, std::ref(nextColumn),
+                         std::ref(times));
+  }
+  computeColumns(graph, rowIndices, columnIndices, maxTime, nextColumn, times);
+  for (auto& worker : workers) worker.join();
+}
+
+unsigned long Matrix::getGeneration() const { return generation; }
+const vector<unsigned>& Matrix::getHousing() const { return housing; }
+const vector<unsigned>& Matrix::getServices() const { return services; }
+
+float Matrix::at(unsigned row, unsigned column) const {
+  return times[static_cast<size_t>(row) * services.size() + column];
+}
+
+const float* Matrix::row(unsigned row) const {
+  return times.data() + static_cast<size_t>(row) * services.size();
+}
+
+/* === FUNCTIONS === */
+
+void writeCsv(std::ostream& stream, const Matrix& matrix) {
+  const auto& services(matrix.getServices());
+  stream.precision(CSV_PRECISION);
+
+  stream << CSV_HOUSING_HEADER;
+  for (const auto& uid : services) stream << ',' << uid;
+  stream << '\n';
+
+  for (unsigned row(0); row < matrix.getHousing().size(); ++row) {
+    const float* times(matrix.row(row));
+    stream << matrix.getHousing()[row];
+    for (unsigned column(0); column < services.size(); ++column)
+      stream << ',' << times[column];
+    stream << '\n';
+  }
+}
+
+void writeBinary(std::ostream& stream, const Matrix& matrix) {
+  const auto& housing(matrix.getHousing());
+  const auto& services(matrix.getServices());
+
+  stream.write(BINARY_MAGIC, MAGIC_LENGTH);
+  writeUnsigned(stream, housing.size());
+  writeUnsigned(stream, services.size());
+  for (const auto& uid : housing) writeUnsigned(stream, uid);
+  for (const auto& uid : services) writeUnsigned(stream, uid);
+
+  if (!housing.empty() && !services.empty()) {
+    stream.write(reinterpret_cast<const char*>(matrix.row(0)),
+                 sizeof(float) * housing.size() * services.size());
+  }
+}
+
+bool saveToFile(const std::string& path, const Matrix& matrix) {
+  const bool csv(endsWith(path, CSV_EXTENSION));
+  std::ofstream file(path, csv ? std::ios::out : std::ios::out | std::ios::binary);
+
+  if (!file.is_open()) {
+    std::cerr << "Error: Could not open file" << std::endl;
+    return false;
+  }
+
+  if (csv) {
+    writeCsv(file, matrix);
+  } else {
+    writeBinary(file, matrix);
+  }
+
+  file.close();
+  if (file.fail()) {
+    std::cerr << "Error: Could not write file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace travel
+
+namespace {
+
+/** Worker loop, each column is written by exactly one thread */
+void computeColumns(const graph::Graph& graph, const vector<unsigned>& rowIndices,
+                    const vector<unsigned>& columnIndices, double maxTime,
+                    std::atomic<unsigned>& nextColumn, vector<float>& times) {
+  TRACE_SCOPE("travel::computeColumns");
+  graph::Workspace workspace;
+  const size_t nbColumns(columnIndices.size());
+
+  for (unsigned column(nextColumn++); column < nbColumns; column = nextColumn++) {
+    graph::towards(graph, workspace, columnIndices[column], maxTime);
+
+    for (size_t row(0); row < rowIndices.size(); ++row) {
+      const unsigned index(rowIndices[row]);
+      const double time(workspace.getDistance(index));
+      if (workspace.isSettled(index) && time <= maxTime)
+        times[row * nbColumns + column] = time;
+    }
+  }
+}
+
+void writeUnsigned(std::ostream& stream, uint32_t value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool endsWith(const std::string& text, const std::string& suffix) {
+  return text.size() >= suffix.size() &&
+         text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
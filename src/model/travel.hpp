@@ -0,0 +1,73 @@
+// archipelago v3.0.0 - architecture b2
+// travel.hpp - housing to service travel times
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_TRAVEL_H
+#define MODEL_TRAVEL_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "constants.hpp"
+#include "graph.hpp"
+
+namespace travel {
+
+/* === CLASSES === */
+
+/**
+ * The access time from every housing node (rows) to every transport and production
+ * node (columns), stored row-major in single precision. Unreachable pairs are
+ * infinite.
+ *
+ * The matrix is computed with one search per service node, outwards from the
+ * service, distributed over all available cores.
+ */
+class Matrix {
+ public:
+  Matrix() = delete;
+  /** Compute the matrix, pairs further apart than maxTime are left infinite */
+  Matrix(const graph::Graph& graph, double maxTime = INFINITE_TIME);
+
+  /** The generation of the town graph that the matrix was computed from */
+  unsigned long getGeneration() const;
+
+  /** The uids of the housing nodes, in row order */
+  const std::vector<unsigned>& getHousing() const;
+  /** The uids of the transport and production nodes, in column order */
+  const std::vector<unsigned>& getServices() const;
+
+  /** Access time from the housing node of a row to the service node of a column */
+  float at(unsigned row, unsigned column) const;
+  /** Pointer to the first element of a row */
+  const float* row(unsigned row) const;
+
+ private:
+  unsigned long generation;
+  std::vector<unsigned> housing;
+  std::vector<unsigned> services;
+  std::vector<float> times;
+};
+
+/* === FUNCTIONS === */
+
+/** Write the matrix as CSV, with a header row of service uids */
+void writeCsv(std::ostream& stream, const Matrix& matrix);
+
+/**
+ * Write the matrix in a binary format: the "ARCHACCM" magic, the row and column
+ * counts and uids as 32-bit integers, followed by the row-major 32-bit floats.
+ * Values are written in the byte order of the host.
+ */
+void writeBinary(std::ostream& stream, const Matrix& matrix);
+
+/**
+ * Save the matrix to a file, as CSV if the path ends with .csv, else binary.
+ * Returns false if the file could not be written.
+ */
+bool saveToFile(const std::string& path, const Matrix& matrix);
+
+}  // namespace travel
+
+#endif
@@ -0,0 +1,382 @@
+// archipelago v3.0.0 - architecture b2
+// validation.cpp - collection of every town rule violation
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "validation.hpp"
+
+#include <algorithm>  // sort(), lower_bound(), min(), max()
+#include <atomic>     // work distribution
+#include <cmath>      // sqrt()
+#include <thread>
+#include <tuple>  // tie()
+#include <unordered_map>
+#include <utility>  // pair
+
+#include "constants.hpp"
+#include "error.hpp"
+#include "spatial.hpp"
+#include "trace.hpp"
+
+using std::vector;
+using tools::Vec2;
+using validation::LinkRecord;
+using validation::NodeRecord;
+using validation::Violation;
+
+namespace {
+
+/** Records are checked without any margin, like a town built from a file */
+constexpr double SAFETY_DISTANCE(0.);
+constexpr double MIN_CELL_SIZE(1.);
+constexpr size_t CHUNK_SIZE(256);  // records handed to a thread at once
+constexpr double HALF(0.5);
+
+/** The order in which a town built record by record checks its rules */
+enum Phase { FIELDS, SELF_LINKS, NODES, LINKS };
+enum LinkCheck { DUPLICATE, VACUUM, MAX_LINK_0, MAX_LINK_1, SUPERPOSITION, CROSSING };
+
+/** A violation and its position in the order of the checks */
+struct Finding {
+  Phase phase;
+  size_t index;
+  unsigned check;
+  unsigned uid;
+  Violation violation;
+};
+
+typedef std::pair<unsigned, unsigned> UidIndex;
+
+/** State shared by the checks of a validation */
+struct Context {
+  const vector<NodeRecord>& nodes;
+  const vector<LinkRecord>& links;
+  /** (uid, index) of each node, sorted */
+  vector<UidIndex> uids;
+  /** Index of the first node with the uid of each link end, or NO_LINK */
+  vector<unsigned> ends0, ends1;
+  /** Whether the link is a copy of an earlier one, or refers to itself */
+  vector<bool> skipped;
+  spatial::Grid grid;
+};
+
+unsigned firstNode(const Context& context, unsigned uid);
+double radius(const NodeRecord& node);
+Vec2 linkLocation(const Context& context, size_t index);
+bool operator<(const Finding& finding0, const Finding& finding1);
+
+template <typename Task>
+void collect(size_t count, vector<Finding>& findings, Task task,
+             const Context& context);
+
+void checkFields(const Context& context, size_t index, vector<Finding>& findings);
+void checkSelfLink(const Context& context, size_t index, vector<Finding>& findings);
+void checkNode(const Context& context, size_t index, vector<Finding>& findings);
+void checkLinkReferences(Context& context, vector<Finding>& findings);
+void checkLinkSuperposition(const Context& context, size_t index,
+                            vector<Finding>& findings);
+void checkLinkCrossings(const Context& context, vector<Finding>& findings);
+
+}  // namespace
+
+namespace validation {
+
+/* === FUNCTIONS === */
+
+vector<Violation> validate(const vector<NodeRecord>& nodes,
+                           const vector<LinkRecord>& links, bool crossingsAllowed) {
+  TRACE_SCOPE("validation::validate");
+
+  // Cells of about one node across keep the candidate lists short
+  double diameters(0.);
+  for (const auto& node : nodes) diameters += 2 * radius(node);
+  const double cellSize(nodes.empty()
+                            ? MIN_CELL_SIZE
+                            : std::max(MIN_CELL_SIZE, diameters / nodes.size()));
+
+  Context context{nodes, links, {}, {}, {}, {}, spatial::Grid(cellSize)};
+  context.uids.reserve(nodes.size());
+  for (unsigned i(0); i < nodes.size(); ++i) context.uids.push_back({nodes[i].uid, i});
+  std::sort(context.uids.begin(), context.uids.end());
+
+  // Only the first node of each uid is a part of the town
+  for (unsigned i(0); i < nodes.size(); ++i) {
+    if (firstNode(context, nodes[i].uid) == i)
+      context.grid.insert(i, spatial::around(nodes[i].position, radius(nodes[i])));
+  }
+
+  vector<Finding> findings;
+  collect(nodes.size(), findings, checkFields, context);
+  collect(links.size(), findings, checkSelfLink, context);
+  collect(nodes.size(), findings, checkNode, context);
+  checkLinkReferences(context, findings);
+  collect(links.size(), findings, checkLinkSuperposition, context);
+  if (!crossingsAllowed) checkLinkCrossings(context, findings);
+
+  std::sort(findings.begin(), findings.end());
+  vector<Violation> violations;
+  violations.reserve(findings.size());
+  for (const auto& finding : findings) violations.push_back(finding.violation);
+  return violations;
+}
+
+std::string message(const Violation& violation) {
+  switch (violation.kind) {
+    case RESERVED_UID:
+      return error::reserved_uid();
+    case TOO_LITTLE_CAPACITY:
+      return error::too_little_capacity(violation.capacity);
+    case TOO_MUCH_CAPACITY:
+      return error::too_much_capacity(violation.capacity);
+    case SELF_LINK_NODE:
+      return error::self_link_node(violation.uid0);
+    case IDENTICAL_UID:
+      return error::identical_uid(violation.uid0);
+    case NODE_NODE_SUPERPOSITION:
+      return error::node_node_superposition(violation.uid0, violation.uid1);
+    case MULTIPLE_SAME_LINK:
+      return error::multiple_same_link(violation.uid0, violation.uid1);
+    case LINK_VACUUM:
+      return error::link_vacuum(violation.uid0);
+    case MAX_LINK:
+      return error::max_link(violation.uid0);
+    case LINK_LINK_SUPERPOSITION:
+      return error::link_link_superposition(violation.uid0, violation.uid1,
+                                            violation.crossedUid0,
+                                            violation.crossedUid1);
+    default:
+      return error::node_link_superposition(violation.uid0);
+  }
+}
+
+}  // namespace validation
+
+namespace {
+
+/** Index of the first node with the uid, or NO_LINK */
+unsigned firstNode(const Context& context, unsigned uid) {
+  auto it(
+      std::lower_bound(context.uids.begin(), context.uids.end(), UidIndex(uid, 0)));
+  if (it == context.uids.end() || it->first != uid) return NO_LINK;
+  return it->second;
+}
+
+/** Same as Node::radius() */
+double radius(const NodeRecord& node) { return std::sqrt(node.capacity); }
+
+/** The middle of a link, or its only existing end */
+Vec2 linkLocation(const Context& context, size_t index) {
+  const unsigned end0(context.ends0[index]), end1(context.ends1[index]);
+  if (end0 == NO_LINK && end1 == NO_LINK) return Vec2();
+  if (end0 == NO_LINK) return context.nodes[end1].position;
+  if (end1 == NO_LINK) return context.nodes[end0].position;
+  return (context.nodes[end0].position + context.nodes[end1].position) * HALF;
+}
+
+bool operator<(const Finding& finding0, const Finding& finding1) {
+  return std::tie(finding0.phase, finding0.index, finding0.check, finding0.uid) <
+         std::tie(finding1.phase, finding1.index, finding1.check, finding1.uid);
+}
+
+/**
+ * Runs a task for each index on every core, records are handed out in chunks. The
+ * findings of all threads are appended to the given vector, in no particular order.
+ */
+template <typename Task>
+void collect(size_t count, vector<Finding>& findings, Task task,
+             const Context& context) {
+  std::atomic<size_t> next(0);
+  const unsigned nbThreads(std::max(
+      1U, std::min<unsigned>(std::thread::hardware_concurrency(),
+                             (count + CHUNK_SIZE - 1) / CHUNK_SIZE)));
+  vector<vector<Finding>> results(nbThreads);
+
+  auto worker = [&](unsigned thread) {
+    for (size_t begin(next.fetch_add(CHUNK_SIZE)); begin < count;
+         begin = next.fetch_add(CHUNK_SIZE)) {
+      for (size_t i(begin); i < std::min(begin + CHUNK_SIZE, count); ++i)
+        task(context, i, results[thread]);
+    }
+  };
+
+  vector<std::thread> threads;
+  for (unsigned i(1); i < nbThreads; ++i) threads.emplace_back(worker, i);
+  worker(0);
+  for (auto& thread : threads) thread.join();
+
+  for (const auto& result : results)
+    findings.insert(findings.end(), result.begin(), result.end());
+}
+
+/** Checks the uid and capacity of a node, which the Node class enforces */
+void checkFields(const Context& context, size_t index, vector<Finding>& findings) {
+  const NodeRecord& node(context.nodes[index]);
+  Violation violation{validation::RESERVED_UID, node.uid, NO_LINK,
+                      node.capacity, node.position, node.line, NO_LINK, NO_LINK};
+
+  if (node.uid == NO_LINK) findings.push_back({FIELDS, index, 0, 0, violation});
+
+  if (node.capacity < MIN_CAPACITY) {
+    violation.kind = validation::TOO_LITTLE_CAPACITY;
+    findings.push_back({FIELDS, index, 1, 0, violation});
+  } else if (node.capacity > MAX_CAPACITY) {
+    violation.kind = validation::TOO_MUCH_CAPACITY;
+    findings.push_back({FIELDS, index, 1, 0, violation});
+  }
+}
+
+void checkSelfLink(const Context& context, size_t index, vector<Finding>& findings) {
+  const LinkRecord& link(context.links[index]);
+  if (link.uid0 != link.uid1) return;
+
+  const unsigned node(firstNode(context, link.uid0));
+  const Vec2 location(node == NO_LINK ? Vec2() : context.nodes[node].position);
+  findings.push_back({SELF_LINKS, index, 0, 0,
+                      {validation::SELF_LINK_NODE, link.uid0, NO_LINK, 0, location,
+                       link.line, NO_LINK, NO_LINK}});
+}
+
+/** Checks a node against the nodes that precede it */
+void checkNode(const Context& context, size_t index, vector<Finding>& findings) {
+  const NodeRecord& node(context.nodes[index]);
+  if (firstNode(context, node.uid) != index) {
+    findings.push_back({NODES, index, 0, 0,
+                        {validation::IDENTICAL_UID, node.uid, NO_LINK, 0,
+                         node.position, node.line, NO_LINK, NO_LINK}});
+    return;
+  }
+
+  vector<unsigned> candidates;
+  context.grid.query(spatial::around(node.position, radius(node)), candidates);
+
+  for (const auto& candidate : candidates) {
+    if (candidate >= index) break;  // sorted, only earlier nodes remain to be checked
+
+    const NodeRecord& other(context.nodes[candidate]);
+    const double distance((node.position - other.position).norm());
+    if (distance <= radius(node) + radius(other) + SAFETY_DISTANCE) {
+      findings.push_back({NODES, index, 1, other.uid,
+                          {validation::NODE_NODE_SUPERPOSITION, node.uid, other.uid, 0,
+                           node.position, node.line, NO_LINK, NO_LINK}});
+    }
+  }
+}
+
+/**
+ * Checks duplicate links, missing nodes and the housing link limit. The limit
+ * depends on the links that precede, so this runs in file order.
+ */
+void checkLinkReferences(Context& context, vector<Finding>& findings) {
+  const auto& links(context.links);
+  context.ends0.resize(links.size());
+  context.ends1.resize(links.size());
+  context.skipped.assign(links.size(), false);
+
+  // Sorting the links by their (smallest, largest) uids reveals the duplicates
+  vector<std::pair<UidIndex, unsigned>> pairs;
+  pairs.reserve(links.size());
+  for (unsigned i(0); i < links.size(); ++i) {
+    const unsigned uid0(std::min(links[i].uid0, links[i].uid1));
+    const unsigned uid1(std::max(links[i].uid0, links[i].uid1));
+    context.ends0[i] = firstNode(context, uid0);
+    context.ends1[i] = firstNode(context, uid1);
+    pairs.push_back({{uid0, uid1}, i});
+  }
+  std::sort(pairs.begin(), pairs.end());
+
+  vector<bool> duplicate(links.size(), false);
+  for (size_t i(1); i < pairs.size(); ++i)
+    if (pairs[i].first == pairs[i - 1].first) duplicate[pairs[i].second] = true;
+
+  std::unordered_map<unsigned, unsigned> degrees;
+  for (unsigned i(0); i < links.size(); ++i) {
+    const LinkRecord& link(links[i]);
+    const unsigned uid0(std::min(link.uid0, link.uid1));
+    const unsigned uid1(std::max(link.uid0, link.uid1));
+    const unsigned ends[]{context.ends0[i], context.ends1[i]};
+    const unsigned uids[]{uid0, uid1};
+    Violation violation{validation::MULTIPLE_SAME_LINK, uid0, uid1, 0,
+                        linkLocation(context, i), link.line, NO_LINK, NO_LINK};
+
+    if (uid0 == uid1) {
+      context.skipped[i] = true;
+    } else if (duplicate[i]) {
+      findings.push_back({LINKS, i, DUPLICATE, 0, violation});
+      context.skipped[i] = true;
+    } else if (ends[0] == NO_LINK || ends[1] == NO_LINK) {
+      violation.kind = validation::LINK_VACUUM;
+      violation.uid0 = ends[0] == NO_LINK ? uid0 : uid1;
+      violation.uid1 = NO_LINK;
+      findings.push_back({LINKS, i, VACUUM, 0, violation});
+      context.skipped[i] = true;
+    } else {
+      // A link that exceeds the limit is not counted towards it
+      bool accepted(true);
+      for (unsigned end(0); end < 2; ++end) {
+        const NodeRecord& node(context.nodes[ends[end]]);
+        if (node.type == node::HOUSING && degrees[uids[end]] >= MAX_LINK) {
+          violation.kind = validation::MAX_LINK;
+          violation.uid0 = uids[end];
+          violation.uid1 = NO_LINK;
+          violation.location = node.position;
+          findings.push_back(
+              {LINKS, i, end == 0 ? MAX_LINK_0 : MAX_LINK_1, 0, violation});
+          accepted = false;
+        }
+      }
+      if (accepted) {
+        ++degrees[uid0];
+        ++degrees[uid1];
+      }
+    }
+  }
+}
+
+/** Checks whether a link crosses a node other than its ends */
+void checkLinkSuperposition(const Context& context, size_t index,
+                            vector<Finding>& findings) {
+  if (context.skipped[index]) return;
+
+  const NodeRecord& end0(context.nodes[context.ends0[index]]);
+  const NodeRecord& end1(context.nodes[context.ends1[index]]);
+  vector<unsigned> candidates;
+  context.grid.query(end0.position, end1.position, candidates);
+
+  for (const auto& candidate : candidates) {
+    const NodeRecord& node(context.nodes[candidate]);
+    if (node.uid == end0.uid || node.uid == end1.uid) continue;
+
+    if (tools::minPointSegmentDistance(node.position, end0.position, end1.position) <=
+        radius(node) + SAFETY_DISTANCE) {
+      findings.push_back({LINKS, index, SUPERPOSITION, node.uid,
+                          {validation::NODE_LINK_SUPERPOSITION, node.uid, NO_LINK, 0,
+                           node.position, context.links[index].line, NO_LINK,
+                           NO_LINK}});
+    }
+  }
+}
+
+/** Checks every pair of links at once, each crossing is reported by the later link */
+void checkLinkCrossings(const Context& context, vector<Finding>& findings) {
+  TRACE_SCOPE("validation::checkLinkCrossings");
+  vector<tools::Segment> segments;
+  vector<size_t> indices;
+  for (size_t i(0); i < context.links.size(); ++i) {
+    if (context.skipped[i]) continue;
+    segments.push_back({context.nodes[context.ends0[i]].position,
+                        context.nodes[context.ends1[i]].position});
+    indices.push_back(i);
+  }
+
+  // Links of the same node meet at its centre, which is not a crossing
+  for (const auto& crossing : tools::findCrossings(segments)) {
+    const size_t earlier(indices[crossing.first]), later(indices[crossing.second]);
+    const LinkRecord& link(context.links[later]);
+    const LinkRecord& crossed(context.links[earlier]);
+    findings.push_back({LINKS, later, CROSSING, static_cast<unsigned>(earlier),
+                        {validation::LINK_LINK_SUPERPOSITION, link.uid0, link.uid1, 0,
+                         linkLocation(context, later), link.line, crossed.uid0,
+                         crossed.uid1}});
+  }
+}
+
+}  // namespace
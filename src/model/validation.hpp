@@ -0,0 +1,86 @@
+// archipelago v3.0.0 - architecture b2
+// validation.hpp - collection of every town rule violation
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_VALIDATION_H
+#define MODEL_VALIDATION_H
+
+#include <string>
+#include <vector>
+
+#include "node.hpp"
+#include "tools.hpp"
+
+namespace validation {
+
+/* === DEFINITIONS === */
+
+/** The rules of a town, each with a matching message in the error module */
+enum Kind {
+  RESERVED_UID,
+  TOO_LITTLE_CAPACITY,
+  TOO_MUCH_CAPACITY,
+  SELF_LINK_NODE,
+  IDENTICAL_UID,
+  NODE_NODE_SUPERPOSITION,
+  MULTIPLE_SAME_LINK,
+  LINK_VACUUM,
+  MAX_LINK,
+  NODE_LINK_SUPERPOSITION,
+  /** Only checked if crossings are not allowed */
+  LINK_LINK_SUPERPOSITION
+};
+
+/** A node as it was read, before any validation. Line is 0 if unknown */
+struct NodeRecord {
+  node::NodeType type;
+  unsigned uid;
+  tools::Vec2 position;
+  unsigned capacity;
+  unsigned line;
+};
+
+/** A link as it was read, before any validation. Line is 0 if unknown */
+struct LinkRecord {
+  unsigned uid0;
+  unsigned uid1;
+  unsigned line;
+};
+
+/** A broken rule, unused uids are NO_LINK */
+struct Violation {
+  Kind kind;
+  unsigned uid0;
+  unsigned uid1;
+  /** The offending capacity of a capacity violation */
+  unsigned capacity;
+  /** Where the violation is in the town */
+  tools::Vec2 location;
+  /** The line of the record at fault */
+  unsigned line;
+  /** The earlier link that a link crosses */
+  unsigned crossedUid0;
+  unsigned crossedUid1;
+};
+
+/* === FUNCTIONS === */
+
+/**
+ * Checks the records against every rule of a town, in parallel and with a spatial
+ * index, without stopping at the first violation. Crossing links are found with a
+ * single sweep (see tools::findCrossings), unless they are allowed.
+ *
+ * Violations are ordered as a town built record by record would encounter them,
+ * the first one is the error that the town would throw. Records that are already at
+ * fault, such as a duplicate node or link, are not checked any further.
+ */
+std::vector<Violation> validate(const std::vector<NodeRecord>& nodes,
+                                const std::vector<LinkRecord>& links,
+                                bool crossingsAllowed = true);
+
+/** The message of the error module that describes the violation */
+std::string message(const Violation& violation);
+
+}  // namespace validation
+
+#endif
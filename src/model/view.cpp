@@ -0,0 +1,492 @@
+// archipelago v3.0.0 - architecture b2
+// view.cpp - read-only town queries over a memory-mapped snapshot
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "view.hpp"
+
+#include <fcntl.h>     // open()
+#include <sys/mman.h>  // mmap(), munmap()
+#include <sys/stat.h>  // fstat(), stat(), fchmod()
+#include <unistd.h>    // close(), unlink()
+
+#include <algorithm>  // max(), min(), equal()
+#include <cmath>      // floor(), sqrt()
+#include <cstdint>    // fixed-width binary format
+#include <cstdio>     // rename()
+#include <cstdlib>    // mkstemp()
+#include <fstream>
+#include <iostream>  // cerr
+
+#include "constants.hpp"
+#include "error.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+constexpr char BINARY_MAGIC[]("ARCHSV01");
+constexpr unsigned MAGIC_LENGTH(8);
+constexpr size_t SECTION_ALIGNMENT(8);
+constexpr char TEMPORARY_SUFFIX[](".tmp.XXXXXX");  // a snapshot being saved
+constexpr mode_t FILE_MODE(0644);  // a new snapshot, mkstemp() creates 0600
+
+constexpr double NODES_PER_CELL(2.);
+constexpr double MIN_CELL_SIZE(1.);
+constexpr double MAX_CELLS_PER_AXIS(4096.);
+
+static_assert(sizeof(node::NodeType) == sizeof(uint32_t), "types are mapped");
+static_assert(sizeof(tools::Vec2) == 2 * sizeof(double), "positions are mapped");
+
+/** The byte offset of each section, in file order */
+struct Layout {
+  size_t uids;
+  size_t types;
+  size_t positions;
+  size_t capacities;
+  size_t offsets;
+  size_t targets;
+  size_t weights;
+  size_t cellOffsets;
+  size_t cellNodes;
+  size_t end;
+};
+
+Layout layoutOf(const view::Header& header);
+size_t padded(size_t size);
+bool isConsistent(const view::Header& header, const graph::Columns& columns,
+                  const uint32_t* types, const unsigned* cellOffsets,
+                  const unsigned* cellNodes);
+bool isIndex(const unsigned* offsets, size_t size, size_t end);
+void buildGrid(const graph::Columns& columns, view::Header& header,
+               vector<unsigned>& cellOffsets, vector<unsigned>& cellNodes);
+void cellRange(const view::Header& header, double low, double high, uint32_t count,
+               bool vertical, unsigned& first, unsigned& last);
+unsigned clampCell(double cell, uint32_t count);
+void writeSection(std::ostream& stream, const void* data, size_t size);
+/**
+ * Creates a file of a unique name next to the path, with the mode of the file that
+ * it replaces. Returns its name, empty if it could not be created.
+ */
+string createTemporary(const string& path);
+
+}  // namespace
+
+namespace view {
+
+/* === DEFINITIONS === */
+
+/**
+ * The header is followed by the sections, each padded to SECTION_ALIGNMENT bytes:
+ * uids, types, positions and capacities of the nodes in uid order, the nbNodes + 1
+ * edge offsets, the edge targets and weights, the nbCells + 1 cell offsets and the
+ * node indices of each cell.
+ */
+struct Header {
+  char magic[MAGIC_LENGTH];
+  uint64_t nbNodes;
+  uint64_t nbEdges;
+  uint64_t nbCells;
+  uint64_t nbEntries;
+  double enj;
+  double ci;
+  double mta;
+  /** The grid starts at (gridX, gridY) and has columns * rows square cells */
+  double gridX;
+  double gridY;
+  double cellSize;
+  uint32_t columns;
+  uint32_t rows;
+};
+
+/* === CLASSES === */
+
+TownView::TownView(const string& path)
+    : mapping(MAP_FAILED), length(0), header(nullptr) {
+  TRACE_SCOPE("view::TownView");
+  const int file(open(path.c_str(), O_RDONLY));
+  if (file < 0) throw string("Could not open file\n");
+
+  struct stat status;
+  if (fstat(file, &status) == 0 &&
+      static_cast<size_t>(status.st_size) >= sizeof(Header)) {
+    length = status.st_size;
+    mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, file, 0);
+  }
+  close(file);
+  if (mapping == MAP_FAILED) throw string("Not a town snapshot\n");
+
+  const char* const base(static_cast<const char*>(mapping));
+  header = reinterpret_cast<const Header*>(base);
+
+  // Counts are checked before the layout, which could otherwise overflow
+  const bool validHeader(
+      std::equal(header->magic, header->magic + MAGIC_LENGTH, BINARY_MAGIC) &&
+      header->nbNodes < NO_LINK && header->nbEdges < NO_LINK &&
+      header->nbEntries < NO_LINK &&
+      header->nbCells == static_cast<uint64_t>(header->columns) * header->rows);
+  const Layout layout(validHeader ? layoutOf(*header) : Layout());
+
+  if (!validHeader || layout.end != length) {
+    munmap(mapping, length);
+    throw string("Not a town snapshot\n");
+  }
+
+  const graph::Columns columns{
+      static_cast<unsigned>(header->nbNodes),
+      reinterpret_cast<const unsigned*>(base + layout.uids),
+      reinterpret_cast<const node::NodeType*>(base + layout.types),
+      reinterpret_cast<const tools::Vec2*>(base + layout.positions),
+      reinterpret_cast<const unsigned*>(base + layout.capacities),
+      reinterpret_cast<const unsigned*>(base + layout.offsets),
+      reinterpret_cast<const unsigned*>(base + layout.targets),
+      reinterpret_cast<const double*>(base + layout.weights)};
+  cellOffsets = reinterpret_cast<const unsigned*>(base + layout.cellOffsets);
+  cellNodes = reinterpret_cast<const unsigned*>(base + layout.cellNodes);
+
+  // The types are checked as integers, before they are read as node types
+  const uint32_t* types(reinterpret_cast<const uint32_t*>(base + layout.types));
+  if (!isConsistent(*header, columns, types, cellOffsets, cellNodes)) {
+    munmap(mapping, length);
+    throw string("Not a town snapshot\n");
+  }
+  graph.reset(new graph::Graph(columns, 0));
+}
+
+TownView::~TownView() { munmap(mapping, length); }
+
+bool TownView::getNode(unsigned uid, NodeEntry& node) const {
+  const unsigned index(graph->index(uid));
+  if (index == NO_LINK) return false;
+
+  node = {uid, graph->type(index), graph->position(index), graph->capacity(index)};
+  return true;
+}
+
+vector<unsigned> TownView::getNodes() const {
+  const graph::Columns& columns(graph->getColumns());
+  return vector<unsigned>(columns.uids, columns.uids + columns.nbNodes);
+}
+
+vector<unsigned> TownView::getLinkedNodes(unsigned uid) const {
+  const unsigned index(graph->index(uid));
+  if (index == NO_LINK) throw error::link_vacuum;
+
+  vector<unsigned> nodeLinks;
+  for (unsigned edge(graph->edgesBegin(index)); edge < graph->edgesEnd(index);
+       ++edge) {
+    nodeLinks.push_back(graph->uid(graph->target(edge)));
+  }
+  return nodeLinks;
+}
+
+double TownView::enj() const { return header->enj; }
+double TownView::ci() const { return header->ci; }
+double TownView::mta() const { return header->mta; }
+
+town::PathQuery TownView::pathFind(unsigned originUid,
+                                   const node::NodeType& searchType,
+                                   graph::Workspace& workspace,
+                                   vector<unsigned>& path) const {
+  METRICS_TIMER(PATH_FIND);
+  path.clear();
+
+  const unsigned origin(graph->index(originUid));
+  if (origin == NO_LINK) throw string("Node does not exist");
+
+  const graph::Search search(graph::nearest(*graph, workspace, origin, searchType));
+  if (search.destination == NO_LINK) return {false, INFINITE_TIME};
+
+  graph::tracePath(*graph, workspace, search.destination, path);
+  return {true, search.distance};
+}
+
+town::DualPathQuery TownView::pathFind(unsigned originUid, const node::NodeType& first,
+                                       const node::NodeType& second,
+                                       graph::Workspace& workspace,
+                                       vector<unsigned>& firstPath,
+                                       vector<unsigned>& secondPath) const {
+  METRICS_TIMER(PATH_FIND);
+  firstPath.clear();
+  secondPath.clear();
+
+  const unsigned origin(graph->index(originUid));
+  if (origin == NO_LINK) throw string("Node does not exist");
+
+  const graph::DualSearch search(
+      graph::nearest(*graph, workspace, origin, first, second));
+  town::DualPathQuery query{{false, INFINITE_TIME}, {false, INFINITE_TIME}};
+
+  if (search.first.destination != NO_LINK) {
+    graph::tracePath(*graph, workspace, search.first.destination, firstPath);
+    query.first = {true, search.first.distance};
+  }
+  if (search.second.destination != NO_LINK) {
+    graph::tracePath(*graph, workspace, search.second.destination, secondPath);
+    query.second = {true, search.second.distance};
+  }
+  return query;
+}
+
+town::PathQuery TownView::pathFindTo(unsigned originUid, unsigned destinationUid,
+                                     graph::Workspace& workspace,
+                                     vector<unsigned>& path) const {
+  METRICS_TIMER(PATH_FIND);
+  path.clear();
+
+  const unsigned origin(graph->index(originUid));
+  const unsigned destination(graph->index(destinationUid));
+  if (origin == NO_LINK || destination == NO_LINK)
+    throw string("Node does not exist");
+
+  const graph::Search search(graph::route(*graph, workspace, origin, destination));
+  if (search.destination == NO_LINK) return {false, INFINITE_TIME};
+
+  graph::tracePath(*graph, workspace, search.destination, path);
+  return {true, search.distance};
+}
+
+unsigned TownView::getNodeAt(const tools::Vec2& position) const {
+  if (header->nbCells == 0) return NO_LINK;
+  const unsigned cell(cellOf(position));
+
+  // Cells list their nodes in uid order, the last one is drawn on top
+  for (unsigned i(cellOffsets[cell + 1]); i > cellOffsets[cell]; --i) {
+    const unsigned index(cellNodes[i - 1]);
+    const double radius(std::sqrt(graph->capacity(index)));
+    if ((graph->position(index) - position).norm() <= radius) return graph->uid(index);
+  }
+  return NO_LINK;
+}
+
+const graph::Graph& TownView::getGraph() const { return *graph; }
+
+/** Positions outside of the grid belong to the nearest edge cell */
+unsigned TownView::cellOf(const tools::Vec2& position) const {
+  unsigned column, row, last;
+  cellRange(*header, position.getX(), position.getX(), header->columns, false,
+            column, last);
+  cellRange(*header, position.getY(), position.getY(), header->rows, true, row, last);
+  return row * header->columns + column;
+}
+
+/* === FUNCTIONS === */
+
+bool saveSnapshot(const string& path, const town::Town& town) {
+  TRACE_SCOPE("view::saveSnapshot");
+  const string temporary(createTemporary(path));
+  std::ofstream file;
+  if (!temporary.empty()) file.open(temporary, std::ios::out | std::ios::binary);
+  if (!file.is_open()) {
+    if (!temporary.empty()) unlink(temporary.c_str());
+    std::cerr << "Error: Could not open file" << std::endl;
+    return false;
+  }
+
+  const auto townGraph(town.getGraph());
+  const auto statistics(town.getStatistics());
+  const graph::Columns& columns(townGraph->getColumns());
+
+  Header header{};
+  std::copy(BINARY_MAGIC, BINARY_MAGIC + MAGIC_LENGTH, header.magic);
+  header.nbNodes = columns.nbNodes;
+  header.nbEdges = columns.offsets[columns.nbNodes];
+  header.enj = statistics->enj;
+  header.ci = statistics->ci;
+  header.mta = statistics->mta;
+
+  vector<unsigned> cellOffsets, cellNodes;
+  buildGrid(columns, header, cellOffsets, cellNodes);
+
+  const size_t nbNodes(header.nbNodes), nbEdges(header.nbEdges);
+  writeSection(file, &header, sizeof(header));
+  writeSection(file, columns.uids, nbNodes * sizeof(unsigned));
+  writeSection(file, columns.types, nbNodes * sizeof(node::NodeType));
+  writeSection(file, columns.positions, nbNodes * sizeof(tools::Vec2));
+  writeSection(file, columns.capacities, nbNodes * sizeof(unsigned));
+  writeSection(file, columns.offsets, (nbNodes + 1) * sizeof(unsigned));
+  writeSection(file, columns.targets, nbEdges * sizeof(unsigned));
+  writeSection(file, columns.weights, nbEdges * sizeof(double));
+  writeSection(file, cellOffsets.data(), cellOffsets.size() * sizeof(unsigned));
+  writeSection(file, cellNodes.data(), cellNodes.size() * sizeof(unsigned));
+  file.close();
+
+  // A view that maps the previous snapshot keeps it, the file is not rewritten
+  if (file.fail() || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    std::cerr << "Error: Could not write file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool isSnapshot(const string& path) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  char magic[MAGIC_LENGTH];
+  return file.read(magic, MAGIC_LENGTH) &&
+         std::equal(magic, magic + MAGIC_LENGTH, BINARY_MAGIC);
+}
+
+}  // namespace view
+
+/* === INTERNAL FUNCTIONS === */
+
+namespace {
+
+Layout layoutOf(const view::Header& header) {
+  Layout layout;
+  layout.uids = padded(sizeof(view::Header));
+  layout.types = layout.uids + padded(header.nbNodes * sizeof(unsigned));
+  layout.positions = layout.types + padded(header.nbNodes * sizeof(node::NodeType));
+  layout.capacities = layout.positions + padded(header.nbNodes * sizeof(tools::Vec2));
+  layout.offsets = layout.capacities + padded(header.nbNodes * sizeof(unsigned));
+  layout.targets = layout.offsets + padded((header.nbNodes + 1) * sizeof(unsigned));
+  layout.weights = layout.targets + padded(header.nbEdges * sizeof(unsigned));
+  layout.cellOffsets = layout.weights + padded(header.nbEdges * sizeof(double));
+  layout.cellNodes =
+      layout.cellOffsets + padded((header.nbCells + 1) * sizeof(unsigned));
+  layout.end = layout.cellNodes + padded(header.nbEntries * sizeof(unsigned));
+  return layout;
+}
+
+size_t padded(size_t size) {
+  return (size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+/**
+ * Checks every value that is used as an index by the queries, in one pass over the
+ * mapped sections. The graph needs sorted uids and node indices in range, and the
+ * types column holds a valid node type in each of its integers.
+ */
+bool isConsistent(const view::Header& header, const graph::Columns& columns,
+                  const uint32_t* types, const unsigned* cellOffsets,
+                  const unsigned* cellNodes) {
+  const unsigned nbNodes(columns.nbNodes);
+  for (unsigned i(0); i < nbNodes; ++i) {
+    if ((i > 0 && columns.uids[i - 1] >= columns.uids[i]) ||
+        types[i] > static_cast<uint32_t>(node::PRODUCTION))
+      return false;
+  }
+  for (size_t edge(0); edge < header.nbEdges; ++edge) {
+    if (columns.targets[edge] >= nbNodes) return false;
+  }
+  for (size_t entry(0); entry < header.nbEntries; ++entry) {
+    if (cellNodes[entry] >= nbNodes) return false;
+  }
+  return isIndex(columns.offsets, nbNodes, header.nbEdges) &&
+         isIndex(cellOffsets, header.nbCells, header.nbEntries);
+}
+
+/** Whether the offsets of a CSR index rise from zero to its end */
+bool isIndex(const unsigned* offsets, size_t size, size_t end) {
+  if (offsets[0] != 0 || offsets[size] != end) return false;
+  for (size_t i(0); i < size; ++i) {
+    if (offsets[i] > offsets[i + 1]) return false;
+  }
+  return true;
+}
+
+/**
+ * Lists each node in every cell that its bounding box overlaps, in index order. The
+ * cells hold about NODES_PER_CELL nodes if the nodes are evenly spread.
+ */
+void buildGrid(const graph::Columns& columns, view::Header& header,
+               vector<unsigned>& cellOffsets, vector<unsigned>& cellNodes) {
+  cellOffsets.assign(1, 0);
+  header.cellSize = MIN_CELL_SIZE;
+  if (columns.nbNodes == 0) return;
+
+  double minX(INFINITE_TIME), minY(INFINITE_TIME);
+  double maxX(-INFINITE_TIME), maxY(-INFINITE_TIME);
+  for (unsigned i(0); i < columns.nbNodes; ++i) {
+    const double radius(std::sqrt(columns.capacities[i]));
+    minX = std::min(minX, columns.positions[i].getX() - radius);
+    minY = std::min(minY, columns.positions[i].getY() - radius);
+    maxX = std::max(maxX, columns.positions[i].getX() + radius);
+    maxY = std::max(maxY, columns.positions[i].getY() + radius);
+  }
+
+  const double width(maxX - minX), height(maxY - minY);
+  header.gridX = minX;
+  header.gridY = minY;
+  header.cellSize = std::max(
+      {std::sqrt(width * height * NODES_PER_CELL / columns.nbNodes),
+       width / MAX_CELLS_PER_AXIS, height / MAX_CELLS_PER_AXIS, MIN_CELL_SIZE});
+  header.columns = std::floor(width / header.cellSize) + 1;
+  header.rows = std::floor(height / header.cellSize) + 1;
+  header.nbCells = static_cast<uint64_t>(header.columns) * header.rows;
+
+  // Count the nodes of each cell, then turn the counts into offsets
+  cellOffsets.assign(header.nbCells + 1, 0);
+  for (int pass(0); pass < 2; ++pass) {
+    vector<unsigned> fill(cellOffsets.begin(), cellOffsets.end() - 1);
+
+    for (unsigned i(0); i < columns.nbNodes; ++i) {
+      const double radius(std::sqrt(columns.capacities[i]));
+      const tools::Vec2& position(columns.positions[i]);
+      unsigned column0, column1, row0, row1;
+      cellRange(header, position.getX() - radius, position.getX() + radius,
+                header.columns, false, column0, column1);
+      cellRange(header, position.getY() - radius, position.getY() + radius,
+                header.rows, true, row0, row1);
+
+      for (unsigned row(row0); row <= row1; ++row) {
+        for (unsigned column(column0); column <= column1; ++column) {
+          const unsigned cell(row * header.columns + column);
+          if (pass == 0) {
+            ++cellOffsets[cell + 1];
+          } else {
+            cellNodes[fill[cell]++] = i;
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      for (size_t cell(1); cell < cellOffsets.size(); ++cell)
+        cellOffsets[cell] += cellOffsets[cell - 1];
+      cellNodes.resize(cellOffsets.back());
+    }
+  }
+  header.nbEntries = cellNodes.size();
+}
+
+/** The first and last cells along an axis that overlap [low, high] */
+void cellRange(const view::Header& header, double low, double high, uint32_t count,
+               bool vertical, unsigned& first, unsigned& last) {
+  const double origin(vertical ? header.gridY : header.gridX);
+  first = clampCell(std::floor((low - origin) / header.cellSize), count);
+  last = clampCell(std::floor((high - origin) / header.cellSize), count);
+}
+
+unsigned clampCell(double cell, uint32_t count) {
+  if (!(cell > 0)) return 0;  // includes NaN
+  return std::min<double>(cell, count - 1);
+}
+
+void writeSection(std::ostream& stream, const void* data, size_t size) {
+  static const char padding[SECTION_ALIGNMENT] = {};
+  stream.write(static_cast<const char*>(data), size);
+  stream.write(padding, padded(size) - size);
+}
+
+string createTemporary(const string& path) {
+  string temporary(path + TEMPORARY_SUFFIX);
+  const int file(mkstemp(&temporary[0]));
+  if (file < 0) return "";
+
+  struct stat replaced;
+  const mode_t mode(stat(path.c_str(), &replaced) == 0 ? replaced.st_mode & 07777
+                                                        : FILE_MODE);
+  const bool created(fchmod(file, mode) == 0);
+  close(file);
+  if (!created) {
+    unlink(temporary.c_str());
+    return "";
+  }
+  return temporary;
+}
+
+}  // namespace
@@ -0,0 +1,130 @@
+// archipelago v3.0.0 - architecture b2
+// view.hpp - read-only town queries over a memory-mapped snapshot
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef MODEL_VIEW_H
+#define MODEL_VIEW_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "graph.hpp"
+#include "node.hpp"
+#include "tools.hpp"
+#include "town.hpp"
+
+/**
+ * Module: view
+ * A binary snapshot of a town holds its graph columns, its CSR adjacency, a grid of
+ * the nodes and its statistics, in the layout used in memory. A TownView maps the
+ * file and answers queries in place, without building nodes, validating or
+ * allocating per node, so that opening a large town only costs the mapping and a
+ * check that its indices are in range.
+ *
+ * Values are in the byte order of the machine that wrote the snapshot.
+ */
+
+namespace view {
+
+/* === DEFINITIONS === */
+
+/** The fixed-size start of a snapshot, see view.cpp */
+struct Header;
+
+/** A node of a snapshot, copied out of the mapping */
+struct NodeEntry {
+  unsigned uid;
+  node::NodeType type;
+  tools::Vec2 position;
+  unsigned capacity;
+};
+
+/* === CLASSES === */
+
+/**
+ * A read-only town over a mapped snapshot, with the const query surface of
+ * town::Town. The path queries follow the same rules and return the same paths.
+ */
+class TownView {
+ public:
+  TownView() = delete;
+  /**
+   * Maps a snapshot written by saveSnapshot()
+   * @throws If the file can not be mapped or is not a complete and consistent
+   * snapshot
+   */
+  explicit TownView(const std::string& path);
+  ~TownView();
+
+  TownView(const TownView&) = delete;
+  TownView& operator=(const TownView&) = delete;
+
+  /** Copies a node into the given entry, returns false if it does not exist */
+  bool getNode(unsigned uid, NodeEntry& node) const;
+
+  /** Returns the sorted uids of the nodes */
+  std::vector<unsigned> getNodes() const;
+
+  /**
+   * Get a list of nodes that are linked to the given node, in link order
+   * @throws If the node is not a part of the town
+   */
+  std::vector<unsigned> getLinkedNodes(unsigned uid) const;
+
+  /** The town indices, computed when the snapshot was written */
+  double enj() const;
+  double ci() const;
+  double mta() const;
+
+  /** See Town::pathFind() */
+  town::PathQuery pathFind(unsigned origin, const node::NodeType& destination,
+                           graph::Workspace& workspace,
+                           std::vector<unsigned>& path) const;
+  town::DualPathQuery pathFind(unsigned origin, const node::NodeType& first,
+                               const node::NodeType& second,
+                               graph::Workspace& workspace,
+                               std::vector<unsigned>& firstPath,
+                               std::vector<unsigned>& secondPath) const;
+
+  /** See Town::pathFindTo() */
+  town::PathQuery pathFindTo(unsigned origin, unsigned destination,
+                             graph::Workspace& workspace,
+                             std::vector<unsigned>& path) const;
+
+  /** Returns the topmost node that contains the given position, or NO_LINK */
+  unsigned getNodeAt(const tools::Vec2& position) const;
+
+  /** The graph over the mapped columns, for the graph algorithms */
+  const graph::Graph& getGraph() const;
+
+ private:
+  void* mapping;
+  size_t length;
+  const Header* header;
+
+  /** The node indices of grid cell i are [cellOffsets[i], cellOffsets[i + 1]) */
+  const unsigned* cellOffsets;
+  const unsigned* cellNodes;
+
+  std::unique_ptr<const graph::Graph> graph;
+
+  unsigned cellOf(const tools::Vec2& position) const;
+};
+
+/* === FUNCTIONS === */
+
+/**
+ * Writes a snapshot of the town, which a TownView can map. The file is written
+ * under a unique temporary name then renamed, it is replaced whole or not at all,
+ * also by concurrent writers.
+ * Returns false if it could not be written.
+ */
+bool saveSnapshot(const std::string& path, const town::Town& town);
+
+/** Whether the file starts like a snapshot */
+bool isSnapshot(const std::string& path);
+
+}  // namespace view
+
+#endif
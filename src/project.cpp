@@ -2,18 +2,287 @@
 // project.cpp - program entry point
 // Authors: Marcus Cemes, Alexandre Dodens
 
+#include <cctype>    // isdigit()
+#include <cerrno>    // errno
+#include <cstdlib>   // getenv(), strtoul()
+#include <fstream>
+#include <iostream>  // cout, cerr
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "gui.hpp"
+#include "image.hpp"
+#include "model/constants.hpp"
+#include "model/error.hpp"
+#include "model/hierarchy.hpp"
+#include "model/town.hpp"
+#include "model/trace.hpp"
+#include "model/travel.hpp"
+#include "model/view.hpp"
+#include "server.hpp"
 
-constexpr int BASIC_ARGS(1);
-constexpr int PATH_ARG(1);
+constexpr int FIRST_ARG(1);
+
+constexpr int EXIT_OK(0);
+constexpr int EXIT_ERROR(1);
+
+constexpr int DECIMAL_BASE(10);
+constexpr int PRINT_PRECISION(17);  // round-trips a double
+constexpr int TIME_PRECISION(9);
+/** The longest side of an exported image, in pixels or points */
+constexpr unsigned DEFAULT_IMAGE_SIZE(4096);
+
+constexpr char EXPORT_FLAG[]("--export");
+constexpr char PATH_FLAG[]("--path");
+constexpr char ROUTES_FLAG[]("--routes");
+constexpr char SERVE_FLAG[]("--serve");
+constexpr char SIZE_FLAG[]("--size");
+constexpr char SNAPSHOT_FLAG[]("--snapshot");
+constexpr char STATS_FLAG[]("--stats");
+constexpr char TRACE_FLAG[]("--trace");
+constexpr char TRAVEL_FLAG[]("--travel-matrix");
+constexpr char VALIDATE_FLAG[]("--validate");
+/** Environment variable that enables tracing, an alternative to the CLI flag */
+constexpr char TRACE_ENV[]("ARCHIPELAGO_TRACE");
+
+int exportImage(const std::unique_ptr<std::string> &townPath,
+                const std::string &imagePath, const char *size);
+unsigned parseImageSize(const char *size);
+int exportTravelMatrix(const std::unique_ptr<std::string> &townPath,
+                       const std::string &matrixPath);
+int answerRoutes(const std::unique_ptr<std::string> &townPath,
+                 const std::string &pairsPath);
+int validateTown(const std::string &townPath);
+int writeSnapshot(const std::unique_ptr<std::string> &townPath,
+                  const std::string &snapshotPath);
+int queryTown(const std::unique_ptr<std::string> &townPath, const char *origin);
+template <typename T>
+void printQuery(const T &town, const char *origin);
 
 /** Parse CLI args and run the program */
 int main(int argc, char *argv[]) {
   std::unique_ptr<std::string> path;
-  if (argc > BASIC_ARGS) path.reset(new std::string(argv[PATH_ARG]));
+  const char *tracePath(std::getenv(TRACE_ENV));
+  const char *travelPath(nullptr);
+  const char *routesPath(nullptr);
+  const char *validatePath(nullptr);
+  const char *socketPath(nullptr);
+  const char *snapshotPath(nullptr);
+  const char *origin(nullptr);
+  const char *imagePath(nullptr);
+  const char *imageSize(nullptr);
+  bool stats(false);
+
+  for (int i(FIRST_ARG); i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == TRACE_FLAG && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (arg == TRAVEL_FLAG && i + 1 < argc) {
+      travelPath = argv[++i];
+    } else if (arg == ROUTES_FLAG && i + 1 < argc) {
+      routesPath = argv[++i];
+    } else if (arg == VALIDATE_FLAG && i + 1 < argc) {
+      validatePath = argv[++i];
+    } else if (arg == SERVE_FLAG && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (arg == SNAPSHOT_FLAG && i + 1 < argc) {
+      snapshotPath = argv[++i];
+    } else if (arg == EXPORT_FLAG && i + 1 < argc) {
+      imagePath = argv[++i];
+    } else if (arg == SIZE_FLAG && i + 1 < argc) {
+      imageSize = argv[++i];
+    } else if (arg == PATH_FLAG && i + 1 < argc) {
+      origin = argv[++i];
+    } else if (arg == STATS_FLAG) {
+      stats = true;
+    } else {
+      path.reset(new std::string(arg));
+    }
+  }
+
+  if (tracePath != nullptr) trace::start(tracePath);
+  const bool query(stats || origin != nullptr);
+  int status(socketPath != nullptr     ? server::run(socketPath)
+              : validatePath != nullptr ? validateTown(validatePath)
+              : travelPath != nullptr   ? exportTravelMatrix(path, travelPath)
+              : routesPath != nullptr   ? answerRoutes(path, routesPath)
+              : snapshotPath != nullptr ? writeSnapshot(path, snapshotPath)
+              : imagePath != nullptr    ? exportImage(path, imagePath, imageSize)
+              : query                   ? queryTown(path, origin)
+                                        : gui::init(path));
+  trace::stop();
+
+  return status;
+}
+
+/** Render a town to a PNG, SVG or PDF file without opening the GUI */
+int exportImage(const std::unique_ptr<std::string> &townPath,
+                const std::string &imagePath, const char *size) {
+  if (!townPath) {
+    std::cerr << "Error: A town file is required" << std::endl;
+    return EXIT_ERROR;
+  }
+
+  try {
+    const unsigned imageSize(size != nullptr ? parseImageSize(size)
+                                             : DEFAULT_IMAGE_SIZE);
+    // A single export reads the cache but does not add the town to it
+    town::Town town(town::openCached(*townPath, true, false));
+    image::exportTown(imagePath, town, imageSize);
+  } catch (std::string &err) {
+    std::cerr << err;
+    return EXIT_ERROR;
+  }
+  return EXIT_OK;
+}
+
+/**
+ * The size of an exported image, a whole number of pixels from 1 to MAX_IMAGE_SIZE
+ * @throws If the size is not such a number
+ */
+unsigned parseImageSize(const char *size) {
+  char *end(nullptr);
+  errno = 0;
+  const unsigned long parsed(std::strtoul(size, &end, DECIMAL_BASE));
+  // strtoul() also takes a sign and leading spaces, a negative value wraps around
+  if (!std::isdigit(static_cast<unsigned char>(size[0])) || *end != '\0' ||
+      errno == ERANGE || parsed == 0 || parsed > MAX_IMAGE_SIZE)
+    throw error::invalid_image_size(size);
+  return parsed;
+}
+
+/** Compute the travel matrix of a town without opening the GUI */
+int exportTravelMatrix(const std::unique_ptr<std::string> &townPath,
+                       const std::string &matrixPath) {
+  if (!townPath) {
+    std::cerr << "Error: A town file is required" << std::endl;
+    return EXIT_ERROR;
+  }
+
+  try {
+    town::Town town(town::openCached(*townPath));
+    if (!travel::saveToFile(matrixPath, *town.getTravelMatrix())) return EXIT_ERROR;
+  } catch (std::string &err) {
+    std::cerr << err;
+    return EXIT_ERROR;
+  }
+  return EXIT_OK;
+}
+
+/**
+ * Print the travel time of each "origin destination" pair of uids in a file, one
+ * pair per line, from the contraction hierarchy of the town. The hierarchy is read
+ * from its sidecar next to the town file, or built and saved there.
+ */
+int answerRoutes(const std::unique_ptr<std::string> &townPath,
+                 const std::string &pairsPath) {
+  if (!townPath) {
+    std::cerr << "Error: A town file is required" << std::endl;
+    return EXIT_ERROR;
+  }
+
+  std::ifstream pairs(pairsPath);
+  if (!pairs.is_open()) {
+    std::cerr << "Error: Could not open file" << std::endl;
+    return EXIT_ERROR;
+  }
+
+  try {
+    town::Town town(town::openCached(*townPath));
+    const auto routes(town.getHierarchy(town::hierarchyPath(*townPath)));
+    hierarchy::Scratch scratch;
+
+    std::cout.precision(TIME_PRECISION);
+    unsigned origin, destination;
+    while (pairs >> origin >> destination) {
+      std::cout << origin << ' ' << destination << ' '
+                << routes->query(origin, destination, scratch) << '\n';
+    }
+    if (!pairs.eof()) throw std::string("Invalid route pair\n");
+  } catch (std::string &err) {
+    std::cerr << err;
+    if (err.empty() || err.back() != '\n') std::cerr << std::endl;
+    return EXIT_ERROR;
+  }
+  return EXIT_OK;
+}
+
+/** Print every rule violation of a town file one per line, crossing links included */
+int validateTown(const std::string &townPath) {
+  try {
+    const auto violations(town::validateFile(townPath, false));
+    for (const auto &violation : violations)
+      std::cout << "line " << violation.line << ": " << validation::message(violation);
+
+    return violations.empty() ? EXIT_OK : EXIT_ERROR;
+  } catch (std::string &err) {
+    std::cerr << err;
+    return EXIT_ERROR;
+  }
+}
+
+/** Write a snapshot of a town, which later queries map instead of loading the town */
+int writeSnapshot(const std::unique_ptr<std::string> &townPath,
+                  const std::string &snapshotPath) {
+  if (!townPath) {
+    std::cerr << "Error: A town file is required" << std::endl;
+    return EXIT_ERROR;
+  }
+
+  try {
+    if (!view::saveSnapshot(snapshotPath, town::openCached(*townPath)))
+      return EXIT_ERROR;
+  } catch (std::string &err) {
+    std::cerr << err;
+    return EXIT_ERROR;
+  }
+  return EXIT_OK;
+}
+
+/**
+ * Print the town indices, or the paths from an origin to the nearest transport and
+ * production nodes. A snapshot is mapped instead of loading a town.
+ */
+int queryTown(const std::unique_ptr<std::string> &townPath, const char *origin) {
+  if (!townPath) {
+    std::cerr << "Error: A town file is required" << std::endl;
+    return EXIT_ERROR;
+  }
+
+  try {
+    if (view::isSnapshot(*townPath)) {
+      printQuery(view::TownView(*townPath), origin);
+    } else {
+      printQuery(town::openCached(*townPath), origin);
+    }
+  } catch (std::string &err) {
+    std::cerr << err;
+    if (err.empty() || err.back() != '\n') std::cerr << std::endl;
+    return EXIT_ERROR;
+  }
+  return EXIT_OK;
+}
+
+/** Towns and views share the same queries */
+template <typename T>
+void printQuery(const T &town, const char *origin) {
+  std::cout.precision(PRINT_PRECISION);
+  if (origin == nullptr) {
+    std::cout << "enj " << town.enj() << "\nci " << town.ci() << "\nmta " << town.mta()
+              << std::endl;
+    return;
+  }
+
+  graph::Workspace workspace;
+  std::vector<unsigned> transportPath, productionPath;
+  const town::DualPathQuery query(
+      town.pathFind(std::strtoul(origin, nullptr, DECIMAL_BASE), node::TRANSPORT,
+                    node::PRODUCTION, workspace, transportPath, productionPath));
 
-  return gui::init(path);
+  std::cout << "transport " << query.first.distance;
+  for (const auto &uid : transportPath) std::cout << ' ' << uid;
+  std::cout << "\nproduction " << query.second.distance;
+  for (const auto &uid : productionPath) std::cout << ' ' << uid;
+  std::cout << std::endl;
 }
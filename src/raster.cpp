@@ -0,0 +1,318 @@
+// archipelago v3.0.0 - architecture b2
+// raster.cpp - direct rasterisation of render primitives into a pixel buffer
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "raster.hpp"
+
+#include <algorithm>  // fill_n(), max(), min()
+#include <atomic>
+#include <cmath>  // ceil(), floor(), sqrt()
+#include <thread>
+
+#include "model/trace.hpp"
+
+using std::vector;
+
+namespace {
+
+/** The width of the strokes of CairoContext, in world units */
+constexpr double STROKE_WIDTH(6.);
+constexpr float HALF_PIXEL(.5f);
+constexpr float FULL_COVERAGE(255.f);
+
+/** The colours of CairoContext, as Cairo rounds them to 8 bits per channel */
+constexpr uint32_t WHITE(0xFFFFFFFF);
+constexpr uint32_t BLACK(0xFF000000);
+constexpr uint32_t ORANGE(0xFFFF851B);
+constexpr uint32_t GREEN(0xFF00FF00);
+
+/** Low and high channel pairs of a pixel, blended two at a time */
+constexpr uint32_t CHANNEL_PAIRS(0x00FF00FF);
+constexpr uint32_t ROUNDING_PAIRS(0x00800080);
+constexpr unsigned CHANNEL_BITS(8);
+constexpr unsigned CHANNEL_MAX(255);
+
+/** Bands are at least this tall, each core takes several of them */
+constexpr int MIN_BAND_ROWS(32);
+constexpr unsigned BANDS_PER_THREAD(4);
+
+/** A stroked segment in pixel coordinates, around its middle */
+struct Segment {
+  float middleX;
+  float middleY;
+  /** The direction of the segment, a unit vector */
+  float directionX;
+  float directionY;
+  float halfLength;
+};
+
+uint32_t lerp(uint32_t destination, uint32_t source, unsigned alpha);
+float overlap(float offset, float halfWidth);
+uint32_t toPixel(const tools::Colour& colour);
+
+}  // namespace
+
+namespace raster {
+
+/* === CLASSES === */
+
+Raster::Raster(const Target& target, const Transform& transform, int top, int bottom)
+    : target(target),
+      transform(transform),
+      top(std::max(0, top)),
+      bottom(std::min(target.height, bottom)),
+      colour(BLACK),
+      coverage(2 * target.width) {}
+
+void Raster::paintBackground() {
+  for (int y(top); y < bottom; ++y)
+    std::fill_n(target.data + static_cast<size_t>(y) * target.stride, target.width,
+                WHITE);
+}
+
+/**
+ * Fills the circle white, then strokes it. The pixels that are inside of the stroke
+ * are filled as one span, the pixels around the stroke are blended.
+ */
+void Raster::draw(const tools::Circle& obj) {
+  const float centreX(obj.getPosition().getX() * transform.scale + transform.originX);
+  const float centreY(transform.originY - obj.getPosition().getY() * transform.scale);
+  const float radius(obj.getRadius() * transform.scale);
+  const float halfWidth(STROKE_WIDTH / 2 * transform.scale);
+  const float outer(radius + halfWidth + HALF_PIXEL);
+  const float inner(radius - halfWidth - HALF_PIXEL);
+  if (centreX + outer < 0 || centreX - outer > target.width) return;
+
+  const int first(std::max(top, static_cast<int>(std::floor(centreY - outer))));
+  const int last(std::min(bottom - 1, static_cast<int>(std::ceil(centreY + outer))));
+  float* const fill(coverage.data());
+  float* const stroke(coverage.data() + target.width);
+
+  auto ring = [&](int y, float offsetY, int left, int right) {
+    if (left > right) return;
+    for (int x(left); x <= right; ++x) {
+      const float offsetX(x + HALF_PIXEL - centreX);
+      const float distance(std::sqrt(offsetX * offsetX + offsetY * offsetY));
+      fill[x - left] = std::min(1.f, std::max(0.f, radius + HALF_PIXEL - distance));
+      stroke[x - left] = overlap(distance - radius, halfWidth);
+    }
+    uint32_t* const row(target.data + static_cast<size_t>(y) * target.stride);
+    for (int x(left); x <= right; ++x) {
+      const uint32_t filled(
+          lerp(row[x], WHITE, static_cast<unsigned>(fill[x - left] * FULL_COVERAGE +
+                                                    HALF_PIXEL)));
+      row[x] = lerp(filled, colour,
+                    static_cast<unsigned>(stroke[x - left] * FULL_COVERAGE +
+                                          HALF_PIXEL));
+    }
+  };
+
+  for (int y(first); y <= last; ++y) {
+    const float offsetY(y + HALF_PIXEL - centreY);
+    if (std::abs(offsetY) >= outer) continue;
+
+    const float reach(std::sqrt(outer * outer - offsetY * offsetY));
+    const int left(
+        std::max(0, static_cast<int>(std::ceil(centreX - reach - HALF_PIXEL))));
+    const int right(std::min(
+        target.width - 1, static_cast<int>(std::floor(centreX + reach - HALF_PIXEL))));
+    if (inner <= std::abs(offsetY)) {
+      ring(y, offsetY, left, right);
+      continue;
+    }
+
+    const float inside(std::sqrt(inner * inner - offsetY * offsetY));
+    const int solidLeft(
+        std::max(left, static_cast<int>(std::ceil(centreX - inside - HALF_PIXEL))));
+    const int solidRight(
+        std::min(right, static_cast<int>(std::floor(centreX + inside - HALF_PIXEL))));
+    ring(y, offsetY, left, std::min(right, solidLeft - 1));
+    if (solidLeft <= solidRight) {
+      std::fill_n(target.data + static_cast<size_t>(y) * target.stride + solidLeft,
+                  solidRight - solidLeft + 1, WHITE);
+    }
+    ring(y, offsetY, std::max(left, solidRight + 1), right);
+  }
+}
+
+void Raster::draw(const tools::Line& obj) {
+  const tools::Vec2 points[2]{obj.getPointA(), obj.getPointB()};
+  strokeSegments(points, 2, false);
+}
+
+void Raster::draw(const tools::Polygon4& obj) {
+  const tools::Vec2 points[4]{obj.getA(), obj.getB(), obj.getC(), obj.getD()};
+  strokeSegments(points, 4, true);
+}
+
+void Raster::setColour(const tools::Colour& newColour) { colour = toPixel(newColour); }
+
+/**
+ * Strokes a path of segments with butt caps. The segments of a closed path reach
+ * past their ends by half of the stroke, which joins square corners with a mitre as
+ * Cairo does. A pixel covered by several segments takes their largest coverage.
+ */
+void Raster::strokeSegments(const tools::Vec2* points, unsigned nbPoints,
+                            bool closed) {
+  const float halfWidth(STROKE_WIDTH / 2 * transform.scale);
+  const float extension(closed ? halfWidth : 0.f);
+
+  Segment segments[4];
+  unsigned nbSegments(0);
+  float minX(HUGE_VALF), minY(HUGE_VALF), maxX(-HUGE_VALF), maxY(-HUGE_VALF);
+  for (unsigned i(0); i < (closed ? nbPoints : nbPoints - 1); ++i) {
+    const tools::Vec2& a(points[i]);
+    const tools::Vec2& b(points[(i + 1) % nbPoints]);
+    const float ax(a.getX() * transform.scale + transform.originX);
+    const float ay(transform.originY - a.getY() * transform.scale);
+    const float bx(b.getX() * transform.scale + transform.originX);
+    const float by(transform.originY - b.getY() * transform.scale);
+    const float length(std::sqrt((bx - ax) * (bx - ax) + (by - ay) * (by - ay)));
+    if (length == 0.f) continue;  // Cairo draws no butt caps for empty segments
+
+    const Segment segment{(ax + bx) / 2, (ay + by) / 2, (bx - ax) / length,
+                          (by - ay) / length, length / 2 + extension};
+    const float reachX(std::abs(segment.directionX) * segment.halfLength +
+                       std::abs(segment.directionY) * halfWidth + HALF_PIXEL);
+    const float reachY(std::abs(segment.directionY) * segment.halfLength +
+                       std::abs(segment.directionX) * halfWidth + HALF_PIXEL);
+    minX = std::min(minX, segment.middleX - reachX);
+    maxX = std::max(maxX, segment.middleX + reachX);
+    minY = std::min(minY, segment.middleY - reachY);
+    maxY = std::max(maxY, segment.middleY + reachY);
+    segments[nbSegments++] = segment;
+  }
+  if (nbSegments == 0 || maxX < 0 || minX > target.width) return;
+
+  const int first(std::max(top, static_cast<int>(std::floor(minY))));
+  const int last(std::min(bottom - 1, static_cast<int>(std::ceil(maxY))));
+  for (int y(first); y <= last; ++y) {
+    const float centreY(y + HALF_PIXEL);
+    int spanLeft(target.width), spanRight(-1);
+    int lefts[4], rights[4];
+
+    // The pixels that a segment may reach, along and across it
+    for (unsigned i(0); i < nbSegments; ++i) {
+      const Segment& s(segments[i]);
+      const float offsetY(centreY - s.middleY);
+      float low(-HUGE_VALF), high(HUGE_VALF);
+      const float limits[2]{s.halfLength + HALF_PIXEL, halfWidth + HALF_PIXEL};
+      const float slopes[2]{s.directionX, -s.directionY};
+      const float offsets[2]{offsetY * s.directionY, offsetY * s.directionX};
+      for (unsigned axis(0); axis < 2; ++axis) {
+        if (slopes[axis] == 0.f) {
+          if (std::abs(offsets[axis]) >= limits[axis]) low = HUGE_VALF;
+          continue;
+        }
+        const float a((-limits[axis] - offsets[axis]) / slopes[axis]);
+        const float b((limits[axis] - offsets[axis]) / slopes[axis]);
+        low = std::max(low, std::min(a, b));
+        high = std::min(high, std::max(a, b));
+      }
+      lefts[i] = low > high ? target.width
+                            : std::max(0, static_cast<int>(std::ceil(
+                                              s.middleX + low - HALF_PIXEL)));
+      rights[i] = low > high ? -1
+                             : std::min(target.width - 1,
+                                        static_cast<int>(std::floor(
+                                            s.middleX + high - HALF_PIXEL)));
+      spanLeft = std::min(spanLeft, lefts[i]);
+      spanRight = std::max(spanRight, rights[i]);
+    }
+    if (spanLeft > spanRight) continue;
+
+    std::fill_n(coverage.data(), spanRight - spanLeft + 1, 0.f);
+    for (unsigned i(0); i < nbSegments; ++i) {
+      const Segment& s(segments[i]);
+      const float offsetY(centreY - s.middleY);
+      float* const span(coverage.data() - spanLeft);
+      for (int x(lefts[i]); x <= rights[i]; ++x) {
+        const float offsetX(x + HALF_PIXEL - s.middleX);
+        const float along(offsetX * s.directionX + offsetY * s.directionY);
+        const float across(offsetY * s.directionX - offsetX * s.directionY);
+        span[x] = std::max(span[x], overlap(along, s.halfLength) *
+                                        overlap(across, halfWidth));
+      }
+    }
+    blendSpan(y, spanLeft, spanRight, colour);
+  }
+}
+
+/** Blends the source over the pixels of a row, by the coverage of the span */
+void Raster::blendSpan(int y, int left, int right, uint32_t source) {
+  uint32_t* const row(target.data + static_cast<size_t>(y) * target.stride);
+  for (int x(left); x <= right; ++x) {
+    row[x] = lerp(row[x], source,
+                  static_cast<unsigned>(coverage[x - left] * FULL_COVERAGE +
+                                        HALF_PIXEL));
+  }
+}
+
+/* === FUNCTIONS === */
+
+void drawBands(const Target& target, const Transform& transform,
+               const std::function<void(Raster&)>& draw) {
+  TRACE_SCOPE("raster::drawBands");
+  const unsigned cores(std::max(1U, std::thread::hardware_concurrency()));
+  // Every band replays the primitives, a single core draws a single band
+  const int nbBands(
+      cores == 1 ? 1
+                 : std::max(1, std::min<int>(
+                                   (target.height + MIN_BAND_ROWS - 1) / MIN_BAND_ROWS,
+                                   cores * BANDS_PER_THREAD)));
+  const int bandRows((target.height + nbBands - 1) / nbBands);
+
+  std::atomic<int> next(0);
+  const unsigned nbThreads(std::min<unsigned>(cores, nbBands));
+
+  auto worker = [&]() {
+    for (int i(next++); i < nbBands; i = next++) {
+      Raster raster(target, transform, i * bandRows, (i + 1) * bandRows);
+      draw(raster);
+    }
+  };
+
+  vector<std::thread> threads;
+  for (unsigned i(1); i < nbThreads; ++i) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+}
+
+}  // namespace raster
+
+namespace {
+
+/**
+ * Blends two premultiplied pixels, channel pairs at a time, dividing by 255 with
+ * the rounding of pixman
+ */
+uint32_t lerp(uint32_t destination, uint32_t source, unsigned alpha) {
+  const unsigned inverse(CHANNEL_MAX - alpha);
+  uint32_t low((destination & CHANNEL_PAIRS) * inverse +
+               (source & CHANNEL_PAIRS) * alpha + ROUNDING_PAIRS);
+  low = ((low + ((low >> CHANNEL_BITS) & CHANNEL_PAIRS)) >> CHANNEL_BITS) &
+        CHANNEL_PAIRS;
+  uint32_t high(((destination >> CHANNEL_BITS) & CHANNEL_PAIRS) * inverse +
+                ((source >> CHANNEL_BITS) & CHANNEL_PAIRS) * alpha + ROUNDING_PAIRS);
+  high = (high + ((high >> CHANNEL_BITS) & CHANNEL_PAIRS)) & ~CHANNEL_PAIRS;
+  return low | high;
+}
+
+/** The part of a pixel centred at an offset that is within [-halfWidth, halfWidth] */
+float overlap(float offset, float halfWidth) {
+  return std::min(1.f, std::max(0.f, std::min(offset + HALF_PIXEL, halfWidth) -
+                                         std::max(offset - HALF_PIXEL, -halfWidth)));
+}
+
+uint32_t toPixel(const tools::Colour& colour) {
+  switch (colour) {
+    case tools::Colour::ORANGE:
+      return ORANGE;
+    case tools::Colour::GREEN:
+      return GREEN;
+    default:
+      return BLACK;
+  }
+}
+
+}  // namespace
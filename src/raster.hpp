@@ -0,0 +1,90 @@
+// archipelago v3.0.0 - architecture b2
+// raster.hpp - direct rasterisation of render primitives into a pixel buffer
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "model/tools.hpp"
+
+/**
+ * Module: raster
+ * Draws the primitives of a town straight into the pixels of an image, without
+ * Cairo's general path machinery. Circles, lines and quads are stroked as CairoContext
+ * strokes them, with antialiased edges, so that both images can be compared pixel
+ * by pixel. A row of a primitive is a span: its coverage is computed for the pixels
+ * that it may reach, then blended in a second pass, both loops without branches.
+ *
+ * The pixels have the layout of a Cairo ARGB32 image surface, so that the image can
+ * be painted by Cairo or written to a file as is.
+ */
+
+namespace raster {
+
+/* === DEFINITIONS === */
+
+/** A buffer of premultiplied ARGB32 pixels, native-endian */
+struct Target {
+  uint32_t* data;
+  int width;
+  int height;
+  /** Pixels from the start of a row to the start of the next */
+  int stride;
+};
+
+/** World to pixel coordinates, the y axis is flipped */
+struct Transform {
+  double scale;
+  /** The pixel coordinates of the world origin */
+  double originX;
+  double originY;
+};
+
+/* === CLASSES === */
+
+/** A RenderContext that draws into a band of rows of a target */
+class Raster : public tools::RenderContext {
+ public:
+  Raster() = delete;
+  /** Draws into the rows [top, bottom) of the target, other rows are not touched */
+  Raster(const Target& target, const Transform& transform, int top, int bottom);
+
+  /** Paints the rows of the raster white */
+  void paintBackground();
+
+  /* Inherited methods */
+  void draw(const tools::Circle& obj) override;
+  void draw(const tools::Line& obj) override;
+  void draw(const tools::Polygon4& obj) override;
+  void setColour(const tools::Colour& colour) override;
+
+ private:
+  Target target;
+  Transform transform;
+  int top;
+  int bottom;
+  uint32_t colour;
+
+  /** The coverage of the pixels of a span, reused from one span to the next */
+  std::vector<float> coverage;
+
+  void strokeSegments(const tools::Vec2* points, unsigned nbPoints, bool closed);
+  void blendSpan(int y, int left, int right, uint32_t source);
+};
+
+/* === FUNCTIONS === */
+
+/**
+ * Draws into the whole target in bands of rows on every core. The draw function is
+ * called once per band with the band's Raster, from several threads at once.
+ */
+void drawBands(const Target& target, const Transform& transform,
+               const std::function<void(Raster&)>& draw);
+
+}  // namespace raster
+
+#endif
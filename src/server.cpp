@@ -0,0 +1,960 @@
+// archipelago v3.0.0 - architecture b2
+// server.cpp - resident town queries over a local socket
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include "server.hpp"
+
+#include <fcntl.h>       // fcntl()
+#include <poll.h>        // poll()
+#include <sys/socket.h>  // socket(), connect(), accept(), recv(), send()
+#include <sys/stat.h>    // lstat()
+#include <sys/un.h>      // sockaddr_un
+#include <unistd.h>      // close(), unlink(), pipe()
+
+#include <algorithm>  // max()
+#include <cerrno>   // errno
+#include <cmath>    // isfinite(), floor()
+#include <cstdio>   // snprintf()
+#include <cstdlib>  // strtod()
+#include <cstring>  // strerror(), memset(), strspn()
+#include <condition_variable>
+#include <deque>
+#include <exception>  // unexpected failures of a request
+#include <iostream>  // cout, cerr
+#include <map>
+#include <memory>  // shared_ptr
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model/constants.hpp"
+#include "model/graph.hpp"
+#include "model/node.hpp"
+#include "model/tools.hpp"
+#include "model/town.hpp"
+#include "model/trace.hpp"
+#include "model/validation.hpp"
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+using town::Town;
+
+/* === INTERNAL DEFINITIONS AND PROTOTYPES === */
+
+namespace {
+
+constexpr int EXIT_OK(0);
+constexpr int EXIT_ERROR(1);
+
+constexpr int LISTEN_BACKLOG(64);             // connections waiting to be accepted
+constexpr size_t READ_SIZE(1 << 16);          // bytes received at once
+constexpr size_t MAX_REQUEST_SIZE(64 << 20);  // a longer line closes the connection
+constexpr unsigned MAX_DEPTH(64);             // nesting of JSON arrays and objects
+constexpr unsigned MAX_NUMBER_LENGTH(32);     // %.17g
+constexpr unsigned HEX_BASE(16);
+constexpr unsigned UNICODE_DIGITS(4);  // \uXXXX
+constexpr char DIGITS[]("0123456789");
+
+/** A parsed JSON value, the items of an object are named by its keys */
+struct Value {
+  enum Kind { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+  Kind kind;
+  bool boolean;
+  double number;
+  string text;
+  vector<Value> items;
+  vector<string> keys;
+};
+
+/** A recursive descent parser of a single JSON value */
+class Reader {
+ public:
+  Reader() = delete;
+  explicit Reader(const string& text);
+
+  /** @throws If the text is not exactly one JSON value */
+  Value parse();
+
+ private:
+  const string& text;
+  size_t position;
+
+  Value value(unsigned depth);
+  string quoted();
+  double number();
+  /** Skips the digits at the position, returns how many there were */
+  size_t digits();
+  void skipSpace();
+  bool separator();
+  void expect(char character);
+  void literal(const char* word);
+  string invalid() const;
+};
+
+/** The fields of a response, written as JSON */
+class Fields {
+ public:
+  void add(const char* key, const Value& value);
+  void add(const char* key, bool value);
+  void add(const char* key, double value);
+  void add(const char* key, unsigned long value);
+  void add(const char* key, const string& value);
+  void add(const char* key, const vector<unsigned>& uids);
+  /** Adds a value that is already written as JSON */
+  void addJson(const char* key, const string& json);
+
+  /** Each field is preceded by a comma */
+  const string& str() const;
+
+ private:
+  string text;
+
+  void key(const char* name);
+};
+
+/** A town as it is queried, never modified once published */
+struct Snapshot {
+  explicit Snapshot(Town&& resident);
+
+  const Town town;
+
+  /** The statistics, computed by the first query that needs them */
+  mutable std::once_flag statsOnce;
+  mutable double enj;
+  mutable double ci;
+  mutable double mta;
+};
+
+/** A client, and the part of its requests that does not end with a newline yet */
+struct Connection {
+  int socket;
+  string buffer;
+  /** The buffer has no newline before this position */
+  size_t searched;
+};
+
+/** The memory reused by the queries of a thread */
+struct Session {
+  graph::Workspace workspace;
+  vector<unsigned> path;
+  vector<char> chunk;
+  /** Whether the last request asked the server to stop */
+  bool shutdown;
+};
+
+/**
+ * A single thread waits for connections and requests, a readable connection is
+ * handed to a worker of the pool. It answers the requests that have arrived, in
+ * order, and hands the connection back. An idle client does not occupy a worker.
+ */
+class Server {
+ public:
+  Server() = delete;
+  /** @throws If the wake-up pipe can not be created */
+  explicit Server(int listener);
+  ~Server();
+
+  /** Serves connections until stop() is called, and waits for the workers */
+  void serve();
+  /** Stops serving, the connections are closed once the workers are done */
+  void stop();
+
+ private:
+  int listener;
+  /** Written to wake up the waiting thread, see serve() */
+  int wakeRead;
+  int wakeWrite;
+
+  std::mutex townsMutex;
+  std::map<string, shared_ptr<const Snapshot>> towns;
+  /** Edits are applied one at a time, a load or an unload waits for them */
+  std::mutex editMutex;
+
+  std::mutex queueMutex;
+  std::condition_variable queueReady;
+  /** Connections with requests to answer, and connections handed back */
+  std::deque<std::unique_ptr<Connection>> readable;
+  vector<std::unique_ptr<Connection>> served;
+  bool stopping;
+
+  void work();
+  void wake();
+  /**
+   * Answers the requests that have arrived on a readable connection
+   * @returns Whether the connection is still open
+   */
+  bool serveConnection(Connection& connection, Session& session);
+  string handle(const string& line, Session& session);
+
+  void load(const Value& request, Fields& results);
+  void unload(const Value& request, Fields& results);
+  void validate(const Value& request, Fields& results) const;
+  void stats(const Value& request, Fields& results);
+  void path(const Value& request, Fields& results, Session& session);
+  void route(const Value& request, Fields& results, Session& session);
+  void edit(const Value& request, Fields& results);
+
+  /** @throws If there is no town of that name */
+  shared_ptr<const Snapshot> find(const string& name);
+  void publish(const string& name, shared_ptr<const Snapshot> snapshot);
+};
+
+const Value* member(const Value& object, const char* key);
+const Value& require(const Value& object, const char* key, Value::Kind kind);
+string textOf(const Value& object, const char* key);
+double numberOf(const Value& object, const char* key);
+unsigned uidOf(const Value& object, const char* key);
+/** @throws If the town has no node of that uid, which the town would ignore */
+unsigned knownUidOf(const Town& town, const Value& object, const char* key);
+bool flagOf(const Value& object, const char* key, bool fallback);
+node::NodeType typeOf(const Value& object, const char* key);
+
+void applyEdit(Town& town, const Value& edit);
+
+string quote(const string& text);
+string format(double value);
+void appendUtf8(string& text, unsigned codePoint);
+/** The message of an error, without the trailing newline of the error module */
+string message(const string& error);
+bool sendAll(int client, const string& data);
+/**
+ * Removes a socket left behind by a server that is no longer running
+ * @returns An error if the path is something else or a server still answers on it
+ */
+string clearSocket(const string& socketPath, const sockaddr_un& address);
+
+}  // namespace
+
+namespace server {
+
+/* === FUNCTIONS === */
+
+int run(const string& socketPath) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: Invalid socket path: " << socketPath << std::endl;
+    return EXIT_ERROR;
+  }
+  socketPath.copy(address.sun_path, socketPath.size());
+
+  const int listener(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listener < 0) {
+    std::cerr << "Error: " << std::strerror(errno) << std::endl;
+    return EXIT_ERROR;
+  }
+
+  const string error(clearSocket(socketPath, address));
+  if (!error.empty()) {
+    std::cerr << "Error: " << error << std::endl;
+    close(listener);
+    return EXIT_ERROR;
+  }
+
+  const sockaddr* generic(reinterpret_cast<const sockaddr*>(&address));
+  if (bind(listener, generic, sizeof(address)) < 0 ||
+      listen(listener, LISTEN_BACKLOG) < 0) {
+    std::cerr << "Error: " << std::strerror(errno) << std::endl;
+    close(listener);
+    return EXIT_ERROR;
+  }
+
+  int status(EXIT_OK);
+  try {
+    Server server(listener);
+    std::cout << "Serving on " << socketPath << std::endl;
+    server.serve();
+  } catch (std::string& err) {
+    std::cerr << "Error: " << err << std::endl;
+    status = EXIT_ERROR;
+  }
+
+  close(listener);
+  unlink(socketPath.c_str());
+  return status;
+}
+
+}  // namespace server
+
+namespace {
+
+/* === SERVER === */
+
+Snapshot::Snapshot(Town&& resident)
+    : town(std::move(resident)), enj(0), ci(0), mta(0) {}
+
+Server::Server(int listener) : listener(listener), stopping(false) {
+  int wakePipe[2];
+  if (pipe(wakePipe) < 0) throw string(std::strerror(errno));
+  wakeRead = wakePipe[0];
+  wakeWrite = wakePipe[1];
+  fcntl(wakeRead, F_SETFL, O_NONBLOCK);
+  fcntl(wakeWrite, F_SETFL, O_NONBLOCK);
+}
+
+Server::~Server() {
+  close(wakeRead);
+  close(wakeWrite);
+}
+
+void Server::serve() {
+  const unsigned nbWorkers(std::max(1U, std::thread::hardware_concurrency()));
+  vector<std::thread> workers;
+  for (unsigned i(0); i < nbWorkers; ++i) workers.emplace_back(&Server::work, this);
+
+  vector<std::unique_ptr<Connection>> idle;
+  vector<pollfd> waiting;
+  char drained[READ_SIZE];
+
+  for (;;) {
+    waiting.assign({{listener, POLLIN, 0}, {wakeRead, POLLIN, 0}});
+    for (const auto& connection : idle)
+      waiting.push_back({connection->socket, POLLIN, 0});
+    if (poll(waiting.data(), waiting.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "Error: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    std::unique_lock<std::mutex> lock(queueMutex);
+    if (stopping) break;
+
+    // The idle connections are in the same order as their entries
+    size_t kept(0);
+    for (size_t i(0); i < idle.size(); ++i) {
+      if (waiting[i + 2].revents != 0) {
+        readable.push_back(std::move(idle[i]));
+        queueReady.notify_one();
+      } else {
+        idle[kept++] = std::move(idle[i]);
+      }
+    }
+    idle.resize(kept);
+
+    if (waiting[1].revents != 0) {
+      while (read(wakeRead, drained, sizeof(drained)) > 0) continue;
+      for (auto& connection : served) idle.push_back(std::move(connection));
+      served.clear();
+    }
+    lock.unlock();
+
+    if (waiting[0].revents != 0) {
+      const int client(accept(listener, nullptr, nullptr));
+      if (client >= 0) idle.emplace_back(new Connection{client, "", 0});
+    }
+  }
+
+  stop();
+  for (auto& worker : workers) worker.join();
+  for (const auto& connection : idle) close(connection->socket);
+  for (const auto& connection : readable) close(connection->socket);
+  for (const auto& connection : served) close(connection->socket);
+}
+
+void Server::stop() {
+  std::lock_guard<std::mutex> lock(queueMutex);
+  stopping = true;
+  queueReady.notify_all();
+  wake();
+}
+
+void Server::work() {
+  Session session;
+  session.chunk.resize(READ_SIZE);
+  session.shutdown = false;
+
+  for (;;) {
+    std::unique_ptr<Connection> connection;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueReady.wait(lock, [this] { return stopping || !readable.empty(); });
+      if (stopping) return;
+      connection = std::move(readable.front());
+      readable.pop_front();
+    }
+
+    if (serveConnection(*connection, session)) {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      served.push_back(std::move(connection));
+      wake();
+    } else {
+      close(connection->socket);
+    }
+    if (session.shutdown) stop();
+  }
+}
+
+/** A full pipe already wakes up the waiting thread */
+void Server::wake() {
+  const char signal('\0');
+  if (write(wakeWrite, &signal, sizeof(signal)) < 0) return;
+}
+
+bool Server::serveConnection(Connection& connection, Session& session) {
+  ssize_t count;
+  do {
+    count = recv(connection.socket, session.chunk.data(), session.chunk.size(), 0);
+  } while (count < 0 && errno == EINTR);
+  if (count <= 0) return false;
+
+  string& buffer(connection.buffer);
+  buffer.append(session.chunk.data(), count);
+
+  size_t start(0);
+  for (size_t end(buffer.find('\n', connection.searched)); end != string::npos;
+       end = buffer.find('\n', start)) {
+    const string line(buffer, start, end - start);
+    start = end + 1;
+    if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+    if (!sendAll(connection.socket, handle(line, session)) || session.shutdown)
+      return false;
+  }
+  buffer.erase(0, start);
+  connection.searched = buffer.size();
+
+  if (buffer.size() > MAX_REQUEST_SIZE) {
+    sendAll(connection.socket, "{\"ok\":false,\"error\":\"Request too large\"}\n");
+    return false;
+  }
+  return true;
+}
+
+string Server::handle(const string& line, Session& session) {
+  TRACE_SCOPE("server::handle");
+  string response("{");
+  Fields results;
+
+  try {
+    const Value request(Reader(line).parse());
+    if (request.kind != Value::OBJECT) throw string("A request must be an object");
+
+    const Value* id(member(request, "id"));
+    if (id != nullptr) {
+      Fields idField;
+      idField.add("id", *id);
+      response += idField.str().substr(1) + ",";
+    }
+
+    const string op(textOf(request, "op"));
+    if (op == "load") {
+      load(request, results);
+    } else if (op == "unload") {
+      unload(request, results);
+    } else if (op == "validate") {
+      validate(request, results);
+    } else if (op == "stats") {
+      stats(request, results);
+    } else if (op == "path") {
+      path(request, results, session);
+    } else if (op == "route") {
+      route(request, results, session);
+    } else if (op == "edit") {
+      edit(request, results);
+    } else if (op == "shutdown") {
+      session.shutdown = true;
+    } else {
+      throw "Unknown operation: " + op;
+    }
+
+  } catch (const string& error) {
+    return response + "\"ok\":false,\"error\":" + quote(message(error)) + "}\n";
+  } catch (const std::exception& error) {
+    // Such as running out of memory, the server and its other towns carry on
+    return response + "\"ok\":false,\"error\":" + quote(message(error.what())) +
+           "}\n";
+  } catch (...) {
+    return response + "\"ok\":false,\"error\":\"Internal error\"}\n";
+  }
+  return response + "\"ok\":true" + results.str() + "}\n";
+}
+
+void Server::load(const Value& request, Fields& results) {
+  const string name(textOf(request, "town"));
+  shared_ptr<const Snapshot> snapshot(std::make_shared<const Snapshot>(
+      town::openCached(textOf(request, "path"), flagOf(request, "crossings", true))));
+
+  results.add("nodes", static_cast<unsigned long>(snapshot->town.getNodes().size()));
+  results.add("links", static_cast<unsigned long>(snapshot->town.getLinks()->size()));
+
+  std::lock_guard<std::mutex> lock(editMutex);
+  publish(name, snapshot);
+}
+
+void Server::unload(const Value& request, Fields& results) {
+  const string name(textOf(request, "town"));
+  std::lock_guard<std::mutex> editLock(editMutex);
+  std::lock_guard<std::mutex> lock(townsMutex);
+  results.add("unloaded", towns.erase(name) == 1);
+}
+
+void Server::validate(const Value& request, Fields& results) const {
+  const auto violations(
+      town::validateFile(textOf(request, "path"), flagOf(request, "crossings", true)));
+
+  string json("[");
+  for (const auto& violation : violations) {
+    if (json.size() > 1) json += ",";
+    json += "{\"line\":" + std::to_string(violation.line) +
+            ",\"message\":" + quote(message(validation::message(violation))) + "}";
+  }
+  results.addJson("violations", json + "]");
+}
+
+void Server::stats(const Value& request, Fields& results) {
+  const auto snapshot(find(textOf(request, "town")));
+  std::call_once(snapshot->statsOnce, [&snapshot] {
+    snapshot->enj = snapshot->town.enj();
+    snapshot->ci = snapshot->town.ci();
+    snapshot->mta = snapshot->town.mta();
+  });
+
+  results.add("enj", snapshot->enj);
+  results.add("ci", snapshot->ci);
+  results.add("mta", snapshot->mta);
+  results.add("clusters",
+              static_cast<unsigned long>(snapshot->town.getClusterCount()));
+}
+
+void Server::path(const Value& request, Fields& results, Session& session) {
+  const auto snapshot(find(textOf(request, "town")));
+  const town::PathQuery query(
+      snapshot->town.pathFind(uidOf(request, "origin"), typeOf(request, "type"),
+                              session.workspace, session.path));
+  results.add("found", query.success);
+  if (query.success) {
+    results.add("distance", query.distance);
+    results.add("path", session.path);
+  }
+}
+
+void Server::route(const Value& request, Fields& results, Session& session) {
+  const auto snapshot(find(textOf(request, "town")));
+  const town::PathQuery query(snapshot->town.pathFindTo(
+      uidOf(request, "origin"), uidOf(request, "destination"), session.workspace,
+      session.path));
+  results.add("found", query.success);
+  if (query.success) {
+    results.add("distance", query.distance);
+    results.add("path", session.path);
+  }
+}
+
+/** The edits are applied to a copy, the town is replaced only if all of them pass */
+void Server::edit(const Value& request, Fields& results) {
+  const string name(textOf(request, "town"));
+  const Value& edits(require(request, "edits", Value::ARRAY));
+
+  std::lock_guard<std::mutex> lock(editMutex);
+  Town town(find(name)->town);
+  town.beginBatch();
+  for (const auto& edit : edits.items) applyEdit(town, edit);
+  town.commit();
+
+  results.add("nodes", static_cast<unsigned long>(town.getNodes().size()));
+  results.add("links", static_cast<unsigned long>(town.getLinks()->size()));
+  publish(name, std::make_shared<const Snapshot>(std::move(town)));
+}
+
+shared_ptr<const Snapshot> Server::find(const string& name) {
+  std::lock_guard<std::mutex> lock(townsMutex);
+  auto snapshot(towns.find(name));
+  if (snapshot == towns.end()) throw "Unknown town: " + name;
+  return snapshot->second;
+}
+
+void Server::publish(const string& name, shared_ptr<const Snapshot> snapshot) {
+  std::lock_guard<std::mutex> lock(townsMutex);
+  towns[name] = std::move(snapshot);
+}
+
+/* === REQUESTS === */
+
+const Value* member(const Value& object, const char* key) {
+  for (size_t i(0); i < object.keys.size(); ++i)
+    if (object.keys[i] == key) return &object.items[i];
+  return nullptr;
+}
+
+const Value& require(const Value& object, const char* key, Value::Kind kind) {
+  const Value* value(member(object, key));
+  if (value == nullptr || value->kind != kind)
+    throw string("Missing or invalid field: ") + key;
+  return *value;
+}
+
+string textOf(const Value& object, const char* key) {
+  return require(object, key, Value::STRING).text;
+}
+
+double numberOf(const Value& object, const char* key) {
+  return require(object, key, Value::NUMBER).number;
+}
+
+unsigned uidOf(const Value& object, const char* key) {
+  const double uid(numberOf(object, key));
+  if (!(uid >= 0 && uid < NO_LINK) || uid != static_cast<unsigned>(uid))
+    throw string("Invalid uid: ") + key;
+  return static_cast<unsigned>(uid);
+}
+
+unsigned knownUidOf(const Town& town, const Value& object, const char* key) {
+  const unsigned uid(uidOf(object, key));
+  if (town.getNode(uid) == nullptr) throw "Unknown node: " + std::to_string(uid);
+  return uid;
+}
+
+bool flagOf(const Value& object, const char* key, bool fallback) {
+  if (member(object, key) == nullptr) return fallback;
+  return require(object, key, Value::BOOLEAN).boolean;
+}
+
+node::NodeType typeOf(const Value& object, const char* key) {
+  const string type(textOf(object, key));
+  if (type == "housing") return node::HOUSING;
+  if (type == "transport") return node::TRANSPORT;
+  if (type == "production") return node::PRODUCTION;
+  throw "Unknown node type: " + type;
+}
+
+void applyEdit(Town& town, const Value& edit) {
+  if (edit.kind != Value::OBJECT) throw string("An edit must be an object");
+
+  const string op(textOf(edit, "op"));
+  if (op == "add_node") {
+    const double capacity(numberOf(edit, "capacity"));
+    if (!(capacity >= 0 && capacity <= NO_LINK) || capacity != std::floor(capacity))
+      throw string("Invalid field: capacity");
+    town.addNode(node::Node(typeOf(edit, "type"), uidOf(edit, "uid"),
+                            tools::Vec2(numberOf(edit, "x"), numberOf(edit, "y")),
+                            static_cast<unsigned>(capacity)));
+  } else if (op == "remove_node") {
+    town.removeNode(knownUidOf(town, edit, "uid"));
+  } else if (op == "move_node") {
+    town.moveNode(knownUidOf(town, edit, "uid"),
+                  tools::Vec2(numberOf(edit, "x"), numberOf(edit, "y")));
+  } else if (op == "add_link") {
+    town.addLink(node::Link(uidOf(edit, "uid0"), uidOf(edit, "uid1")));
+  } else if (op == "remove_link") {
+    town.removeLink(node::Link(uidOf(edit, "uid0"), uidOf(edit, "uid1")));
+  } else {
+    throw "Unknown edit: " + op;
+  }
+}
+
+/* === JSON === */
+
+Reader::Reader(const string& text) : text(text), position(0) {}
+
+Value Reader::parse() {
+  Value parsed(value(0));
+  skipSpace();
+  if (position != text.size()) throw invalid();
+  return parsed;
+}
+
+Value Reader::value(unsigned depth) {
+  if (depth > MAX_DEPTH) throw invalid();
+  skipSpace();
+  if (position == text.size()) throw invalid();
+
+  Value parsed{Value::NUL, false, 0, "", {}, {}};
+  switch (text[position]) {
+    case '{':
+      parsed.kind = Value::OBJECT;
+      ++position;
+      skipSpace();
+      if (position < text.size() && text[position] == '}') {
+        ++position;
+        break;
+      }
+      for (;;) {
+        parsed.keys.push_back(quoted());
+        expect(':');
+        parsed.items.push_back(value(depth + 1));
+        if (!separator()) break;
+      }
+      expect('}');
+      break;
+
+    case '[':
+      parsed.kind = Value::ARRAY;
+      ++position;
+      skipSpace();
+      if (position < text.size() && text[position] == ']') {
+        ++position;
+        break;
+      }
+      for (;;) {
+        parsed.items.push_back(value(depth + 1));
+        if (!separator()) break;
+      }
+      expect(']');
+      break;
+
+    case '"':
+      parsed.kind = Value::STRING;
+      parsed.text = quoted();
+      break;
+
+    case 't':
+      literal("true");
+      parsed.kind = Value::BOOLEAN;
+      parsed.boolean = true;
+      break;
+
+    case 'f':
+      literal("false");
+      parsed.kind = Value::BOOLEAN;
+      break;
+
+    case 'n':
+      literal("null");
+      break;
+
+    default:
+      parsed.kind = Value::NUMBER;
+      parsed.number = number();
+  }
+  return parsed;
+}
+
+string Reader::quoted() {
+  expect('"');
+  string unquoted;
+  while (position < text.size() && text[position] != '"') {
+    char character(text[position++]);
+    if (character != '\\') {
+      unquoted += character;
+      continue;
+    }
+    if (position == text.size()) throw invalid();
+
+    switch (text[position++]) {
+      case 'b':
+        unquoted += '\b';
+        break;
+      case 'f':
+        unquoted += '\f';
+        break;
+      case 'n':
+        unquoted += '\n';
+        break;
+      case 'r':
+        unquoted += '\r';
+        break;
+      case 't':
+        unquoted += '\t';
+        break;
+      case 'u': {
+        if (text.size() - position < UNICODE_DIGITS) throw invalid();
+        const string digits(text, position, UNICODE_DIGITS);
+        if (digits.find_first_not_of("0123456789abcdefABCDEF") != string::npos)
+          throw invalid();
+        appendUtf8(unquoted, std::stoul(digits, nullptr, HEX_BASE));
+        position += UNICODE_DIGITS;
+        break;
+      }
+      default:
+        unquoted += text[position - 1];  // quote, backslash or slash
+    }
+  }
+  expect('"');
+  return unquoted;
+}
+
+/** The JSON grammar, which strtod() extends with hexadecimal, infinity and a plus */
+double Reader::number() {
+  const size_t start(position);
+  if (position < text.size() && text[position] == '-') ++position;
+  if (position < text.size() && text[position] == '0') {
+    ++position;
+  } else if (digits() == 0) {
+    throw invalid();
+  }
+  if (position < text.size() && text[position] == '.') {
+    ++position;
+    if (digits() == 0) throw invalid();
+  }
+  if (position < text.size() && (text[position] == 'e' || text[position] == 'E')) {
+    ++position;
+    if (position < text.size() && (text[position] == '+' || text[position] == '-'))
+      ++position;
+    if (digits() == 0) throw invalid();
+  }
+
+  const string written(text, start, position - start);
+  const double parsed(std::strtod(written.c_str(), nullptr));
+  if (!std::isfinite(parsed)) throw invalid();
+  return parsed;
+}
+
+size_t Reader::digits() {
+  const size_t count(std::strspn(text.c_str() + position, DIGITS));
+  position += count;
+  return count;
+}
+
+void Reader::skipSpace() {
+  while (position < text.size() && (text[position] == ' ' || text[position] == '\t' ||
+                                    text[position] == '\r' || text[position] == '\n'))
+    ++position;
+}
+
+/** Skips a comma, if there is one */
+bool Reader::separator() {
+  skipSpace();
+  if (position == text.size() || text[position] != ',') return false;
+  ++position;
+  return true;
+}
+
+void Reader::expect(char character) {
+  skipSpace();
+  if (position == text.size() || text[position] != character) throw invalid();
+  ++position;
+}
+
+void Reader::literal(const char* word) {
+  const string expected(word);
+  if (text.compare(position, expected.size(), expected) != 0) throw invalid();
+  position += expected.size();
+}
+
+string Reader::invalid() const {
+  return "Invalid JSON at byte " + std::to_string(position);
+}
+
+void Fields::add(const char* name, const Value& value) {
+  if (value.kind == Value::NUMBER) {
+    add(name, value.number);
+  } else if (value.kind == Value::STRING) {
+    add(name, value.text);
+  } else if (value.kind == Value::BOOLEAN) {
+    add(name, value.boolean);
+  } else {
+    addJson(name, "null");
+  }
+}
+
+void Fields::add(const char* name, bool value) {
+  addJson(name, value ? "true" : "false");
+}
+
+void Fields::add(const char* name, double value) { addJson(name, format(value)); }
+
+void Fields::add(const char* name, unsigned long value) {
+  addJson(name, std::to_string(value));
+}
+
+void Fields::add(const char* name, const string& value) {
+  addJson(name, quote(value));
+}
+
+void Fields::add(const char* name, const vector<unsigned>& uids) {
+  key(name);
+  text += '[';
+  for (size_t i(0); i < uids.size(); ++i) {
+    if (i > 0) text += ',';
+    text += std::to_string(uids[i]);
+  }
+  text += ']';
+}
+
+void Fields::addJson(const char* name, const string& json) {
+  key(name);
+  text += json;
+}
+
+const string& Fields::str() const { return text; }
+
+void Fields::key(const char* name) {
+  text += ",\"";
+  text += name;
+  text += "\":";
+}
+
+/** Escapes quotes, backslashes and control characters */
+string quote(const string& text) {
+  string quoted("\"");
+  for (const char& character : text) {
+    if (character == '"' || character == '\\') {
+      quoted += '\\';
+      quoted += character;
+    } else if (character == '\n') {
+      quoted += "\\n";
+    } else if (static_cast<unsigned char>(character) < ' ') {
+      char escaped[MAX_NUMBER_LENGTH];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+      quoted += escaped;
+    } else {
+      quoted += character;
+    }
+  }
+  return quoted + '"';
+}
+
+/** Enough digits to read back the same value, JSON has no infinite numbers */
+string format(double value) {
+  if (!std::isfinite(value)) return "null";
+  char formatted[MAX_NUMBER_LENGTH];
+  std::snprintf(formatted, sizeof(formatted), "%.17g", value);
+  return formatted;
+}
+
+void appendUtf8(string& text, unsigned codePoint) {
+  if (codePoint < 0x80) {
+    text += static_cast<char>(codePoint);
+  } else if (codePoint < 0x800) {
+    text += static_cast<char>(0xC0 | codePoint >> 6);
+    text += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else {
+    text += static_cast<char>(0xE0 | codePoint >> 12);
+    text += static_cast<char>(0x80 | (codePoint >> 6 & 0x3F));
+    text += static_cast<char>(0x80 | (codePoint & 0x3F));
+  }
+}
+
+string message(const string& error) {
+  if (!error.empty() && error.back() == '\n') return error.substr(0, error.size() - 1);
+  return error;
+}
+
+bool sendAll(int client, const string& data) {
+  size_t sent(0);
+  while (sent < data.size()) {
+    const ssize_t count(
+        send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL));
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    sent += count;
+  }
+  return true;
+}
+
+string clearSocket(const string& socketPath, const sockaddr_un& address) {
+  struct stat status;
+  if (lstat(socketPath.c_str(), &status) < 0) {
+    if (errno == ENOENT) return "";
+    return std::strerror(errno);
+  }
+  if (!S_ISSOCK(status.st_mode)) return "Not a socket: " + socketPath;
+
+  const int probe(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (probe < 0) return std::strerror(errno);
+  const sockaddr* generic(reinterpret_cast<const sockaddr*>(&address));
+  const bool answered(connect(probe, generic, sizeof(address)) == 0);
+  const int refusal(errno);
+  close(probe);
+
+  if (answered) return "A server is already running on " + socketPath;
+  if (refusal != ECONNREFUSED) return std::strerror(refusal);
+  if (unlink(socketPath.c_str()) < 0 && errno != ENOENT) return std::strerror(errno);
+  return "";
+}
+
+}  // namespace
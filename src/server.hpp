@@ -0,0 +1,53 @@
+// archipelago v3.0.0 - architecture b2
+// server.hpp - resident town queries over a local socket
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+
+/**
+ * Module: server
+ * A daemon that keeps named towns in memory and answers queries on a Unix domain
+ * socket, so that repeated queries skip loading and validating the same files.
+ *
+ * The protocol is JSON lines: each request is a JSON object on its own line, each
+ * response is a single line object with "ok" and either the results or an "error"
+ * message. The "id" of a request, if any, is repeated in its response.
+ *
+ *   {"op":"load","town":"a","path":"test/tests/g01.txt"}
+ *   {"op":"unload","town":"a"}
+ *   {"op":"validate","path":"test/tests/e01.txt","crossings":false}
+ *   {"op":"stats","town":"a"}                     enj, ci and mta
+ *   {"op":"path","town":"a","origin":1,"type":"transport"}
+ *   {"op":"route","town":"a","origin":1,"destination":7}
+ *   {"op":"edit","town":"a","edits":[{"op":"add_node","type":"housing","uid":9,
+ *     "x":0,"y":0,"capacity":1000},{"op":"add_link","uid0":9,"uid1":1}]}
+ *   {"op":"shutdown"}
+ *
+ * Edits are "add_node", "remove_node", "move_node" (uid, x, y), "add_link" and
+ * "remove_link" (uid0, uid1). They are applied together as a batch of a copy of the
+ * town (see Town::beginBatch), either all or none of them take effect. An edit of a
+ * node that does not exist fails.
+ *
+ * Queries run concurrently on a pool of threads, each connection being served by
+ * one thread at a time. A query holds an immutable snapshot of its town, an edit
+ * replaces the snapshot instead of modifying it.
+ */
+
+namespace server {
+
+/* === FUNCTIONS === */
+
+/**
+ * Serves requests on a socket at the given path until a shutdown request. A socket
+ * already at the path is replaced only if no server answers on it, any other file
+ * is left alone and the server does not start.
+ * @returns The exit status of the program
+ */
+int run(const std::string& socketPath);
+
+}  // namespace server
+
+#endif
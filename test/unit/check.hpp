@@ -0,0 +1,51 @@
+// archipelago v3.0.0 - architecture b2
+// check.hpp - assertions shared by the unit tests
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <iostream>
+
+/**
+ * Module: check
+ * A unit test is a program that runs its checks and reports them with
+ * check::report(), its exit status. A failed check prints its location and
+ * expression, without stopping the test.
+ */
+
+/** Records a check of a condition, see check::record() */
+#define CHECK(condition) check::record((condition), #condition, __FILE__, __LINE__)
+
+namespace check {
+
+/* === FUNCTIONS === */
+
+/** The number of failed checks of the program */
+inline unsigned& failures() {
+  static unsigned count(0);
+  return count;
+}
+
+/** Prints a failed check with its location. Returns whether the check passed */
+inline bool record(bool passed, const char* expression, const char* file, int line) {
+  if (!passed) {
+    ++failures();
+    std::cerr << file << ':' << line << ": check failed: " << expression << std::endl;
+  }
+  return passed;
+}
+
+/** Prints the result of a test, returns its exit status */
+inline int report(const char* name) {
+  if (failures() == 0) {
+    std::cout << "  ✓ " << name << std::endl;
+    return 0;
+  }
+  std::cout << "  ✗ " << name << ", " << failures() << " failed checks" << std::endl;
+  return 1;
+}
+
+}  // namespace check
+
+#endif
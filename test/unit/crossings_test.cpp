@@ -0,0 +1,192 @@
+// archipelago v3.0.0 - architecture b2
+// crossings_test.cpp - the link crossing sweep against every pair of links
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "model/node.hpp"
+#include "model/tools.hpp"
+#include "model/town.hpp"
+
+using std::pair;
+using std::vector;
+using tools::Segment;
+using tools::Vec2;
+
+namespace {
+
+constexpr unsigned SEED(36);
+constexpr unsigned NB_LATTICES(4000);
+constexpr unsigned NB_TOWNS(200);
+constexpr unsigned MAX_POINTS(20);
+constexpr unsigned MAX_SEGMENTS(30);
+constexpr unsigned MAX_LATTICE_SIZE(7);
+constexpr unsigned NB_TOWN_NODES(19);
+constexpr unsigned TOWN_LATTICE_SIZE(5);
+constexpr unsigned NB_TOWN_LINKS(40);
+constexpr unsigned CAPACITY(1000);
+
+/** Decimal steps and origins that are rounded when added up */
+constexpr double STEPS[] = {0.1, 1., 50.3, 100.1, 200.57};
+constexpr double ORIGINS[][2] = {{-209.1, -51.7}, {-209.10000000000002, -51.7}};
+
+/** Two segments on almost the same line, far apart */
+const Segment NEAR_COLLINEAR[] = {{{0.37, 140.6}, {200.57, 210.9}},
+                                  {{1001.37, 492.1}, {801.17, 421.8}}};
+
+/** Crossings missed by a sweep that ordered its status with rounded heights */
+const vector<Segment> MISSED{
+    {{392.61, 1151.72}, {-8.530000000000001, -51.7}},
+    {{392.71000000000004, 951.1499999999999}, {192.04, 550.01}},
+    {{192.04, 550.01}, {793.7499999999999, 349.44}},
+};
+
+/** Vertical and overlapping segments that corrupted such a status */
+const vector<Segment> CORRUPTED{
+    {{392.61, 550.01}, {392.61, 349.44}},
+    {{-8.530000000000001, 349.44}, {392.61, -51.7}},
+    {{392.61, 349.44}, {392.61, -51.7}},
+    {{392.61, -51.7}, {392.61, 349.44}},
+    {{192.04, 148.87}, {-8.530000000000001, 148.87}},
+    {{-8.530000000000001, -51.7}, {392.61, -51.7}},
+    {{-8.530000000000001, 148.87}, {-209.1, -51.7}},
+    {{-8.530000000000001, -51.7}, {392.61, 349.44}},
+    {{-8.530000000000001, 148.87}, {192.14, 148.87}},
+    {{-209.1, 550.01}, {192.14, 148.87}},
+    {{192.14, 148.87}, {392.61, 550.01}},
+    {{392.61, -51.7}, {192.04, 148.87}},
+    {{392.61, -51.7}, {392.61, 349.44}},
+    {{192.14, 148.87}, {-8.530000000000001, 148.87}},
+};
+
+vector<pair<unsigned, unsigned>> bruteForce(const vector<Segment>& segments) {
+  vector<pair<unsigned, unsigned>> crossings;
+  for (unsigned i(0); i < segments.size(); ++i)
+    for (unsigned j(i + 1); j < segments.size(); ++j)
+      if (tools::segmentsCross(segments[i], segments[j])) crossings.push_back({i, j});
+  return crossings;
+}
+
+vector<Segment> segmentsOf(const town::Town& town) {
+  vector<Segment> segments;
+  for (const auto& link : *town.getLinks()) {
+    segments.push_back({town.getNode(link.getUid0())->getPosition(),
+                        town.getNode(link.getUid1())->getPosition()});
+  }
+  return segments;
+}
+
+/** Points of a lattice, some of them shifted by a tenth */
+vector<Vec2> lattice(std::mt19937& random, unsigned size, unsigned count) {
+  const double step(STEPS[random() % (sizeof(STEPS) / sizeof(STEPS[0]))]);
+  const auto& origin(ORIGINS[random() % (sizeof(ORIGINS) / sizeof(ORIGINS[0]))]);
+  vector<Vec2> points;
+  for (unsigned i(0); i < count; ++i) {
+    const double shift(random() % 4 == 0 ? 0.1 * (random() % 3) : 0.);
+    points.push_back({origin[0] + step * (random() % size) + shift,
+                      origin[1] + step * (random() % size)});
+  }
+  return points;
+}
+
+/** Segments between random points of a lattice, with single points and duplicates */
+void checkLattices(std::mt19937& random) {
+  for (unsigned round(0); round < NB_LATTICES; ++round) {
+    const unsigned size(2 + random() % (MAX_LATTICE_SIZE - 1));
+    const vector<Vec2> points(lattice(random, size, 3 + random() % MAX_POINTS));
+    vector<Segment> segments;
+    for (unsigned i(0), count(1 + random() % MAX_SEGMENTS); i < count; ++i)
+      segments.push_back({points[random() % points.size()],
+                          points[random() % points.size()]});
+
+    if (!CHECK(tools::findCrossings(segments) == bruteForce(segments))) return;
+  }
+}
+
+/** The predicates give the same answer for either order of segments and ends */
+void checkSymmetry(const Segment& segment0, const Segment& segment1) {
+  const Segment reversed{segment1.pointB, segment1.pointA};
+  const bool crosses(tools::segmentsCross(segment0, segment1));
+  CHECK(tools::segmentsCross(segment1, segment0) == crosses);
+  CHECK(tools::segmentsCross(segment0, reversed) == crosses);
+}
+
+/**
+ * Links added one by one to a town that forbids crossings are refused exactly when
+ * they cross a link already there, and a town that allows them can only forbid them
+ * when none of its links cross.
+ */
+void checkTowns(std::mt19937& random) {
+  for (unsigned round(0); round < NB_TOWNS; ++round) {
+    const double step(STEPS[3 + random() % 2]);  // wider than the nodes
+    town::Town strict, loose;
+    strict.setCrossingsAllowed(false);
+    for (unsigned uid(1); uid <= NB_TOWN_NODES; ++uid) {
+      const Vec2 position(step * (random() % TOWN_LATTICE_SIZE) + ORIGINS[1][0],
+                          step * (random() % TOWN_LATTICE_SIZE) + ORIGINS[1][1]);
+      const node::Node node(node::HOUSING, uid, position, CAPACITY);
+      try {
+        loose.addNode(node);
+        strict.addNode(node);
+      } catch (std::string&) {
+      }
+    }
+
+    const vector<unsigned> uids(loose.getNodes());
+    if (uids.size() < 2) continue;
+    vector<Segment> segments;
+    for (unsigned i(0); i < NB_TOWN_LINKS; ++i) {
+      const unsigned first(random() % uids.size());
+      const unsigned second((first + 1 + random() % (uids.size() - 1)) % uids.size());
+      const node::Link link(uids[first], uids[second]);
+      try {
+        loose.addLink(link);
+      } catch (std::string&) {
+        continue;
+      }
+
+      const Segment segment{loose.getNode(link.getUid0())->getPosition(),
+                            loose.getNode(link.getUid1())->getPosition()};
+      bool crosses(false);
+      for (const auto& other : segments) {
+        crosses = crosses || tools::segmentsCross(segment, other);
+        checkSymmetry(segment, other);
+      }
+      bool refused(false);
+      try {
+        strict.addLink(link);
+      } catch (std::string&) {
+        refused = true;
+      }
+      if (!CHECK(refused == crosses)) return;
+      if (!refused) segments.push_back(segment);
+    }
+
+    bool forbidden(true);
+    try {
+      loose.setCrossingsAllowed(false);
+    } catch (std::string&) {
+      forbidden = false;
+    }
+    CHECK(forbidden == bruteForce(segmentsOf(loose)).empty());
+  }
+}
+
+}  // namespace
+
+int main() {
+  CHECK(!tools::segmentsIntersect(NEAR_COLLINEAR[0], NEAR_COLLINEAR[1]));
+  CHECK(!tools::segmentsCross(NEAR_COLLINEAR[0], NEAR_COLLINEAR[1]));
+  CHECK(tools::findCrossings(MISSED) == bruteForce(MISSED));
+  CHECK(tools::findCrossings(CORRUPTED) == bruteForce(CORRUPTED));
+
+  std::mt19937 random(SEED);
+  checkLattices(random);
+  checkTowns(random);
+
+  return check::report("crossings");
+}
@@ -0,0 +1,181 @@
+// archipelago v3.0.0 - architecture b2
+// journal_test.cpp - recovery of a town from a cut or damaged journal
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include <cstdlib>  // mkdtemp(), setenv(), system()
+#include <cstring>  // strcpy()
+#include <fstream>
+#include <functional>
+#include <iterator>  // istreambuf_iterator
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "model/journal.hpp"
+#include "model/node.hpp"
+#include "model/town.hpp"
+
+using std::string;
+using std::vector;
+using town::Town;
+
+namespace {
+
+constexpr char DIRECTORY_TEMPLATE[]("/tmp/archipelago-journal-XXXXXX");
+constexpr char TOWN_FILE[]("test/tests/g01.txt");
+constexpr unsigned CAPACITY(1000);
+constexpr unsigned FIRST_UID(100);
+constexpr unsigned SECOND_UID(101);
+
+/** The nodes and links of a town, in a form that can be compared */
+struct State {
+  vector<std::pair<unsigned, string>> nodes;
+  vector<std::pair<unsigned, unsigned>> links;
+
+  bool operator==(const State& other) const {
+    return nodes == other.nodes && links == other.links;
+  }
+};
+
+typedef std::function<void(Town&, journal::Journal&)> Edit;
+
+State stateOf(const Town& town) {
+  State state;
+  for (const auto& node : *town.getNodeMap()) {
+    const tools::Vec2 position(node.second.getPosition());
+    state.nodes.push_back(
+        {node.first, std::to_string(node.second.getType()) + " " +
+                         std::to_string(position.getX()) + " " +
+                         std::to_string(position.getY()) + " " +
+                         std::to_string(node.second.getCapacity())});
+  }
+  for (const auto& link : *town.getLinks())
+    state.links.push_back({link.getUid0(), link.getUid1()});
+  return state;
+}
+
+string readAll(const string& path) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  return string((std::istreambuf_iterator<char>(file)),
+                std::istreambuf_iterator<char>());
+}
+
+void writeAll(const string& path, const string& data) {
+  std::ofstream(path, std::ios::out | std::ios::binary | std::ios::trunc) << data;
+}
+
+/** Recovers the town with the journal replaced by the data */
+State recoverWith(const string& townPath, const string& data) {
+  writeAll(journal::journalPath(townPath), data);
+  Town town;
+  journal::recover(townPath, town);
+  return stateOf(town);
+}
+
+/** One edit of each kind, each made in its own session of the town */
+vector<Edit> edits() {
+  return {
+      [](Town& town, journal::Journal& log) {
+        const node::Node node(node::HOUSING, FIRST_UID, {1000, 1000}, CAPACITY);
+        town.addNode(node);
+        log.addNode(node);
+      },
+      [](Town& town, journal::Journal& log) {
+        const node::Node node(node::TRANSPORT, SECOND_UID, {1000, 1200}, CAPACITY);
+        town.addNode(node);
+        log.addNode(node);
+      },
+      [](Town& town, journal::Journal& log) {
+        const node::Link link(FIRST_UID, SECOND_UID);
+        town.addLink(link);
+        log.addLink(link);
+      },
+      [](Town& town, journal::Journal& log) {
+        town.moveNode(FIRST_UID, {1100, 1000});
+        log.setNodes(town, {FIRST_UID});
+      },
+      [](Town& town, journal::Journal& log) {
+        const node::Link link(FIRST_UID, SECOND_UID);
+        town.removeLink(link);
+        log.removeLink(link);
+      },
+      [](Town& town, journal::Journal& log) {
+        town.removeNodes({SECOND_UID});
+        log.removeNodes({SECOND_UID});
+      },
+  };
+}
+
+/**
+ * The journal after each edit and the town it holds, then the recovery of a journal
+ * that is cut inside a record or damaged in one: the edits before it are kept.
+ */
+void checkRecovery(const string& townPath) {
+  vector<size_t> sizes;
+  vector<State> states;
+  {
+    Town town;
+    journal::recover(townPath, town);
+    states.push_back(stateOf(town));
+    sizes.push_back(readAll(journal::journalPath(townPath)).size());
+  }
+  for (const auto& edit : edits()) {
+    Town town;
+    std::unique_ptr<journal::Journal> log(journal::recover(townPath, town));
+    edit(town, *log);
+    log.reset();  // writes the record
+    states.push_back(stateOf(town));
+    sizes.push_back(readAll(journal::journalPath(townPath)).size());
+  }
+  const string full(readAll(journal::journalPath(townPath)));
+  if (!CHECK(sizes.back() == full.size())) return;
+
+  CHECK(recoverWith(townPath, full) == states.back());
+  for (size_t edit(1); edit < sizes.size(); ++edit) {
+    if (!CHECK(sizes[edit] > sizes[edit - 1])) return;
+
+    // Cut anywhere inside the record of the edit
+    const string firstByte(full, 0, sizes[edit - 1] + 1);
+    const string lastByteMissing(full, 0, sizes[edit] - 1);
+    CHECK(recoverWith(townPath, firstByte) == states[edit - 1]);
+    CHECK(recoverWith(townPath, lastByteMissing) == states[edit - 1]);
+    CHECK(recoverWith(townPath, string(full, 0, sizes[edit])) == states[edit]);
+
+    // A damaged record drops the records after it too
+    string damaged(full);
+    damaged[(sizes[edit - 1] + sizes[edit]) / 2] ^= 0x5A;
+    CHECK(recoverWith(townPath, damaged) == states[edit - 1]);
+  }
+
+  // A damaged header is another journal, the town file is loaded alone
+  string header(full);
+  header[1] ^= 0x5A;
+  CHECK(recoverWith(townPath, header) == states.front());
+
+  // After a cut journal is recovered, new edits follow the records that were kept
+  writeAll(journal::journalPath(townPath), string(full, 0, sizes[2] + 1));
+  {
+    Town town;
+    std::unique_ptr<journal::Journal> log(journal::recover(townPath, town));
+    edits()[2](town, *log);
+  }
+  CHECK(recoverWith(townPath, readAll(journal::journalPath(townPath))) == states[3]);
+}
+
+}  // namespace
+
+int main() {
+  char directory[sizeof(DIRECTORY_TEMPLATE)];
+  std::strcpy(directory, DIRECTORY_TEMPLATE);
+  if (!CHECK(mkdtemp(directory) != nullptr)) return check::report("journal");
+  setenv("XDG_CACHE_HOME", directory, 1);
+
+  const string townPath(string(directory) + "/town.txt");
+  writeAll(townPath, readAll(TOWN_FILE));
+  checkRecovery(townPath);
+  std::system(("rm -rf " + string(directory)).c_str());
+
+  return check::report("journal");
+}
@@ -0,0 +1,136 @@
+// archipelago v3.0.0 - architecture b2
+// parser_test.cpp - the parallel parser against the sequential one
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "model/parser.hpp"
+
+using std::string;
+using std::vector;
+using validation::LinkRecord;
+using validation::NodeRecord;
+
+namespace {
+
+constexpr unsigned SEED(35);
+constexpr unsigned NB_NODE_SECTIONS(3);
+constexpr size_t LONG_COMMENT(1536 * 1024);  // spans a chunk boundary
+constexpr char TRUNCATED_FILE[]("test/tests/e11.txt");
+constexpr unsigned TRUNCATED_LAST_LINE(4);
+
+/** The quirks of a generated town file */
+struct Shape {
+  unsigned counts[NB_NODE_SECTIONS + 1];
+  /** Extra records beyond the counts, or missing ones if the counts run past */
+  bool pastEnd;
+  bool longComment;
+  bool finalFeed;
+};
+
+/** A record line with random spacing, comments and missing or extra fields */
+void writeRecord(std::ostringstream& text, std::mt19937& random, unsigned fields) {
+  std::uniform_int_distribution<unsigned> pick(0, 15);
+  if (pick(random) == 0) text << "# comment only\n";
+  if (pick(random) == 0) text << "\n \t\n";
+  text << (pick(random) < 8 ? "\t" : "  ");
+
+  const unsigned written(pick(random) == 0 ? pick(random) % fields : fields);
+  for (unsigned i(0); i < written; ++i) {
+    if (i > 0) text << (pick(random) < 2 ? "\t " : " ");
+    if (i == 1 || i == 2) {
+      text << std::uniform_real_distribution<double>(-1e4, 1e4)(random);
+    } else {
+      text << random() % 100000;
+    }
+  }
+  if (pick(random) == 0) text << " 42";
+  if (pick(random) < 3) text << " # trailing comment";
+  text << (pick(random) == 0 ? "\r\n" : "\n");
+}
+
+string generate(const Shape& shape, std::mt19937& random) {
+  std::ostringstream text;
+  text.precision(9);
+  text << "# generated town\n";
+  for (unsigned section(0); section <= NB_NODE_SECTIONS; ++section) {
+    const bool links(section == NB_NODE_SECTIONS);
+    const unsigned count(shape.counts[section]);
+    text << (shape.pastEnd && links ? count * 2 : count) << " # count\n";
+    for (unsigned i(0); i < count; ++i) {
+      writeRecord(text, random, links ? 2 : 4);
+      if (shape.longComment && section == 1 && i == count / 2) {
+        text << '#' << string(LONG_COMMENT, 'x') << '\n';
+      }
+    }
+  }
+  if (!shape.pastEnd) text << "9 9 # past the last link\n";
+
+  string result(text.str());
+  if (!shape.finalFeed) result.pop_back();
+  return result;
+}
+
+bool sameNode(const NodeRecord& a, const NodeRecord& b) {
+  return a.type == b.type && a.uid == b.uid && a.capacity == b.capacity &&
+         a.line == b.line && a.position.getX() == b.position.getX() &&
+         a.position.getY() == b.position.getY();
+}
+
+bool sameLink(const LinkRecord& a, const LinkRecord& b) {
+  return a.uid0 == b.uid0 && a.uid1 == b.uid1 && a.line == b.line;
+}
+
+/** Parses the text with both parsers and compares every record */
+void compare(const string& text) {
+  vector<NodeRecord> parallelNodes, sequentialNodes;
+  vector<LinkRecord> parallelLinks, sequentialLinks;
+  parser::parseTown(text.data(), text.size(), parallelNodes, parallelLinks);
+  std::istringstream stream(text);
+  parser::parseSequential(stream, sequentialNodes, sequentialLinks);
+
+  if (!CHECK(parallelNodes.size() == sequentialNodes.size()) ||
+      !CHECK(parallelLinks.size() == sequentialLinks.size()))
+    return;
+  for (size_t i(0); i < parallelNodes.size(); ++i) {
+    if (!CHECK(sameNode(parallelNodes[i], sequentialNodes[i]))) return;
+  }
+  for (size_t i(0); i < parallelLinks.size(); ++i) {
+    if (!CHECK(sameLink(parallelLinks[i], sequentialLinks[i]))) return;
+  }
+}
+
+/** A count that runs past the end reports the last line of the file */
+void checkTruncated() {
+  std::ifstream file(TRUNCATED_FILE);
+  const string text((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+  vector<NodeRecord> nodes;
+  vector<LinkRecord> links;
+  parser::parseTown(text.data(), text.size(), nodes, links);
+  if (CHECK(nodes.size() == 2)) CHECK(nodes.back().line == TRUNCATED_LAST_LINE);
+  compare(text);
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 random(SEED);
+  const Shape shapes[] = {
+      {{40000, 20000, 20000, 60000}, false, false, true},
+      {{40000, 20000, 20000, 60000}, false, true, false},
+      {{90000, 0, 1, 0}, false, false, true},
+      {{30000, 30000, 30000, 30000}, true, false, true},
+      {{30000, 30000, 30000, 30000}, true, true, false},
+      {{3, 2, 1, 2}, false, false, true},
+  };
+  for (const auto& shape : shapes) compare(generate(shape, random));
+  checkTruncated();
+
+  return check::report("parser");
+}
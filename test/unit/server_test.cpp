@@ -0,0 +1,179 @@
+// archipelago v3.0.0 - architecture b2
+// server_test.cpp - requests and responses of the query server on a socket
+// Authors: Marcus Cemes, Alexandre Dodens
+
+#include <sys/socket.h>  // socket(), bind(), connect()
+#include <sys/stat.h>    // stat()
+#include <sys/un.h>      // sockaddr_un
+#include <unistd.h>      // close(), unlink()
+
+#include <chrono>
+#include <cstdlib>  // mkdtemp(), setenv(), system()
+#include <cstring>  // memset(), strcpy()
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "check.hpp"
+#include "server.hpp"
+
+using std::string;
+
+namespace {
+
+constexpr char DIRECTORY_TEMPLATE[]("/tmp/archipelago-server-XXXXXX");
+constexpr char TOWN_FILE[]("test/tests/g01.txt");
+constexpr unsigned CONNECT_ATTEMPTS(500);
+constexpr std::chrono::milliseconds CONNECT_DELAY(10);
+
+sockaddr_un addressOf(const string& path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+  return address;
+}
+
+/** @returns The connected socket, or -1 if no server answers */
+int connectTo(const string& path) {
+  const sockaddr_un address(addressOf(path));
+  const int client(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (connect(client, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) <
+      0) {
+    close(client);
+    return -1;
+  }
+  return client;
+}
+
+/** Sends a request line and reads its response line */
+string ask(int client, const string& request) {
+  const string line(request + "\n");
+  if (send(client, line.data(), line.size(), MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(line.size()))
+    return "";
+
+  string response;
+  char character;
+  while (recv(client, &character, 1, 0) == 1 && character != '\n')
+    response += character;
+  return response;
+}
+
+bool contains(const string& text, const string& part) {
+  return text.find(part) != string::npos;
+}
+
+bool exists(const string& path) {
+  struct stat status;
+  return stat(path.c_str(), &status) == 0;
+}
+
+/** A socket file that no server listens on, as a crashed server leaves it */
+void leaveStaleSocket(const string& path) {
+  const sockaddr_un address(addressOf(path));
+  const int stale(socket(AF_UNIX, SOCK_STREAM, 0));
+  bind(stale, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+  close(stale);
+}
+
+/** Runs the server quietly, its errors are expected */
+int runQuietly(const string& path) {
+  std::ostringstream ignored;
+  std::streambuf* errors(std::cerr.rdbuf(ignored.rdbuf()));
+  const int status(server::run(path));
+  std::cerr.rdbuf(errors);
+  return status;
+}
+
+/** A file that is not a socket is never replaced */
+void checkRefusesFile(const string& path) {
+  std::ofstream(path) << "not a socket\n";
+  CHECK(runQuietly(path) != 0);
+  std::ifstream file(path);
+  string kept;
+  CHECK(std::getline(file, kept) && kept == "not a socket");
+  unlink(path.c_str());
+}
+
+void checkRequests(int client, const string& path) {
+  const string load(ask(client, "{\"id\":1,\"op\":\"load\",\"town\":\"g\","
+                                "\"path\":\"" + string(TOWN_FILE) + "\"}"));
+  CHECK(contains(load, "\"id\":1") && contains(load, "\"ok\":true"));
+  CHECK(contains(ask(client, "{\"op\":\"stats\",\"town\":\"g\"}"), "\"enj\":"));
+  CHECK(contains(ask(client, "{\"op\":\"route\",\"town\":\"g\",\"origin\":15,"
+                             "\"destination\":16}"),
+                 "\"found\":"));
+
+  // Unknown nodes and fractional capacities fail the whole edit
+  CHECK(contains(ask(client, "{\"op\":\"edit\",\"town\":\"g\",\"edits\":["
+                             "{\"op\":\"move_node\",\"uid\":999,\"x\":0,\"y\":0}]}"),
+                 "Unknown node: 999"));
+  CHECK(contains(ask(client, "{\"op\":\"edit\",\"town\":\"g\",\"edits\":["
+                             "{\"op\":\"remove_node\",\"uid\":15},"
+                             "{\"op\":\"remove_node\",\"uid\":999}]}"),
+                 "\"ok\":false"));
+  CHECK(contains(ask(client, "{\"op\":\"edit\",\"town\":\"g\",\"edits\":["
+                             "{\"op\":\"add_node\",\"type\":\"housing\",\"uid\":9,"
+                             "\"x\":0,\"y\":1000,\"capacity\":1000.5}]}"),
+                 "Invalid field: capacity"));
+  CHECK(contains(ask(client, "{\"op\":\"edit\",\"town\":\"g\",\"edits\":["
+                             "{\"op\":\"remove_node\",\"uid\":15}]}"),
+                 "\"ok\":true"));
+
+  // Numbers that strtod() reads but JSON does not have
+  for (const char* number : {"0x10", "+1", "1.", ".5", "01", "-", "1e", "inf"}) {
+    CHECK(contains(ask(client, "{\"op\":\"route\",\"town\":\"g\",\"origin\":" +
+                                   string(number) + ",\"destination\":16}"),
+                   "Invalid JSON"));
+  }
+  CHECK(contains(ask(client, "{\"op\":\"route\",\"town\":\"g\",\"origin\":1.6e1,"
+                             "\"destination\":16.0E+0}"),
+                 "\"ok\":true"));
+
+  // A running server is not replaced
+  CHECK(runQuietly(path) != 0);
+  CHECK(contains(ask(client, "{\"op\":\"stats\",\"town\":\"g\"}"), "\"ok\":true"));
+}
+
+}  // namespace
+
+int main() {
+  char directory[sizeof(DIRECTORY_TEMPLATE)];
+  std::strcpy(directory, DIRECTORY_TEMPLATE);
+  if (!CHECK(mkdtemp(directory) != nullptr)) return check::report("server");
+  const string path(string(directory) + "/server.sock");
+  setenv("XDG_CACHE_HOME", directory, 1);
+
+  checkRefusesFile(path);
+  leaveStaleSocket(path);
+
+  std::ostringstream served;
+  std::streambuf* output(std::cout.rdbuf(served.rdbuf()));
+  int status(-1);
+  std::thread server([&status, &path] { status = server::run(path); });
+
+  int client(-1);
+  for (unsigned i(0); i < CONNECT_ATTEMPTS && client < 0; ++i) {
+    std::this_thread::sleep_for(CONNECT_DELAY);
+    client = connectTo(path);
+  }
+  if (CHECK(client >= 0)) {
+    checkRequests(client, path);
+    CHECK(contains(ask(client, "{\"op\":\"shutdown\"}"), "\"ok\":true"));
+    close(client);
+  } else {
+    const int stopper(connectTo(path));
+    if (stopper >= 0) ask(stopper, "{\"op\":\"shutdown\"}");
+  }
+  server.join();
+  std::cout.rdbuf(output);
+
+  CHECK(status == 0);
+  CHECK(!exists(path));
+  std::system(("rm -rf " + string(directory)).c_str());
+
+  return check::report("server");
+}